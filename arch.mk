@@ -1113,6 +1113,7 @@ ifeq ($(ARCH),sim)
   LD = gcc
   ifneq ($(TARGET),library)
     UPDATE_OBJS:=src/update_flash.o
+    OBJS+=./hal/sim_flash.o
   endif
   LD_START_GROUP=
   LD_END_GROUP=
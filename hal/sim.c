@@ -32,6 +32,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #ifdef __APPLE__
 #include <mach-o/loader.h>
@@ -42,11 +43,17 @@
 #include "wolfboot/wolfboot.h"
 #include "target.h"
 #include "printf.h"
+#include "image.h"
+#include "sim_flash.h"
 
 #ifdef WOLFBOOT_ELF_FLASH_SCATTER
 #include "elf.h"
 #endif
 
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+#include <pthread.h>
+#endif
+
 #ifdef WOLFBOOT_ENABLE_WOLFHSM_CLIENT
 #include "wolfhsm/wh_error.h"
 #include "wolfhsm/wh_client.h"
@@ -61,14 +68,8 @@
 #include "port/posix/posix_flash_file.h"
 #endif /* WOLFBOOT_ENABLE_WOLFHSM_SERVER */
 
-/* Global pointer to the internal and external flash base */
-uint8_t *sim_ram_base;
-static uint8_t *flash_base;
-
-int forceEmergency = 0;
-uint32_t erasefail_address = 0xFFFFFFFF;
-int flashLocked = 1;
-int extFlashLocked = 1;
+static uint64_t sim_start_us;
+static int flash_report = 0;
 
 #define INTERNAL_FLASH_FILE "./internal_flash.dd"
 #define EXTERNAL_FLASH_FILE "./external_flash.dd"
@@ -191,7 +192,8 @@ int hal_hsm_server_cleanup(void);
 
 #endif /* WOLFBOOT_ENABLE_WOLFHSM_SERVER*/
 
-static int mmap_file(const char *path, uint8_t *address, uint8_t** ret_address)
+static int mmap_file(const char *path, uint8_t *address, uint8_t** ret_address,
+    size_t *ret_size)
 {
     struct stat st = { 0 };
     uint8_t *mmaped_addr;
@@ -219,19 +221,20 @@ static int mmap_file(const char *path, uint8_t *address, uint8_t** ret_address)
     wolfBoot_printf( "Simulator assigned %s to base %p\n", path, mmaped_addr);
 
     *ret_address = mmaped_addr;
+    if (ret_size)
+        *ret_size = st.st_size;
 
     close(fd);
     return 0;
 }
 
-void hal_flash_unlock(void)
-{
-    flashLocked = 0;
-}
-
-void hal_flash_lock(void)
+/* Flash model report, printed at exit or before starting the application */
+static void sim_flash_report(void)
 {
-    flashLocked = 1;
+    if (!flash_report)
+        return;
+    flash_report = 0;
+    sim_flash_model_report();
 }
 
 void hal_prepare_boot(void)
@@ -239,77 +242,83 @@ void hal_prepare_boot(void)
     /* no op */
 }
 
-int hal_flash_write(uintptr_t address, const uint8_t *data, int len)
+#ifdef WOLFBOOT_PROFILE
+uint64_t hal_get_timestamp(void)
 {
-    int i;
-    if (flashLocked == 1) {
-        wolfBoot_printf("FLASH IS BEING WRITTEN TO WHILE LOCKED\n");
-        return -1;
-    }
-    if (forceEmergency == 1 && address == WOLFBOOT_PARTITION_BOOT_ADDRESS) {
-        /* implicit cast abide compiler warning */
-        memset((void*)address, 0, len);
-        /* let the rest of the writes work properly for the emergency update */
-        forceEmergency = 0;
-    }
-    else {
-        for (i = 0; i < len; i++) {
-#ifdef NVM_FLASH_WRITEONCE
-            uint8_t *addr = (uint8_t *)address;
-            if (addr[i] != FLASH_BYTE_ERASED) {
-                /* no writing to non-erased page in NVM_FLASH_WRITEONCE */
-                wolfBoot_printf("NVM_FLASH_WRITEONCE non-erased write detected at address %p!\n", addr);
-                wolfBoot_printf("Address[%d] = %02x\n", i, addr[i]);
-                return -1;
-            }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 #endif
-#ifdef WOLFBOOT_FLAGS_INVERT
-            ((uint8_t*)address)[i] |= data[i];
-#else
-            ((uint8_t*)address)[i] &= data[i];
+
+/* Hashing throughput benchmark, run with the "hashbench" argument.
+ * Verifies the integrity of the image in the BOOT partition in a loop, through
+ * the same image_hash() path used at boot, and prints a "hash,chunk,MB/s"
+ * line. The chunk size is the one of this build: WOLFBOOT_SHA_BLOCK_SIZE, or 0
+ * when WOLFBOOT_HASH_CONTIGUOUS hashes the image in a single call. */
+#if defined(WOLFBOOT_HASH_SHA256)
+    #define SIM_HASH_NAME "SHA256"
+#elif defined(WOLFBOOT_HASH_SHA384)
+    #define SIM_HASH_NAME "SHA384"
+#elif defined(WOLFBOOT_HASH_SHA3_384)
+    #define SIM_HASH_NAME "SHA3-384"
 #endif
-        }
-    }
-    return 0;
-}
 
-int hal_flash_erase(uintptr_t address, int len)
+#define SIM_HASHBENCH_MIN_US 500000
+
+static void sim_hash_benchmark(void)
 {
-    if (flashLocked == 1) {
-        wolfBoot_printf("FLASH IS BEING ERASED WHILE LOCKED\n");
-        return -1;
-    }
-    /* implicit cast abide compiler warning */
-    wolfBoot_printf( "hal_flash_erase addr %p len %d\n", (void*)address, len);
-    if (address == erasefail_address + WOLFBOOT_PARTITION_BOOT_ADDRESS) {
-        wolfBoot_printf( "POWER FAILURE\n");
-        /* Corrupt page */
-        memset((void*)address, 0xEE, len);
-        exit(0);
+    struct wolfBoot_image img;
+    uint64_t start, elapsed, total = 0;
+    uint32_t chunk = WOLFBOOT_SHA_BLOCK_SIZE, rate;
+
+    if (wolfBoot_open_image(&img, PART_BOOT) != 0) {
+        wolfBoot_printf("hashbench: no valid image in BOOT partition\n");
+        exit(-1);
     }
-    memset((void*)address, FLASH_BYTE_ERASED, len);
-    return 0;
+#ifdef WOLFBOOT_HASH_CONTIGUOUS
+    if (!(PART_IS_EXT(&img)))
+        chunk = 0;
+#endif
+    printf("hash,chunk,MB/s\n");
+    start = sim_time_us();
+    do {
+        img.sha_ok = 0;
+        if (wolfBoot_verify_integrity(&img) != 0) {
+            wolfBoot_printf("hashbench: integrity check failed\n");
+            exit(-1);
+        }
+        total += IMAGE_HEADER_SIZE + img.fw_size;
+        elapsed = sim_time_us() - start;
+    } while (elapsed < SIM_HASHBENCH_MIN_US);
+    /* bytes per microsecond == MB/s */
+    rate = (uint32_t)((total * 100) / elapsed);
+    printf("%s,%u,%u.%02u\n", SIM_HASH_NAME, chunk, rate / 100, rate % 100);
 }
 
 void hal_init(void)
 {
     int ret;
     int i;
+    int hashbench = 0;
+    size_t flash_size = 0;
 
     ret = mmap_file(INTERNAL_FLASH_FILE,
-        (uint8_t*)ARCH_FLASH_OFFSET, &sim_ram_base);
+        (uint8_t*)ARCH_FLASH_OFFSET, &sim_ram_base, &flash_size);
     if (ret != 0) {
         wolfBoot_printf( "failed to load internal flash file\n");
         exit(-1);
     }
+    sim_flash_model_init(&int_flash_model, flash_size);
 
 #ifdef EXT_FLASH
     ret = mmap_file(EXTERNAL_FLASH_FILE,
-        (uint8_t*)ARCH_FLASH_OFFSET + 0x10000000, &flash_base);
+        (uint8_t*)ARCH_FLASH_OFFSET + 0x10000000, &sim_ext_flash_base, &flash_size);
     if (ret != 0) {
         wolfBoot_printf( "failed to load external flash file\n");
         exit(-1);
     }
+    sim_flash_model_init(&ext_flash_model, flash_size);
 #endif /* EXT_FLASH */
 
     for (i = 1; i < main_argc; i++) {
@@ -322,44 +331,69 @@ void hal_init(void)
          * emergency fallback feature */
         else if (strcmp(main_argv[i], "emergency") == 0)
             forceEmergency = 1;
+        else if (strcmp(main_argv[i], "extlatency") == 0) {
+            ext_latency_us_kb = strtoul(main_argv[++i], NULL, 0);
+            wolfBoot_printf("Set external flash latency to %u us/KB\n",
+                ext_latency_us_kb);
+        }
+        else if (strcmp(main_argv[i], "hashbench") == 0)
+            hashbench = 1;
+        else if (strcmp(main_argv[i], "flashprofile") == 0) {
+            int_flash_model.profile = sim_flash_profile_find(main_argv[++i]);
+            flash_report = 1;
+        }
+        else if (strcmp(main_argv[i], "extflashprofile") == 0) {
+            ext_flash_model.profile = sim_flash_profile_find(main_argv[++i]);
+            flash_report = 1;
+        }
+        else if (strcmp(main_argv[i], "flashreport") == 0)
+            flash_report = 1;
+    }
+    if (flash_report)
+        atexit(sim_flash_report);
+    if (hashbench) {
+        sim_hash_benchmark();
+        exit(0);
     }
+    sim_start_us = sim_time_us();
 }
 
-void ext_flash_lock(void)
-{
-    extFlashLocked = 1;
-}
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+/* Secondary core worker, backed by a thread */
+static struct {
+    pthread_t thread;
+    void (*job)(void *arg);
+    void *arg;
+    int busy;
+} worker;
 
-void ext_flash_unlock(void)
+static void *worker_main(void *unused)
 {
-    extFlashLocked = 0;
+    (void)unused;
+    worker.job(worker.arg);
+    return NULL;
 }
 
-int ext_flash_write(uintptr_t address, const uint8_t *data, int len)
+int hal_worker_start(void (*job)(void *arg), void *arg)
 {
-    if (extFlashLocked == 1) {
-        wolfBoot_printf("EXT FLASH IS BEING WRITTEN TO WHILE LOCKED\n");
+    if (worker.busy)
         return -1;
-    }
-    memcpy(flash_base + address, data, len);
+    worker.job = job;
+    worker.arg = arg;
+    if (pthread_create(&worker.thread, NULL, worker_main, NULL) != 0)
+        return -1;
+    worker.busy = 1;
     return 0;
 }
 
-int ext_flash_read(uintptr_t address, uint8_t *data, int len)
-{
-    memcpy(data, flash_base + address, len);
-    return len;
-}
-
-int ext_flash_erase(uintptr_t address, int len)
+void hal_worker_wait(void)
 {
-    if (extFlashLocked == 1) {
-        wolfBoot_printf("EXT FLASH IS BEING ERASED WHILE LOCKED\n");
-        return -1;
-    }
-    memset(flash_base + address, FLASH_BYTE_ERASED, len);
-    return 0;
+    if (!worker.busy)
+        return;
+    pthread_join(worker.thread, NULL);
+    worker.busy = 0;
 }
+#endif /* WOLFBOOT_PARALLEL_VERIFY */
 
 #ifdef __APPLE__
 #ifdef __GNUC__
@@ -395,6 +429,10 @@ void do_boot(const uint32_t *app_offset)
     int ret;
     size_t app_size = WOLFBOOT_PARTITION_SIZE - IMAGE_HEADER_SIZE;
     wolfBoot_printf("Simulator do_boot app_offset = %p\n", app_offset);
+    if (ext_latency_us_kb != 0) {
+        wolfBoot_printf("Time to boot: %u us\n",
+            (unsigned int)(sim_time_us() - sim_start_us));
+    }
 
     if (flashLocked == 0) {
         wolfBoot_printf("WARNING FLASH IS UNLOCKED AT BOOT");
@@ -404,6 +442,9 @@ void do_boot(const uint32_t *app_offset)
         wolfBoot_printf("WARNING EXT FLASH IS UNLOCKED AT BOOT");
     }
 
+    /* atexit handlers do not run after fexecve */
+    sim_flash_report();
+
 #ifdef __APPLE__
     typedef int (*main_entry)(int, char**, char**, char**);
     NSObjectFileImage fileImage = NULL;
@@ -0,0 +1,395 @@
+/* sim_flash.c
+ *
+ * Simulated internal and external flash, with a cost and wear model.
+ * Shared by the simulator (hal/sim.c) and the host-side benchmark
+ * (tools/bench/bench.c).
+ *
+ * Copyright (C) 2025 wolfSSL Inc.
+ *
+ * This file is part of wolfBoot.
+ *
+ * wolfBoot is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfBoot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "wolfboot/wolfboot.h"
+#include "target.h"
+#include "printf.h"
+#include "sim_flash.h"
+
+/* Global pointer to the internal and external flash base */
+uint8_t *sim_ram_base;
+uint8_t *sim_ext_flash_base;
+
+int forceEmergency = 0;
+uint32_t erasefail_address = 0xFFFFFFFF;
+int flashLocked = 1;
+int extFlashLocked = 1;
+
+/* Power failure at the given erase operation (counted from 0) on either
+ * device, or -1 when disabled */
+int sim_powerfail_erase_op = -1;
+
+/* Simulated external flash transfer time, in microseconds per KB.
+ * Set with the "extlatency" command line argument (default: no latency) */
+uint32_t ext_latency_us_kb = 0;
+
+/* Flash cost and wear model.
+ * Each flash device accumulates the simulated time spent programming,
+ * erasing and reading, and counts erase cycles per WOLFBOOT_SECTOR_SIZE
+ * sector. Typical datasheet timings are selected with the "flashprofile"
+ * (internal flash) and "extflashprofile" (external flash) arguments of the
+ * simulator, or with the -f and -e options of tools/bench/wolfboot-bench. */
+static const struct sim_flash_profile sim_flash_profiles[] = {
+    /* MCU internal flash, double-word programming, 2KB pages */
+    { "internal", 8,   82,  2048, 22000, 0   },
+    /* SPI NOR, single I/O at 50MHz, 4KB sector erase */
+    { "spi-nor",  256, 700, 4096, 45000, 160 },
+    /* QSPI NOR, quad I/O, 4KB sector erase */
+    { "qspi-nor", 256, 400, 4096, 45000, 40  },
+};
+
+struct sim_flash_model int_flash_model = {
+    .device = "internal",
+    .profile = &sim_flash_profiles[0],
+};
+struct sim_flash_model ext_flash_model = {
+    .device = "external",
+    .profile = &sim_flash_profiles[1],
+};
+
+uint64_t sim_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)(ts.tv_nsec / 1000);
+}
+
+static void sim_wait_until(uint64_t deadline)
+{
+    uint64_t now;
+    while ((now = sim_time_us()) < deadline)
+        usleep(deadline - now);
+}
+
+static uint64_t ext_transfer_us(int len)
+{
+    return ((uint64_t)len * ext_latency_us_kb) / 1024;
+}
+
+const struct sim_flash_profile *sim_flash_profile_find(const char *name)
+{
+    size_t i;
+    for (i = 0; i < sizeof(sim_flash_profiles) / sizeof(sim_flash_profiles[0]);
+            i++) {
+        if (strcmp(sim_flash_profiles[i].name, name) == 0)
+            return &sim_flash_profiles[i];
+    }
+    wolfBoot_printf("Unknown flash profile: %s\n", name);
+    exit(-1);
+}
+
+void sim_flash_model_init(struct sim_flash_model *m, size_t size)
+{
+    m->size = size;
+    m->erase_count = calloc((size + WOLFBOOT_SECTOR_SIZE - 1) /
+        WOLFBOOT_SECTOR_SIZE, sizeof(uint32_t));
+}
+
+void sim_flash_model_reset(struct sim_flash_model *m)
+{
+    m->bytes_programmed = m->pages_programmed = 0;
+    m->sectors_erased = m->bytes_read = 0;
+    m->program_us = m->erase_us = m->read_us = 0;
+    if (m->erase_count != NULL) {
+        memset(m->erase_count, 0, ((m->size + WOLFBOOT_SECTOR_SIZE - 1) /
+            WOLFBOOT_SECTOR_SIZE) * sizeof(uint32_t));
+    }
+}
+
+uint64_t sim_flash_model_us(const struct sim_flash_model *m)
+{
+    return m->program_us + m->erase_us + m->read_us;
+}
+
+static void sim_flash_model_program(struct sim_flash_model *m, uintptr_t off,
+    int len)
+{
+    uint32_t pages;
+    if (len <= 0)
+        return;
+    pages = (uint32_t)((off + len - 1) / m->profile->page_size -
+        off / m->profile->page_size + 1);
+    m->bytes_programmed += len;
+    m->pages_programmed += pages;
+    m->program_us += (uint64_t)pages * m->profile->page_prog_us;
+}
+
+static void sim_flash_model_erase(struct sim_flash_model *m, uintptr_t off,
+    int len)
+{
+    uintptr_t end = off + len;
+    uint32_t n;
+    if (len <= 0)
+        return;
+    n = (len + m->profile->erase_size - 1) / m->profile->erase_size;
+    m->erase_us += (uint64_t)n * m->profile->erase_us;
+    for (; off < end; off += WOLFBOOT_SECTOR_SIZE) {
+        m->sectors_erased++;
+        if ((m->erase_count != NULL) && (off < m->size))
+            m->erase_count[off / WOLFBOOT_SECTOR_SIZE]++;
+    }
+}
+
+static void sim_flash_model_read(struct sim_flash_model *m, int len)
+{
+    m->bytes_read += len;
+    m->read_us += ((uint64_t)len * m->profile->read_us_kb) / 1024;
+}
+
+static void sim_flash_report_device(struct sim_flash_model *m)
+{
+    wolfBoot_printf("flashmodel,%s,%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+        m->device, m->profile->name,
+        (unsigned long)m->bytes_programmed,
+        (unsigned long)m->pages_programmed,
+        (unsigned long)m->sectors_erased,
+        (unsigned long)m->bytes_read,
+        (unsigned long)m->program_us,
+        (unsigned long)m->erase_us,
+        (unsigned long)m->read_us,
+        (unsigned long)sim_flash_model_us(m));
+}
+
+static void sim_flash_report_part(const char *name, struct sim_flash_model *m,
+    uintptr_t off, uint32_t size)
+{
+    uint32_t total = 0, max = 0, i;
+    if (m->erase_count == NULL)
+        return;
+    for (i = 0; i < size; i += WOLFBOOT_SECTOR_SIZE) {
+        uint32_t c;
+        if (off + i >= m->size)
+            break;
+        c = m->erase_count[(off + i) / WOLFBOOT_SECTOR_SIZE];
+        total += c;
+        if (c > max)
+            max = c;
+    }
+    wolfBoot_printf("flashwear,%s,%s,%u,%u\n", name, m->device, total, max);
+}
+
+void sim_flash_model_report(void)
+{
+    uintptr_t int_base = (uintptr_t)sim_ram_base;
+    wolfBoot_printf("flashmodel,device,profile,bytes_programmed,"
+        "pages_programmed,sectors_erased,bytes_read,program_us,erase_us,"
+        "read_us,total_us\n");
+    sim_flash_report_device(&int_flash_model);
+#ifdef EXT_FLASH
+    sim_flash_report_device(&ext_flash_model);
+#endif
+    wolfBoot_printf("flashwear,partition,device,sector_erases,"
+        "max_erases_per_sector\n");
+#ifdef PART_BOOT_EXT
+    sim_flash_report_part("boot", &ext_flash_model,
+        WOLFBOOT_PARTITION_BOOT_ADDRESS, WOLFBOOT_PARTITION_SIZE);
+#else
+    sim_flash_report_part("boot", &int_flash_model,
+        WOLFBOOT_PARTITION_BOOT_ADDRESS - int_base, WOLFBOOT_PARTITION_SIZE);
+#endif
+#ifdef PART_UPDATE_EXT
+    sim_flash_report_part("update", &ext_flash_model,
+        WOLFBOOT_PARTITION_UPDATE_ADDRESS, WOLFBOOT_PARTITION_SIZE);
+#else
+    sim_flash_report_part("update", &int_flash_model,
+        WOLFBOOT_PARTITION_UPDATE_ADDRESS - int_base, WOLFBOOT_PARTITION_SIZE);
+#endif
+#ifdef PART_SWAP_EXT
+    sim_flash_report_part("swap", &ext_flash_model,
+        WOLFBOOT_PARTITION_SWAP_ADDRESS, WOLFBOOT_SECTOR_SIZE);
+#else
+    sim_flash_report_part("swap", &int_flash_model,
+        WOLFBOOT_PARTITION_SWAP_ADDRESS - int_base, WOLFBOOT_SECTOR_SIZE);
+#endif
+}
+
+void hal_flash_unlock(void)
+{
+    flashLocked = 0;
+}
+
+void hal_flash_lock(void)
+{
+    flashLocked = 1;
+}
+
+static void sim_flash_powerfail(uint8_t *address, int len)
+{
+    wolfBoot_printf( "POWER FAILURE\n");
+    /* Corrupt page */
+    memset(address, 0xEE, len);
+    exit(0);
+}
+
+static void sim_flash_powerfail_check(uint8_t *address, int len)
+{
+    if (sim_powerfail_erase_op < 0)
+        return;
+    if (sim_powerfail_erase_op-- == 0)
+        sim_flash_powerfail(address, len);
+}
+
+int hal_flash_write(uintptr_t address, const uint8_t *data, int len)
+{
+    int i;
+    if (flashLocked == 1) {
+        wolfBoot_printf("FLASH IS BEING WRITTEN TO WHILE LOCKED\n");
+        return -1;
+    }
+    if (forceEmergency == 1 && address == WOLFBOOT_PARTITION_BOOT_ADDRESS) {
+        /* implicit cast abide compiler warning */
+        memset((void*)address, 0, len);
+        /* let the rest of the writes work properly for the emergency update */
+        forceEmergency = 0;
+    }
+    else {
+        for (i = 0; i < len; i++) {
+#ifdef NVM_FLASH_WRITEONCE
+            uint8_t *addr = (uint8_t *)address;
+            if (addr[i] != FLASH_BYTE_ERASED) {
+                /* no writing to non-erased page in NVM_FLASH_WRITEONCE */
+                wolfBoot_printf("NVM_FLASH_WRITEONCE non-erased write detected at address %p!\n", addr);
+                wolfBoot_printf("Address[%d] = %02x\n", i, addr[i]);
+                return -1;
+            }
+#endif
+#ifdef WOLFBOOT_FLAGS_INVERT
+            ((uint8_t*)address)[i] |= data[i];
+#else
+            ((uint8_t*)address)[i] &= data[i];
+#endif
+        }
+    }
+    sim_flash_model_program(&int_flash_model, address - (uintptr_t)sim_ram_base,
+        len);
+    return 0;
+}
+
+int hal_flash_erase(uintptr_t address, int len)
+{
+    if (flashLocked == 1) {
+        wolfBoot_printf("FLASH IS BEING ERASED WHILE LOCKED\n");
+        return -1;
+    }
+    /* implicit cast abide compiler warning */
+    wolfBoot_printf( "hal_flash_erase addr %p len %d\n", (void*)address, len);
+    if (address == erasefail_address + WOLFBOOT_PARTITION_BOOT_ADDRESS)
+        sim_flash_powerfail((uint8_t *)address, len);
+    sim_flash_powerfail_check((uint8_t *)address, len);
+    memset((void*)address, FLASH_BYTE_ERASED, len);
+    sim_flash_model_erase(&int_flash_model, address - (uintptr_t)sim_ram_base,
+        len);
+    return 0;
+}
+
+void ext_flash_lock(void)
+{
+    extFlashLocked = 1;
+}
+
+void ext_flash_unlock(void)
+{
+    extFlashLocked = 0;
+}
+
+int ext_flash_write(uintptr_t address, const uint8_t *data, int len)
+{
+    if (extFlashLocked == 1) {
+        wolfBoot_printf("EXT FLASH IS BEING WRITTEN TO WHILE LOCKED\n");
+        return -1;
+    }
+    memcpy(sim_ext_flash_base + address, data, len);
+    sim_flash_model_program(&ext_flash_model, address, len);
+    return 0;
+}
+
+int ext_flash_read(uintptr_t address, uint8_t *data, int len)
+{
+    sim_wait_until(sim_time_us() + ext_transfer_us(len));
+    memcpy(data, sim_ext_flash_base + address, len);
+    sim_flash_model_read(&ext_flash_model, len);
+    return len;
+}
+
+#ifdef EXT_FLASH_ASYNC
+/* Asynchronous read: the transfer runs in the background until 'deadline',
+ * data is only valid in the destination buffer after completion */
+static struct {
+    uintptr_t address;
+    uint8_t *data;
+    int len;
+    uint64_t deadline;
+    int busy;
+} ext_async;
+
+int ext_flash_read_start(uintptr_t address, uint8_t *data, int len)
+{
+    if (ext_async.busy)
+        return -1;
+    ext_async.address = address;
+    ext_async.data = data;
+    ext_async.len = len;
+    ext_async.deadline = sim_time_us() + ext_transfer_us(len);
+    ext_async.busy = 1;
+    return 0;
+}
+
+int ext_flash_read_poll(void)
+{
+    if (!ext_async.busy)
+        return -1;
+    return (sim_time_us() >= ext_async.deadline);
+}
+
+int ext_flash_read_complete(void)
+{
+    if (!ext_async.busy)
+        return -1;
+    sim_wait_until(ext_async.deadline);
+    memcpy(ext_async.data, sim_ext_flash_base + ext_async.address, ext_async.len);
+    sim_flash_model_read(&ext_flash_model, ext_async.len);
+    ext_async.busy = 0;
+    return ext_async.len;
+}
+#endif /* EXT_FLASH_ASYNC */
+
+int ext_flash_erase(uintptr_t address, int len)
+{
+    if (extFlashLocked == 1) {
+        wolfBoot_printf("EXT FLASH IS BEING ERASED WHILE LOCKED\n");
+        return -1;
+    }
+    sim_flash_powerfail_check(sim_ext_flash_base + address, len);
+    memset(sim_ext_flash_base + address, FLASH_BYTE_ERASED, len);
+    sim_flash_model_erase(&ext_flash_model, address, len);
+    return 0;
+}
@@ -0,0 +1,81 @@
+/* sim_flash.h
+ *
+ * Simulated flash for the sim target and the host-side benchmark.
+ *
+ * Copyright (C) 2025 wolfSSL Inc.
+ *
+ * This file is part of wolfBoot.
+ *
+ * wolfBoot is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfBoot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+#ifndef SIM_FLASH_H
+#define SIM_FLASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Flash device timings */
+struct sim_flash_profile {
+    const char *name;
+    uint32_t page_size;     /* program granularity, in bytes */
+    uint32_t page_prog_us;  /* time to program one page */
+    uint32_t erase_size;    /* physical erase sector size, in bytes */
+    uint32_t erase_us;      /* time to erase one physical sector */
+    uint32_t read_us_kb;    /* read time per KB, 0 if memory mapped */
+};
+
+/* Per-device counters */
+struct sim_flash_model {
+    const char *device;
+    const struct sim_flash_profile *profile;
+    size_t size;
+    uint32_t *erase_count;
+    uint64_t bytes_programmed;
+    uint64_t pages_programmed;
+    uint64_t sectors_erased;
+    uint64_t bytes_read;
+    uint64_t program_us;
+    uint64_t erase_us;
+    uint64_t read_us;
+};
+
+
+/* Flash contents: internal flash (memory-mapped) and external flash */
+extern uint8_t *sim_ram_base;
+extern uint8_t *sim_ext_flash_base;
+
+extern int flashLocked;
+extern int extFlashLocked;
+
+/* Fault injection */
+extern int forceEmergency;
+extern uint32_t erasefail_address;
+extern int sim_powerfail_erase_op;
+
+/* External flash transfer time, in microseconds per KB */
+extern uint32_t ext_latency_us_kb;
+
+extern struct sim_flash_model int_flash_model;
+extern struct sim_flash_model ext_flash_model;
+
+uint64_t sim_time_us(void);
+const struct sim_flash_profile *sim_flash_profile_find(const char *name);
+void sim_flash_model_init(struct sim_flash_model *m, size_t size);
+void sim_flash_model_reset(struct sim_flash_model *m);
+uint64_t sim_flash_model_us(const struct sim_flash_model *m);
+void sim_flash_model_report(void);
+
+#endif /* SIM_FLASH_H */
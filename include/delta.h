@@ -41,6 +41,71 @@
 #define DELTA_PATCH_BLOCK_SIZE 1024
 #endif
 
+/* With EXT_FLASH, the patch is read through a cache of
+ * DELTA_PATCH_CACHE_SIZE bytes. When PART_BOOT_EXT is also defined, the
+ * base image is read through a cache of DELTA_SRC_CACHE_SIZE bytes. */
+#ifndef DELTA_PATCH_CACHE_SIZE
+#define DELTA_PATCH_CACHE_SIZE DELTA_PATCH_BLOCK_SIZE
+#endif
+#ifndef DELTA_SRC_CACHE_SIZE
+#define DELTA_SRC_CACHE_SIZE 512
+#endif
+
+/* Patch format versions, stored in the HDR_IMG_DELTA_FORMAT TLV.
+ * Version 1 (no TLV): literal bytes and copy blocks.
+ * Version 2: adds length-prefixed literal runs.
+ * Version 3: adds copy blocks and literal runs with varint offsets and
+ * lengths, for images larger than 16MB and blocks larger than 64KB.
+ * WB_PATCH_FORMAT_RAW is not a patch: the stream is the full image, used for
+ * compressed full-image updates. */
+#define WB_PATCH_FORMAT_V1 1
+#define WB_PATCH_FORMAT_V2 2
+#define WB_PATCH_FORMAT_V3 3
+#define WB_PATCH_FORMAT_MAX WB_PATCH_FORMAT_V3
+#define WB_PATCH_FORMAT_RAW 0xFF
+
+/* In-place patches: flag added to the patch format.
+ * The patch starts with a plan: a wb_inplace_hdr followed by n_ops
+ * wb_inplace_op entries, in the order in which the sectors of BOOT are
+ * rewritten. The patch of each sector follows, in the same order. Sectors
+ * which are identical in both images are not part of the plan.
+ * The patch of a sector may reference the sectors that are not written
+ * yet, in the base image, and the sectors that are already written, in the
+ * new image. It never references its own sector, unless WB_INPLACE_SAVE is
+ * set: the base content of the sector is saved to the swap sector, and read
+ * from there by the following patches, until the next WB_INPLACE_SAVE.
+ * WB_INPLACE_ERASE marks the sectors of the base image beyond the end of
+ * the new image, with no patch. */
+#define WB_PATCH_INPLACE 0x100
+#define WB_INPLACE_SAVE  0x01
+#define WB_INPLACE_ERASE 0x02
+
+struct wb_inplace_hdr {
+    uint32_t img_size;  /* size of the new image */
+    uint32_t n_ops;
+};
+
+struct wb_inplace_op {
+    uint32_t sector;
+    uint32_t flags;
+};
+
+#define WB_INPLACE_PLAN_SIZE(n) (sizeof(struct wb_inplace_hdr) + \
+        (n) * sizeof(struct wb_inplace_op))
+
+/* Patch compression codecs, stored in the HDR_IMG_DELTA_CODEC TLV.
+ * WB_DELTA_CODEC_LZ: LZ77 sequences with a WB_LZ_WINDOW bytes window,
+ * preceded by the uncompressed size of the patch (32-bit, big endian).
+ * The decoder is only available when DELTA_COMPRESSION is defined. */
+#define WB_DELTA_CODEC_NONE 0
+#define WB_DELTA_CODEC_LZ   1
+
+#define WB_LZ_WINDOW_BITS 11
+#define WB_LZ_WINDOW (1 << WB_LZ_WINDOW_BITS)
+#define WB_LZ_HDR_SIZE 4
+/* Worst case size of a compressed stream */
+#define WB_LZ_BOUND(sz) ((sz) + ((sz) / 255) + WB_LZ_HDR_SIZE + 16)
+
 struct wb_patch_ctx {
     uint8_t *src_base;
     uint32_t src_size;
@@ -50,29 +115,116 @@ struct wb_patch_ctx {
     int matching;
     uint32_t blk_sz;
     uint32_t blk_off;
+    uint32_t format;
+    uint32_t lit_sz;
 #ifdef EXT_FLASH
-    uint8_t patch_cache[DELTA_PATCH_BLOCK_SIZE];
+    uint8_t patch_cache[DELTA_PATCH_CACHE_SIZE];
     uint32_t patch_cache_start;
+#ifdef PART_BOOT_EXT
+    uint8_t src_cache[DELTA_SRC_CACHE_SIZE];
+    uint32_t src_cache_start;
+#endif
+#endif
+#ifdef DELTA_CACHE_STATS
+    struct wb_patch_stats {
+        uint32_t patch_hits;
+        uint32_t patch_misses;
+        uint32_t patch_read;    /* bytes read from flash */
+        uint32_t src_hits;
+        uint32_t src_misses;
+        uint32_t src_read;
+    } stats;
+#endif
+#ifdef DELTA_COMPRESSION
+    /* Decompressed patch stream, the last WB_LZ_WINDOW bytes are kept
+     * as history for back-references */
+    uint32_t codec;
+    uint32_t lz_in_off;
+    uint32_t lz_in_size;
+    uint32_t lz_out_start;
+    uint32_t lz_out_len;
+    uint32_t lz_lit;
+    uint32_t lz_match;
+    uint32_t lz_dist;
+    int lz_state;
+    uint8_t lz_buf[2 * WB_LZ_WINDOW];
+#endif
+#ifdef DELTA_INPLACE
+    /* Copy of the base content of a sector, see WB_INPLACE_SAVE */
+    uint8_t *saved_base;
+    uint32_t saved_off;
+    uint32_t saved_sz;
 #endif
 };
 
+#define WB_DIFF_ENGINE_HASH 0 /* hash-indexed longest match (default) */
+#define WB_DIFF_ENGINE_SCAN 1 /* linear scan, first match */
+
 struct wb_diff_ctx {
     uint8_t *src_a;
     uint8_t *src_b;
     uint32_t size_a, size_b, off_b;
+    int engine;
+    uint32_t format;
+    /* match index, host-side only */
+    uint32_t *head_a, *prev_a;
+    uint32_t *head_b, *prev_b;
+    uint32_t indexed_b;
+    uint32_t hash_bits;
+    uint32_t end_b;
+    int b_indexed;
+    int shared;
+    /* in-place patches, see wb_diff_inplace() */
+    uint8_t *sec_state;
+    uint32_t n_sectors;
+    uint32_t cur_sec;
+    uint32_t saved_sec;
 };
 
+/* Index tables owned by another context */
+#define WB_DIFF_SHARED_A 0x01
+#define WB_DIFF_SHARED_B 0x02
+
+/* Worst case size of the patch for 'sz' bytes of a new image, see
+ * wb_diff_sectors() */
+#define WB_DIFF_BOUND(sz) (2 * (sz) + 32)
+
+/* Worst case size of an in-place patch, 'n' being the number of sectors
+ * of the larger image, see wb_diff_inplace() */
+#define WB_DIFF_INPLACE_BOUND(sz, n) (WB_INPLACE_PLAN_SIZE(n) + \
+        WB_DIFF_BOUND(sz))
+
 
 typedef struct wb_patch_ctx WB_PATCH_CTX;
 typedef struct wb_diff_ctx WB_DIFF_CTX;
 
 int wb_diff_init(WB_DIFF_CTX *ctx, uint8_t *src_a, uint32_t len_a, uint8_t *src_b, uint32_t len_b);
 int wb_diff(WB_DIFF_CTX *ctx, uint8_t *patch, uint32_t len);
+void wb_diff_free(WB_DIFF_CTX *ctx);
+int wb_diff_set_format(WB_DIFF_CTX *ctx, uint32_t format);
+int wb_diff_index_b(WB_DIFF_CTX *ctx);
+int wb_diff_init_worker(WB_DIFF_CTX *ctx, const WB_DIFF_CTX *main_ctx);
+int wb_diff_init_base(WB_DIFF_CTX *ctx, uint8_t *src_a, uint32_t len_a,
+    const WB_DIFF_CTX *target);
+int wb_diff_sectors(WB_DIFF_CTX *ctx, uint32_t start, uint32_t end,
+    uint8_t *patch, uint32_t len);
+int wb_diff_inplace(WB_DIFF_CTX *ctx, uint8_t *patch, uint32_t len,
+    uint32_t *plan_sz);
 int wb_patch_init(WB_PATCH_CTX *bm, uint8_t *src, uint32_t ssz, uint8_t *patch, uint32_t psz);
+int wb_patch_set_format(WB_PATCH_CTX *ctx, uint32_t format);
+int wb_patch_set_codec(WB_PATCH_CTX *ctx, uint32_t codec);
 int wb_patch(WB_PATCH_CTX *ctx, uint8_t *dst, uint32_t len);
+void wb_patch_src_written(WB_PATCH_CTX *ctx);
+#ifdef DELTA_INPLACE
+int wb_patch_set_saved(WB_PATCH_CTX *ctx, uint32_t off, uint8_t *copy,
+    uint32_t sz);
+#endif
 int wolfBoot_get_delta_info(uint8_t part, int inverse, uint32_t **img_offset,
-    uint32_t **img_size, uint8_t **base_hash, uint16_t *base_hash_size);
+    uint32_t **img_size, uint8_t **base_hash, uint16_t *base_hash_size,
+    uint32_t *format, uint32_t *codec);
 int wb_diff_get_sector_size(void);
+int wb_lz_compress(const uint8_t *in, uint32_t in_sz, uint8_t *out,
+    uint32_t out_sz);
 
 #endif
 
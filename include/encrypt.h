@@ -35,6 +35,9 @@
 
 #ifdef ENCRYPT_WITH_CHACHA
     #include "wolfssl/wolfcrypt/chacha.h"
+    #ifdef ENCRYPT_AEAD
+        #include "wolfssl/wolfcrypt/chacha20_poly1305.h"
+    #endif
 #else
     #include "wolfssl/wolfcrypt/aes.h"
 #endif
@@ -69,5 +72,13 @@ void aes_set_iv(uint8_t *nonce, uint32_t address);
 int ext_flash_encrypt_write(uintptr_t address, const uint8_t *data, int len);
 int ext_flash_decrypt_read(uintptr_t address, uint8_t *data, int len);
 
+#ifdef ENCRYPT_AEAD
+/* per-sector tags (ChaCha20-Poly1305 or AES-GCM), computed over the
+ * ciphertext while ext_flash_decrypt_read() goes through it */
+int aead_sector_init(const uint8_t *key, const uint8_t *nonce,
+    uint32_t sector, uintptr_t address, uint32_t len);
+int aead_sector_final(const uint8_t *tag);
+#endif
+
 #endif /* __WOLFBOOT || UNIT_TEST */
 #endif /* ENCRYPT_H_INCLUDED */
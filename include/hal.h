@@ -79,6 +79,15 @@ void hal_prepare_boot(void);
     void *hal_get_dts_update_address(void);
 #endif
 
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+    /* optional secondary core worker: one job at a time.
+     * start: runs job(arg) on another core, 0 on success, -1 if no core is
+     *        available (the caller then does the work itself)
+     * wait: returns once the job has completed */
+    int  hal_worker_start(void (*job)(void *arg), void *arg);
+    void hal_worker_wait(void);
+#endif
+
 #if !defined(SPI_FLASH) && !defined(QSPI_FLASH) && !defined(OCTOSPI_FLASH)
     /* user supplied external flash interfaces */
     int  ext_flash_write(uintptr_t address, const uint8_t *data, int len);
@@ -86,7 +95,19 @@ void hal_prepare_boot(void);
     int  ext_flash_erase(uintptr_t address, int len);
     void ext_flash_lock(void);
     void ext_flash_unlock(void);
+#ifdef EXT_FLASH_ASYNC
+    /* optional asynchronous read: one transfer in flight at a time.
+     * start: 0 on success, -1 on failure
+     * poll: 1 when complete, 0 while busy, -1 on failure
+     * complete: waits for the transfer, returns len or -1 on failure */
+    int  ext_flash_read_start(uintptr_t address, uint8_t *data, int len);
+    int  ext_flash_read_poll(void);
+    int  ext_flash_read_complete(void);
+#endif
 #else
+#ifdef EXT_FLASH_ASYNC
+    #error "EXT_FLASH_ASYNC requires a user supplied external flash driver"
+#endif
     #include "spi_flash.h"
     #define ext_flash_lock() do{}while(0)
     #define ext_flash_unlock() do{}while(0)
@@ -97,8 +118,26 @@ void hal_prepare_boot(void);
         int ret = 0;
         uint32_t end = address + len - 1;
         uint32_t p;
-        for (p = address; p <= end; p += SPI_FLASH_SECTOR_SIZE) {
-            ret = spi_flash_sector_erase(p);
+        p = address;
+        while (p <= end) {
+#ifdef SPI_FLASH_BLOCK_ERASE
+            /* use the largest block erase covering an aligned range */
+            if (((p & (SPI_FLASH_BLOCK64_SIZE - 1)) == 0) &&
+                    (end - p >= SPI_FLASH_BLOCK64_SIZE - 1)) {
+                ret = spi_flash_block_erase(p, SPI_FLASH_BLOCK64_SIZE);
+                p += SPI_FLASH_BLOCK64_SIZE;
+            }
+            else if (((p & (SPI_FLASH_BLOCK32_SIZE - 1)) == 0) &&
+                    (end - p >= SPI_FLASH_BLOCK32_SIZE - 1)) {
+                ret = spi_flash_block_erase(p, SPI_FLASH_BLOCK32_SIZE);
+                p += SPI_FLASH_BLOCK32_SIZE;
+            }
+            else
+#endif
+            {
+                ret = spi_flash_sector_erase(p);
+                p += SPI_FLASH_SECTOR_SIZE;
+            }
             if (ret != 0) {
                 break;
             }
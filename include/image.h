@@ -833,10 +833,45 @@ int wolfBoot_open_image_external(struct wolfBoot_image* img, uint8_t part, uint8
 int wolfBoot_open_image_address(struct wolfBoot_image* img, uint8_t* image);
 int wolfBoot_verify_integrity(struct wolfBoot_image *img);
 int wolfBoot_verify_authenticity(struct wolfBoot_image *img);
+#ifdef WOLFBOOT_MERKLE
+int wolfBoot_merkle_sectors(struct wolfBoot_image *img);
+int wolfBoot_merkle_verify_root(struct wolfBoot_image *img);
+int wolfBoot_merkle_verify_sector(struct wolfBoot_image *img, uint32_t sector);
+#ifdef ENCRYPT_AEAD
+int wolfBoot_aead_sector_tag(struct wolfBoot_image *img, uint32_t sector,
+    uint8_t **tag);
+#endif
+#endif
 int wolfBoot_set_partition_state(uint8_t part, uint8_t newst);
 int wolfBoot_get_update_sector_flag(uint16_t sector, uint8_t *flag);
 int wolfBoot_set_update_sector_flag(uint16_t sector, uint8_t newflag);
 
+#ifdef WOLFBOOT_VERIFY_CACHE
+/* Verified-digest record, stored in the BOOT partition trailer sector */
+#define WOLFBOOT_VERIFY_CACHE_MAGIC 0x48435657 /* "WVCH" */
+struct wolfBoot_verify_cache {
+    uint32_t magic;
+    uint32_t erase_count;
+    uint8_t  hdr_digest[WOLFBOOT_SHA_DIGEST_SIZE];
+    uint8_t  mac[WOLFBOOT_SHA_DIGEST_SIZE];
+};
+
+/* Defined in libwolfboot.c */
+int wolfBoot_get_verify_cache(struct wolfBoot_verify_cache *rec);
+int wolfBoot_set_verify_cache(const struct wolfBoot_verify_cache *rec);
+
+/* Provided by the platform (no default implementation).
+ * wolfBoot_get_erase_count: monotonic counter, incremented on every erase or
+ * program operation on the partition, excluding the sector holding the
+ * partition flags (e.g. kept in OTP, TPM NV or by the flash controller).
+ * wolfBoot_get_verify_cache_key: device secret used to authenticate the
+ * record, not readable by the application (e.g. derived from a hardware
+ * unique key). Returns 0 on success, -1 if the key is not available.
+ */
+uint32_t wolfBoot_get_erase_count(uint8_t part);
+int wolfBoot_get_verify_cache_key(uint8_t *key, uint32_t len);
+#endif
+
 #ifdef WOLFBOOT_ELF_FLASH_SCATTER
 /* Support for ELF scatter/gather format */
 int wolfBoot_load_flash_image_elf(int part, unsigned long* entry_out,
@@ -0,0 +1,90 @@
+/* profile.h
+ *
+ * Boot-time profiling: trace of phase begin/end events.
+ *
+ * Copyright (C) 2025 wolfSSL Inc.
+ *
+ * This file is part of wolfBoot.
+ *
+ * wolfBoot is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfBoot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+#ifndef WOLFBOOT_PROFILE_H
+#define WOLFBOOT_PROFILE_H
+
+#include <stdint.h>
+
+/* Boot phases */
+#define PROF_HAL_INIT               0x01
+#define PROF_OPEN_IMAGE             0x02
+#define PROF_VERIFY_INTEGRITY       0x03
+#define PROF_VERIFY_AUTHENTICITY    0x04
+#define PROF_UPDATE                 0x05
+#define PROF_DO_BOOT                0x06
+
+/* Event types */
+#define PROF_EVT_BEGIN              0x01
+#define PROF_EVT_END                0x02
+#define PROF_EVT_POINT              0x03 /* single event, no duration */
+
+#ifdef WOLFBOOT_PROFILE
+
+#ifndef WOLFBOOT_PROFILE_ENTRIES
+#   define WOLFBOOT_PROFILE_ENTRIES 32
+#endif
+
+#define WOLFBOOT_PROFILE_MAGIC 0x464F5250 /* "PROF" */
+
+struct wolfBoot_profile_event {
+    uint64_t timestamp;
+    uint16_t phase;
+    uint16_t type;
+    uint32_t reserved;
+};
+
+/* In-RAM trace ring: once full, the oldest events are overwritten.
+ * 'count' is the total number of events recorded. */
+struct wolfBoot_profile_trace {
+    uint32_t magic;
+    uint32_t count;
+    struct wolfBoot_profile_event ev[WOLFBOOT_PROFILE_ENTRIES];
+};
+
+/* HAL hook: free-running cycle/timestamp counter. Unit is port-specific. */
+uint64_t hal_get_timestamp(void);
+
+void wolfBoot_profile_event(uint16_t phase, uint16_t type);
+int wolfBoot_profile_end(uint16_t phase, int ret);
+struct wolfBoot_profile_trace *wolfBoot_profile_get(void);
+void wolfBoot_profile_dump(void);
+
+#define PROFILE_BEGIN(phase) wolfBoot_profile_event(phase, PROF_EVT_BEGIN)
+#define PROFILE_END(phase) wolfBoot_profile_event(phase, PROF_EVT_END)
+#define PROFILE_POINT(phase) wolfBoot_profile_event(phase, PROF_EVT_POINT)
+/* Wrap a call returning int */
+#define PROFILE_CALL(phase, call) \
+    (PROFILE_BEGIN(phase), wolfBoot_profile_end(phase, (call)))
+#define PROFILE_DUMP() wolfBoot_profile_dump()
+
+#else
+
+#define PROFILE_BEGIN(phase) do{}while(0)
+#define PROFILE_END(phase) do{}while(0)
+#define PROFILE_POINT(phase) do{}while(0)
+#define PROFILE_CALL(phase, call) (call)
+#define PROFILE_DUMP() do{}while(0)
+
+#endif /* WOLFBOOT_PROFILE */
+
+#endif /* WOLFBOOT_PROFILE_H */
@@ -33,6 +33,14 @@
 #define SPI_FLASH_SECTOR_SIZE (4096)
 #endif
 
+#ifndef SPI_FLASH_BLOCK32_SIZE
+#define SPI_FLASH_BLOCK32_SIZE (32 * 1024)
+#endif
+
+#ifndef SPI_FLASH_BLOCK64_SIZE
+#define SPI_FLASH_BLOCK64_SIZE (64 * 1024)
+#endif
+
 #ifndef SPI_FLASH_PAGE_SIZE
 #define SPI_FLASH_PAGE_SIZE   (256)
 #endif
@@ -47,6 +55,10 @@ void spi_flash_release(void);
 
 int spi_flash_sector_erase(uint32_t address);
 int spi_flash_chip_erase(void);
+#ifdef SPI_FLASH_BLOCK_ERASE
+/* size: SPI_FLASH_BLOCK32_SIZE or SPI_FLASH_BLOCK64_SIZE */
+int spi_flash_block_erase(uint32_t address, uint32_t size);
+#endif
 int spi_flash_read(uint32_t address, void *data, int len);
 int spi_flash_write(uint32_t address, const void *data, int len);
 
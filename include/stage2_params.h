@@ -32,6 +32,9 @@ struct stage2_parameter {
     uint32_t tpm_policy;
     uint16_t tpm_policy_size;
 #endif
+#ifdef WOLFBOOT_PROFILE
+    uint32_t profile_trace; /* struct wolfBoot_profile_trace */
+#endif
 #endif
 } __attribute__((packed));
 
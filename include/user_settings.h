@@ -430,7 +430,9 @@ extern int tolower(int c);
 #endif
 
 #if !defined(WOLFBOOT_TPM) && !defined(WOLFCRYPT_SECURE_MODE)
-#   define NO_HMAC
+#   ifndef WOLFBOOT_VERIFY_CACHE
+#       define NO_HMAC
+#   endif
 #if !(defined(WOLFBOOT_ENABLE_WOLFHSM_CLIENT) && \
       defined(WOLFBOOT_SIGN_ML_DSA)) &&          \
     !defined(WOLFBOOT_ENABLE_WOLFHSM_SERVER)
@@ -76,6 +76,11 @@ extern "C" {
 #define HDR_SHA384                  0x14
 #define HDR_IMG_DELTA_INVERSE       0x15
 #define HDR_IMG_DELTA_INVERSE_SIZE  0x16
+#define HDR_IMG_MERKLE_SECTOR_SIZE  0x17
+#define HDR_IMG_MERKLE_LEAVES       0x18
+#define HDR_IMG_DELTA_FORMAT        0x19
+#define HDR_IMG_DELTA_CODEC         0x1A
+#define HDR_IMG_AEAD_TAGS           0x1B
 #define HDR_SIGNATURE               0x20
 #define HDR_POLICY_SIGNATURE        0x21
 #define HDR_SECONDARY_SIGNATURE     0x22
@@ -117,6 +122,7 @@ extern "C" {
 #define HDR_IMG_TYPE_AUTH_ML_DSA  (AUTH_KEY_ML_DSA  << 8)
 
 #define HDR_IMG_TYPE_DIFF         0x00D0
+#define HDR_IMG_TYPE_COMPRESSED   0x00C0
 
 #define HDR_IMG_TYPE_PART_MASK    0x000F
 #define HDR_IMG_TYPE_WOLFBOOT     0x0000
@@ -216,8 +222,8 @@ extern "C" {
 #   define WOLFBOOT_SHA_DIGEST_SIZE (48)
 #   define image_hash image_sha3_384
 #   define header_hash header_sha3_384
-#   define update_hash wc_Sha3Update
-#   define final_hash wc_Sha3Final
+#   define update_hash wc_Sha3_384_Update
+#   define final_hash wc_Sha3_384_Final
 #   define key_hash key_sha3_384
     typedef wc_Sha3 wolfBoot_hash_t;
 #   define HDR_HASH HDR_SHA3_384
@@ -349,6 +355,11 @@ extern "C" {
 
 void wolfBoot_update_trigger(void);
 void wolfBoot_success(void);
+#ifdef PARTITION_STATE_CACHE
+void wolfBoot_state_cache_invalidate(void);
+#else
+#define wolfBoot_state_cache_invalidate() do {} while (0)
+#endif
 uint32_t wolfBoot_image_size(uint8_t *image);
 uint32_t wolfBoot_get_blob_version(uint8_t *blob);
 uint16_t wolfBoot_get_blob_type(uint8_t *blob);
@@ -397,6 +408,11 @@ int wolfBoot_get_partition_state(uint8_t part, uint8_t *st);
 #   error "Encryption ON, but no encryption algorithm selected."
 #endif
 
+#ifdef ENCRYPT_AEAD
+    #define ENCRYPT_AEAD_TAG_SIZE   16 /* GCM / Poly1305 tag */
+    #define ENCRYPT_AEAD_NONCE_SIZE 12 /* 96 bit, one per sector */
+#endif
+
 #endif /* EXT_ENCRYPTED */
 
 #if defined(EXT_ENCRYPTED) && defined(MMU)
@@ -525,6 +525,10 @@ ifeq ($(QSPI_FLASH),1)
   endif
 endif
 
+ifeq ($(SPI_FLASH_BLOCK_ERASE),1)
+  CFLAGS+=-D"SPI_FLASH_BLOCK_ERASE"
+endif
+
 ifeq ($(UART_FLASH),1)
   EXT_FLASH=1
 endif
@@ -561,6 +565,9 @@ ifeq ($(EXT_FLASH),1)
     OBJS+=src/uart_flash.o
     WOLFCRYPT_OBJS+=hal/uart/uart_drv_$(UART_TARGET).o
   endif
+  ifeq ($(EXT_FLASH_ASYNC),1)
+    CFLAGS+=-D"EXT_FLASH_ASYNC"
+  endif
 endif
 
 ifeq ($(NO_XIP),1)
@@ -578,6 +585,17 @@ ifeq ($(NVM_FLASH_WRITEONCE),1)
   CFLAGS+= -D"NVM_FLASH_WRITEONCE"
 endif
 
+ifeq ($(NVM_FLASH_JOURNAL),1)
+  ifneq ($(NVM_FLASH_WRITEONCE),1)
+    $(error NVM_FLASH_JOURNAL requires NVM_FLASH_WRITEONCE=1)
+  endif
+  CFLAGS+= -D"NVM_FLASH_JOURNAL"
+endif
+
+ifeq ($(PARTITION_STATE_CACHE),1)
+  CFLAGS+= -D"PARTITION_STATE_CACHE"
+endif
+
 ifeq ($(DISABLE_BACKUP),1)
   CFLAGS+= -D"DISABLE_BACKUP"
 endif
@@ -630,12 +648,91 @@ ifneq ($(WOLFBOOT_VERSION),0)
   endif
 endif
 
+# Compressed full-image updates are applied by the delta update engine.
+# The previous image is not backed up, so a rollback is not possible.
+ifeq ($(COMPRESSED_UPDATES),1)
+  ifneq ($(DISABLE_BACKUP),1)
+    $(error COMPRESSED_UPDATES requires DISABLE_BACKUP=1)
+  endif
+  DELTA_UPDATES:=1
+  DELTA_COMPRESSION:=1
+  CFLAGS+=-DCOMPRESSED_UPDATES
+  SIGN_OPTIONS+=--compress
+endif
+
 ifeq ($(DELTA_UPDATES),1)
   OBJS += src/delta.o
   CFLAGS+=-DDELTA_UPDATES
   ifneq ($(DELTA_BLOCK_SIZE),)
     CFLAGS+=-DDELTA_BLOCK_SIZE=$(DELTA_BLOCK_SIZE)
   endif
+  ifneq ($(DELTA_PATCH_CACHE_SIZE),)
+    CFLAGS+=-DDELTA_PATCH_CACHE_SIZE=$(DELTA_PATCH_CACHE_SIZE)
+  endif
+  ifneq ($(DELTA_SRC_CACHE_SIZE),)
+    CFLAGS+=-DDELTA_SRC_CACHE_SIZE=$(DELTA_SRC_CACHE_SIZE)
+  endif
+  ifeq ($(DELTA_CACHE_STATS),1)
+    CFLAGS+=-DDELTA_CACHE_STATS
+  endif
+  ifeq ($(DELTA_COMPRESSION),1)
+    CFLAGS+=-DDELTA_COMPRESSION
+    SIGN_OPTIONS+=--delta-compress
+  endif
+  ifeq ($(DELTA_INPLACE),1)
+    CFLAGS+=-DDELTA_INPLACE
+    SIGN_OPTIONS+=--delta-inplace
+  endif
+endif
+
+ifeq ($(MERKLE),1)
+  CFLAGS+=-DWOLFBOOT_MERKLE
+  SIGN_OPTIONS+=--merkle
+endif
+
+ifeq ($(PARALLEL_VERIFY),1)
+  CFLAGS+=-DWOLFBOOT_PARALLEL_VERIFY
+  ifeq ($(ARCH),sim)
+    LDFLAGS+=-pthread
+  endif
+endif
+
+ifeq ($(ENCRYPT_AEAD),1)
+  ifneq ($(ENCRYPT),1)
+    $(error ENCRYPT_AEAD requires ENCRYPT=1)
+  endif
+  ifneq ($(MERKLE),1)
+    $(error ENCRYPT_AEAD requires MERKLE=1)
+  endif
+  CFLAGS+=-DENCRYPT_AEAD
+  ifeq ($(ENCRYPT_WITH_CHACHA),1)
+    CFLAGS+=-DHAVE_POLY1305
+    WOLFCRYPT_OBJS+=./lib/wolfssl/wolfcrypt/src/poly1305.o
+    WOLFCRYPT_OBJS+=./lib/wolfssl/wolfcrypt/src/chacha20_poly1305.o
+  else
+    CFLAGS+=-DHAVE_AESGCM -DWOLFSSL_AESGCM_STREAM -DGCM_SMALL
+  endif
+  SIGN_OPTIONS+=--aead
+endif
+
+ifeq ($(VERIFY_CACHE),1)
+  CFLAGS+=-DWOLFBOOT_VERIFY_CACHE
+endif
+
+ifeq ($(PROFILE),1)
+  CFLAGS+=-DWOLFBOOT_PROFILE
+  OBJS+=./src/profile.o
+  ifneq ($(PROFILE_ENTRIES),)
+    CFLAGS+=-DWOLFBOOT_PROFILE_ENTRIES=$(PROFILE_ENTRIES)
+  endif
+endif
+
+ifeq ($(HASH_CONTIGUOUS),1)
+  CFLAGS+=-DWOLFBOOT_HASH_CONTIGUOUS
+endif
+
+ifneq ($(SHA_BLOCK_SIZE),)
+  CFLAGS+=-DWOLFBOOT_SHA_BLOCK_SIZE=$(SHA_BLOCK_SIZE)
 endif
 
 ifeq ($(ARMORED),1)
@@ -758,6 +855,42 @@ ifeq ($(HASH),SHA3)
   SIGN_OPTIONS+=--sha3
 endif
 
+## Verified-digest cache: the record is authenticated with HMAC
+ifeq ($(VERIFY_CACHE),1)
+  ifeq ($(findstring hmac.o,$(WOLFCRYPT_OBJS)),)
+    WOLFCRYPT_OBJS+=./lib/wolfssl/wolfcrypt/src/hmac.o
+  endif
+endif
+
+## Merkle manifest size
+# The leaf table (and the AEAD tag table) is stored in the manifest header,
+# which must fit in the first sector. Check that IMAGE_HEADER_SIZE can hold
+# one entry per partition sector, plus 256 bytes for the other fields.
+ifeq ($(MERKLE),1)
+  ifneq ($(WOLFBOOT_PARTITION_SIZE),)
+    MERKLE_ENTRY_SIZE=32
+    ifneq ($(HASH),SHA256)
+      MERKLE_ENTRY_SIZE=48
+    endif
+    ifeq ($(ENCRYPT_AEAD),1)
+      MERKLE_ENTRY_SIZE:=$(shell echo $$(( $(MERKLE_ENTRY_SIZE) + 16 )))
+    endif
+    MERKLE_SECTORS:=$(shell echo $$(( $(WOLFBOOT_PARTITION_SIZE) / \
+        $(WOLFBOOT_SECTOR_SIZE) )))
+    MERKLE_HEADER_SIZE:=$(shell echo $$(( 256 + $(MERKLE_SECTORS) * \
+        $(MERKLE_ENTRY_SIZE) )))
+    ifneq ($(shell test $(IMAGE_HEADER_SIZE) -lt \
+        $$(( $(WOLFBOOT_SECTOR_SIZE) )); echo $$?),0)
+      $(error MERKLE=1 requires IMAGE_HEADER_SIZE < WOLFBOOT_SECTOR_SIZE)
+    endif
+    ifneq ($(shell test $(MERKLE_HEADER_SIZE) -le $(IMAGE_HEADER_SIZE); \
+        echo $$?),0)
+      $(error MERKLE=1: $(MERKLE_SECTORS) partition sectors need \
+        IMAGE_HEADER_SIZE=$(MERKLE_HEADER_SIZE) or more, see docs/Signing.md)
+    endif
+  endif
+endif
+
 CFLAGS+=-DIMAGE_HEADER_SIZE=$(IMAGE_HEADER_SIZE)
 OBJS+=$(SECURE_OBJS)
 
@@ -844,6 +977,10 @@ ifeq ($(FLASH_MULTI_SECTOR_ERASE),1)
     CFLAGS+=-DWOLFBOOT_FLASH_MULTI_SECTOR_ERASE
 endif
 
+ifeq ($(FLASH_SKIP_IDENTICAL),1)
+    CFLAGS+=-DWOLFBOOT_FLASH_SKIP_IDENTICAL
+endif
+
 CFLAGS+=$(CFLAGS_EXTRA)
 OBJS+=$(OBJS_EXTRA)
 
@@ -25,6 +25,18 @@
 
 
 #define ESC 0x7f
+/* Format v2: ESC LIT_RUN followed by a 16-bit length and the raw bytes.
+ * Format v3: the length is a varint. */
+#define LIT_RUN 0xff
+/* Format v3: ESC WIDE_COPY followed by the source offset and the size of
+ * the block, as varints */
+#define WIDE_COPY 0xfe
+/* Varints are stored in groups of 7 bits, least significant first. The
+ * highest bit is set in all the bytes but the last one. */
+#define VARINT_MAX_SIZE 5
+#define WIDE_HDR_MAX_SIZE (2 + 2 * VARINT_MAX_SIZE)
+/* Shortest back-reference in WB_DELTA_CODEC_LZ streams */
+#define LZ_MIN_MATCH 4
 
 
 #if (defined(__IAR_SYSTEMS_ICC__) && (__IAR_SYSTEMS_ICC__ > 8)) || \
@@ -42,6 +54,14 @@ struct BLOCK_HDR_PACKED block_hdr {
 
 #define BLOCK_HDR_SIZE (sizeof (struct block_hdr))
 
+struct BLOCK_HDR_PACKED literal_hdr {
+    uint8_t esc;
+    uint8_t op;
+    uint8_t sz[2];
+};
+
+#define LITERAL_HDR_SIZE (sizeof (struct literal_hdr))
+
 #if defined(EXT_ENCRYPTED) && defined(__WOLFBOOT)
 #include "image.h"
 #define ext_flash_check_write ext_flash_encrypt_write
@@ -63,33 +83,184 @@ int wb_patch_init(WB_PATCH_CTX *bm, uint8_t *src, uint32_t ssz, uint8_t *patch,
     bm->src_size = ssz;
     bm->patch_base = patch;
     bm->patch_size = psz;
+    bm->format = WB_PATCH_FORMAT_V1;
 #ifdef EXT_FLASH
     bm->patch_cache_start = 0xFFFFFFFF;
+#ifdef PART_BOOT_EXT
+    bm->src_cache_start = 0xFFFFFFFF;
+#endif
 #endif
     return 0;
 }
 
+int wb_patch_set_format(WB_PATCH_CTX *bm, uint32_t format)
+{
+    if (!bm)
+        return -1;
+    if ((format != WB_PATCH_FORMAT_RAW) &&
+            ((format < WB_PATCH_FORMAT_V1) || (format > WB_PATCH_FORMAT_MAX)))
+        return -1;
+    bm->format = format;
+    return 0;
+}
+
+#ifdef DELTA_CACHE_STATS
+#define CACHE_STAT(ctx, field, n) ((ctx)->stats.field += (n))
+#else
+#define CACHE_STAT(ctx, field, n) do {} while (0)
+#endif
+
+#if defined(EXT_FLASH) && defined(PART_BOOT_EXT)
+/* Base image in external flash: reads are served from src_cache, which
+ * holds an aligned block of DELTA_SRC_CACHE_SIZE bytes. Copies of a whole
+ * cache block or more are read directly. */
+static void patch_read_src(WB_PATCH_CTX *ctx, uint8_t *dst, uint32_t off,
+        uint32_t sz)
+{
+    uint32_t n;
+
+    while (sz > 0) {
+        if ((ctx->src_cache_start == 0xFFFFFFFF) ||
+                (off < ctx->src_cache_start) ||
+                (off >= ctx->src_cache_start + DELTA_SRC_CACHE_SIZE)) {
+            CACHE_STAT(ctx, src_misses, 1);
+            if (sz >= DELTA_SRC_CACHE_SIZE) {
+                ext_flash_read((uintptr_t)(ctx->src_base + off), dst, sz);
+                CACHE_STAT(ctx, src_read, sz);
+                return;
+            }
+            ctx->src_cache_start = off - (off % DELTA_SRC_CACHE_SIZE);
+            ext_flash_read((uintptr_t)(ctx->src_base + ctx->src_cache_start),
+                    ctx->src_cache, DELTA_SRC_CACHE_SIZE);
+            CACHE_STAT(ctx, src_read, DELTA_SRC_CACHE_SIZE);
+        } else {
+            CACHE_STAT(ctx, src_hits, 1);
+        }
+        n = ctx->src_cache_start + DELTA_SRC_CACHE_SIZE - off;
+        if (n > sz)
+            n = sz;
+        memcpy(dst, ctx->src_cache + off - ctx->src_cache_start, n);
+        dst += n;
+        off += n;
+        sz -= n;
+    }
+}
+#else
+#define patch_read_src(ctx, dst, off, sz) \
+    memcpy((dst), (ctx)->src_base + (off), (sz))
+#endif
+
+/* The base image has been modified by the caller, drop any cached copy */
+void wb_patch_src_written(WB_PATCH_CTX *ctx)
+{
+#if defined(EXT_FLASH) && defined(PART_BOOT_EXT)
+    if (ctx)
+        ctx->src_cache_start = 0xFFFFFFFF;
+#else
+    (void)ctx;
+#endif
+}
+
+#ifdef DELTA_INPLACE
+/* Read the range [off, off + sz) of the base image from 'copy' (see
+ * WB_INPLACE_SAVE). The previous range, if any, is replaced. */
+int wb_patch_set_saved(WB_PATCH_CTX *ctx, uint32_t off, uint8_t *copy,
+        uint32_t sz)
+{
+    if (!ctx || !copy || (sz == 0))
+        return -1;
+    ctx->saved_base = copy;
+    ctx->saved_off = off;
+    ctx->saved_sz = sz;
+    return 0;
+}
+
+static void patch_copy_src(WB_PATCH_CTX *ctx, uint8_t *dst, uint32_t off,
+        uint32_t sz)
+{
+    while (sz > 0) {
+        uint32_t n = sz;
+        int saved = 0;
+        if (ctx->saved_sz != 0) {
+            if (off < ctx->saved_off) {
+                if (n > ctx->saved_off - off)
+                    n = ctx->saved_off - off;
+            } else if (off < ctx->saved_off + ctx->saved_sz) {
+                saved = 1;
+                if (n > ctx->saved_off + ctx->saved_sz - off)
+                    n = ctx->saved_off + ctx->saved_sz - off;
+            }
+        }
+        if (saved)
+            memcpy(dst, ctx->saved_base + off - ctx->saved_off, n);
+        else
+            patch_read_src(ctx, dst, off, n);
+        dst += n;
+        off += n;
+        sz -= n;
+    }
+}
+#else
+#define patch_copy_src(ctx, dst, off, sz) patch_read_src(ctx, dst, off, sz)
+#endif
+
 #ifdef EXT_FLASH
-#define PATCH_CACHE_SIZE 256
-#define DELTA_SWAP_CACHE_SIZE 1024
+#if DELTA_PATCH_CACHE_SIZE < (4 * WIDE_HDR_MAX_SIZE)
+#error "DELTA_PATCH_CACHE_SIZE is too small"
+#endif
 
-static inline uint8_t *patch_read_cache(WB_PATCH_CTX *ctx)
+/* Move the patch cache to 'off'. The bytes already cached after 'off' are
+ * kept, so while the patch is read sequentially each byte is read (and
+ * decrypted, with EXT_ENCRYPTED) only once. Nothing is read past the end
+ * of the patch. */
+static void patch_cache_fill(WB_PATCH_CTX *ctx, uint32_t off)
 {
-    if (ctx->patch_cache_start != 0xFFFFFFFF) {
-        if (ctx->patch_cache_start == ctx->p_off)
-            return ctx->patch_cache;
+    uint32_t end = ctx->patch_size;
+    uint32_t keep = 0, sz = 0;
 
-        if (ctx->p_off < ctx->patch_cache_start +
-                (DELTA_PATCH_BLOCK_SIZE - BLOCK_HDR_SIZE))
-            return ctx->patch_cache + ctx->p_off - ctx->patch_cache_start;
+#ifdef DELTA_COMPRESSION
+    if (ctx->codec != WB_DELTA_CODEC_NONE)
+        end = ctx->lz_in_size;
+#endif
+    if ((ctx->patch_cache_start != 0xFFFFFFFF) &&
+            (off >= ctx->patch_cache_start) &&
+            (off < ctx->patch_cache_start + DELTA_PATCH_CACHE_SIZE)) {
+        keep = ctx->patch_cache_start + DELTA_PATCH_CACHE_SIZE - off;
+        memmove(ctx->patch_cache,
+                ctx->patch_cache + off - ctx->patch_cache_start, keep);
+    }
+    ctx->patch_cache_start = off;
+    if (off + keep < end) {
+        sz = DELTA_PATCH_CACHE_SIZE - keep;
+        if (sz > end - (off + keep))
+            sz = end - (off + keep);
+        ext_flash_check_read(
+                (uintptr_t)(ctx->patch_base + off + keep),
+                ctx->patch_cache + keep, sz);
     }
-    ctx->patch_cache_start = ctx->p_off;
-    ext_flash_check_read(
-            (uintptr_t)(ctx->patch_base + ctx->p_off),
-            ctx->patch_cache, DELTA_PATCH_BLOCK_SIZE);
-    return ctx->patch_cache;
+    CACHE_STAT(ctx, patch_misses, 1);
+    CACHE_STAT(ctx, patch_read, sz);
 }
 
+/* The cache is moved when fewer than WIDE_HDR_MAX_SIZE bytes are left, so
+ * that a block header is always contiguous */
+static inline uint8_t *patch_read_cache(WB_PATCH_CTX *ctx)
+{
+    if ((ctx->patch_cache_start == 0xFFFFFFFF) ||
+            (ctx->p_off < ctx->patch_cache_start) ||
+            (ctx->p_off >= ctx->patch_cache_start +
+             (DELTA_PATCH_CACHE_SIZE - WIDE_HDR_MAX_SIZE)))
+        patch_cache_fill(ctx, ctx->p_off);
+    else
+        CACHE_STAT(ctx, patch_hits, 1);
+    return ctx->patch_cache + ctx->p_off - ctx->patch_cache_start;
+}
+
+/* Bytes available in the cache from the current patch offset */
+static inline uint32_t patch_cache_avail(WB_PATCH_CTX *ctx)
+{
+    return ctx->patch_cache_start + DELTA_PATCH_CACHE_SIZE - ctx->p_off;
+}
 
 #else
 
@@ -98,28 +269,297 @@ static inline uint8_t *patch_read_cache(WB_PATCH_CTX *ctx)
     return ctx->patch_base + ctx->p_off;
 }
 
+static inline uint32_t patch_cache_avail(WB_PATCH_CTX *ctx)
+{
+    return ctx->patch_size - ctx->p_off;
+}
+
+#endif
+
+#ifdef DELTA_COMPRESSION
+/* Decoder states, a sequence is: token, [literal length], literals,
+ * distance, [match length] */
+#define LZ_TOKEN     0
+#define LZ_LIT_EXT   1
+#define LZ_LIT       2
+#define LZ_DIST      3
+#define LZ_MATCH_EXT 4
+#define LZ_MATCH     5
+#define LZ_ERROR     6
+
+#define LZ_BUF_SIZE (2 * WB_LZ_WINDOW)
+
+/* Returns a pointer to the compressed stream at the current input offset,
+ * and the number of contiguous bytes available */
+static uint8_t *lz_in_ptr(WB_PATCH_CTX *ctx, uint32_t *avail)
+{
+#ifdef EXT_FLASH
+    if ((ctx->patch_cache_start == 0xFFFFFFFF) ||
+            (ctx->lz_in_off < ctx->patch_cache_start) ||
+            (ctx->lz_in_off >= ctx->patch_cache_start +
+             DELTA_PATCH_CACHE_SIZE))
+        patch_cache_fill(ctx, ctx->lz_in_off);
+    else
+        CACHE_STAT(ctx, patch_hits, 1);
+    *avail = ctx->patch_cache_start + DELTA_PATCH_CACHE_SIZE - ctx->lz_in_off;
+    if (*avail > ctx->lz_in_size - ctx->lz_in_off)
+        *avail = ctx->lz_in_size - ctx->lz_in_off;
+    return ctx->patch_cache + ctx->lz_in_off - ctx->patch_cache_start;
+#else
+    *avail = ctx->lz_in_size - ctx->lz_in_off;
+    return ctx->patch_base + ctx->lz_in_off;
+#endif
+}
+
+static uint8_t lz_in_byte(WB_PATCH_CTX *ctx)
+{
+    uint32_t avail;
+    uint8_t c = *lz_in_ptr(ctx, &avail);
+    ctx->lz_in_off++;
+    return c;
+}
+
+/* Decode as much of the compressed stream as fits in the output buffer.
+ * When the buffer is full, the oldest half is dropped, keeping
+ * WB_LZ_WINDOW bytes of history. */
+static void lz_decode(WB_PATCH_CTX *ctx)
+{
+    uint8_t *in, *out;
+    uint32_t avail, n;
+    uint8_t c;
+
+    if (ctx->lz_out_len == LZ_BUF_SIZE) {
+        memmove(ctx->lz_buf, ctx->lz_buf + WB_LZ_WINDOW, WB_LZ_WINDOW);
+        ctx->lz_out_start += WB_LZ_WINDOW;
+        ctx->lz_out_len -= WB_LZ_WINDOW;
+    }
+    while ((ctx->lz_out_len < LZ_BUF_SIZE) && (ctx->lz_state != LZ_ERROR)) {
+        out = ctx->lz_buf + ctx->lz_out_len;
+        switch (ctx->lz_state) {
+            case LZ_TOKEN:
+                if (ctx->lz_in_off >= ctx->lz_in_size)
+                    return;
+                c = lz_in_byte(ctx);
+                ctx->lz_lit = c >> 4;
+                ctx->lz_match = c & 0x0F;
+                ctx->lz_state = (ctx->lz_lit == 0x0F) ? LZ_LIT_EXT : LZ_LIT;
+                break;
+            case LZ_LIT_EXT:
+                if (ctx->lz_in_off >= ctx->lz_in_size) {
+                    ctx->lz_state = LZ_ERROR;
+                    break;
+                }
+                c = lz_in_byte(ctx);
+                ctx->lz_lit += c;
+                if (c != 0xFF)
+                    ctx->lz_state = LZ_LIT;
+                break;
+            case LZ_LIT:
+                if (ctx->lz_lit == 0) {
+                    /* The last sequence has no match */
+                    if (ctx->lz_in_off >= ctx->lz_in_size)
+                        return;
+                    ctx->lz_state = LZ_DIST;
+                    break;
+                }
+                in = lz_in_ptr(ctx, &avail);
+                if (avail == 0) {
+                    ctx->lz_state = LZ_ERROR;
+                    break;
+                }
+                n = LZ_BUF_SIZE - ctx->lz_out_len;
+                if (n > ctx->lz_lit)
+                    n = ctx->lz_lit;
+                if (n > avail)
+                    n = avail;
+                memcpy(out, in, n);
+                ctx->lz_in_off += n;
+                ctx->lz_out_len += n;
+                ctx->lz_lit -= n;
+                break;
+            case LZ_DIST:
+                if (ctx->lz_in_off + 2 > ctx->lz_in_size) {
+                    ctx->lz_state = LZ_ERROR;
+                    break;
+                }
+                ctx->lz_dist = lz_in_byte(ctx) << 8;
+                ctx->lz_dist |= lz_in_byte(ctx);
+                if ((ctx->lz_dist == 0) || (ctx->lz_dist > WB_LZ_WINDOW) ||
+                        (ctx->lz_dist > ctx->lz_out_len)) {
+                    ctx->lz_state = LZ_ERROR;
+                    break;
+                }
+                if (ctx->lz_match == 0x0F) {
+                    ctx->lz_state = LZ_MATCH_EXT;
+                } else {
+                    ctx->lz_match += LZ_MIN_MATCH;
+                    ctx->lz_state = LZ_MATCH;
+                }
+                break;
+            case LZ_MATCH_EXT:
+                if (ctx->lz_in_off >= ctx->lz_in_size) {
+                    ctx->lz_state = LZ_ERROR;
+                    break;
+                }
+                c = lz_in_byte(ctx);
+                ctx->lz_match += c;
+                if (c != 0xFF) {
+                    ctx->lz_match += LZ_MIN_MATCH;
+                    ctx->lz_state = LZ_MATCH;
+                }
+                break;
+            case LZ_MATCH:
+                n = LZ_BUF_SIZE - ctx->lz_out_len;
+                if (n > ctx->lz_match)
+                    n = ctx->lz_match;
+                if (n <= ctx->lz_dist) {
+                    memcpy(out, out - ctx->lz_dist, n);
+                } else {
+                    /* Overlapping copy, repeats the last lz_dist bytes */
+                    uint32_t i;
+                    for (i = 0; i < n; i++)
+                        out[i] = *(out + i - ctx->lz_dist);
+                }
+                ctx->lz_out_len += n;
+                ctx->lz_match -= n;
+                if (ctx->lz_match == 0)
+                    ctx->lz_state = LZ_TOKEN;
+                break;
+            default:
+                ctx->lz_state = LZ_ERROR;
+                break;
+        }
+    }
+}
+
+static uint8_t *lz_read_cache(WB_PATCH_CTX *ctx)
+{
+    /* Keep a full block header decoded ahead of the patch offset */
+    if ((ctx->lz_out_start + ctx->lz_out_len <
+                ctx->p_off + WIDE_HDR_MAX_SIZE) &&
+            (ctx->lz_out_start + ctx->lz_out_len < ctx->patch_size)) {
+        lz_decode(ctx);
+    }
+    if ((ctx->lz_state == LZ_ERROR) ||
+            (ctx->p_off >= ctx->lz_out_start + ctx->lz_out_len))
+        return NULL;
+    return ctx->lz_buf + ctx->p_off - ctx->lz_out_start;
+}
+
+static inline uint32_t lz_cache_avail(WB_PATCH_CTX *ctx)
+{
+    return ctx->lz_out_start + ctx->lz_out_len - ctx->p_off;
+}
+#endif /* DELTA_COMPRESSION */
+
+int wb_patch_set_codec(WB_PATCH_CTX *ctx, uint32_t codec)
+{
+    if (!ctx)
+        return -1;
+    if (codec == WB_DELTA_CODEC_NONE)
+        return 0;
+#ifdef DELTA_COMPRESSION
+    if ((codec == WB_DELTA_CODEC_LZ) && (ctx->p_off == 0) &&
+            (ctx->patch_size > WB_LZ_HDR_SIZE)) {
+        uint32_t raw_size = 0;
+        int i;
+        ctx->lz_in_size = ctx->patch_size;
+        ctx->lz_in_off = 0;
+        for (i = 0; i < WB_LZ_HDR_SIZE; i++)
+            raw_size = (raw_size << 8) | lz_in_byte(ctx);
+        if (raw_size == 0)
+            return -1;
+        ctx->codec = codec;
+        ctx->patch_size = raw_size;
+        ctx->lz_out_start = 0;
+        ctx->lz_out_len = 0;
+        ctx->lz_state = LZ_TOKEN;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+static inline uint8_t *patch_read(WB_PATCH_CTX *ctx)
+{
+#ifdef DELTA_COMPRESSION
+    if (ctx->codec != WB_DELTA_CODEC_NONE)
+        return lz_read_cache(ctx);
 #endif
+    return patch_read_cache(ctx);
+}
+
+static inline uint32_t patch_avail(WB_PATCH_CTX *ctx)
+{
+#ifdef DELTA_COMPRESSION
+    if (ctx->codec != WB_DELTA_CODEC_NONE)
+        return lz_cache_avail(ctx);
+#endif
+    return patch_cache_avail(ctx);
+}
+
+static uint32_t varint_decode(const uint8_t *p, uint32_t avail,
+        uint32_t *val)
+{
+    uint32_t i, v = 0;
+    for (i = 0; (i < avail) && (i < VARINT_MAX_SIZE); i++) {
+        v |= (uint32_t)(p[i] & 0x7F) << (7 * i);
+        if ((p[i] & 0x80) == 0) {
+            /* The last group of a 32-bit value has 4 bits */
+            if ((i == VARINT_MAX_SIZE - 1) && (p[i] > 0x0F))
+                return 0;
+            *val = v;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Parse a format v3 header: ESC, opcode, then the offset (WIDE_COPY only)
+ * and the size. Returns the size of the header, or 0 if it is truncated
+ * or invalid. */
+static uint32_t patch_wide_hdr(WB_PATCH_CTX *ctx, const uint8_t *pp,
+        uint32_t *off, uint32_t *sz)
+{
+    uint32_t avail = patch_avail(ctx);
+    uint32_t hdr_sz = 2;
+    uint32_t n;
+
+    if (avail > ctx->patch_size - ctx->p_off)
+        avail = ctx->patch_size - ctx->p_off;
+    if (avail < hdr_sz)
+        return 0;
+    if (pp[1] == WIDE_COPY) {
+        n = varint_decode(pp + hdr_sz, avail - hdr_sz, off);
+        if (n == 0)
+            return 0;
+        hdr_sz += n;
+    }
+    n = varint_decode(pp + hdr_sz, avail - hdr_sz, sz);
+    if (n == 0)
+        return 0;
+    return hdr_sz + n;
+}
 
 int wb_patch(WB_PATCH_CTX *ctx, uint8_t *dst, uint32_t len)
 {
     struct block_hdr *hdr;
     uint32_t dst_off = 0;
     uint32_t src_off;
-    uint16_t sz;
+    uint32_t sz;
+    uint32_t hdr_sz;
     uint32_t copy_sz;
-    if (!ctx)
-        return -1;
-    if (len < BLOCK_HDR_SIZE)
+    if (!ctx || (len == 0))
         return -1;
 
     while ( ( (ctx->matching != 0) || (ctx->p_off < ctx->patch_size)) && (dst_off < len)) {
-        uint8_t *pp = patch_read_cache(ctx);
+        uint8_t *pp;
         if (ctx->matching) {
             /* Resume matching block from previous sector */
             sz = ctx->blk_sz;
             if (sz > len)
                 sz = len;
-            memcpy(dst + dst_off, ctx->src_base + ctx->blk_off, sz);
+            patch_copy_src(ctx, dst + dst_off, ctx->blk_off, sz);
             if (ctx->blk_sz > len) {
                 ctx->blk_sz -= len;
                 ctx->blk_off += len;
@@ -131,40 +571,89 @@ int wb_patch(WB_PATCH_CTX *ctx, uint8_t *dst, uint32_t len)
             dst_off += sz;
             continue;
         }
-        if (*pp == ESC) {
-            if (*(pp + 1) == ESC) {
-                *(dst + dst_off) = ESC;
-                /* Two bytes of the patch have been consumed to produce ESC */
-                ctx->p_off += 2;
-                dst_off++;
-                continue;
-            } else {
-                hdr = (struct block_hdr *)pp;
-                src_off = (hdr->off[0] << 16) + (hdr->off[1] << 8) +
-                    hdr->off[2];
-                sz = (hdr->sz[0] << 8) + hdr->sz[1];
-                ctx->matching = 1;
-                if (sz > (len - dst_off)) {
-                    copy_sz = len - dst_off;
-                    ctx->blk_off = src_off + copy_sz;
-                    ctx->blk_sz = sz - copy_sz;
-                } else {
-                    copy_sz = sz;
-                }
-                memcpy(dst + dst_off, ctx->src_base + src_off, copy_sz);
-                if (sz == copy_sz) {
-                    /* End of the block, reset counters and matching state */
-                    ctx->matching = 0;
-                    ctx->blk_off = 0;
-                }
-                ctx->p_off += BLOCK_HDR_SIZE;
-                dst_off += copy_sz;
-            }
-        } else {
+        pp = patch_read(ctx);
+        if (pp == NULL)
+            return -1;
+        if (ctx->format == WB_PATCH_FORMAT_RAW) {
+            /* Full image: the stream is copied as is */
+            copy_sz = ctx->patch_size - ctx->p_off;
+            if (copy_sz > len - dst_off)
+                copy_sz = len - dst_off;
+            if (copy_sz > patch_avail(ctx))
+                copy_sz = patch_avail(ctx);
+            memcpy(dst + dst_off, pp, copy_sz);
+            ctx->p_off += copy_sz;
+            dst_off += copy_sz;
+            continue;
+        }
+        if (ctx->lit_sz) {
+            /* Literal run: copy as many bytes as available in one go */
+            copy_sz = ctx->lit_sz;
+            if (copy_sz > len - dst_off)
+                copy_sz = len - dst_off;
+            if (copy_sz > patch_avail(ctx))
+                copy_sz = patch_avail(ctx);
+            if (copy_sz > ctx->patch_size - ctx->p_off)
+                copy_sz = ctx->patch_size - ctx->p_off;
+            memcpy(dst + dst_off, pp, copy_sz);
+            ctx->lit_sz -= copy_sz;
+            ctx->p_off += copy_sz;
+            dst_off += copy_sz;
+            continue;
+        }
+        if (*pp != ESC) {
             *(dst + dst_off) = *pp;
             dst_off++;
             ctx->p_off++;
+            continue;
+        }
+        if (*(pp + 1) == ESC) {
+            *(dst + dst_off) = ESC;
+            /* Two bytes of the patch have been consumed to produce ESC */
+            ctx->p_off += 2;
+            dst_off++;
+            continue;
+        }
+        if ((ctx->format >= WB_PATCH_FORMAT_V3) &&
+                ((*(pp + 1) == LIT_RUN) || (*(pp + 1) == WIDE_COPY))) {
+            src_off = 0;
+            hdr_sz = patch_wide_hdr(ctx, pp, &src_off, &sz);
+            if (hdr_sz == 0)
+                return -1;
+            if (*(pp + 1) == LIT_RUN) {
+                ctx->lit_sz = sz;
+                ctx->p_off += hdr_sz;
+                continue;
+            }
+        } else if ((ctx->format >= WB_PATCH_FORMAT_V2) &&
+                (*(pp + 1) == LIT_RUN)) {
+            struct literal_hdr *lhdr = (struct literal_hdr *)pp;
+            ctx->lit_sz = (lhdr->sz[0] << 8) + lhdr->sz[1];
+            ctx->p_off += LITERAL_HDR_SIZE;
+            continue;
+        } else {
+            hdr = (struct block_hdr *)pp;
+            src_off = (hdr->off[0] << 16) + (hdr->off[1] << 8) +
+                hdr->off[2];
+            sz = (hdr->sz[0] << 8) + hdr->sz[1];
+            hdr_sz = BLOCK_HDR_SIZE;
+        }
+        ctx->matching = 1;
+        if (sz > (len - dst_off)) {
+            copy_sz = len - dst_off;
+            ctx->blk_off = src_off + copy_sz;
+            ctx->blk_sz = sz - copy_sz;
+        } else {
+            copy_sz = sz;
+        }
+        patch_copy_src(ctx, dst + dst_off, src_off, copy_sz);
+        if (sz == copy_sz) {
+            /* End of the block, reset counters and matching state */
+            ctx->matching = 0;
+            ctx->blk_off = 0;
         }
+        ctx->p_off += hdr_sz;
+        dst_off += copy_sz;
     }
     return dst_off;
 }
@@ -200,8 +689,106 @@ int wb_diff_get_sector_size(void)
     return sec_sz;
 }
 
+/* Hash-indexed match search.
+ *
+ * Every position of the source image 'A' is indexed in a hash table of
+ * chains, keyed on the first BLOCK_HDR_SIZE bytes. Positions of the
+ * destination image 'B' are added to a second table once they are far
+ * enough behind the current position to be referenced by a patch (see
+ * wb_diff_scan() for the rules). For each position, the candidates in the
+ * chains are extended and the longest match is selected, so the search is
+ * near-linear in the size of the images. The tables grow with the size of
+ * the images, so that chains stay short for large images.
+ */
+#define DIFF_HASH_BITS 16
+#define DIFF_HASH_MAX_BITS 24
+#define DIFF_MAX_CHAIN 256
+#define DIFF_MAX_MATCH 0xFFFF
+#define DIFF_MAX_OFFSET 0xFFFFFF
+#define DIFF_MIN_LITERAL_RUN 64
+#define DIFF_MAX_LITERAL_RUN 0xFFFF
+
+static uint32_t diff_hash(const uint8_t *p, uint32_t bits)
+{
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    uint32_t w = (uint32_t)p[4] | ((uint32_t)p[5] << 8);
+    return ((v * 2654435761U) ^ (w * 2246822519U)) >> (32 - bits);
+}
+
+static void diff_index_insert(WB_DIFF_CTX *ctx, uint32_t *head,
+        uint32_t *prev, const uint8_t *base, uint32_t pos)
+{
+    uint32_t h = diff_hash(base + pos, ctx->hash_bits);
+    /* chain entries are stored as position + 1, 0 terminates the chain */
+    prev[pos] = head[h];
+    head[h] = pos + 1;
+}
+
+static uint32_t diff_match_len(const uint8_t *a, const uint8_t *b,
+        uint32_t max_len)
+{
+    uint32_t l = 0;
+    while ((l < max_len) && (a[l] == b[l]))
+        l++;
+    return l;
+}
+
+/* Size of the patch if the next 'len' bytes of B are stored as literals */
+static uint32_t diff_literal_cost(const uint8_t *b, uint32_t len)
+{
+    uint32_t i, cost = len;
+    for (i = 0; i < len; i++) {
+        if (b[i] == ESC)
+            cost++;
+    }
+    return cost;
+}
+
+static void diff_free_index(WB_DIFF_CTX *ctx)
+{
+    if ((ctx->shared & WB_DIFF_SHARED_A) == 0) {
+        free(ctx->head_a);
+        free(ctx->prev_a);
+    }
+    if ((ctx->shared & WB_DIFF_SHARED_B) == 0)
+        free(ctx->prev_b);
+    free(ctx->head_b);
+    ctx->head_a = NULL;
+    ctx->prev_a = NULL;
+    ctx->head_b = NULL;
+    ctx->prev_b = NULL;
+}
+
+/* The size of the tables only depends on the new image, so that the index
+ * of B can be shared by patches from different base images */
+static int diff_build_index(WB_DIFF_CTX *ctx)
+{
+    uint32_t pos;
+    if (ctx->hash_bits == 0) {
+        ctx->hash_bits = DIFF_HASH_BITS;
+        while ((ctx->hash_bits < DIFF_HASH_MAX_BITS) &&
+                ((1U << ctx->hash_bits) < ctx->size_b))
+            ctx->hash_bits++;
+    }
+    ctx->head_a = calloc(1U << ctx->hash_bits, sizeof(uint32_t));
+    ctx->head_b = calloc(1U << ctx->hash_bits, sizeof(uint32_t));
+    ctx->prev_a = calloc(ctx->size_a, sizeof(uint32_t));
+    if ((ctx->shared & WB_DIFF_SHARED_B) == 0)
+        ctx->prev_b = calloc(ctx->size_b, sizeof(uint32_t));
+    if (!ctx->head_a || !ctx->head_b || !ctx->prev_a || !ctx->prev_b) {
+        diff_free_index(ctx);
+        return -1;
+    }
+    for (pos = 0; pos + BLOCK_HDR_SIZE <= ctx->size_a; pos++)
+        diff_index_insert(ctx, ctx->head_a, ctx->prev_a, ctx->src_a, pos);
+    ctx->indexed_b = 0;
+    return 0;
+}
+
 int wb_diff_init(WB_DIFF_CTX *ctx, uint8_t *src_a, uint32_t len_a, uint8_t *src_b, uint32_t len_b)
 {
+    char *env_engine;
     if (!ctx || (len_a == 0) || (len_b == 0))
         return -1;
     memset(ctx, 0, sizeof(WB_DIFF_CTX));
@@ -209,12 +796,469 @@ int wb_diff_init(WB_DIFF_CTX *ctx, uint8_t *src_a, uint32_t len_a, uint8_t *src_
     ctx->src_b = src_b;
     ctx->size_a = len_a;
     ctx->size_b = len_b;
+    ctx->end_b = len_b;
+    ctx->format = WB_PATCH_FORMAT_V1;
     wolfboot_sector_size = wb_diff_get_sector_size();
     printf("WOLFBOOT_SECTOR_SIZE: %u\n", wolfboot_sector_size);
+    env_engine = getenv("WOLFBOOT_DIFF_ENGINE");
+    if (env_engine && (strcmp(env_engine, "scan") == 0)) {
+        ctx->engine = WB_DIFF_ENGINE_SCAN;
+    } else if (env_engine && (strcmp(env_engine, "hash") != 0)) {
+        fprintf(stderr, "Invalid WOLFBOOT_DIFF_ENGINE value\n");
+        return -1;
+    } else {
+        ctx->engine = WB_DIFF_ENGINE_HASH;
+        if (diff_build_index(ctx) < 0)
+            return -1;
+    }
     return 0;
 }
 
-int wb_diff(WB_DIFF_CTX *ctx, uint8_t *patch, uint32_t len)
+int wb_diff_set_format(WB_DIFF_CTX *ctx, uint32_t format)
+{
+    if (!ctx || (format < WB_PATCH_FORMAT_V1) || (format > WB_PATCH_FORMAT_MAX))
+        return -1;
+    /* Literal runs are only generated by the hash engine */
+    if ((format > WB_PATCH_FORMAT_V1) && (ctx->engine != WB_DIFF_ENGINE_HASH))
+        return -1;
+    ctx->format = format;
+    return 0;
+}
+
+void wb_diff_free(WB_DIFF_CTX *ctx)
+{
+    if (ctx)
+        diff_free_index(ctx);
+}
+
+/* Index all the positions of the new image at once. The chains of B are
+ * then read-only, and can be shared by the contexts created with
+ * wb_diff_init_worker() and wb_diff_init_base(), each keeping its own
+ * table of heads. */
+int wb_diff_index_b(WB_DIFF_CTX *ctx)
+{
+    uint32_t pos;
+    if (!ctx || (ctx->engine != WB_DIFF_ENGINE_HASH) || (ctx->indexed_b != 0))
+        return -1;
+    if (ctx->b_indexed)
+        return 0;
+    for (pos = 0; pos + BLOCK_HDR_SIZE <= ctx->size_b; pos++)
+        diff_index_insert(ctx, ctx->head_b, ctx->prev_b, ctx->src_b, pos);
+    memset(ctx->head_b, 0, (1U << ctx->hash_bits) * sizeof(uint32_t));
+    ctx->b_indexed = 1;
+    return 0;
+}
+
+/* Context diffing the same images as 'ctx', sharing its index */
+int wb_diff_init_worker(WB_DIFF_CTX *ctx, const WB_DIFF_CTX *main_ctx)
+{
+    if (!ctx || !main_ctx || !main_ctx->b_indexed)
+        return -1;
+    memcpy(ctx, main_ctx, sizeof(WB_DIFF_CTX));
+    ctx->shared = WB_DIFF_SHARED_A | WB_DIFF_SHARED_B;
+    ctx->off_b = 0;
+    ctx->indexed_b = 0;
+    ctx->head_b = calloc(1U << ctx->hash_bits, sizeof(uint32_t));
+    if (!ctx->head_b)
+        return -1;
+    return 0;
+}
+
+/* Context diffing a different base image against the same new image as
+ * 'target', sharing the index of the new image */
+int wb_diff_init_base(WB_DIFF_CTX *ctx, uint8_t *src_a, uint32_t len_a,
+        const WB_DIFF_CTX *target)
+{
+    if (!ctx || !target || !target->b_indexed || (len_a == 0))
+        return -1;
+    memset(ctx, 0, sizeof(WB_DIFF_CTX));
+    ctx->src_a = src_a;
+    ctx->size_a = len_a;
+    ctx->src_b = target->src_b;
+    ctx->size_b = target->size_b;
+    ctx->end_b = target->size_b;
+    ctx->engine = target->engine;
+    ctx->format = target->format;
+    ctx->hash_bits = target->hash_bits;
+    ctx->prev_b = target->prev_b;
+    ctx->b_indexed = 1;
+    ctx->shared = WB_DIFF_SHARED_B;
+    return diff_build_index(ctx);
+}
+
+static uint32_t varint_size(uint32_t val)
+{
+    uint32_t n = 1;
+    while (val >= 0x80) {
+        val >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static uint32_t varint_write(uint8_t *p, uint32_t val)
+{
+    uint32_t n = 0;
+    while (val >= 0x80) {
+        p[n++] = (uint8_t)(val | 0x80);
+        val >>= 7;
+    }
+    p[n++] = (uint8_t)val;
+    return n;
+}
+
+/* A header whose first offset byte is ESC would be parsed as an escaped
+ * literal by wb_patch(), so such offsets cannot be referenced with a
+ * block_hdr. The same applies to LIT_RUN in format v2, and to WIDE_COPY
+ * in format v3. */
+static int diff_block_hdr_valid(WB_DIFF_CTX *ctx, uint32_t off,
+        uint32_t len)
+{
+    uint8_t op = (off >> 16) & 0xFF;
+    if ((off > DIFF_MAX_OFFSET) || (len > DIFF_MAX_MATCH) || (op == ESC))
+        return 0;
+    if ((ctx->format >= WB_PATCH_FORMAT_V2) && (op == LIT_RUN))
+        return 0;
+    if ((ctx->format >= WB_PATCH_FORMAT_V3) && (op == WIDE_COPY))
+        return 0;
+    return 1;
+}
+
+/* Any offset can be referenced by a WIDE_COPY header in format v3 */
+static int diff_offset_valid(WB_DIFF_CTX *ctx, uint32_t off)
+{
+    if (ctx->format >= WB_PATCH_FORMAT_V3)
+        return 1;
+    return diff_block_hdr_valid(ctx, off, 0);
+}
+
+/* In format v3, a copy block is encoded with the shortest header. Returns
+ * the size of the WIDE_COPY header if it is selected, 0 otherwise. */
+static uint32_t diff_wide_hdr_size(WB_DIFF_CTX *ctx, uint32_t blk_start,
+        uint32_t match_len)
+{
+    uint32_t wide_sz;
+    if (ctx->format < WB_PATCH_FORMAT_V3)
+        return 0;
+    wide_sz = 2 + varint_size(blk_start) + varint_size(match_len);
+    if ((wide_sz < BLOCK_HDR_SIZE) ||
+            !diff_block_hdr_valid(ctx, blk_start, match_len))
+        return wide_sz;
+    return 0;
+}
+
+static uint32_t diff_hdr_size(WB_DIFF_CTX *ctx, uint32_t blk_start,
+        uint32_t match_len)
+{
+    uint32_t wide_sz = diff_wide_hdr_size(ctx, blk_start, match_len);
+    return (wide_sz != 0) ? wide_sz : BLOCK_HDR_SIZE;
+}
+
+static uint32_t diff_write_hdr(WB_DIFF_CTX *ctx, uint8_t *patch,
+        uint32_t blk_start, uint32_t match_len)
+{
+    struct block_hdr hdr;
+    uint32_t hdr_sz;
+    if (diff_wide_hdr_size(ctx, blk_start, match_len) != 0) {
+        patch[0] = ESC;
+        patch[1] = WIDE_COPY;
+        hdr_sz = 2 + varint_write(patch + 2, blk_start);
+        return hdr_sz + varint_write(patch + hdr_sz, match_len);
+    }
+    hdr.esc = ESC;
+    hdr.off[0] = ((blk_start >> 16) & 0x000000FF);
+    hdr.off[1] = ((blk_start >> 8) & 0x000000FF);
+    hdr.off[2] = ((blk_start) & 0x000000FF);
+    hdr.sz[0] = ((match_len >> 8) & 0x00FF);
+    hdr.sz[1] = ((match_len) & 0x00FF);
+    memcpy(patch, &hdr, sizeof(hdr));
+    return BLOCK_HDR_SIZE;
+}
+
+/* In-place patches, see wb_diff_inplace(). State of the sectors of the
+ * partition while the plan is built. */
+#define INPLACE_OLD  0 /* base content, not written yet */
+#define INPLACE_NEW  1 /* written with the content of the new image */
+#define INPLACE_SAME 2 /* identical in both images, never written */
+#define INPLACE_NONE 0xFFFFFFFF
+
+/* Whether sector 'sec' can be referenced in the base image (in_b == 0) or
+ * in the new image (in_b == 1) by the patch of the current sector. The
+ * base content of the saved sector is read from the swap sector, so its
+ * offsets always refer to the base image. */
+static int diff_inplace_readable(WB_DIFF_CTX *ctx, uint32_t sec, int in_b)
+{
+    if (sec >= ctx->n_sectors)
+        return 0;
+    if (ctx->sec_state[sec] == INPLACE_SAME)
+        return 1;
+    if (in_b)
+        return (ctx->sec_state[sec] == INPLACE_NEW) &&
+            (sec != ctx->saved_sec);
+    if (sec == ctx->saved_sec)
+        return 1;
+    return (ctx->sec_state[sec] == INPLACE_OLD) && (sec != ctx->cur_sec);
+}
+
+/* Number of bytes that can be referenced from 'pos', up to 'limit' */
+static uint32_t diff_inplace_avail(WB_DIFF_CTX *ctx, uint32_t pos, int in_b,
+        uint32_t limit)
+{
+    const uint32_t ss = wolfboot_sector_size;
+    uint32_t size = in_b ? ctx->size_b : ctx->size_a;
+    uint32_t end = pos;
+
+    while ((end < size) && (end - pos < limit) &&
+            diff_inplace_readable(ctx, end / ss, in_b))
+        end = (end / ss + 1) * ss;
+    if (end > size)
+        end = size;
+    if (end - pos > limit)
+        return limit;
+    return end - pos;
+}
+
+/* Longest match for the data at 'off_b', among the positions of both
+ * images that are still valid on the device when the current sector is
+ * written */
+static uint32_t diff_find_match_inplace(WB_DIFF_CTX *ctx, uint32_t off_b,
+        uint32_t *match_off)
+{
+    const uint8_t *cur = ctx->src_b + off_b;
+    uint32_t limit = ctx->end_b - off_b;
+    uint32_t best_len = 0, best_off = 0;
+    uint32_t h, cand, max_len, l, chain;
+    int in_b;
+
+    if (limit < BLOCK_HDR_SIZE)
+        return 0;
+    if ((ctx->format < WB_PATCH_FORMAT_V3) && (limit > DIFF_MAX_MATCH))
+        limit = DIFF_MAX_MATCH;
+    h = diff_hash(cur, ctx->hash_bits);
+    for (in_b = 0; in_b < 2; in_b++) {
+        const uint8_t *src = in_b ? ctx->src_b : ctx->src_a;
+        const uint32_t *prev = in_b ? ctx->prev_b : ctx->prev_a;
+        cand = in_b ? ctx->head_b[h] : ctx->head_a[h];
+        for (chain = 0; (cand != 0) && (chain < DIFF_MAX_CHAIN); chain++) {
+            uint32_t pos = cand - 1;
+            cand = prev[pos];
+            if (!diff_offset_valid(ctx, pos))
+                continue;
+            max_len = diff_inplace_avail(ctx, pos, in_b, limit);
+            if (max_len <= best_len)
+                continue;
+            l = diff_match_len(src + pos, cur, max_len);
+            if (l > best_len) {
+                best_len = l;
+                best_off = pos;
+                if (l == limit)
+                    break;
+            }
+        }
+        if (best_len == limit)
+            break;
+    }
+    if ((best_len < BLOCK_HDR_SIZE) || (diff_literal_cost(cur, best_len) <=
+                diff_hdr_size(ctx, best_off, best_len)))
+        return 0;
+    *match_off = best_off;
+    return best_len;
+}
+
+/* Find the longest match for the data at 'off_b' in the new image.
+ * Returns the length of the match, or 0 if the same data stored as literals
+ * is not larger than the header of the block. */
+static uint32_t diff_find_match(WB_DIFF_CTX *ctx, uint32_t off_b,
+        uint32_t *match_off)
+{
+    const uint32_t ss = wolfboot_sector_size;
+    const uint8_t *cur = ctx->src_b + off_b;
+    uint32_t sector_start = (off_b / ss) * ss;
+    uint32_t sector_left = ss - (off_b % ss);
+    uint32_t best_len = 0, best_off = 0;
+    uint32_t h, cand, max_len, limit, l, chain;
+
+    if (ctx->sec_state != NULL)
+        return diff_find_match_inplace(ctx, off_b, match_off);
+    if ((sector_left < BLOCK_HDR_SIZE) ||
+            (ctx->size_b - off_b < BLOCK_HDR_SIZE))
+        return 0;
+
+    /* B positions in sectors at least one sector behind the current one
+     * can be referenced, as long as the match ends before the current
+     * sector. */
+    while ((sector_start >= ss) && (ctx->indexed_b <= sector_start - ss) &&
+            (ctx->indexed_b + BLOCK_HDR_SIZE <= sector_start)) {
+        if (ctx->b_indexed) {
+            /* Chains are already linked, only the heads are updated */
+            ctx->head_b[diff_hash(ctx->src_b + ctx->indexed_b,
+                    ctx->hash_bits)] = ctx->indexed_b + 1;
+        } else {
+            diff_index_insert(ctx, ctx->head_b, ctx->prev_b, ctx->src_b,
+                    ctx->indexed_b);
+        }
+        ctx->indexed_b++;
+    }
+
+    h = diff_hash(cur, ctx->hash_bits);
+
+    /* Matches in A: only the current sector and the ones ahead are
+     * still unmodified, and the match must end within the current
+     * sector of B. */
+    limit = sector_left;
+    if (limit > ctx->end_b - off_b)
+        limit = ctx->end_b - off_b;
+    if ((ctx->format < WB_PATCH_FORMAT_V3) && (limit > DIFF_MAX_MATCH))
+        limit = DIFF_MAX_MATCH;
+    cand = ctx->head_a[h];
+    for (chain = 0; (cand != 0) && (chain < DIFF_MAX_CHAIN); chain++) {
+        uint32_t pos = cand - 1;
+        cand = ctx->prev_a[pos];
+        if (pos < sector_start)
+            break; /* chains are in descending order */
+        if (!diff_offset_valid(ctx, pos))
+            continue;
+        max_len = ctx->size_a - pos;
+        if (max_len > limit)
+            max_len = limit;
+        if (max_len <= best_len)
+            continue;
+        l = diff_match_len(ctx->src_a + pos, cur, max_len);
+        if (l > best_len) {
+            best_len = l;
+            best_off = pos;
+            if (l == limit)
+                break;
+        }
+    }
+
+    /* Matches in the part of B that has already been patched. The index
+     * may be ahead when looking for the end of a literal run. */
+    limit = ctx->end_b - off_b;
+    if ((ctx->format < WB_PATCH_FORMAT_V3) && (limit > DIFF_MAX_MATCH))
+        limit = DIFF_MAX_MATCH;
+    cand = ctx->head_b[h];
+    for (chain = 0; (cand != 0) && (chain < DIFF_MAX_CHAIN); chain++) {
+        uint32_t pos = cand - 1;
+        cand = ctx->prev_b[pos];
+        if ((pos + ss > sector_start) || !diff_offset_valid(ctx, pos))
+            continue;
+        max_len = sector_start - pos;
+        if (max_len > limit)
+            max_len = limit;
+        if (max_len <= best_len)
+            continue;
+        l = diff_match_len(ctx->src_b + pos, cur, max_len);
+        if (l > best_len) {
+            best_len = l;
+            best_off = pos;
+            if (l == limit)
+                break;
+        }
+    }
+
+    if ((best_len < BLOCK_HDR_SIZE) || (diff_literal_cost(cur, best_len) <=
+                diff_hdr_size(ctx, best_off, best_len)))
+        return 0;
+    *match_off = best_off;
+    return best_len;
+}
+
+static uint32_t diff_write_literal(uint8_t *patch, uint8_t c)
+{
+    patch[0] = c;
+    if (c == ESC) {
+        patch[1] = ESC;
+        return 2;
+    }
+    return 1;
+}
+
+static uint32_t diff_write_lit_run(WB_DIFF_CTX *ctx, uint8_t *patch,
+        uint32_t run)
+{
+    struct literal_hdr lhdr;
+    if (ctx->format >= WB_PATCH_FORMAT_V3) {
+        patch[0] = ESC;
+        patch[1] = LIT_RUN;
+        return 2 + varint_write(patch + 2, run);
+    }
+    lhdr.esc = ESC;
+    lhdr.op = LIT_RUN;
+    lhdr.sz[0] = (run >> 8) & 0xFF;
+    lhdr.sz[1] = run & 0xFF;
+    memcpy(patch, &lhdr, LITERAL_HDR_SIZE);
+    return LITERAL_HDR_SIZE;
+}
+
+static int wb_diff_hash(WB_DIFF_CTX *ctx, uint8_t *patch, uint32_t len)
+{
+    uint32_t p_off = 0;
+    uint32_t match_len, match_off = 0;
+    /* Space reserved for the next header in the output block */
+    uint32_t hdr_max = BLOCK_HDR_SIZE;
+    uint32_t lit_hdr_max = LITERAL_HDR_SIZE;
+    uint32_t max_run = DIFF_MAX_LITERAL_RUN;
+
+    if (ctx->format >= WB_PATCH_FORMAT_V3) {
+        hdr_max = WIDE_HDR_MAX_SIZE;
+        lit_hdr_max = 2 + VARINT_MAX_SIZE;
+        max_run = len;
+    }
+    if (ctx->off_b >= ctx->end_b)
+        return 0;
+    if (len < hdr_max)
+        return -1;
+
+    while ((ctx->off_b + BLOCK_HDR_SIZE < ctx->end_b) &&
+            (len > p_off + hdr_max)) {
+        uint32_t run, i;
+
+        match_len = diff_find_match(ctx, ctx->off_b, &match_off);
+        if (match_len > 0) {
+            p_off += diff_write_hdr(ctx, patch + p_off, match_off, match_len);
+            ctx->off_b += match_len;
+            continue;
+        }
+        if (ctx->format < WB_PATCH_FORMAT_V2) {
+            p_off += diff_write_literal(patch + p_off, ctx->src_b[ctx->off_b]);
+            ctx->off_b++;
+            continue;
+        }
+
+        /* Format v2: find the end of the literal run, bounded by the space
+         * left in the output block */
+        run = 1;
+        while ((ctx->off_b + run + BLOCK_HDR_SIZE < ctx->end_b) &&
+                (run < max_run) &&
+                (p_off + lit_hdr_max + run + hdr_max < len) &&
+                (diff_find_match(ctx, ctx->off_b + run, &match_off) == 0)) {
+            run++;
+        }
+        if (run >= DIFF_MIN_LITERAL_RUN) {
+            p_off += diff_write_lit_run(ctx, patch + p_off, run);
+            memcpy(patch + p_off, ctx->src_b + ctx->off_b, run);
+            p_off += run;
+            ctx->off_b += run;
+        } else {
+            /* Short run: single literals, the match search is not repeated */
+            for (i = 0; (i < run) && (len > p_off + hdr_max); i++) {
+                p_off += diff_write_literal(patch + p_off,
+                        ctx->src_b[ctx->off_b]);
+                ctx->off_b++;
+            }
+        }
+    }
+    while ((p_off < len - BLOCK_HDR_SIZE) && ctx->off_b < ctx->end_b) {
+        p_off += diff_write_literal(patch + p_off, ctx->src_b[ctx->off_b]);
+        ctx->off_b++;
+    }
+    return (int)p_off;
+}
+
+/* Original match search: linear scan for the first match of at least
+ * BLOCK_HDR_SIZE bytes. Selected with WOLFBOOT_DIFF_ENGINE=scan */
+static int wb_diff_scan(WB_DIFF_CTX *ctx, uint8_t *patch, uint32_t len)
 {
     struct block_hdr hdr;
     int found;
@@ -370,6 +1414,420 @@ int wb_diff(WB_DIFF_CTX *ctx, uint8_t *patch, uint32_t len)
     }
     return (int)p_off;
 }
+
+int wb_diff(WB_DIFF_CTX *ctx, uint8_t *patch, uint32_t len)
+{
+    if (!ctx || !patch)
+        return -1;
+    if (ctx->engine == WB_DIFF_ENGINE_SCAN)
+        return wb_diff_scan(ctx, patch, len);
+    return wb_diff_hash(ctx, patch, len);
+}
+
+/* Diff of the sectors of the new image in [start, end), 'start' being
+ * aligned to the sector size. Blocks and literal runs do not cross the
+ * sectors, so the patch of each sector only depends on the images: the
+ * patches of consecutive ranges, diffed by any number of contexts, are
+ * concatenated into the same patch. Each context must be given ranges
+ * in increasing order. 'len' must be at least WB_DIFF_BOUND(end - start).
+ */
+int wb_diff_sectors(WB_DIFF_CTX *ctx, uint32_t start, uint32_t end,
+        uint8_t *patch, uint32_t len)
+{
+    const uint32_t ss = wolfboot_sector_size;
+    uint32_t sec, p_off = 0;
+    int ret = 0;
+
+    if (!ctx || !patch || (ctx->engine != WB_DIFF_ENGINE_HASH) ||
+            (ss == 0) || ((start % ss) != 0) || (start >= end) ||
+            (end > ctx->size_b) || (len < WB_DIFF_BOUND(end - start)))
+        return -1;
+    for (sec = start; sec < end; sec += ss) {
+        ctx->off_b = sec;
+        ctx->end_b = (end - sec > ss) ? sec + ss : end;
+        ret = wb_diff_hash(ctx, patch + p_off, len - p_off);
+        if ((ret < 0) || (ctx->off_b != ctx->end_b)) {
+            ret = -1;
+            break;
+        }
+        p_off += ret;
+    }
+    ctx->end_b = ctx->size_b;
+    if (ret < 0)
+        return -1;
+    return (int)p_off;
+}
+
+/* In-place patch (WB_PATCH_INPLACE) of the new image, see delta.h for the
+ * format. Writing a sector on the device destroys its base content, so
+ * all the sectors reading from it must be written before. The order of
+ * the plan is computed from a first diff of each sector against the whole
+ * base image, which gives the number of bytes each sector reads from the
+ * others. Sectors are then picked greedily:
+ *  - a sector that none of the pending sectors reads from is written;
+ *  - if it also reads at least DIFF_INPLACE_MIN_SAVE bytes from its own
+ *    base content, and the swap sector is free, it is saved first;
+ *  - if all the pending sectors are read by others (cycles), the sector
+ *    most read by the others is saved, and the cycle is broken: the others
+ *    read its base content from the swap sector. The swap sector is in use
+ *    until all of them have been written;
+ *  - otherwise, the sector losing the fewest references is written.
+ * The patch of each sector is then computed in the order of the plan, only
+ * referencing the data still available on the device at that point, so
+ * lost references only make the patch larger.
+ * Returns the size of the patch, including the plan, whose size is stored
+ * in 'plan_sz'. 'len' must be at least WB_DIFF_INPLACE_BOUND().
+ */
+#define DIFF_INPLACE_MIN_SAVE 256
+
+struct inplace_dep {
+    uint32_t sec;
+    uint32_t bytes;
+};
+
+struct diff_inplace {
+    struct inplace_dep *deps;
+    uint32_t n_deps, max_deps;
+    uint32_t *dep_start;  /* first dependency of each sector */
+    uint32_t *pending_in; /* bytes read by the pending sectors */
+    uint32_t *self;       /* bytes read from the sector itself */
+};
+
+/* Account for a block of 'len' bytes at 'off' in the base image, read by
+ * the sector whose dependencies start at 'first' */
+static int diff_inplace_add_dep(struct diff_inplace *pl, uint32_t first,
+        uint32_t off, uint32_t len)
+{
+    const uint32_t ss = wolfboot_sector_size;
+    while (len > 0) {
+        uint32_t sec = off / ss;
+        uint32_t n = ss - (off % ss);
+        uint32_t i;
+        if (n > len)
+            n = len;
+        for (i = first; (i < pl->n_deps) && (pl->deps[i].sec != sec); i++)
+            ;
+        if (i == pl->n_deps) {
+            if (pl->n_deps == pl->max_deps) {
+                struct inplace_dep *tmp;
+                pl->max_deps = 2 * pl->max_deps + 64;
+                tmp = realloc(pl->deps, pl->max_deps * sizeof(*tmp));
+                if (tmp == NULL)
+                    return -1;
+                pl->deps = tmp;
+            }
+            pl->deps[i].sec = sec;
+            pl->deps[i].bytes = 0;
+            pl->n_deps++;
+        }
+        pl->deps[i].bytes += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Next sector of the plan, among the ones in INPLACE_OLD state */
+static uint32_t diff_inplace_pick(WB_DIFF_CTX *ctx, struct diff_inplace *pl,
+        uint32_t n_b, uint32_t *flags)
+{
+    uint32_t x, pick = INPLACE_NONE, best = 0;
+    int swap_free = (ctx->saved_sec == INPLACE_NONE) ||
+        (pl->pending_in[ctx->saved_sec] == 0);
+
+    *flags = 0;
+    for (x = 0; x < n_b; x++) {
+        if ((ctx->sec_state[x] != INPLACE_OLD) || (pl->pending_in[x] != 0))
+            continue;
+        if (pl->self[x] < DIFF_INPLACE_MIN_SAVE)
+            return x;
+        if (pick == INPLACE_NONE)
+            pick = x;
+    }
+    if ((pick != INPLACE_NONE) && swap_free) {
+        *flags = WB_INPLACE_SAVE;
+        return pick;
+    }
+    if (swap_free) {
+        for (x = 0; x < n_b; x++) {
+            if ((ctx->sec_state[x] == INPLACE_OLD) &&
+                    ((pick == INPLACE_NONE) || (pl->pending_in[x] > best))) {
+                pick = x;
+                best = pl->pending_in[x];
+            }
+        }
+        *flags = WB_INPLACE_SAVE;
+        return pick;
+    }
+    pick = INPLACE_NONE;
+    for (x = 0; x < n_b; x++) {
+        if ((ctx->sec_state[x] == INPLACE_OLD) && ((pick == INPLACE_NONE) ||
+                    (pl->pending_in[x] + pl->self[x] < best))) {
+            pick = x;
+            best = pl->pending_in[x] + pl->self[x];
+        }
+    }
+    return pick;
+}
+
+int wb_diff_inplace(WB_DIFF_CTX *ctx, uint8_t *patch, uint32_t len,
+        uint32_t *plan_sz)
+{
+    const uint32_t ss = wolfboot_sector_size;
+    struct diff_inplace pl;
+    struct wb_inplace_hdr hdr;
+    struct wb_inplace_op *ops = NULL;
+    uint32_t n_a, n_b, n, x, i, pos, end, step, m_off = 0, m_len;
+    uint32_t n_ops = 0, n_pending = 0, p_off, flags;
+    int r, ret = -1;
+
+    if (!ctx || !patch || !plan_sz || (ctx->engine != WB_DIFF_ENGINE_HASH) ||
+            (ss == 0) || (ctx->shared != 0) || ctx->b_indexed ||
+            (ctx->indexed_b != 0))
+        return -1;
+    n_a = (ctx->size_a + ss - 1) / ss;
+    n_b = (ctx->size_b + ss - 1) / ss;
+    n = (n_a > n_b) ? n_a : n_b;
+    if (len < WB_DIFF_INPLACE_BOUND(ctx->size_b, n))
+        return -1;
+    memset(&pl, 0, sizeof(pl));
+    ctx->sec_state = calloc(n, 1);
+    ctx->n_sectors = n;
+    pl.dep_start = calloc(n_b + 1, sizeof(uint32_t));
+    pl.pending_in = calloc(n, sizeof(uint32_t));
+    pl.self = calloc(n, sizeof(uint32_t));
+    ops = calloc(n, sizeof(struct wb_inplace_op));
+    if (!ctx->sec_state || !pl.dep_start || !pl.pending_in || !pl.self ||
+            !ops)
+        goto out;
+
+    /* Sectors identical in both images are never written */
+    for (x = 0; x < n_b; x++) {
+        pos = x * ss;
+        end = (ctx->size_b - pos > ss) ? pos + ss : ctx->size_b;
+        if ((end <= ctx->size_a) &&
+                (memcmp(ctx->src_a + pos, ctx->src_b + pos, end - pos) == 0))
+            ctx->sec_state[x] = INPLACE_SAME;
+        else
+            n_pending++;
+    }
+
+    /* Dependencies: each sector against the whole base image */
+    for (x = 0; x < n_b; x++) {
+        pl.dep_start[x] = pl.n_deps;
+        if (ctx->sec_state[x] == INPLACE_SAME)
+            continue;
+        ctx->cur_sec = x;
+        ctx->saved_sec = x;
+        pos = x * ss;
+        ctx->end_b = (ctx->size_b - pos > ss) ? pos + ss : ctx->size_b;
+        while (pos < ctx->end_b) {
+            m_len = diff_find_match(ctx, pos, &m_off);
+            if (m_len == 0) {
+                pos++;
+                continue;
+            }
+            if (diff_inplace_add_dep(&pl, pl.dep_start[x], m_off, m_len) < 0)
+                goto out;
+            pos += m_len;
+        }
+    }
+    pl.dep_start[n_b] = pl.n_deps;
+    for (x = 0; x < n_b; x++) {
+        for (i = pl.dep_start[x]; i < pl.dep_start[x + 1]; i++) {
+            if (pl.deps[i].sec == x)
+                pl.self[x] = pl.deps[i].bytes;
+            else
+                pl.pending_in[pl.deps[i].sec] += pl.deps[i].bytes;
+        }
+    }
+
+    /* Order of the plan */
+    ctx->saved_sec = INPLACE_NONE;
+    for (n_ops = 0; n_ops < n_pending; n_ops++) {
+        x = diff_inplace_pick(ctx, &pl, n_b, &flags);
+        ops[n_ops].sector = x;
+        ops[n_ops].flags = flags;
+        ctx->sec_state[x] = INPLACE_NEW;
+        if (flags & WB_INPLACE_SAVE)
+            ctx->saved_sec = x;
+        for (i = pl.dep_start[x]; i < pl.dep_start[x + 1]; i++) {
+            if (pl.deps[i].sec != x)
+                pl.pending_in[pl.deps[i].sec] -= pl.deps[i].bytes;
+        }
+    }
+    /* Base sectors beyond the end of the new image are erased last */
+    for (x = n_b; x < n_a; x++) {
+        ops[n_ops].sector = x;
+        ops[n_ops++].flags = WB_INPLACE_ERASE;
+    }
+
+    /* Patch of each sector, in the order of the plan */
+    for (x = 0; x < n; x++) {
+        if (ctx->sec_state[x] == INPLACE_NEW)
+            ctx->sec_state[x] = INPLACE_OLD;
+    }
+    ctx->saved_sec = INPLACE_NONE;
+    *plan_sz = WB_INPLACE_PLAN_SIZE(n_ops);
+    p_off = *plan_sz;
+    for (step = 0; step < n_pending; step++) {
+        x = ops[step].sector;
+        ctx->cur_sec = x;
+        if (ops[step].flags & WB_INPLACE_SAVE)
+            ctx->saved_sec = x;
+        ctx->off_b = x * ss;
+        ctx->end_b = (ctx->size_b - ctx->off_b > ss) ? ctx->off_b + ss :
+            ctx->size_b;
+        r = wb_diff_hash(ctx, patch + p_off, len - p_off);
+        if ((r < 0) || (ctx->off_b != ctx->end_b))
+            goto out;
+        p_off += r;
+        ctx->sec_state[x] = INPLACE_NEW;
+        end = ctx->end_b;
+        for (pos = x * ss; (pos < end) &&
+                (pos + BLOCK_HDR_SIZE <= ctx->size_b); pos++) {
+            diff_index_insert(ctx, ctx->head_b, ctx->prev_b, ctx->src_b, pos);
+        }
+    }
+    hdr.img_size = ctx->size_b;
+    hdr.n_ops = n_ops;
+    memcpy(patch, &hdr, sizeof(hdr));
+    memcpy(patch + sizeof(hdr), ops, n_ops * sizeof(struct wb_inplace_op));
+    ret = (int)p_off;
+
+out:
+    ctx->end_b = ctx->size_b;
+    free(ctx->sec_state);
+    ctx->sec_state = NULL;
+    free(pl.deps);
+    free(pl.dep_start);
+    free(pl.pending_in);
+    free(pl.self);
+    free(ops);
+    return ret;
+}
+
+/* LZ compression of a patch (WB_DELTA_CODEC_LZ).
+ *
+ * The output is a sequence of: token (literal length << 4 | match length - 4),
+ * literal length extension, literals, distance (16-bit, big endian),
+ * match length extension. Lengths of 15 or more are extended with bytes
+ * added to the nibble, until a byte lower than 255. The last sequence only
+ * contains literals. Matches are searched in hash chains, within the
+ * WB_LZ_WINDOW bytes preceding the current position.
+ */
+#define LZ_HASH_BITS 14
+#define LZ_MAX_CHAIN 64
+#define LZ_NONE 0xFFFFFFFF
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint32_t lz_write_len(uint8_t *out, uint32_t len)
+{
+    uint32_t i = 0;
+    while (len >= 0xFF) {
+        out[i++] = 0xFF;
+        len -= 0xFF;
+    }
+    out[i++] = (uint8_t)len;
+    return i;
+}
+
+static uint32_t lz_write_seq(uint8_t *out, const uint8_t *lit, uint32_t lit_len,
+        uint32_t match_len, uint32_t dist)
+{
+    uint32_t o = 1;
+    uint8_t token;
+
+    token = (uint8_t)((lit_len < 0x0F ? lit_len : 0x0F) << 4);
+    if (lit_len >= 0x0F)
+        o += lz_write_len(out + o, lit_len - 0x0F);
+    memcpy(out + o, lit, lit_len);
+    o += lit_len;
+    if (match_len > 0) {
+        match_len -= LZ_MIN_MATCH;
+        token |= (uint8_t)(match_len < 0x0F ? match_len : 0x0F);
+        out[o++] = (uint8_t)(dist >> 8);
+        out[o++] = (uint8_t)(dist & 0xFF);
+        if (match_len >= 0x0F)
+            o += lz_write_len(out + o, match_len - 0x0F);
+    }
+    out[0] = token;
+    return o;
+}
+
+int wb_lz_compress(const uint8_t *in, uint32_t in_sz, uint8_t *out,
+        uint32_t out_sz)
+{
+    uint32_t *head, *prev;
+    uint32_t pos = 0, anchor = 0, o = WB_LZ_HDR_SIZE;
+    uint32_t i;
+
+    if (!in || !out || (in_sz == 0) || (out_sz < WB_LZ_BOUND(in_sz)))
+        return -1;
+    head = malloc((1 << LZ_HASH_BITS) * sizeof(uint32_t));
+    prev = malloc(WB_LZ_WINDOW * sizeof(uint32_t));
+    if (!head || !prev) {
+        free(head);
+        free(prev);
+        return -1;
+    }
+    memset(head, 0xFF, (1 << LZ_HASH_BITS) * sizeof(uint32_t));
+    out[0] = (uint8_t)(in_sz >> 24);
+    out[1] = (uint8_t)(in_sz >> 16);
+    out[2] = (uint8_t)(in_sz >> 8);
+    out[3] = (uint8_t)(in_sz);
+
+    while (pos + LZ_MIN_MATCH <= in_sz) {
+        uint32_t h = lz_hash(in + pos);
+        uint32_t cand = head[h];
+        uint32_t best_len = 0, best_dist = 0;
+        int chain = 0;
+
+        while ((cand != LZ_NONE) && (pos - cand <= WB_LZ_WINDOW) &&
+                (chain++ < LZ_MAX_CHAIN)) {
+            uint32_t len = 0;
+            uint32_t next;
+            while ((pos + len < in_sz) && (in[cand + len] == in[pos + len]))
+                len++;
+            if (len > best_len) {
+                best_len = len;
+                best_dist = pos - cand;
+                if (pos + len == in_sz)
+                    break;
+            }
+            next = prev[cand & (WB_LZ_WINDOW - 1)];
+            if ((next == LZ_NONE) || (next >= cand))
+                break;
+            cand = next;
+        }
+        prev[pos & (WB_LZ_WINDOW - 1)] = head[h];
+        head[h] = pos;
+        if (best_len < LZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+        o += lz_write_seq(out + o, in + anchor, pos - anchor, best_len,
+                best_dist);
+        for (i = 1; (i < best_len) && (pos + i + LZ_MIN_MATCH <= in_sz); i++) {
+            h = lz_hash(in + pos + i);
+            prev[(pos + i) & (WB_LZ_WINDOW - 1)] = head[h];
+            head[h] = pos + i;
+        }
+        pos += best_len;
+        anchor = pos;
+    }
+    if (anchor < in_sz)
+        o += lz_write_seq(out + o, in + anchor, in_sz - anchor, 0, 0);
+    free(head);
+    free(prev);
+    return (int)o;
+}
 #endif /* __WOLFBOOT */
 
 #endif /* DELTA_UPDATES */
@@ -51,6 +51,13 @@
 #ifdef WOLFBOOT_HASH_SHA3_384
 #include <wolfssl/wolfcrypt/sha3.h>
 #endif
+#ifdef WOLFBOOT_VERIFY_CACHE
+#include <wolfssl/wolfcrypt/hmac.h>
+#ifndef WOLFSSL_MISC_INCLUDED
+#define WOLFSSL_MISC_INCLUDED /* allow misc.c code to be inlined */
+#include <wolfcrypt/src/misc.c> /* for ConstantCompare */
+#endif
+#endif
 
 /* Globals */
 static uint8_t digest[WOLFBOOT_SHA_DIGEST_SIZE] XALIGNED(4);
@@ -869,6 +876,80 @@ static uint8_t *get_sha_block(struct wolfBoot_image *img, uint32_t offset)
         return (uint8_t *)(img->fw_base + offset);
 }
 
+#ifdef WOLFBOOT_HASH_CONTIGUOUS
+/* The header is always memory-mapped or cached in RAM */
+#define WOLFBOOT_HDR_SHA_BLOCK_SIZE IMAGE_HEADER_SIZE
+#else
+#define WOLFBOOT_HDR_SHA_BLOCK_SIZE WOLFBOOT_SHA_BLOCK_SIZE
+#endif
+
+/**
+ * @brief Get the size of the next block to be hashed.
+ *
+ * With WOLFBOOT_HASH_CONTIGUOUS, a memory-mapped image is hashed in a single
+ * call over the remaining span. Images on external flash are always read in
+ * blocks of WOLFBOOT_SHA_BLOCK_SIZE bytes.
+ *
+ * @param img The image being hashed.
+ * @param position The current offset in the firmware.
+ * @return The number of bytes to hash at this position.
+ */
+static uint32_t get_sha_block_size(struct wolfBoot_image *img,
+    uint32_t position)
+{
+    uint32_t blksz = WOLFBOOT_SHA_BLOCK_SIZE;
+#ifdef WOLFBOOT_HASH_CONTIGUOUS
+    if (!(PART_IS_EXT(img)))
+        blksz = img->fw_size - position;
+#endif
+    if (position + blksz > img->fw_size)
+        blksz = img->fw_size - position;
+    return blksz;
+}
+
+#if defined(EXT_FLASH) && defined(EXT_FLASH_ASYNC) && !defined(EXT_ENCRYPTED)
+#define EXT_HASH_PIPELINE
+static uint8_t ext_hash_pp[2][WOLFBOOT_SHA_BLOCK_SIZE] XALIGNED(4);
+
+/**
+ * @brief Hash a region of the external flash, overlapping transfers and
+ * hashing.
+ *
+ * The next block is fetched in the background into one buffer, while the
+ * previous one is hashed from the other buffer.
+ *
+ * @param ctx The hash context to update.
+ * @param addr The external flash address of the region.
+ * @param size The size of the region.
+ * @return 0 on success, -1 on error.
+ */
+static int update_hash_ext_async(wolfBoot_hash_t *ctx, uintptr_t addr,
+    uint32_t size)
+{
+    uint32_t len, next_len;
+    int cur = 0;
+
+    len = (size > WOLFBOOT_SHA_BLOCK_SIZE) ? WOLFBOOT_SHA_BLOCK_SIZE : size;
+    if ((len > 0) && (ext_flash_read_start(addr, ext_hash_pp[cur], len) < 0))
+        return -1;
+    while (len > 0) {
+        if (ext_flash_read_complete() < 0)
+            return -1;
+        size -= len;
+        addr += len;
+        next_len = (size > WOLFBOOT_SHA_BLOCK_SIZE) ?
+            WOLFBOOT_SHA_BLOCK_SIZE : size;
+        if ((next_len > 0) &&
+                (ext_flash_read_start(addr, ext_hash_pp[!cur], next_len) < 0))
+            return -1;
+        update_hash(ctx, ext_hash_pp[cur], len);
+        cur = !cur;
+        len = next_len;
+    }
+    return 0;
+}
+#endif /* EXT_FLASH && EXT_FLASH_ASYNC && !EXT_ENCRYPTED */
+
 #ifdef EXT_FLASH
 static uint8_t hdr_cpy[IMAGE_HEADER_SIZE] XALIGNED(4);
 static int hdr_cpy_done = 0;
@@ -937,7 +1018,7 @@ static int header_sha256(wc_Sha256 *sha256_ctx, struct wolfBoot_image *img)
 #endif
     end_sha = stored_sha - (2 * sizeof(uint16_t)); /* Subtract 2 Type + 2 Len */
     while (p < end_sha) {
-        blksz = WOLFBOOT_SHA_BLOCK_SIZE;
+        blksz = WOLFBOOT_HDR_SHA_BLOCK_SIZE;
         if (end_sha - p < blksz)
             blksz = end_sha - p;
         wc_Sha256Update(sha256_ctx, p, blksz);
@@ -962,16 +1043,24 @@ static int image_sha256(struct wolfBoot_image *img, uint8_t *hash)
 
     if (header_sha256(&sha256_ctx, img) != 0)
         return -1;
-    do {
+#ifdef EXT_HASH_PIPELINE
+    if (PART_IS_EXT(img)) {
+        if (update_hash_ext_async(&sha256_ctx, (uintptr_t)img->fw_base,
+                    img->fw_size) != 0) {
+            wc_Sha256Free(&sha256_ctx);
+            return -1;
+        }
+        position = img->fw_size;
+    }
+#endif
+    while (position < img->fw_size) {
         p = get_sha_block(img, position);
         if (p == NULL)
             break;
-        blksz = WOLFBOOT_SHA_BLOCK_SIZE;
-        if (position + blksz > img->fw_size)
-            blksz = img->fw_size - position;
+        blksz = get_sha_block_size(img, position);
         wc_Sha256Update(&sha256_ctx, p, blksz);
         position += blksz;
-    } while(position < img->fw_size);
+    }
 
     wc_Sha256Final(&sha256_ctx, hash);
     wc_Sha256Free(&sha256_ctx);
@@ -1028,7 +1117,7 @@ static int header_sha384(wc_Sha384 *sha384_ctx, struct wolfBoot_image *img)
 #endif
     end_sha = stored_sha - (2 * sizeof(uint16_t)); /* Subtract 2 Type + 2 Len */
     while (p < end_sha) {
-        blksz = WOLFBOOT_SHA_BLOCK_SIZE;
+        blksz = WOLFBOOT_HDR_SHA_BLOCK_SIZE;
         if (end_sha - p < blksz)
             blksz = end_sha - p;
         wc_Sha384Update(sha384_ctx, p, blksz);
@@ -1056,16 +1145,24 @@ static int image_sha384(struct wolfBoot_image *img, uint8_t *hash)
 
     if (header_sha384(&sha384_ctx, img) != 0)
         return -1;
-    do {
+#ifdef EXT_HASH_PIPELINE
+    if (PART_IS_EXT(img)) {
+        if (update_hash_ext_async(&sha384_ctx, (uintptr_t)img->fw_base,
+                    img->fw_size) != 0) {
+            wc_Sha384Free(&sha384_ctx);
+            return -1;
+        }
+        position = img->fw_size;
+    }
+#endif
+    while (position < img->fw_size) {
         p = get_sha_block(img, position);
         if (p == NULL)
             break;
-        blksz = WOLFBOOT_SHA_BLOCK_SIZE;
-        if (position + blksz > img->fw_size)
-            blksz = img->fw_size - position;
+        blksz = get_sha_block_size(img, position);
         wc_Sha384Update(&sha384_ctx, p, blksz);
         position += blksz;
-    } while(position < img->fw_size);
+    }
 
     wc_Sha384Final(&sha384_ctx, hash);
     wc_Sha384Free(&sha384_ctx);
@@ -1124,7 +1221,7 @@ static int header_sha3_384(wc_Sha3 *sha3_ctx, struct wolfBoot_image *img)
     wc_InitSha3_384(sha3_ctx, NULL, INVALID_DEVID);
     end_sha = stored_sha - (2 * sizeof(uint16_t)); /* Subtract 2 Type + 2 Len */
     while (p < end_sha) {
-        blksz = WOLFBOOT_SHA_BLOCK_SIZE;
+        blksz = WOLFBOOT_HDR_SHA_BLOCK_SIZE;
         if (end_sha - p < blksz)
             blksz = end_sha - p;
         wc_Sha3_384_Update(sha3_ctx, p, blksz);
@@ -1151,16 +1248,24 @@ static int image_sha3_384(struct wolfBoot_image *img, uint8_t *hash)
 
     if (header_sha3_384(&sha3_ctx, img) != 0)
         return -1;
-    do {
+#ifdef EXT_HASH_PIPELINE
+    if (PART_IS_EXT(img)) {
+        if (update_hash_ext_async(&sha3_ctx, (uintptr_t)img->fw_base,
+                    img->fw_size) != 0) {
+            wc_Sha3_384_Free(&sha3_ctx);
+            return -1;
+        }
+        position = img->fw_size;
+    }
+#endif
+    while (position < img->fw_size) {
         p = get_sha_block(img, position);
         if (p == NULL)
             break;
-        blksz = WOLFBOOT_SHA_BLOCK_SIZE;
-        if (position + blksz > img->fw_size)
-            blksz = img->fw_size - position;
+        blksz = get_sha_block_size(img, position);
         wc_Sha3_384_Update(&sha3_ctx, p, blksz);
         position += blksz;
-    } while(position < img->fw_size);
+    }
 
     wc_Sha3_384_Final(&sha3_ctx, hash);
     wc_Sha3_384_Free(&sha3_ctx);
@@ -1400,11 +1505,430 @@ int wolfBoot_open_image_external(struct wolfBoot_image* img, uint8_t part,
 
 #endif /* WOLFBOOT_FIXED_PARTITIONS */
 
+#if defined(WOLFBOOT_MERKLE) || defined(WOLFBOOT_VERIFY_CACHE)
+static void hash_ctx_init(wolfBoot_hash_t *ctx)
+{
+#if defined(WOLFBOOT_HASH_SHA256)
+    wc_InitSha256(ctx);
+#elif defined(WOLFBOOT_HASH_SHA384)
+    wc_InitSha384(ctx);
+#elif defined(WOLFBOOT_HASH_SHA3_384)
+    wc_InitSha3_384(ctx, NULL, INVALID_DEVID);
+#endif
+}
+
+static void hash_ctx_free(wolfBoot_hash_t *ctx)
+{
+#if defined(WOLFBOOT_HASH_SHA256)
+    wc_Sha256Free(ctx);
+#elif defined(WOLFBOOT_HASH_SHA384)
+    wc_Sha384Free(ctx);
+#elif defined(WOLFBOOT_HASH_SHA3_384)
+    wc_Sha3_384_Free(ctx);
+#endif
+}
+#endif /* WOLFBOOT_MERKLE || WOLFBOOT_VERIFY_CACHE */
+
+#ifdef WOLFBOOT_MERKLE
+/* The leaf table is part of the manifest header, which must fit in the first
+ * sector. See the size check in options.mk. */
+#if IMAGE_HEADER_SIZE >= WOLFBOOT_SECTOR_SIZE
+#   error "WOLFBOOT_MERKLE requires IMAGE_HEADER_SIZE < WOLFBOOT_SECTOR_SIZE"
+#endif
+
+/**
+ * @brief Get the per-sector leaf hashes stored in the manifest header.
+ *
+ * Leaf 'n' is the digest of the firmware bytes stored in sector 'n' of the
+ * partition. Sector 0 only contributes the bytes following the manifest
+ * header. The leaf table is part of the header, so it is covered by the
+ * signed digest (the Merkle root).
+ *
+ * @param img The image to inspect.
+ * @param leaves Set to the first leaf in the table.
+ * @return The number of leaves, or 0 if the image has no valid manifest.
+ */
+static uint32_t merkle_get_leaves(struct wolfBoot_image *img, uint8_t **leaves)
+{
+    uint8_t *p;
+    uint16_t len;
+    uint32_t n;
+
+    if (!img)
+        return 0;
+    len = get_header(img, HDR_IMG_MERKLE_SECTOR_SIZE, &p);
+    if (len != sizeof(uint32_t))
+        return 0;
+    if (im2n(*((uint32_t *)p)) != WOLFBOOT_SECTOR_SIZE)
+        return 0;
+    len = get_header(img, HDR_IMG_MERKLE_LEAVES, leaves);
+    n = (img->fw_size + IMAGE_HEADER_SIZE + WOLFBOOT_SECTOR_SIZE - 1) /
+        WOLFBOOT_SECTOR_SIZE;
+    if ((n == 0) || (len != n * WOLFBOOT_SHA_DIGEST_SIZE))
+        return 0;
+    return n;
+}
+
+/**
+ * @brief Get the number of sectors covered by the Merkle manifest.
+ *
+ * @param img The image to inspect.
+ * @return The number of leaf hashes, or 0 if the image has no manifest.
+ */
+int wolfBoot_merkle_sectors(struct wolfBoot_image *img)
+{
+    uint8_t *leaves;
+    return (int)merkle_get_leaves(img, &leaves);
+}
+
+/**
+ * @brief Verify the Merkle root of the image.
+ *
+ * For images carrying a per-sector manifest, the stored digest only covers
+ * the manifest header, including the leaf table. Once the root matches,
+ * wolfBoot_verify_authenticity() can check the signature and individual
+ * sectors can be verified with wolfBoot_merkle_verify_sector().
+ *
+ * @param img The image to verify.
+ * @return 0 on success, -1 on error.
+ */
+int wolfBoot_merkle_verify_root(struct wolfBoot_image *img)
+{
+    uint8_t *stored_sha;
+    uint16_t stored_sha_len;
+    wolfBoot_hash_t ctx;
+
+    if (merkle_get_leaves(img, &stored_sha) == 0)
+        return -1;
+    stored_sha_len = get_header(img, WOLFBOOT_SHA_HDR, &stored_sha);
+    if (stored_sha_len != WOLFBOOT_SHA_DIGEST_SIZE)
+        return -1;
+    if (header_hash(&ctx, img) != 0)
+        return -1;
+    final_hash(&ctx, digest);
+    hash_ctx_free(&ctx);
+    if (memcmp(digest, stored_sha, stored_sha_len) != 0)
+        return -1;
+    img->sha_ok = 1;
+    img->sha_hash = stored_sha;
+    return 0;
+}
+
+/**
+ * @brief Verify a single partition sector against its leaf hash.
+ *
+ * The Merkle root must have been verified beforehand, see
+ * wolfBoot_merkle_verify_root().
+ *
+ * @param img The image to verify.
+ * @param sector The partition sector to check.
+ * @return 0 on success, -1 on error.
+ */
+int wolfBoot_merkle_verify_sector(struct wolfBoot_image *img, uint32_t sector)
+{
+    uint8_t leaf[WOLFBOOT_SHA_DIGEST_SIZE];
+    uint8_t *leaves, *p;
+    uint32_t start, end, position;
+    uint32_t blksz;
+    wolfBoot_hash_t ctx;
+
+    if (!img || !img->sha_ok)
+        return -1;
+    if (sector >= merkle_get_leaves(img, &leaves))
+        return -1;
+    start = 0;
+    if (sector > 0)
+        start = (sector * WOLFBOOT_SECTOR_SIZE) - IMAGE_HEADER_SIZE;
+    end = ((sector + 1) * WOLFBOOT_SECTOR_SIZE) - IMAGE_HEADER_SIZE;
+    if (end > img->fw_size)
+        end = img->fw_size;
+
+    hash_ctx_init(&ctx);
+    position = start;
+#ifdef EXT_HASH_PIPELINE
+    if (PART_IS_EXT(img)) {
+        if (update_hash_ext_async(&ctx, (uintptr_t)img->fw_base + start,
+                    end - start) != 0) {
+            hash_ctx_free(&ctx);
+            return -1;
+        }
+        position = end;
+    }
+#endif
+    for (; position < end; position += blksz) {
+        p = get_sha_block(img, position);
+        if (p == NULL)
+            break;
+        blksz = WOLFBOOT_SHA_BLOCK_SIZE;
+        if (position + blksz > end)
+            blksz = end - position;
+        update_hash(&ctx, p, blksz);
+    }
+    final_hash(&ctx, leaf);
+    hash_ctx_free(&ctx);
+    if (position < end)
+        return -1;
+    if (memcmp(leaf, leaves + (sector * WOLFBOOT_SHA_DIGEST_SIZE),
+                WOLFBOOT_SHA_DIGEST_SIZE) != 0) {
+        wolfBoot_printf("Merkle: sector %u mismatch\n", (unsigned int)sector);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef ENCRYPT_AEAD
+/**
+ * @brief Get the AEAD tag of a partition sector.
+ *
+ * The tag table follows the layout of the leaf table, and is covered by the
+ * Merkle root, which must have been verified beforehand.
+ *
+ * @param img The image to inspect.
+ * @param sector The partition sector.
+ * @param tag Set to the ENCRYPT_AEAD_TAG_SIZE bytes tag of the sector.
+ * @return 0 on success, -1 if the image has no tag for this sector.
+ */
+int wolfBoot_aead_sector_tag(struct wolfBoot_image *img, uint32_t sector,
+    uint8_t **tag)
+{
+    uint8_t *leaves, *tags;
+    uint32_t n;
+    uint16_t len;
+
+    if (!img || !img->sha_ok)
+        return -1;
+    n = merkle_get_leaves(img, &leaves);
+    if (sector >= n)
+        return -1;
+    len = get_header(img, HDR_IMG_AEAD_TAGS, &tags);
+    if (len != n * ENCRYPT_AEAD_TAG_SIZE)
+        return -1;
+    *tag = tags + (sector * ENCRYPT_AEAD_TAG_SIZE);
+    return 0;
+}
+#endif /* ENCRYPT_AEAD */
+
+/**
+ * @brief Verify the sectors [first, last) of an image against their leaves.
+ *
+ * Stops at the first sector that does not match its leaf hash.
+ *
+ * @param img The image to verify, with a verified Merkle root.
+ * @param first The first sector to check.
+ * @param last The sector after the last one to check.
+ * @return 0 on success, -1 on error.
+ */
+static int merkle_verify_range(struct wolfBoot_image *img, uint32_t first,
+    uint32_t last)
+{
+    uint32_t sector;
+
+    for (sector = first; sector < last; sector++) {
+        if (wolfBoot_merkle_verify_sector(img, sector) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+/* Range of sectors verified by the secondary core */
+struct merkle_job {
+    struct wolfBoot_image *img;
+    uint32_t first;
+    uint32_t last;
+    volatile int ret;
+};
+
+static void merkle_verify_job(void *arg)
+{
+    struct merkle_job *job = (struct merkle_job *)arg;
+    job->ret = merkle_verify_range(job->img, job->first, job->last);
+}
+#endif
+
+/**
+ * @brief Verify an image carrying a Merkle manifest, one sector at a time.
+ *
+ * With WOLFBOOT_PARALLEL_VERIFY, the second half of the sectors of an image
+ * in memory-mapped flash is verified by a secondary core, if the HAL
+ * provides one, while the first half is verified by the calling core.
+ *
+ * @param img The image to verify.
+ * @return 0 on success, -1 on error.
+ */
+static int merkle_verify_integrity(struct wolfBoot_image *img)
+{
+    uint32_t n, split;
+    uint8_t *leaves;
+    int ret;
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+    struct merkle_job job;
+#endif
+
+    n = merkle_get_leaves(img, &leaves);
+    if (wolfBoot_merkle_verify_root(img) != 0)
+        return -1;
+    split = n;
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+    /* External partitions are read through shared buffers: not split */
+    if ((n > 1) && !(PART_IS_EXT(img))) {
+        job.img = img;
+        job.first = n / 2;
+        job.last = n;
+        job.ret = -1;
+        if (hal_worker_start(merkle_verify_job, &job) == 0)
+            split = n / 2;
+    }
+#endif
+    ret = merkle_verify_range(img, 0, split);
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+    if (split < n) {
+        hal_worker_wait();
+        if (job.ret != 0)
+            ret = -1;
+    }
+#endif
+    if (ret != 0) {
+        img->sha_ok = 0;
+        img->sha_hash = NULL;
+        return -1;
+    }
+    return 0;
+}
+#endif /* WOLFBOOT_MERKLE */
+
+#if defined(WOLFBOOT_VERIFY_CACHE) && defined(WOLFBOOT_FIXED_PARTITIONS)
+
+#if defined(WOLFBOOT_HASH_SHA256)
+#   define VERIFY_CACHE_HMAC_TYPE WC_SHA256
+#elif defined(WOLFBOOT_HASH_SHA384)
+#   define VERIFY_CACHE_HMAC_TYPE WC_SHA384
+#elif defined(WOLFBOOT_HASH_SHA3_384)
+#   define VERIFY_CACHE_HMAC_TYPE WC_SHA3_384
+#endif
+
+/**
+ * @brief Compute the MAC of a verified-digest record.
+ *
+ * The MAC key is a device secret provided by the platform through
+ * wolfBoot_get_verify_cache_key(), so that a record cannot be forged by
+ * writing to the partition. The MAC is the HMAC of erase_count | hdr_digest,
+ * using the hash algorithm of the images.
+ *
+ * @param rec The record to authenticate.
+ * @param mac A pointer to store the resulting MAC.
+ * @return 0 on success, -1 if the key is not available or on error.
+ */
+static int verify_cache_mac(const struct wolfBoot_verify_cache *rec,
+    uint8_t *mac)
+{
+    uint8_t key[WOLFBOOT_SHA_DIGEST_SIZE];
+    Hmac hmac;
+    int ret;
+
+    if (wolfBoot_get_verify_cache_key(key, sizeof(key)) != 0) {
+        memset(key, 0, sizeof(key));
+        return -1;
+    }
+    ret = wc_HmacInit(&hmac, NULL, INVALID_DEVID);
+    if (ret == 0) {
+        ret = wc_HmacSetKey(&hmac, VERIFY_CACHE_HMAC_TYPE, key, sizeof(key));
+        if (ret == 0)
+            ret = wc_HmacUpdate(&hmac, (const uint8_t *)&rec->erase_count,
+                sizeof(rec->erase_count));
+        if (ret == 0)
+            ret = wc_HmacUpdate(&hmac, rec->hdr_digest,
+                sizeof(rec->hdr_digest));
+        if (ret == 0)
+            ret = wc_HmacFinal(&hmac, mac);
+        wc_HmacFree(&hmac);
+    }
+    memset(key, 0, sizeof(key));
+    return (ret == 0) ? 0 : -1;
+}
+
+/**
+ * @brief Build the verified-digest record for an image.
+ *
+ * The record is bound to the full manifest header (which carries the
+ * firmware digest and its signature) and to the partition erase counter.
+ *
+ * @param img The image to describe.
+ * @param rec A pointer to store the resulting record.
+ * @return 0 on success, -1 on error.
+ */
+static int verify_cache_build(struct wolfBoot_image *img,
+    struct wolfBoot_verify_cache *rec)
+{
+    uint8_t *hdr = get_img_hdr(img);
+    wolfBoot_hash_t ctx;
+
+    if (hdr == NULL)
+        return -1;
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = WOLFBOOT_VERIFY_CACHE_MAGIC;
+    rec->erase_count = wolfBoot_get_erase_count(img->part);
+    hash_ctx_init(&ctx);
+    update_hash(&ctx, hdr, IMAGE_HEADER_SIZE);
+    final_hash(&ctx, rec->hdr_digest);
+    hash_ctx_free(&ctx);
+    return verify_cache_mac(rec, rec->mac);
+}
+
+/**
+ * @brief Check the verified-digest record stored for an image.
+ *
+ * @param img The image to check.
+ * @return 0 if the image was verified since the partition was last written,
+ *         -1 otherwise.
+ */
+static int verify_cache_lookup(struct wolfBoot_image *img)
+{
+    struct wolfBoot_verify_cache stored, cur;
+
+    if (img->part != PART_BOOT)
+        return -1;
+    if (wolfBoot_get_verify_cache(&stored) != 0)
+        return -1;
+    if (stored.magic != WOLFBOOT_VERIFY_CACHE_MAGIC)
+        return -1;
+    if (verify_cache_build(img, &cur) != 0)
+        return -1;
+    if ((stored.erase_count != cur.erase_count) ||
+            (memcmp(stored.hdr_digest, cur.hdr_digest,
+                    sizeof(cur.hdr_digest)) != 0))
+        return -1;
+    if (ConstantCompare(stored.mac, cur.mac, sizeof(cur.mac)) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Store the verified-digest record after a full verification.
+ *
+ * @param img The image that was verified.
+ */
+static void verify_cache_store(struct wolfBoot_image *img)
+{
+    struct wolfBoot_verify_cache rec;
+
+    if (img->part != PART_BOOT)
+        return;
+    if (verify_cache_build(img, &rec) == 0)
+        (void)wolfBoot_set_verify_cache(&rec);
+}
+#else
+#   define verify_cache_lookup(img) (-1)
+#   define verify_cache_store(img) do{}while(0)
+#endif /* WOLFBOOT_VERIFY_CACHE && WOLFBOOT_FIXED_PARTITIONS */
+
 /**
  * @brief Verify the integrity of the image using the stored SHA hash.
  *
  * This function verifies the integrity of the image by calculating its SHA hash
  * and comparing it with the stored hash.
+ * When WOLFBOOT_VERIFY_CACHE is enabled, the full hash of the BOOT image is
+ * skipped if a valid verified-digest record matches the current header.
  *
  * @param img The pointer to the wolfBoot_image structure representing the image.
  * @return 0 on success, -1 on error.
@@ -1416,12 +1940,26 @@ int wolfBoot_verify_integrity(struct wolfBoot_image *img)
     stored_sha_len = get_header(img, WOLFBOOT_SHA_HDR, &stored_sha);
     if (stored_sha_len != WOLFBOOT_SHA_DIGEST_SIZE)
         return -1;
+    if (verify_cache_lookup(img) == 0) {
+        img->sha_ok = 1;
+        img->sha_hash = stored_sha;
+        return 0;
+    }
+#ifdef WOLFBOOT_MERKLE
+    if (wolfBoot_merkle_sectors(img) > 0) {
+        if (merkle_verify_integrity(img) != 0)
+            return -1;
+        verify_cache_store(img);
+        return 0;
+    }
+#endif
     if (image_hash(img, digest) != 0)
         return -1;
     if (memcmp(digest, stored_sha, stored_sha_len) != 0)
         return -1;
     img->sha_ok = 1;
     img->sha_hash = stored_sha;
+    verify_cache_store(img);
     return 0;
 }
 
@@ -1600,6 +2138,16 @@ static int update_hash_flash_fwimg(wolfBoot_hash_t*       ctx,
     uint32_t remaining_size = size;
     uint8_t read_buf[WOLFBOOT_SHA_BLOCK_SIZE] XALIGNED_STACK(4); /* Use local buffer */
 
+#ifdef EXT_HASH_PIPELINE
+    if (PART_IS_EXT(img)) {
+        /* Prevent reading past the end of the image */
+        if ((uint64_t)offset + size > img->fw_size)
+            return -1;
+        return update_hash_ext_async(ctx, (uintptr_t)img->fw_base + offset,
+            size);
+    }
+#endif
+
     while (remaining_size > 0) {
         uint32_t read_size = (remaining_size > WOLFBOOT_SHA_BLOCK_SIZE)
                                  ? WOLFBOOT_SHA_BLOCK_SIZE
@@ -1631,6 +2179,11 @@ static int update_hash_flash_addr(wolfBoot_hash_t* ctx, uintptr_t addr,
     uint32_t  remaining_size = size;
     uintptr_t current_addr   = addr;
 
+#ifdef EXT_HASH_PIPELINE
+    if (src_ext)
+        return update_hash_ext_async(ctx, addr, size);
+#endif
+
     while (remaining_size > 0) {
         uint32_t read_size = (remaining_size > WOLFBOOT_SHA_BLOCK_SIZE)
                                  ? WOLFBOOT_SHA_BLOCK_SIZE
@@ -2057,9 +2610,18 @@ int wolfBoot_verify_authenticity(struct wolfBoot_image *img)
     if ((image_type & HDR_IMG_TYPE_AUTH_MASK) != HDR_IMG_TYPE_AUTH)
         return -1;
     if (img->sha_hash == NULL) {
-        if (image_hash(img, digest) != 0)
-            return -1;
-        img->sha_hash = digest;
+#ifdef WOLFBOOT_MERKLE
+        /* The signature of a Merkle image covers the manifest root */
+        if (wolfBoot_merkle_sectors(img) > 0) {
+            if (wolfBoot_merkle_verify_root(img) != 0)
+                return -1;
+        } else
+#endif
+        {
+            if (image_hash(img, digest) != 0)
+                return -1;
+            img->sha_hash = digest;
+        }
     }
     key_mask = keystore_get_mask(key_slot);
     image_part = image_type & HDR_IMG_TYPE_PART_MASK;
@@ -31,6 +31,7 @@
 #include "wolfboot/wolfboot.h"
 #include "image.h"
 #include "printf.h"
+#include "delta.h"
 
 #ifdef UNIT_TEST
 /**
@@ -189,7 +190,7 @@ void WEAKFUNCTION hal_cache_invalidate(void)
     /* if cache flushing is required implement in hal */
 }
 
-static int RAMFUNCTION nvm_select_fresh_sector(int part)
+static int RAMFUNCTION nvm_scan_fresh_sector(int part)
 {
     int sel;
     uintptr_t off;
@@ -277,6 +278,236 @@ finish:
     return sel;
 }
 
+#ifndef NVM_FLASH_JOURNAL
+#define nvm_select_fresh_sector nvm_scan_fresh_sector
+#else
+/* NVM_FLASH_JOURNAL keeps an append-only log of the flag updates in the
+ * lower NVM_JOURNAL_SIZE bytes of the selected trailer sector. Each record
+ * is programmed into its own NVM_JOURNAL_LINE_SIZE slot (the ECC line of the
+ * flash), so no slot is ever written twice:
+ *
+ *   | off (LSB) | off (MSB) | value | check | 0xFF ... |
+ *
+ * 'off' is the distance of the flag below the ENDFLAGS of the trailer. The
+ * flags are decoded once into RAM (base flags + records, in order) and kept
+ * in sync with each append. The two-sector copy is only used to compact the
+ * journal when it is full.
+ */
+#ifndef NVM_JOURNAL_LINE_SIZE
+#define NVM_JOURNAL_LINE_SIZE 16
+#endif
+#ifndef NVM_JOURNAL_SIZE
+#define NVM_JOURNAL_SIZE (WOLFBOOT_SECTOR_SIZE / 2)
+#endif
+#ifndef NVM_JOURNAL_VIEW_SIZE
+    #ifdef PULL_LINKER_DEFINES
+        #error "NVM_FLASH_JOURNAL requires NVM_JOURNAL_VIEW_SIZE with PULL_LINKER_DEFINES"
+    #endif
+    /* Magic, partition flag and sector flags of both partitions, rounded to
+     * a 4B multiple */
+    #define NVM_JOURNAL_VIEW_SIZE \
+        ((16 + (WOLFBOOT_PARTITION_SIZE / (2 * WOLFBOOT_SECTOR_SIZE)) + 3) & ~3)
+    #if (NVM_JOURNAL_SIZE + NVM_JOURNAL_VIEW_SIZE) > \
+        (SECTOR_FLAGS_SIZE - TRAILER_SKIP)
+        #error "NVM_JOURNAL_SIZE overlaps with the trailer flags"
+    #endif
+#endif
+#define NVM_JOURNAL_SLOTS (NVM_JOURNAL_SIZE / NVM_JOURNAL_LINE_SIZE)
+#define NVM_JOURNAL_CHECK(r) ((uint8_t)((r)[0] ^ (r)[1] ^ (r)[2] ^ 0xA5))
+
+#ifdef FLAGS_HOME
+#define NVM_JOURNAL_TRAILERS 1 /* Both partitions share the BOOT trailer */
+#else
+#define NVM_JOURNAL_TRAILERS 2
+#endif
+
+struct nvm_journal {
+    uint8_t view[NVM_JOURNAL_VIEW_SIZE] XALIGNED(4); /* decoded flags */
+    uint8_t base[NVM_JOURNAL_VIEW_SIZE];  /* flags as stored in the sector */
+    uint8_t last[4];                      /* last record programmed */
+    uint32_t next;                        /* next free slot */
+    int sel;                              /* selected sector */
+    int valid;
+};
+static struct nvm_journal nvm_journal[NVM_JOURNAL_TRAILERS];
+
+static int RAMFUNCTION nvm_journal_idx(int part)
+{
+    return (part == PART_BOOT) ? 0 : (NVM_JOURNAL_TRAILERS - 1);
+}
+
+static uintptr_t RAMFUNCTION nvm_journal_endflags(int t)
+{
+    return (t == 0) ? (uintptr_t)PART_BOOT_ENDFLAGS :
+        (uintptr_t)PART_UPDATE_ENDFLAGS;
+}
+
+static uintptr_t RAMFUNCTION nvm_journal_sector(int t, int sel)
+{
+    uintptr_t part_end = (t == 0) ?
+        WOLFBOOT_PARTITION_BOOT_ADDRESS + WOLFBOOT_PARTITION_SIZE :
+        WOLFBOOT_PARTITION_UPDATE_ADDRESS + WOLFBOOT_PARTITION_SIZE;
+    return part_end - WOLFBOOT_SECTOR_SIZE * (1 + sel);
+}
+
+static int RAMFUNCTION nvm_journal_slot_erased(const uint8_t *slot)
+{
+    return (slot[0] == FLASH_BYTE_ERASED) && (slot[1] == FLASH_BYTE_ERASED) &&
+        (slot[2] == FLASH_BYTE_ERASED) && (slot[3] == FLASH_BYTE_ERASED);
+}
+
+static void RAMFUNCTION nvm_journal_invalidate(void)
+{
+    int t;
+    for (t = 0; t < NVM_JOURNAL_TRAILERS; t++)
+        nvm_journal[t].valid = 0;
+}
+
+/**
+ * @brief Get the decoded trailer flags of a partition.
+ *
+ * The RAM copy is reused as long as the flags stored in the selected sector
+ * and the tail of the journal are unchanged, otherwise the fresh sector is
+ * selected again and the journal is replayed.
+ *
+ * @param[in] part Partition number.
+ * @return Pointer to the decoded journal state.
+ */
+static struct nvm_journal* RAMFUNCTION nvm_journal_load(int part)
+{
+    int t = nvm_journal_idx(part);
+    struct nvm_journal *j = &nvm_journal[t];
+    const uint8_t *flags;
+    const uint8_t *slot;
+    uint32_t i;
+    uint32_t off;
+
+    hal_cache_invalidate();
+    if (j->valid) {
+        flags = (const uint8_t *)(nvm_journal_endflags(t) -
+            (WOLFBOOT_SECTOR_SIZE * j->sel + NVM_JOURNAL_VIEW_SIZE));
+        slot = (const uint8_t *)nvm_journal_sector(t, j->sel) +
+            j->next * NVM_JOURNAL_LINE_SIZE;
+        if ((XMEMCMP(flags, j->base, NVM_JOURNAL_VIEW_SIZE) == 0) &&
+            ((j->next == NVM_JOURNAL_SLOTS) ||
+                nvm_journal_slot_erased(slot)) &&
+            ((j->next == 0) ||
+                (XMEMCMP(slot - NVM_JOURNAL_LINE_SIZE, j->last, 4) == 0))) {
+            return j;
+        }
+    }
+
+    j->sel = nvm_scan_fresh_sector(part);
+    flags = (const uint8_t *)(nvm_journal_endflags(t) -
+        (WOLFBOOT_SECTOR_SIZE * j->sel + NVM_JOURNAL_VIEW_SIZE));
+    XMEMCPY(j->base, flags, NVM_JOURNAL_VIEW_SIZE);
+    XMEMCPY(j->view, flags, NVM_JOURNAL_VIEW_SIZE);
+    slot = (const uint8_t *)nvm_journal_sector(t, j->sel);
+    for (i = 0; i < NVM_JOURNAL_SLOTS; i++, slot += NVM_JOURNAL_LINE_SIZE) {
+        if (nvm_journal_slot_erased(slot))
+            break;
+        off = slot[0] | ((uint32_t)slot[1] << 8);
+        /* Skip torn records, the next append goes after them */
+        if ((slot[3] == NVM_JOURNAL_CHECK(slot)) && (off > 0) &&
+                (off <= NVM_JOURNAL_VIEW_SIZE)) {
+            j->view[NVM_JOURNAL_VIEW_SIZE - off] = slot[2];
+        }
+        XMEMCPY(j->last, slot, 4);
+    }
+    j->next = i;
+    j->valid = 1;
+    return j;
+}
+
+static int RAMFUNCTION nvm_select_fresh_sector(int part)
+{
+#if defined(EXT_FLASH) && !defined(FLAGS_HOME)
+    if ((part == PART_UPDATE) && FLAGS_UPDATE_EXT()) {
+        return 0;
+    }
+#endif
+    return nvm_journal_load(part)->sel;
+}
+
+/**
+ * @brief Get a pointer to the current value of a trailer byte.
+ *
+ * @param[in] part Partition number.
+ * @param[in] addr Address of the byte in the trailer of sector '0'.
+ * @return Pointer to the decoded byte.
+ */
+static uint8_t* RAMFUNCTION nvm_journal_at(uint8_t part, uintptr_t addr)
+{
+    struct nvm_journal *j = nvm_journal_load(part);
+    uintptr_t off = nvm_journal_endflags(nvm_journal_idx(part)) - addr;
+
+    if ((off == 0) || (off > NVM_JOURNAL_VIEW_SIZE))
+        return (uint8_t *)(addr - WOLFBOOT_SECTOR_SIZE * j->sel);
+    return j->view + NVM_JOURNAL_VIEW_SIZE - off;
+}
+
+/**
+ * @brief Append a flag update to the journal.
+ *
+ * @param[in] part Partition number.
+ * @param[in] addr Address of the byte in the trailer of sector '0'.
+ * @param[in] val New value.
+ * @return 0 on success, -1 if the journal must be compacted.
+ */
+static int RAMFUNCTION nvm_journal_append(uint8_t part, uintptr_t addr,
+    uint8_t val)
+{
+    int t = nvm_journal_idx(part);
+    struct nvm_journal *j = nvm_journal_load(part);
+    uintptr_t off = nvm_journal_endflags(t) - addr;
+    uint8_t rec[NVM_JOURNAL_LINE_SIZE] XALIGNED_STACK(4);
+    uintptr_t slot;
+
+    if ((off == 0) || (off > NVM_JOURNAL_VIEW_SIZE))
+        return -1;
+    if (j->view[NVM_JOURNAL_VIEW_SIZE - off] == val)
+        return 0;
+    if (j->next >= NVM_JOURNAL_SLOTS)
+        return -1;
+    XMEMSET(rec, FLASH_BYTE_ERASED, NVM_JOURNAL_LINE_SIZE);
+    rec[0] = (uint8_t)(off & 0xFF);
+    rec[1] = (uint8_t)(off >> 8);
+    rec[2] = val;
+    rec[3] = NVM_JOURNAL_CHECK(rec);
+    slot = nvm_journal_sector(t, j->sel) + j->next * NVM_JOURNAL_LINE_SIZE;
+    j->next++;
+    XMEMCPY(j->last, rec, 4);
+    if (hal_flash_write(slot, rec, NVM_JOURNAL_LINE_SIZE) != 0)
+        return -1;
+    hal_cache_invalidate();
+    if (XMEMCMP((void *)slot, rec, NVM_JOURNAL_LINE_SIZE) != 0)
+        return -1;
+    j->view[NVM_JOURNAL_VIEW_SIZE - off] = val;
+    return 0;
+}
+
+/**
+ * @brief Copy the selected trailer sector with the journal applied to
+ * NVM_CACHE, leaving the journal area erased.
+ *
+ * @param[in] part Partition number.
+ * @return The selected sector.
+ */
+static int RAMFUNCTION nvm_journal_fold(uint8_t part)
+{
+    int t = nvm_journal_idx(part);
+    struct nvm_journal *j = nvm_journal_load(part);
+    uintptr_t sector = nvm_journal_sector(t, j->sel);
+    uintptr_t end_off = nvm_journal_endflags(t) - nvm_journal_sector(t, 0);
+
+    XMEMCPY(NVM_CACHE, (void *)sector, NVM_CACHE_SIZE);
+    XMEMCPY(NVM_CACHE + end_off - NVM_JOURNAL_VIEW_SIZE, j->view,
+        NVM_JOURNAL_VIEW_SIZE);
+    XMEMSET(NVM_CACHE, FLASH_BYTE_ERASED, NVM_JOURNAL_SIZE);
+    return j->sel;
+}
+#endif /* NVM_FLASH_JOURNAL */
+
 /**
  * @brief Write the trailer in a non-volatile memory.
  *
@@ -294,9 +525,18 @@ static int RAMFUNCTION trailer_write(uint8_t part, uintptr_t addr, uint8_t val)
     uintptr_t addr_off = addr & (NVM_CACHE_SIZE - 1);
     int ret = 0;
 
+#ifdef NVM_FLASH_JOURNAL
+    if (nvm_journal_append(part, addr, val) == 0)
+        return 0;
+    /* Journal full: compact it into the alternate sector */
+    nvm_cached_sector = nvm_journal_fold(part);
+    addr_read = addr_align - (nvm_cached_sector * NVM_CACHE_SIZE);
+    nvm_journal_invalidate();
+#else
     nvm_cached_sector = nvm_select_fresh_sector(part);
     addr_read = addr_align - (nvm_cached_sector * NVM_CACHE_SIZE);
     XMEMCPY(NVM_CACHE, (void*)addr_read, NVM_CACHE_SIZE);
+#endif
     NVM_CACHE[addr_off] = val;
 
     /* Calculate write address */
@@ -337,10 +577,16 @@ static int RAMFUNCTION partition_magic_write(uint8_t part, uintptr_t addr)
     uintptr_t addr_read, addr_write;
     int ret;
 
+#ifdef NVM_FLASH_JOURNAL
+    nvm_cached_sector = nvm_journal_fold(part);
+    nvm_journal_invalidate();
+#else
     nvm_cached_sector = nvm_select_fresh_sector(part);
+    XMEMCPY(NVM_CACHE, (void*)(base - (nvm_cached_sector * NVM_CACHE_SIZE)),
+        NVM_CACHE_SIZE);
+#endif
     addr_read = base - (nvm_cached_sector * NVM_CACHE_SIZE);
     addr_write = base - (!nvm_cached_sector * NVM_CACHE_SIZE);
-    XMEMCPY(NVM_CACHE, (void*)addr_read, NVM_CACHE_SIZE);
     XMEMCPY(NVM_CACHE + off, &wolfboot_magic_trail, sizeof(uint32_t));
     ret = hal_flash_write(addr_write, NVM_CACHE, WOLFBOOT_SECTOR_SIZE);
     nvm_cached_sector = !nvm_cached_sector;
@@ -399,7 +645,9 @@ static void RAMFUNCTION set_partition_magic(uint8_t part)
 static uint8_t* RAMFUNCTION get_trailer_at(uint8_t part, uint32_t at)
 {
     uint8_t *ret = NULL;
+#ifndef NVM_FLASH_JOURNAL
     uint32_t sel_sec = 0;
+#endif
 
     if (part == PART_BOOT) {
     #ifdef EXT_FLASH
@@ -412,11 +660,16 @@ static uint8_t* RAMFUNCTION get_trailer_at(uint8_t part, uint32_t at)
     #endif
         {
             /* only internal flash should be writeonce */
+        #ifdef NVM_FLASH_JOURNAL
+            ret = nvm_journal_at(part,
+                    PART_BOOT_ENDFLAGS - (sizeof(uint32_t) + at));
+        #else
         #ifdef NVM_FLASH_WRITEONCE
             sel_sec = nvm_select_fresh_sector(part);
         #endif
             ret = (void *)(PART_BOOT_ENDFLAGS -
                     (WOLFBOOT_SECTOR_SIZE * sel_sec + (sizeof(uint32_t) + at)));
+        #endif
         }
     }
     else if (part == PART_UPDATE) {
@@ -430,11 +683,16 @@ static uint8_t* RAMFUNCTION get_trailer_at(uint8_t part, uint32_t at)
     #endif
         {
             /* only internal flash should be writeonce */
+        #ifdef NVM_FLASH_JOURNAL
+            ret = nvm_journal_at(part,
+                    PART_UPDATE_ENDFLAGS - (sizeof(uint32_t) + at));
+        #else
         #ifdef NVM_FLASH_WRITEONCE
             sel_sec = nvm_select_fresh_sector(part);
         #endif
             ret = (void *)(PART_UPDATE_ENDFLAGS -
                     (WOLFBOOT_SECTOR_SIZE * sel_sec + (sizeof(uint32_t) + at)));
+        #endif
         }
     }
     return ret;
@@ -523,6 +781,111 @@ static void RAMFUNCTION set_partition_magic(uint8_t part)
 #endif
 #endif /* !MOCK_PARTITION_TRAILER */
 
+#ifdef PARTITION_STATE_CACHE
+/* RAM copy of the flags (magic, partition state and sector flags) of each
+ * partition, read once from flash and kept in sync by the setters below
+ * (write-through). wolfBoot_state_cache_invalidate() must be called whenever
+ * a trailer is modified without going through set_trailer_at(), e.g. when
+ * its sector is erased.
+ */
+#if defined(CUSTOM_PARTITION_TRAILER) || defined(MOCK_PARTITION_TRAILER) || \
+    !defined(WOLFBOOT_FIXED_PARTITIONS)
+    #error "PARTITION_STATE_CACHE requires the built-in partition trailer"
+#endif
+#ifndef STATE_CACHE_SIZE
+    #ifdef PULL_LINKER_DEFINES
+        #error "PARTITION_STATE_CACHE requires STATE_CACHE_SIZE with PULL_LINKER_DEFINES"
+    #endif
+    /* MAGIC (4B) + PART_FLAG (1B) + (N_SECTORS / 2), rounded to 4B */
+    #define STATE_CACHE_SIZE \
+        ((4 + 1 + (WOLFBOOT_PARTITION_SIZE / (2 * WOLFBOOT_SECTOR_SIZE)) + 3) & ~3)
+#endif
+
+static struct state_cache {
+    uint8_t flags[STATE_CACHE_SIZE] XALIGNED(4);
+    int valid;
+} state_cache[2]; /* PART_BOOT, PART_UPDATE */
+
+/**
+ * @brief Drop the cached partition flags.
+ *
+ * The flags are read again from flash on the next access.
+ */
+void RAMFUNCTION wolfBoot_state_cache_invalidate(void)
+{
+    state_cache[PART_BOOT].valid = 0;
+    state_cache[PART_UPDATE].valid = 0;
+}
+
+static struct state_cache* RAMFUNCTION state_cache_load(uint8_t part)
+{
+    struct state_cache *c = &state_cache[part];
+
+    if (c->valid)
+        return c;
+#ifdef EXT_FLASH
+    if ((part == PART_BOOT) ? FLAGS_BOOT_EXT() : FLAGS_UPDATE_EXT()) {
+        /* one transaction for the whole area, flags are never encrypted */
+        ext_flash_read(((part == PART_BOOT) ? PART_BOOT_ENDFLAGS :
+                PART_UPDATE_ENDFLAGS) - STATE_CACHE_SIZE,
+            c->flags, STATE_CACHE_SIZE);
+    }
+    else
+#endif
+    {
+        XMEMCPY(c->flags,
+            get_trailer_at(part, STATE_CACHE_SIZE - sizeof(uint32_t)),
+            STATE_CACHE_SIZE);
+    }
+    c->valid = 1;
+    return c;
+}
+
+static uint8_t* RAMFUNCTION state_cache_at(uint8_t part, uint32_t at)
+{
+    if ((part != PART_BOOT) && (part != PART_UPDATE))
+        return NULL;
+    if (sizeof(uint32_t) + at > STATE_CACHE_SIZE)
+        return get_trailer_at(part, at);
+    return state_cache_load(part)->flags + STATE_CACHE_SIZE -
+        (sizeof(uint32_t) + at);
+}
+
+static void RAMFUNCTION state_cache_set(uint8_t part, uint32_t at, uint8_t val)
+{
+    uint8_t *flag;
+
+    if ((part != PART_BOOT) && (part != PART_UPDATE))
+        return;
+    if (sizeof(uint32_t) + at > STATE_CACHE_SIZE) {
+        set_trailer_at(part, at, val);
+        return;
+    }
+    flag = state_cache_at(part, at);
+#ifdef EXT_FLASH
+    /* set_trailer_at() writes back the word read by the last get_trailer_at()
+     * on external flash */
+    XMEMCPY(&ext_cache, flag, sizeof(uint32_t));
+#endif
+    set_trailer_at(part, at, val);
+    *flag = val;
+}
+
+static void RAMFUNCTION state_cache_set_magic(uint8_t part)
+{
+    uint8_t *magic = state_cache_at(part, 0);
+
+    set_partition_magic(part);
+    if (magic != NULL)
+        XMEMCPY(magic, &wolfboot_magic_trail, sizeof(uint32_t));
+}
+
+/* The accessors below are served from the cache */
+#define get_trailer_at(part, at) state_cache_at(part, at)
+#define set_trailer_at(part, at, val) state_cache_set(part, at, val)
+#define set_partition_magic(part) state_cache_set_magic(part)
+#endif /* PARTITION_STATE_CACHE */
+
 
 
 #ifdef WOLFBOOT_FIXED_PARTITIONS
@@ -721,6 +1084,7 @@ void RAMFUNCTION wolfBoot_erase_partition(uint8_t part)
             hal_flash_erase(address, size);
         }
     }
+    wolfBoot_state_cache_invalidate();
 }
 
 /**
@@ -753,10 +1117,12 @@ void RAMFUNCTION wolfBoot_update_trigger(void)
      * not match what's in wolfBoot */
     if (FLAGS_UPDATE_EXT()) {
         ext_flash_erase(lastSector, WOLFBOOT_SECTOR_SIZE);
+        wolfBoot_state_cache_invalidate();
         wolfBoot_set_partition_state(PART_UPDATE, st);
     } else {
 #ifndef NVM_FLASH_WRITEONCE
         hal_flash_erase(lastSector, WOLFBOOT_SECTOR_SIZE);
+        wolfBoot_state_cache_invalidate();
         wolfBoot_set_partition_state(PART_UPDATE, st);
 #else
         uint32_t magic = WOLFBOOT_MAGIC_TRAIL;
@@ -764,9 +1130,15 @@ void RAMFUNCTION wolfBoot_update_trigger(void)
 #ifdef FLAGS_HOME
         offset -= (PART_BOOT_ENDFLAGS - PART_UPDATE_ENDFLAGS);
 #endif
+#ifdef NVM_FLASH_JOURNAL
+        /* apply the journal, older records would override the new state */
+        selSec = nvm_journal_fold(PART_UPDATE);
+        nvm_journal_invalidate();
+#else
         selSec = nvm_select_fresh_sector(PART_UPDATE);
         XMEMCPY(NVM_CACHE, (uint8_t*)lastSector - WOLFBOOT_SECTOR_SIZE * selSec,
             WOLFBOOT_SECTOR_SIZE);
+#endif
         /* write to the non selected sector */
         hal_flash_erase(lastSector - WOLFBOOT_SECTOR_SIZE * !selSec,
             WOLFBOOT_SECTOR_SIZE);
@@ -778,10 +1150,10 @@ void RAMFUNCTION wolfBoot_update_trigger(void)
         /* erase the previously selected sector */
         hal_flash_erase(lastSector - WOLFBOOT_SECTOR_SIZE * selSec,
             WOLFBOOT_SECTOR_SIZE);
+        wolfBoot_state_cache_invalidate();
 #endif
     }
 
-
     if (FLAGS_UPDATE_EXT()) {
         ext_flash_lock();
     } else {
@@ -813,6 +1185,122 @@ void RAMFUNCTION wolfBoot_success(void)
     wolfBoot_erase_encrypt_key();
 #endif
 }
+
+#ifdef WOLFBOOT_VERIFY_CACHE
+#ifdef NVM_FLASH_WRITEONCE
+#   error "WOLFBOOT_VERIFY_CACHE is not compatible with NVM_FLASH_WRITEONCE"
+#endif
+
+/* The verified-digest record lives at the beginning of the sector holding the
+ * BOOT partition flags. The bootloader erases this sector every time the
+ * content of the BOOT partition is replaced, which invalidates the record.
+ */
+#define PART_BOOT_VERIFY_CACHE \
+    (((PART_BOOT_ENDFLAGS - 1) / WOLFBOOT_SECTOR_SIZE) * WOLFBOOT_SECTOR_SIZE)
+
+/* Space reserved at the end of the sector for the partition flags: two
+ * magic/state pairs (FLAGS_HOME) + 4-bits per sector */
+#define VERIFY_CACHE_FLAGS_RESERVED (2 * (4 + 1) + \
+    ((WOLFBOOT_PARTITION_SIZE / WOLFBOOT_SECTOR_SIZE) + 1) / 2)
+
+/* The platform must provide wolfBoot_get_erase_count() and
+ * wolfBoot_get_verify_cache_key() (see include/image.h): there is no default
+ * implementation, since the record cannot be trusted without them.
+ */
+
+/**
+ * @brief Read the verified-digest record of the BOOT partition.
+ *
+ * @param[out] rec Pointer to store the record.
+ * @return 0 on success, -1 on failure.
+ */
+int RAMFUNCTION wolfBoot_get_verify_cache(struct wolfBoot_verify_cache *rec)
+{
+    uintptr_t addr = PART_BOOT_VERIFY_CACHE;
+
+    if (rec == NULL)
+        return -1;
+    if (addr + sizeof(*rec) > PART_BOOT_ENDFLAGS - VERIFY_CACHE_FLAGS_RESERVED)
+        return -1;
+#ifdef EXT_FLASH
+    if (FLAGS_BOOT_EXT()) {
+        /* the record is not confidential, bypass ext_flash_check_read */
+        if (ext_flash_read(addr, (void *)rec, sizeof(*rec)) < 0)
+            return -1;
+    }
+    else
+#endif
+    {
+        XMEMCPY(rec, (void *)addr, sizeof(*rec));
+    }
+    return 0;
+}
+
+/**
+ * @brief Store the verified-digest record of the BOOT partition.
+ *
+ * The record can only be written once after the flags sector is erased:
+ * if a record is already present, it is left untouched.
+ *
+ * @param[in] rec The record to store.
+ * @return 0 on success, -1 on failure.
+ */
+int RAMFUNCTION wolfBoot_set_verify_cache(const struct wolfBoot_verify_cache *rec)
+{
+    struct wolfBoot_verify_cache cur;
+    uint8_t *p = (uint8_t *)&cur;
+    uint32_t i;
+    int ret;
+
+    if (rec == NULL)
+        return -1;
+    if (wolfBoot_get_verify_cache(&cur) != 0)
+        return -1;
+    for (i = 0; i < sizeof(cur); i++) {
+        if (p[i] != FLASH_BYTE_ERASED)
+            return -1;
+    }
+    if (FLAGS_BOOT_EXT()) {
+        ext_flash_unlock();
+        ret = ext_flash_write(PART_BOOT_VERIFY_CACHE, (const uint8_t *)rec,
+            sizeof(*rec));
+        ext_flash_lock();
+    } else {
+        hal_flash_unlock();
+        ret = hal_flash_write(PART_BOOT_VERIFY_CACHE, (const uint8_t *)rec,
+            sizeof(*rec));
+        hal_flash_lock();
+    }
+    return (ret < 0) ? -1 : 0;
+}
+#endif /* WOLFBOOT_VERIFY_CACHE */
+
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+/**
+ * @brief Start a job on a secondary core.
+ *
+ * Targets with a secondary core available to the bootloader should override
+ * this function. The default implementation never starts the job, which is
+ * then run by the caller.
+ *
+ * @param[in] job The function to run.
+ * @param[in] arg The argument passed to the function.
+ * @return 0 if the job was started, -1 otherwise.
+ */
+int WEAKFUNCTION hal_worker_start(void (*job)(void *arg), void *arg)
+{
+    (void)job;
+    (void)arg;
+    return -1;
+}
+
+/**
+ * @brief Wait for the job started by hal_worker_start() to complete.
+ */
+void WEAKFUNCTION hal_worker_wait(void)
+{
+}
+#endif /* WOLFBOOT_PARALLEL_VERIFY */
 #endif /* WOLFBOOT_FIXED_PARTITIONS */
 
 /**
@@ -932,19 +1420,28 @@ static inline uint16_t im2ns(uint16_t val)
  * It checks if the partition is extended, reads the image header, and returns
  * the delta image offset and size. The 'inverse' flag indicates whether to get
  * the inverse delta information or regular delta information.
+ * Patches signed without a format TLV are reported as WB_PATCH_FORMAT_V1,
+ * patches without a codec TLV as uncompressed (WB_DELTA_CODEC_NONE).
  *
  * @param part The partition to check for delta update information.
  * @param inverse Flag to indicate if the delta update is inverse.
  * @param img_offset Pointer to store the delta image offset.
  * @param img_size Pointer to store the delta image size.
+ * @param base_hash Pointer to store the base image hash.
+ * @param base_hash_size Pointer to store the base image hash size.
+ * @param format Pointer to store the patch format version.
+ * @param codec Pointer to store the patch compression codec.
  *
  * @return int 0 if successful, -1 if not found or an error occurred.
  *
  */
 int wolfBoot_get_delta_info(uint8_t part, int inverse, uint32_t **img_offset,
-    uint32_t **img_size, uint8_t **base_hash, uint16_t *base_hash_size)
+    uint32_t **img_size, uint8_t **base_hash, uint16_t *base_hash_size,
+    uint32_t *format, uint32_t *codec)
 {
     uint32_t *magic = NULL;
+    uint8_t *fmt = NULL;
+    uint8_t *cod = NULL;
     uint8_t *image = (uint8_t *)0x00000000;
     if (part == PART_UPDATE) {
         if (PARTN_IS_EXT(PART_UPDATE)) {
@@ -994,6 +1491,18 @@ int wolfBoot_get_delta_info(uint8_t part, int inverse, uint32_t **img_offset,
     }
     *base_hash_size = wolfBoot_find_header((uint8_t *)(image + IMAGE_HEADER_OFFSET),
             HDR_IMG_DELTA_BASE_HASH, base_hash);
+    if (wolfBoot_find_header((uint8_t *)(image + IMAGE_HEADER_OFFSET),
+                HDR_IMG_DELTA_FORMAT, &fmt) == sizeof(uint32_t)) {
+        *format = *((uint32_t *)fmt);
+    } else {
+        *format = WB_PATCH_FORMAT_V1;
+    }
+    if (wolfBoot_find_header((uint8_t *)(image + IMAGE_HEADER_OFFSET),
+                HDR_IMG_DELTA_CODEC, &cod) == sizeof(uint32_t)) {
+        *codec = *((uint32_t *)cod);
+    } else {
+        *codec = WB_DELTA_CODEC_NONE;
+    }
     return 0;
 }
 #endif
@@ -1004,13 +1513,10 @@ static uint8_t dec_hdr[IMAGE_HEADER_SIZE];
 
 static int decrypt_header(uint8_t *src)
 {
-    int i;
     uint32_t magic;
     uint32_t len;
-    for (i = 0; i < IMAGE_HEADER_SIZE; i+=ENCRYPT_BLOCK_SIZE) {
-        crypto_set_iv(encrypt_iv_nonce, i / ENCRYPT_BLOCK_SIZE);
-        crypto_decrypt(dec_hdr + i, src + i, ENCRYPT_BLOCK_SIZE);
-    }
+    crypto_set_iv(encrypt_iv_nonce, 0);
+    crypto_decrypt(dec_hdr, src, IMAGE_HEADER_SIZE);
     magic = *((uint32_t*)(dec_hdr));
     len = *((uint32_t*)(dec_hdr + sizeof(uint32_t)));
     if (magic != WOLFBOOT_MAGIC)
@@ -1447,6 +1953,12 @@ static int RAMFUNCTION hal_set_key(const uint8_t *k, const uint8_t *nonce)
     addr_align -= (sel_sec * WOLFBOOT_SECTOR_SIZE);
     ret = hal_flash_erase(addr_align, WOLFBOOT_SECTOR_SIZE);
 #endif
+#ifdef NVM_FLASH_JOURNAL
+    /* the journal was copied along, but the selected sector changed */
+    nvm_journal_invalidate();
+#endif
+    /* the trailer sector was rewritten */
+    wolfBoot_state_cache_invalidate();
     hal_flash_lock();
     return ret;
 #endif
@@ -1708,6 +2220,137 @@ void aes_set_iv(uint8_t *nonce, uint32_t iv_ctr)
 
 #endif
 
+#ifdef ENCRYPT_AEAD
+#ifdef WOLFBOOT_RENESAS_TSIP
+    #error "ENCRYPT_AEAD is not supported with WOLFBOOT_RENESAS_TSIP"
+#endif
+
+#ifdef ENCRYPT_WITH_CHACHA
+static ChaChaPoly_Aead aead;
+#else
+static Aes aead;
+#endif
+
+/* External flash range covered by the sector tag being computed. The
+ * ciphertext is authenticated in address order, as it goes through
+ * ext_flash_decrypt_read(). */
+static struct {
+    uintptr_t next;
+    uintptr_t end;
+    int state; /* 1: in progress, 0: idle, -1: failed */
+} aead_win;
+
+/**
+ * @brief Start the authentication of a sector.
+ *
+ * The sector tag is computed with a per-sector nonce: the first 96 bits of
+ * the stored nonce, with the last 32 bits XOR-ed with (sector + 1). The
+ * ciphertext in [address, address + len) is passed as associated data, and
+ * is fed by ext_flash_decrypt_read() while it decrypts it.
+ *
+ * @param key The encryption key.
+ * @param nonce The stored nonce.
+ * @param sector The index of the sector in the partition.
+ * @param address The external flash address of the authenticated range.
+ * @param len The length of the authenticated range.
+ * @return 0 on success, -1 on failure.
+ */
+int RAMFUNCTION aead_sector_init(const uint8_t *key, const uint8_t *nonce,
+    uint32_t sector, uintptr_t address, uint32_t len)
+{
+    uint8_t iv[ENCRYPT_AEAD_NONCE_SIZE];
+    int ret;
+
+    XMEMCPY(iv, nonce, ENCRYPT_AEAD_NONCE_SIZE);
+    sector++;
+    iv[8] ^= (uint8_t)(sector >> 24);
+    iv[9] ^= (uint8_t)(sector >> 16);
+    iv[10] ^= (uint8_t)(sector >> 8);
+    iv[11] ^= (uint8_t)sector;
+#ifdef ENCRYPT_WITH_CHACHA
+    ret = wc_ChaCha20Poly1305_Init(&aead, key, iv,
+            CHACHA20_POLY1305_AEAD_DECRYPT);
+#else
+    ret = wc_AesInit(&aead, NULL, INVALID_DEVID);
+    if (ret == 0)
+        ret = wc_AesGcmInit(&aead, key, ENCRYPT_KEY_SIZE, iv,
+                ENCRYPT_AEAD_NONCE_SIZE);
+#endif
+    aead_win.next = address;
+    aead_win.end = address + len;
+    aead_win.state = (ret == 0) ? 1 : -1;
+    return (ret == 0) ? 0 : -1;
+}
+
+/**
+ * @brief Feed the ciphertext read from the external flash to the sector tag.
+ *
+ * Only the bytes within the authenticated range are used. Skipping part of
+ * the range fails the authentication.
+ */
+static void RAMFUNCTION aead_update(uintptr_t address, const uint8_t *data,
+    uint32_t len)
+{
+    uintptr_t end = address + len;
+    int ret;
+
+    if (aead_win.state != 1)
+        return;
+    if (end > aead_win.end)
+        end = aead_win.end;
+    if (address > aead_win.next) {
+        if (address < aead_win.end)
+            aead_win.state = -1;
+        return;
+    }
+    if (end <= aead_win.next)
+        return;
+    data += aead_win.next - address;
+#ifdef ENCRYPT_WITH_CHACHA
+    ret = wc_ChaCha20Poly1305_UpdateAad(&aead, data, end - aead_win.next);
+#else
+    ret = wc_AesGcmDecryptUpdate(&aead, NULL, NULL, 0, data,
+            end - aead_win.next);
+#endif
+    if (ret != 0)
+        aead_win.state = -1;
+    aead_win.next = end;
+}
+
+/**
+ * @brief Complete the authentication of a sector.
+ *
+ * @param tag The expected tag, ENCRYPT_AEAD_TAG_SIZE bytes.
+ * @return 0 if the whole range was read and the tag matches, -1 otherwise.
+ */
+int RAMFUNCTION aead_sector_final(const uint8_t *tag)
+{
+    int ret = -1;
+#ifdef ENCRYPT_WITH_CHACHA
+    uint8_t calc[ENCRYPT_AEAD_TAG_SIZE];
+#endif
+
+    if ((aead_win.state == 1) && (aead_win.next == aead_win.end)) {
+#ifdef ENCRYPT_WITH_CHACHA
+        if ((wc_ChaCha20Poly1305_Final(&aead, calc) == 0) &&
+                (ConstantCompare(calc, tag, ENCRYPT_AEAD_TAG_SIZE) == 0))
+            ret = 0;
+#else
+        if (wc_AesGcmDecryptFinal(&aead, tag, ENCRYPT_AEAD_TAG_SIZE) == 0)
+            ret = 0;
+#endif
+    }
+#ifndef ENCRYPT_WITH_CHACHA
+    wc_AesFree(&aead);
+#endif
+    ForceZero(&aead, sizeof(aead));
+    aead_win.state = 0;
+    return ret;
+}
+#else
+#define aead_update(address, data, len) do {} while (0)
+#endif /* ENCRYPT_AEAD */
+
 /**
  * @brief Determine the partition address type.
  *
@@ -1764,7 +2407,8 @@ int RAMFUNCTION ext_flash_encrypt_write(uintptr_t address, const uint8_t *data,
     uint8_t block[ENCRYPT_BLOCK_SIZE];
     uint8_t enc_block[ENCRYPT_BLOCK_SIZE];
     uint32_t row_address = address, row_offset;
-    int sz = len, i, step;
+    int sz = len, step;
+    int ret = 0;
     uint8_t part;
     uint32_t iv_counter = 0;
 #if defined(EXT_ENCRYPTED) && !defined(WOLFBOOT_SMALL_STACK) && \
@@ -1818,16 +2462,63 @@ int RAMFUNCTION ext_flash_encrypt_write(uintptr_t address, const uint8_t *data,
         sz = len - step;
     }
 
-    /* encrypt remainder */
-    step = sz & ~(ENCRYPT_BLOCK_SIZE - 1);
-    for (i = 0; i < step / ENCRYPT_BLOCK_SIZE; i++) {
-        XMEMCPY(block, data + (ENCRYPT_BLOCK_SIZE * i), ENCRYPT_BLOCK_SIZE);
-        crypto_encrypt(ENCRYPT_CACHE + (ENCRYPT_BLOCK_SIZE * i), block,
-            ENCRYPT_BLOCK_SIZE);
+    /* encrypt remainder: one cipher call per cache-sized run, the
+     * counter advances across the whole run */
+    sz &= ~(ENCRYPT_BLOCK_SIZE - 1);
+    while (sz > 0) {
+        step = (sz > NVM_CACHE_SIZE) ? NVM_CACHE_SIZE : sz;
+        crypto_encrypt(ENCRYPT_CACHE, data, step);
+        ret = ext_flash_write(address, ENCRYPT_CACHE, step);
+        if (ret < 0)
+            return ret;
+        address += step;
+        data += step;
+        sz -= step;
     }
+    return ret;
+}
+
+#ifdef EXT_FLASH_ASYNC
+#ifndef ENCRYPT_KEYSTREAM_SIZE
+    #define ENCRYPT_KEYSTREAM_SIZE 512
+#endif
+#if (ENCRYPT_KEYSTREAM_SIZE % ENCRYPT_BLOCK_SIZE) != 0
+    #error "ENCRYPT_KEYSTREAM_SIZE must be a multiple of ENCRYPT_BLOCK_SIZE"
+#endif
+static uint8_t encrypt_keystream[ENCRYPT_KEYSTREAM_SIZE] XALIGNED(4);
+
+/**
+ * @brief Read and decrypt a block-aligned run from the external flash,
+ * generating the keystream while the transfer is in flight.
+ *
+ * @param address The block-aligned address in the external flash.
+ * @param data Pointer to the destination buffer.
+ * @param len The length of the run, a multiple of ENCRYPT_BLOCK_SIZE.
+ * @return 0 on success, -1 on failure.
+ */
+static int RAMFUNCTION ext_flash_decrypt_run_async(uintptr_t address,
+    uint8_t *data, int len)
+{
+    int i, step;
 
-    return ext_flash_write(address, ENCRYPT_CACHE, step);
+    while (len > 0) {
+        step = (len > ENCRYPT_KEYSTREAM_SIZE) ? ENCRYPT_KEYSTREAM_SIZE : len;
+        if (ext_flash_read_start(address, data, step) < 0)
+            return -1;
+        XMEMSET(encrypt_keystream, 0, step);
+        crypto_decrypt(encrypt_keystream, encrypt_keystream, step);
+        if (ext_flash_read_complete() != step)
+            return -1;
+        aead_update(address, data, step);
+        for (i = 0; i < step; i++)
+            data[i] ^= encrypt_keystream[i];
+        address += step;
+        data += step;
+        len -= step;
+    }
+    return 0;
 }
+#endif /* EXT_FLASH_ASYNC */
 
 /**
  * @brief Read and decrypt data from an external flash.
@@ -1848,7 +2539,6 @@ int RAMFUNCTION ext_flash_decrypt_read(uintptr_t address, uint8_t *data, int len
     uint8_t  block[ENCRYPT_BLOCK_SIZE] XALIGNED_STACK(4);
     uint8_t  dec_block[ENCRYPT_BLOCK_SIZE] XALIGNED_STACK(4);
     uint32_t row_address = address, row_offset, iv_counter = 0;
-    int i;
     int flash_read_size;
     int read_remaining = len;
     int unaligned_head_size, unaligned_trailer_size;
@@ -1894,6 +2584,7 @@ int RAMFUNCTION ext_flash_decrypt_read(uintptr_t address, uint8_t *data, int len
                 != ENCRYPT_BLOCK_SIZE) {
             return -1;
         }
+        aead_update(address, block + row_offset, unaligned_head_size);
         crypto_decrypt(dec_block, block, ENCRYPT_BLOCK_SIZE);
         XMEMCPY(data, dec_block + row_offset, unaligned_head_size);
         address += unaligned_head_size;
@@ -1906,15 +2597,17 @@ int RAMFUNCTION ext_flash_decrypt_read(uintptr_t address, uint8_t *data, int len
      * have enough space to handle the extra bytes.
      */
     flash_read_size = read_remaining & ~(ENCRYPT_BLOCK_SIZE - 1);
+#ifdef EXT_FLASH_ASYNC
+    if (ext_flash_decrypt_run_async(address, data, flash_read_size) < 0)
+        return -1;
+#else
     if (ext_flash_read(address, data, flash_read_size) != flash_read_size)
         return -1;
-    for (i = 0; i < flash_read_size / ENCRYPT_BLOCK_SIZE; i++)
-    {
-        XMEMCPY(block, data + (ENCRYPT_BLOCK_SIZE * i), ENCRYPT_BLOCK_SIZE);
-        crypto_decrypt(data + (ENCRYPT_BLOCK_SIZE * i), block,
-                ENCRYPT_BLOCK_SIZE);
-        iv_counter++;
-    }
+    aead_update(address, data, flash_read_size);
+    /* CTR mode: decrypt the whole run in place with a single call */
+    crypto_decrypt(data, data, flash_read_size);
+#endif
+    iv_counter += flash_read_size / ENCRYPT_BLOCK_SIZE;
 
     address += flash_read_size;
     data += flash_read_size;
@@ -1928,6 +2621,7 @@ int RAMFUNCTION ext_flash_decrypt_read(uintptr_t address, uint8_t *data, int len
         if (ext_flash_read(address, block, ENCRYPT_BLOCK_SIZE)
                 != ENCRYPT_BLOCK_SIZE)
             return -1;
+        aead_update(address, block, unaligned_trailer_size);
         crypto_decrypt(dec_block, block, ENCRYPT_BLOCK_SIZE);
         XMEMCPY(data, dec_block, unaligned_trailer_size);
         read_remaining -= unaligned_trailer_size;
@@ -1951,11 +2645,7 @@ int RAMFUNCTION ext_flash_decrypt_read(uintptr_t address, uint8_t *data, int len
  */
 int wolfBoot_ram_decrypt(uint8_t *src, uint8_t *dst)
 {
-    uint8_t block[ENCRYPT_BLOCK_SIZE];
-    uint8_t dec_block[ENCRYPT_BLOCK_SIZE];
-    uint8_t *row_address = src;
-    uint32_t dst_offset = 0, iv_counter = 0;
-    uint32_t magic, len;
+    uint32_t len;
 
     if (!encrypt_initialized) {
         if (crypto_init() < 0) {
@@ -1971,15 +2661,11 @@ int wolfBoot_ram_decrypt(uint8_t *src, uint8_t *dst)
     }
     len = *((uint32_t*)(dec_hdr + sizeof(uint32_t)));
 
-    /* decrypt content */
-    while (dst_offset < (len + IMAGE_HEADER_SIZE)) {
-        crypto_set_iv(encrypt_iv_nonce, iv_counter);
-        crypto_decrypt(dec_block, row_address, ENCRYPT_BLOCK_SIZE);
-        XMEMCPY(dst + dst_offset, dec_block, ENCRYPT_BLOCK_SIZE);
-        row_address += ENCRYPT_BLOCK_SIZE;
-        dst_offset += ENCRYPT_BLOCK_SIZE;
-        iv_counter++;
-    }
+    /* decrypt content, header included, as a single run */
+    len = (len + IMAGE_HEADER_SIZE + ENCRYPT_BLOCK_SIZE - 1) &
+        ~(ENCRYPT_BLOCK_SIZE - 1);
+    crypto_set_iv(encrypt_iv_nonce, 0);
+    crypto_decrypt(dst, src, len);
     return 0;
 }
 #endif /* MMU */
@@ -37,6 +37,7 @@
 #include "uart_flash.h"
 #endif
 #include "wolfboot/wolfboot.h"
+#include "profile.h"
 
 #ifdef WOLFBOOT_TPM
 #include "tpm.h"
@@ -101,7 +102,9 @@ int main(void)
     main_argc = argc;
 #endif
 
+    PROFILE_BEGIN(PROF_HAL_INIT);
     hal_init();
+    PROFILE_END(PROF_HAL_INIT);
 #ifdef TEST_FLASH
     hal_flash_test();
 #endif
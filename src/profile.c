@@ -0,0 +1,154 @@
+/* profile.c
+ *
+ * Boot-time profiling: trace of phase begin/end events.
+ *
+ * Copyright (C) 2025 wolfSSL Inc.
+ *
+ * This file is part of wolfBoot.
+ *
+ * wolfBoot is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfBoot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+#ifdef WOLFBOOT_PROFILE
+
+#include <stdint.h>
+#include "image.h"
+#include "printf.h"
+#include "profile.h"
+#ifdef WOLFBOOT_FSP
+#include "stage2_params.h"
+#endif
+
+static struct wolfBoot_profile_trace profile_trace;
+
+/**
+ * @brief Default timestamp hook.
+ *
+ * Ports override this function to return a free-running cycle or timer
+ * counter. The default implementation returns 0.
+ *
+ * @return The current timestamp.
+ */
+uint64_t WEAKFUNCTION hal_get_timestamp(void)
+{
+    return 0;
+}
+
+/**
+ * @brief Record a profiling event in the trace ring.
+ *
+ * @param[in] phase The boot phase (PROF_*).
+ * @param[in] type PROF_EVT_BEGIN, PROF_EVT_END or PROF_EVT_POINT.
+ */
+void wolfBoot_profile_event(uint16_t phase, uint16_t type)
+{
+    struct wolfBoot_profile_event *ev;
+
+    profile_trace.magic = WOLFBOOT_PROFILE_MAGIC;
+    ev = &profile_trace.ev[profile_trace.count % WOLFBOOT_PROFILE_ENTRIES];
+    ev->timestamp = hal_get_timestamp();
+    ev->phase = phase;
+    ev->type = type;
+    ev->reserved = 0;
+    profile_trace.count++;
+}
+
+/**
+ * @brief Record the end of a phase, passing through a return value.
+ *
+ * Used by PROFILE_CALL() to wrap calls in expressions.
+ *
+ * @param[in] phase The boot phase (PROF_*).
+ * @param[in] ret The return value of the profiled call.
+ * @return ret.
+ */
+int wolfBoot_profile_end(uint16_t phase, int ret)
+{
+    wolfBoot_profile_event(phase, PROF_EVT_END);
+    return ret;
+}
+
+/**
+ * @brief Get the trace ring.
+ *
+ * @return A pointer to the trace.
+ */
+struct wolfBoot_profile_trace *wolfBoot_profile_get(void)
+{
+    return &profile_trace;
+}
+
+static const char *profile_phase_name(uint16_t phase)
+{
+    switch (phase) {
+        case PROF_HAL_INIT:
+            return "hal_init";
+        case PROF_OPEN_IMAGE:
+            return "open_image";
+        case PROF_VERIFY_INTEGRITY:
+            return "verify_integrity";
+        case PROF_VERIFY_AUTHENTICITY:
+            return "verify_authenticity";
+        case PROF_UPDATE:
+            return "update";
+        case PROF_DO_BOOT:
+            return "do_boot";
+        default:
+            return "unknown";
+    }
+}
+
+static const char *profile_type_name(uint16_t type)
+{
+    switch (type) {
+        case PROF_EVT_BEGIN:
+            return "begin";
+        case PROF_EVT_END:
+            return "end";
+        default:
+            return "point";
+    }
+}
+
+/**
+ * @brief Dump the trace and hand it over to the next stage.
+ *
+ * Events are printed (oldest first) as
+ * "prof,<phase>,<begin|end|point>,0x<timestamp>". The 64-bit timestamp is
+ * printed as two 32-bit hex halves, since wolfBoot_printf only handles
+ * 32-bit integers.
+ * On FSP targets, the address of the trace is stored in the stage2
+ * parameters.
+ */
+void wolfBoot_profile_dump(void)
+{
+    uint32_t i, first = 0;
+    struct wolfBoot_profile_event *ev;
+
+    if (profile_trace.count > WOLFBOOT_PROFILE_ENTRIES)
+        first = profile_trace.count - WOLFBOOT_PROFILE_ENTRIES;
+    for (i = first; i < profile_trace.count; i++) {
+        ev = &profile_trace.ev[i % WOLFBOOT_PROFILE_ENTRIES];
+        wolfBoot_printf("prof,%s,%s,0x%08x%08x\n",
+            profile_phase_name(ev->phase), profile_type_name(ev->type),
+            (unsigned int)(ev->timestamp >> 32),
+            (unsigned int)(ev->timestamp & 0xFFFFFFFFUL));
+    }
+#ifdef WOLFBOOT_FSP
+    stage2_get_parameters()->profile_trace =
+        (uint32_t)(uintptr_t)&profile_trace;
+#endif
+}
+
+#endif /* WOLFBOOT_PROFILE */
@@ -85,6 +85,7 @@
 #define QUAD_PROG_4B_CMD       0x34U
 
 #define SEC_ERASE_CMD          0x20U /* 4KB */
+#define BLOCK32_ERASE_CMD      0x52U /* 32KB */
 #define BLOCK_ERASE_CMD        0xD8U /* 64KB */
 #define RESET_ENABLE_CMD       0x66U
 #define RESET_MEMORY_CMD       0x99U
@@ -378,6 +379,41 @@ int spi_flash_sector_erase(uint32_t address)
     return ret;
 }
 
+#ifdef SPI_FLASH_BLOCK_ERASE
+/* Called from hal.h inline ext_flash_erase function for aligned ranges
+ * covering a whole 32KB or 64KB block */
+int spi_flash_block_erase(uint32_t address, uint32_t size)
+{
+    int ret;
+    uint8_t cmd;
+
+    if (size == SPI_FLASH_BLOCK64_SIZE)
+        cmd = BLOCK_ERASE_CMD;
+    else if (size == SPI_FLASH_BLOCK32_SIZE)
+        cmd = BLOCK32_ERASE_CMD;
+    else
+        return -1;
+
+    ret = qspi_write_enable();
+    if (ret == 0) {
+        ret = qspi_transfer(QSPI_MODE_WRITE, cmd,
+            address, QSPI_ADDR_SZ, QSPI_DATA_MODE_SPI,     /* Address */
+            0, 0, QSPI_DATA_MODE_NONE,                     /* Alternate Bytes */
+            0,                                             /* Dummy */
+            NULL, 0, QSPI_DATA_MODE_NONE                   /* Data */
+        );
+#ifdef DEBUG_QSPI
+        wolfBoot_printf("QSPI Flash Block Erase: Ret %d, Address 0x%x, Size %d\n",
+            ret, address, size);
+#endif
+        if (ret == 0) {
+            ret = qspi_wait_ready(); /* Wait for not busy */
+        }
+    }
+    return ret;
+}
+#endif
+
 int spi_flash_read(uint32_t address, void *data, int len)
 {
     int ret;
@@ -44,6 +44,8 @@
 #define WREN            0x06
 #define WRDI            0x04
 #define SECTOR_ERASE    0x20
+#define BLOCK32_ERASE   0x52
+#define BLOCK64_ERASE   0xD8
 #define CHIP_ERASE      0x60
 #define BYTE_READ       0x03
 #define BYTE_WRITE      0x02
@@ -233,6 +235,30 @@ int RAMFUNCTION spi_flash_sector_erase(uint32_t address)
     return 0;
 }
 
+#ifdef SPI_FLASH_BLOCK_ERASE
+int RAMFUNCTION spi_flash_block_erase(uint32_t address, uint32_t size)
+{
+    uint8_t cmd;
+    if (size == SPI_FLASH_BLOCK64_SIZE)
+        cmd = BLOCK64_ERASE;
+    else if (size == SPI_FLASH_BLOCK32_SIZE)
+        cmd = BLOCK32_ERASE;
+    else
+        return -1;
+    address &= (~(size - 1));
+
+    wait_busy();
+    flash_write_enable();
+    spi_cs_on(SPI_CS_PIO_BASE, SPI_CS_FLASH);
+    spi_write(cmd);
+    spi_read();
+    write_address(address);
+    spi_cs_off(SPI_CS_PIO_BASE, SPI_CS_FLASH);
+    wait_busy();
+    return 0;
+}
+#endif
+
 int RAMFUNCTION spi_flash_chip_erase(void)
 {
     wait_busy();
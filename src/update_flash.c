@@ -31,6 +31,7 @@
 
 #include "delta.h"
 #include "printf.h"
+#include "profile.h"
 #ifdef WOLFBOOT_TPM
 #include "tpm.h"
 #endif
@@ -128,6 +129,85 @@ void RAMFUNCTION wolfBoot_check_self_update(void)
 }
 #endif /* RAM_CODE for self_update */
 
+#if defined(ENCRYPT_AEAD) && !defined(WOLFBOOT_MERKLE)
+#   error "ENCRYPT_AEAD requires WOLFBOOT_MERKLE"
+#endif
+
+#if defined(ENCRYPT_AEAD) && !defined(DISABLE_BACKUP)
+#include "encrypt.h"
+
+/* Tag of the sector of the new image that is going to be decrypted by
+ * wolfBoot_copy_sector(). The range [start, end) of the sector is
+ * authenticated while it is decrypted. */
+static struct {
+    uint8_t tag[ENCRYPT_AEAD_TAG_SIZE];
+    uint32_t sector;
+    uint32_t start;
+    uint32_t end;
+    int state; /* 0: no tag, 1: tag loaded, 2: sector authenticated,
+                * 3: tag mismatch */
+} aead_check;
+#endif
+
+#if defined(WOLFBOOT_FLASH_SKIP_IDENTICAL) && !defined(EXT_ENCRYPTED)
+/**
+ * @brief Check whether a destination sector already contains the data that
+ * wolfBoot_copy_sector() would program into it.
+ *
+ * Each chunk that would be copied must match the source byte by byte, and
+ * the remaining chunks in the sector must be erased. When this holds, the
+ * erase/program cycle can be skipped: the resulting flash content is the
+ * same, so the sector flags and the resume logic are not affected.
+ *
+ * @param src Pointer to the source image.
+ * @param dst Pointer to the destination image.
+ * @param src_sector_offset Offset of the sector in the source partition.
+ * @param dst_sector_offset Offset of the sector in the destination partition.
+ * @return 1 if the destination sector is identical, 0 otherwise.
+ */
+static int RAMFUNCTION wolfBoot_sector_is_identical(struct wolfBoot_image *src,
+    struct wolfBoot_image *dst, uint32_t src_sector_offset,
+    uint32_t dst_sector_offset)
+{
+#ifdef EXT_FLASH
+    static uint8_t src_buf[FLASHBUFFER_SIZE] XALIGNED(4);
+    static uint8_t dst_buf[FLASHBUFFER_SIZE] XALIGNED(4);
+#endif
+    const uint8_t *s, *d;
+    uint32_t pos = 0;
+    uint32_t i;
+
+    while (pos < WOLFBOOT_SECTOR_SIZE) {
+        d = dst->hdr + dst_sector_offset + pos;
+#ifdef EXT_FLASH
+        if (PART_IS_EXT(dst)) {
+            ext_flash_read((uintptr_t)d, dst_buf, FLASHBUFFER_SIZE);
+            d = dst_buf;
+        }
+#endif
+        if (src_sector_offset + pos <
+                (src->fw_size + IMAGE_HEADER_SIZE + FLASHBUFFER_SIZE)) {
+            s = src->hdr + src_sector_offset + pos;
+#ifdef EXT_FLASH
+            if (PART_IS_EXT(src)) {
+                ext_flash_read((uintptr_t)s, src_buf, FLASHBUFFER_SIZE);
+                s = src_buf;
+            }
+#endif
+            if (memcmp(s, d, FLASHBUFFER_SIZE) != 0)
+                return 0;
+        } else {
+            for (i = 0; i < FLASHBUFFER_SIZE; i++) {
+                if (d[i] != FLASH_BYTE_ERASED)
+                    return 0;
+            }
+        }
+        pos += FLASHBUFFER_SIZE;
+    }
+    return 1;
+}
+#endif
+
 static int RAMFUNCTION wolfBoot_copy_sector(struct wolfBoot_image *src,
     struct wolfBoot_image *dst, uint32_t sector)
 {
@@ -139,6 +219,9 @@ static int RAMFUNCTION wolfBoot_copy_sector(struct wolfBoot_image *src,
     uint8_t nonce[ENCRYPT_NONCE_SIZE];
     uint32_t iv_counter;
 #endif
+#if defined(ENCRYPT_AEAD) && !defined(DISABLE_BACKUP)
+    int aead = 0;
+#endif
 
     if (src == dst)
         return 0;
@@ -151,6 +234,14 @@ static int RAMFUNCTION wolfBoot_copy_sector(struct wolfBoot_image *src,
     if (dst->part == PART_SWAP)
         dst_sector_offset = 0;
 
+#if defined(WOLFBOOT_FLASH_SKIP_IDENTICAL) && !defined(EXT_ENCRYPTED)
+    if (wolfBoot_sector_is_identical(src, dst, src_sector_offset,
+            dst_sector_offset)) {
+        wolfBoot_printf("Sector %d unchanged, skipping\n", sector);
+        return WOLFBOOT_SECTOR_SIZE;
+    }
+#endif
+
 #ifdef EXT_ENCRYPTED
     wolfBoot_get_encrypt_key(key, nonce);
     if (src->part == PART_SWAP)
@@ -169,6 +260,16 @@ static int RAMFUNCTION wolfBoot_copy_sector(struct wolfBoot_image *src,
         static uint8_t buffer[FLASHBUFFER_SIZE] XALIGNED(4);
 #endif
         wb_flash_erase(dst, dst_sector_offset, WOLFBOOT_SECTOR_SIZE);
+#if defined(ENCRYPT_AEAD) && !defined(DISABLE_BACKUP)
+        /* The ciphertext of the new image is authenticated while it is
+         * decrypted, unless it is only moved to the external swap */
+        if ((aead_check.state == 1) && (aead_check.sector == sector) &&
+                !(dst->part == PART_SWAP && SWAP_EXT)) {
+            aead = (aead_sector_init(key, nonce, sector,
+                    (uintptr_t)(src->hdr) + src_sector_offset +
+                    aead_check.start, aead_check.end - aead_check.start) == 0);
+        }
+#endif
         while (pos < WOLFBOOT_SECTOR_SIZE)  {
           if (src_sector_offset + pos <
               (src->fw_size + IMAGE_HEADER_SIZE + FLASHBUFFER_SIZE)) {
@@ -187,6 +288,16 @@ static int RAMFUNCTION wolfBoot_copy_sector(struct wolfBoot_image *src,
             }
             pos += FLASHBUFFER_SIZE;
         }
+#if defined(ENCRYPT_AEAD) && !defined(DISABLE_BACKUP)
+        if (aead) {
+            if (aead_sector_final(aead_check.tag) == 0) {
+                aead_check.state = 2;
+            } else {
+                wolfBoot_printf("AEAD: sector %d tag mismatch\n", sector);
+                aead_check.state = 3;
+            }
+        }
+#endif
         return pos;
     }
 #endif
@@ -311,6 +422,7 @@ static int RAMFUNCTION wolfBoot_swap_and_final_erase(int resume)
 #endif
     /* Erase the last sector(s) of boot partition (where partition state is stored) */
     wb_flash_erase(boot, WOLFBOOT_PARTITION_SIZE - eraseLen, eraseLen);
+    wolfBoot_state_cache_invalidate();
 
 #ifdef EXT_ENCRYPTED
     /* Initialize encryption with the saved key */
@@ -333,6 +445,7 @@ static int RAMFUNCTION wolfBoot_swap_and_final_erase(int resume)
     /* Erase the last sector(s) of update partition */
     /* This resets the update partition state to IMG_STATE_NEW */
     wb_flash_erase(update, WOLFBOOT_PARTITION_SIZE - eraseLen, eraseLen);
+    wolfBoot_state_cache_invalidate();
 
 #ifdef EXT_FLASH
     ext_flash_lock();
@@ -345,13 +458,118 @@ static int RAMFUNCTION wolfBoot_swap_and_final_erase(int resume)
 
 #ifdef DELTA_UPDATES
 
+#if defined(COMPRESSED_UPDATES) && !defined(DISABLE_BACKUP)
+    #error "COMPRESSED_UPDATES requires DISABLE_BACKUP"
+#endif
+
     #ifndef DELTA_BLOCK_SIZE
     #   define DELTA_BLOCK_SIZE 1024
     #endif
 
+#ifdef DELTA_INPLACE
+#if SWAP_EXT || BOOT_EXT
+    #error "DELTA_INPLACE requires BOOT and SWAP partitions in internal flash"
+#endif
+
+static void wolfBoot_delta_plan_read(struct wolfBoot_image *update,
+    uint8_t *plan, uint32_t off, void *buf, uint32_t size)
+{
+#ifdef EXT_FLASH
+    if (PART_IS_EXT(update)) {
+        ext_flash_check_read((uintptr_t)(plan + off), buf, size);
+        return;
+    }
+#endif
+    (void)update;
+    memcpy(buf, plan + off, size);
+}
+
+/* In-place delta update: the sectors of BOOT are patched directly, in the
+ * order of the plan found at the beginning of the patch (see delta.h).
+ * The progress is stored in the sector flags of UPDATE, indexed by the
+ * step in the plan. A step is marked SECT_FLAG_SWAPPING before BOOT is
+ * modified, and SECT_FLAG_UPDATED once the sector is written. Each sector
+ * is only written after all the sectors reading its base content, so an
+ * interrupted step can be repeated using the same sources. A sector that
+ * reads its own base content is saved in SWAP first (WB_INPLACE_SAVE): the
+ * patch then reads it from there, until the next sector is saved.
+ */
+static int wolfBoot_delta_inplace(struct wolfBoot_image *boot,
+    struct wolfBoot_image *update, struct wolfBoot_image *swap,
+    WB_PATCH_CTX *ctx, uint8_t *plan)
+{
+    struct wb_inplace_hdr hdr;
+    struct wb_inplace_op op;
+    uint8_t delta_blk[DELTA_BLOCK_SIZE];
+    uint32_t max_size = WOLFBOOT_PARTITION_SIZE - WOLFBOOT_SECTOR_SIZE;
+    uint32_t step, off, sz, len, blk;
+    uint8_t flag;
+    int ret;
+
+#ifdef NVM_FLASH_WRITEONCE
+    max_size -= WOLFBOOT_SECTOR_SIZE;
+#endif
+    wolfBoot_delta_plan_read(update, plan, 0, &hdr, sizeof(hdr));
+    if ((hdr.img_size <= IMAGE_HEADER_SIZE) || (hdr.img_size > max_size))
+        return -1;
+    for (step = 0; step < hdr.n_ops; step++) {
+        wolfBoot_delta_plan_read(update, plan, WB_INPLACE_PLAN_SIZE(step),
+                &op, sizeof(op));
+        if (op.sector >= max_size / WOLFBOOT_SECTOR_SIZE)
+            return -1;
+        off = op.sector * WOLFBOOT_SECTOR_SIZE;
+        if (wolfBoot_get_update_sector_flag(step, &flag) != 0)
+            flag = SECT_FLAG_NEW;
+        if (op.flags & WB_INPLACE_ERASE) {
+            /* Base content beyond the end of the new image */
+            if (flag != SECT_FLAG_UPDATED) {
+                wb_flash_erase(boot, off, WOLFBOOT_SECTOR_SIZE);
+                wolfBoot_set_update_sector_flag(step, SECT_FLAG_UPDATED);
+            }
+            continue;
+        }
+        if (off >= hdr.img_size)
+            return -1;
+        sz = hdr.img_size - off;
+        if (sz > WOLFBOOT_SECTOR_SIZE)
+            sz = WOLFBOOT_SECTOR_SIZE;
+        if (op.flags & WB_INPLACE_SAVE) {
+            if (flag == SECT_FLAG_NEW) {
+                wb_flash_erase(swap, 0, WOLFBOOT_SECTOR_SIZE);
+                wb_flash_write(swap, 0, boot->hdr + off, WOLFBOOT_SECTOR_SIZE);
+                flag = SECT_FLAG_SWAPPING;
+                wolfBoot_set_update_sector_flag(step, flag);
+            }
+            wb_patch_set_saved(ctx, off, swap->hdr, WOLFBOOT_SECTOR_SIZE);
+        }
+        if (flag == SECT_FLAG_NEW) {
+            flag = SECT_FLAG_SWAPPING;
+            wolfBoot_set_update_sector_flag(step, flag);
+        }
+        if (flag == SECT_FLAG_SWAPPING)
+            wb_flash_erase(boot, off, WOLFBOOT_SECTOR_SIZE);
+        /* When resuming, the output of the steps already done is only
+         * consumed */
+        for (len = 0; len < sz; len += ret) {
+            blk = sz - len;
+            if (blk > DELTA_BLOCK_SIZE)
+                blk = DELTA_BLOCK_SIZE;
+            ret = wb_patch(ctx, delta_blk, blk);
+            if (ret <= 0)
+                return -1;
+            if (flag == SECT_FLAG_SWAPPING)
+                wb_flash_write(boot, off + len, delta_blk, ret);
+        }
+        if (flag == SECT_FLAG_SWAPPING)
+            wolfBoot_set_update_sector_flag(step, SECT_FLAG_UPDATED);
+    }
+    return 0;
+}
+#endif /* DELTA_INPLACE */
+
 static int wolfBoot_delta_update(struct wolfBoot_image *boot,
     struct wolfBoot_image *update, struct wolfBoot_image *swap, int inverse,
-    int resume)
+    int resume, int compressed)
 {
     int sector = 0;
     int ret;
@@ -372,8 +590,15 @@ static int wolfBoot_delta_update(struct wolfBoot_image *boot,
 #endif
     uint16_t delta_base_hash_sz;
     uint8_t *delta_base_hash;
+    uint32_t delta_format;
+    uint32_t delta_codec;
     uint16_t base_hash_sz;
     uint8_t *base_hash;
+#ifdef DELTA_INPLACE
+    uint8_t *plan = NULL;
+    struct wb_inplace_hdr plan_hdr;
+    uint32_t plan_sz;
+#endif
 
     /* Use biggest size for the swap */
     total_size = boot->fw_size + IMAGE_HEADER_SIZE;
@@ -389,14 +614,15 @@ static int wolfBoot_delta_update(struct wolfBoot_image *boot,
     wolfBoot_get_encrypt_key(key, nonce);
 #endif
     if (wolfBoot_get_delta_info(PART_UPDATE, inverse, &img_offset, &img_size,
-                &delta_base_hash, &delta_base_hash_sz) < 0) {
+                &delta_base_hash, &delta_base_hash_sz, &delta_format,
+                &delta_codec) < 0) {
         return -1;
     }
     cur_v = wolfBoot_current_firmware_version();
     upd_v = wolfBoot_update_firmware_version();
     delta_base_v = wolfBoot_get_diffbase_version(PART_UPDATE);
 
-    if (delta_base_hash_sz != WOLFBOOT_SHA_DIGEST_SIZE) {
+    if (!compressed && (delta_base_hash_sz != WOLFBOOT_SHA_DIGEST_SIZE)) {
         if (delta_base_hash_sz == 0) {
             wolfBoot_printf("Warning: delta update: Base hash not found in image\n");
             delta_base_hash = NULL;
@@ -421,6 +647,14 @@ static int wolfBoot_delta_update(struct wolfBoot_image *boot,
     #error "Delta update: Fatal error, no hash algorithm defined!"
 #endif
 
+#ifdef COMPRESSED_UPDATES
+    if (compressed) {
+        /* Full image, it does not depend on the content of BOOT */
+        ret = wb_patch_init(&ctx, boot->hdr, boot->fw_size + IMAGE_HEADER_SIZE,
+                update->hdr + IMAGE_HEADER_SIZE, *img_size);
+        delta_format = WB_PATCH_FORMAT_RAW;
+    } else
+#endif
     if (inverse) {
         if (((cur_v == upd_v) && (delta_base_v < cur_v)) || resume) {
             ret = wb_patch_init(&ctx, boot->hdr, boot->fw_size +
@@ -447,8 +681,42 @@ static int wolfBoot_delta_update(struct wolfBoot_image *boot,
                     update->hdr + IMAGE_HEADER_SIZE, *img_size);
         }
     }
+#ifdef DELTA_INPLACE
+    if ((ret == 0) && (delta_format & WB_PATCH_INPLACE)) {
+        /* The patch data follows the plan */
+        plan = ctx.patch_base;
+        wolfBoot_delta_plan_read(update, plan, 0, &plan_hdr, sizeof(plan_hdr));
+        plan_sz = WB_INPLACE_PLAN_SIZE(plan_hdr.n_ops);
+        if ((plan_hdr.n_ops > WOLFBOOT_PARTITION_SIZE / WOLFBOOT_SECTOR_SIZE) ||
+                (plan_sz > ctx.patch_size)) {
+            ret = -1;
+        } else if (plan_sz == ctx.patch_size) {
+            /* Only erased or unchanged sectors */
+            memset(&ctx, 0, sizeof(ctx));
+            delta_codec = WB_DELTA_CODEC_NONE;
+        } else {
+            ret = wb_patch_init(&ctx, boot->hdr, WOLFBOOT_PARTITION_SIZE,
+                    plan + plan_sz, ctx.patch_size - plan_sz);
+        }
+        delta_format &= ~WB_PATCH_INPLACE;
+    }
+#endif
+    if ((ret == 0) && (wb_patch_set_format(&ctx, delta_format) < 0)) {
+        wolfBoot_printf("Unsupported delta patch format %u\n", delta_format);
+        ret = -1;
+    }
+    if ((ret == 0) && (wb_patch_set_codec(&ctx, delta_codec) < 0)) {
+        wolfBoot_printf("Unsupported delta patch codec %u\n", delta_codec);
+        ret = -1;
+    }
     if (ret < 0)
         goto out;
+#ifdef DELTA_INPLACE
+    if (plan != NULL) {
+        ret = wolfBoot_delta_inplace(boot, update, swap, &ctx, plan);
+        goto out;
+    }
+#endif
 
     while((sector * WOLFBOOT_SECTOR_SIZE) < (int)total_size) {
         if ((wolfBoot_get_update_sector_flag(sector, &flag) != 0) ||
@@ -499,6 +767,7 @@ static int wolfBoot_delta_update(struct wolfBoot_image *boot,
         }
         if (flag == SECT_FLAG_SWAPPING) {
            wolfBoot_copy_sector(swap, boot, sector);
+           wb_patch_src_written(&ctx);
            flag = SECT_FLAG_UPDATED;
            if (((sector + 1) * WOLFBOOT_SECTOR_SIZE) < WOLFBOOT_PARTITION_SIZE)
                wolfBoot_set_update_sector_flag(sector, flag);
@@ -527,6 +796,22 @@ static int wolfBoot_delta_update(struct wolfBoot_image *boot,
     }
     ret = 0;
     /* erase to the last sector, writeonce has 2 sectors */
+#ifdef WOLFBOOT_FLASH_MULTI_SECTOR_ERASE
+    if ((sector * WOLFBOOT_SECTOR_SIZE) < WOLFBOOT_PARTITION_SIZE -
+        WOLFBOOT_SECTOR_SIZE
+#ifdef NVM_FLASH_WRITEONCE
+        * 2
+#endif
+    ) {
+        wb_flash_erase(boot, sector * WOLFBOOT_SECTOR_SIZE,
+            WOLFBOOT_PARTITION_SIZE - (sector * WOLFBOOT_SECTOR_SIZE) -
+            WOLFBOOT_SECTOR_SIZE
+#ifdef NVM_FLASH_WRITEONCE
+            * 2
+#endif
+            );
+    }
+#else
     while((sector * WOLFBOOT_SECTOR_SIZE) < WOLFBOOT_PARTITION_SIZE -
         WOLFBOOT_SECTOR_SIZE
 #ifdef NVM_FLASH_WRITEONCE
@@ -536,11 +821,21 @@ static int wolfBoot_delta_update(struct wolfBoot_image *boot,
         wb_flash_erase(boot, sector * WOLFBOOT_SECTOR_SIZE, WOLFBOOT_SECTOR_SIZE);
         sector++;
     }
+#endif /* WOLFBOOT_FLASH_MULTI_SECTOR_ERASE */
 out:
 #ifdef EXT_FLASH
     ext_flash_lock();
 #endif
     hal_flash_lock();
+#ifdef DELTA_CACHE_STATS
+    if (ret == 0) {
+        wolfBoot_printf("Delta patch cache: %u hits, %u misses, %u bytes read\n",
+                ctx.stats.patch_hits, ctx.stats.patch_misses,
+                ctx.stats.patch_read);
+        wolfBoot_printf("Delta source cache: %u hits, %u misses, %u bytes read\n",
+                ctx.stats.src_hits, ctx.stats.src_misses, ctx.stats.src_read);
+    }
+#endif
 
 #if !defined(DISABLE_BACKUP) && !defined(CUSTOM_PARTITION_TRAILER)
     /* start re-entrant final erase, return code is only for resumption in
@@ -553,6 +848,49 @@ out:
     return ret;
 }
 
+#ifdef COMPRESSED_UPDATES
+/**
+ * @brief Completes a compressed update, once the new image has been
+ * decompressed into the BOOT partition.
+ *
+ * There is no copy of the previous image to fall back to, so the new image
+ * is marked as SUCCESS right away, as with the direct copy of DISABLE_BACKUP.
+ * The trailers are erased to reset the sector flags, so that the update is
+ * not resumed at the next boot. The compressed image is left in the UPDATE
+ * partition, to be installed again by an emergency update if needed.
+ */
+static void RAMFUNCTION wolfBoot_compressed_final_flags(
+    struct wolfBoot_image *boot, struct wolfBoot_image *update)
+{
+    int eraseLen = (WOLFBOOT_SECTOR_SIZE
+#ifdef NVM_FLASH_WRITEONCE /* need to erase the redundant sector too */
+        * 2
+#endif
+    );
+#ifdef EXT_ENCRYPTED
+    uint8_t key[ENCRYPT_KEY_SIZE];
+    uint8_t nonce[ENCRYPT_NONCE_SIZE];
+
+    wolfBoot_get_encrypt_key(key, nonce);
+#endif
+    hal_flash_unlock();
+#ifdef EXT_FLASH
+    ext_flash_unlock();
+#endif
+    wb_flash_erase(update, WOLFBOOT_PARTITION_SIZE - eraseLen, eraseLen);
+    wb_flash_erase(boot, WOLFBOOT_PARTITION_SIZE - eraseLen, eraseLen);
+    wolfBoot_state_cache_invalidate();
+    wolfBoot_set_partition_state(PART_BOOT, IMG_STATE_SUCCESS);
+#ifdef EXT_FLASH
+    ext_flash_lock();
+#endif
+    hal_flash_lock();
+#ifdef EXT_ENCRYPTED
+    wolfBoot_set_encrypt_key(key, nonce);
+#endif
+}
+#endif /* COMPRESSED_UPDATES */
+
 #endif
 
 
@@ -585,6 +923,148 @@ static int wolfBoot_get_total_size(struct wolfBoot_image* boot,
     return total_size;
 }
 
+#if defined(WOLFBOOT_MERKLE) && !defined(DISABLE_BACKUP)
+/* Images carrying a per-sector Merkle manifest only need their signed root
+ * to be checked before the swap: the sectors are verified as they land in
+ * the BOOT partition. If a sector does not match, the swap is completed and
+ * the previous image is swapped back right away, see wolfBoot_update(). */
+static int RAMFUNCTION wolfBoot_update_verify_integrity(
+    struct wolfBoot_image *img)
+{
+    if (wolfBoot_merkle_sectors(img) > 0)
+        return wolfBoot_merkle_verify_root(img);
+    return wolfBoot_verify_integrity(img);
+}
+
+/* Sectors [first, last) of the image in BOOT, verified against its manifest
+ * while they were swapped in during this boot cycle */
+static struct {
+    uint32_t first;
+    uint32_t last;
+    int failed;
+} merkle_swap;
+
+/* Open the manifest of the new image, once its header is in BOOT */
+static int RAMFUNCTION wolfBoot_merkle_open(struct wolfBoot_image *img)
+{
+    if (!img->hdr_ok) {
+        if ((wolfBoot_open_image(img, PART_BOOT) < 0) ||
+                (wolfBoot_merkle_sectors(img) == 0) ||
+                (wolfBoot_merkle_verify_root(img) < 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void RAMFUNCTION wolfBoot_merkle_check_sector(
+    struct wolfBoot_image *img, uint32_t sector)
+{
+    if (merkle_swap.failed)
+        return;
+    if (!img->hdr_ok && (wolfBoot_open_image(img, PART_BOOT) < 0)) {
+        merkle_swap.failed = 1;
+        return;
+    }
+    /* Not a Merkle image: verified as a whole before the swap. Sectors past
+     * the end of the new image are only erased */
+    if (sector >= (uint32_t)wolfBoot_merkle_sectors(img))
+        return;
+    if (!img->sha_ok && (wolfBoot_merkle_verify_root(img) < 0)) {
+        merkle_swap.failed = 1;
+        return;
+    }
+#ifdef ENCRYPT_AEAD
+    /* A sector that failed its tag check rejects the update right away. A
+     * valid tag is not enough: the sector is still checked against its
+     * signed leaf below */
+    if ((aead_check.sector == sector) && (aead_check.state == 3)) {
+        merkle_swap.failed = 1;
+        return;
+    }
+#endif
+    if (wolfBoot_merkle_verify_sector(img, sector) < 0) {
+        merkle_swap.failed = 1;
+        return;
+    }
+    if (merkle_swap.last != sector)
+        merkle_swap.first = sector;
+    merkle_swap.last = sector + 1;
+}
+
+/**
+ * @brief Verify the integrity of the image in BOOT before staging it.
+ *
+ * The sectors verified while they were swapped in during this boot cycle are
+ * not hashed again. The root of the manifest is always checked, as well as
+ * the sectors swapped before a power failure and the staging sector used by
+ * wolfBoot_swap_and_final_erase().
+ *
+ * @param img The image in BOOT.
+ * @return 0 on success, -1 on error.
+ */
+static int RAMFUNCTION wolfBoot_boot_verify_integrity(
+    struct wolfBoot_image *img)
+{
+    const uint32_t staging = (WOLFBOOT_PARTITION_SIZE / WOLFBOOT_SECTOR_SIZE) -
+#ifdef NVM_FLASH_WRITEONCE
+        3;
+#else
+        2;
+#endif
+    uint32_t n, sector;
+
+    n = (uint32_t)wolfBoot_merkle_sectors(img);
+    if ((n == 0) || merkle_swap.failed || (merkle_swap.last != n))
+        return wolfBoot_verify_integrity(img);
+    if (wolfBoot_merkle_verify_root(img) < 0)
+        return -1;
+    for (sector = 0; sector < n; sector++) {
+        if ((sector >= merkle_swap.first) && (sector != staging))
+            continue;
+        if (wolfBoot_merkle_verify_sector(img, sector) < 0) {
+            img->sha_ok = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#ifdef ENCRYPT_AEAD
+/**
+ * @brief Load the AEAD tag of a sector of the new image before it is copied.
+ *
+ * The tag of sector 0 comes from the UPDATE image, verified before the swap.
+ * The following sectors use the manifest of the new image in BOOT.
+ */
+static void RAMFUNCTION wolfBoot_aead_load_tag(struct wolfBoot_image *update,
+    struct wolfBoot_image *merkle, uint32_t sector)
+{
+    struct wolfBoot_image *img = update;
+    uint8_t *tag;
+    uint32_t end;
+
+    aead_check.state = 0;
+    if (sector > 0) {
+        if (wolfBoot_merkle_open(merkle) < 0)
+            return;
+        img = merkle;
+    }
+    if (wolfBoot_aead_sector_tag(img, sector, &tag) < 0)
+        return;
+    memcpy(aead_check.tag, tag, ENCRYPT_AEAD_TAG_SIZE);
+    aead_check.sector = sector;
+    aead_check.start = (sector == 0) ? IMAGE_HEADER_SIZE : 0;
+    end = img->fw_size + IMAGE_HEADER_SIZE - (sector * WOLFBOOT_SECTOR_SIZE);
+    aead_check.end = (end > WOLFBOOT_SECTOR_SIZE) ? WOLFBOOT_SECTOR_SIZE : end;
+    aead_check.state = 1;
+}
+#endif
+#else
+#define wolfBoot_update_verify_integrity wolfBoot_verify_integrity
+#define wolfBoot_boot_verify_integrity wolfBoot_verify_integrity
+#endif
+
 static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
 {
     uint32_t total_size = 0;
@@ -612,6 +1092,17 @@ static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
     uint32_t up_v;
 #endif
     uint32_t cur_ver, upd_ver;
+#if defined(WOLFBOOT_MERKLE) && !defined(DISABLE_BACKUP)
+    struct wolfBoot_image merkle;
+    uint8_t boot_st;
+
+    if (wolfBoot_get_partition_state(PART_BOOT, &boot_st) != 0)
+        boot_st = IMG_STATE_NEW;
+    merkle.hdr_ok = 0;
+    merkle_swap.first = 0;
+    merkle_swap.last = 0;
+    merkle_swap.failed = 0;
+#endif
 
     wolfBoot_printf("Staring Update (fallback allowed %d)\n", fallback_allowed);
 
@@ -646,7 +1137,7 @@ static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
             return -1;
         }
         if (!update.hdr_ok
-                || (wolfBoot_verify_integrity(&update) < 0)
+                || (wolfBoot_update_verify_integrity(&update) < 0)
                 || (wolfBoot_verify_authenticity(&update) < 0)) {
             wolfBoot_printf("Update verify failed: Hdr %d, Hash %d, Sig %d\n",
                 update.hdr_ok, update.sha_ok, update.signature_ok);
@@ -709,7 +1200,18 @@ static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
             hal_flash_lock();
         }
 
-        return wolfBoot_delta_update(&boot, &update, &swap, inverse, resume);
+        return wolfBoot_delta_update(&boot, &update, &swap, inverse, resume, 0);
+    }
+#endif
+#ifdef COMPRESSED_UPDATES
+    if ((update_type & 0x00F0) == HDR_IMG_TYPE_COMPRESSED) {
+        /* Only built with DISABLE_BACKUP: the image is decompressed over
+         * the previous one, which cannot be restored */
+        if (wolfBoot_delta_update(&boot, &update, &swap, 0,
+                    (flag != SECT_FLAG_NEW), 1) < 0)
+            return -1;
+        wolfBoot_compressed_final_flags(&boot, &update);
+        return 0;
     }
 #endif
 
@@ -728,6 +1230,10 @@ static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
     while ((sector * sector_size) < total_size) {
         flag = SECT_FLAG_NEW;
         wolfBoot_get_update_sector_flag(sector, &flag);
+    #if defined(WOLFBOOT_MERKLE) && defined(ENCRYPT_AEAD)
+        if (flag != SECT_FLAG_UPDATED)
+            wolfBoot_aead_load_tag(&update, &merkle, sector);
+    #endif
         switch (flag) {
             case SECT_FLAG_NEW:
                flag = SECT_FLAG_SWAPPING;
@@ -752,6 +1258,9 @@ static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
                 wolfBoot_copy_sector(&swap, &boot, sector);
                 if (((sector + 1) * sector_size) < WOLFBOOT_PARTITION_SIZE)
                     wolfBoot_set_update_sector_flag(sector, flag);
+            #ifdef WOLFBOOT_MERKLE
+                wolfBoot_merkle_check_sector(&merkle, sector);
+            #endif
                 break;
             case SECT_FLAG_UPDATED:
                 /* FALL THROUGH */
@@ -775,6 +1284,10 @@ static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
 
             /* get total size */
             total_size = wolfBoot_get_total_size(&boot, &update);
+        #ifdef WOLFBOOT_MERKLE
+            /* re-open the manifest after the header cache was reloaded */
+            merkle.hdr_ok = 0;
+        #endif
         }
     }
 
@@ -827,6 +1340,28 @@ static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
     /* Mark boot partition as TESTING - this tells bootloader to fallback if update fails */
     wolfBoot_set_partition_state(PART_BOOT, IMG_STATE_TESTING);
 #endif
+#ifdef WOLFBOOT_MERKLE
+    if (merkle_swap.failed) {
+        /* The new image is now in BOOT, in TESTING state, and the previous
+         * one is in UPDATE: swap them back now instead of booting it */
+        wolfBoot_printf("Merkle: image rejected, swapping back\n");
+        if ((fallback_allowed == 0) && (wolfBoot_update(1) == 0) &&
+                (boot_st == IMG_STATE_SUCCESS)) {
+            /* Keep the previous image confirmed, so that the rejected one is
+             * not tried again as a fallback */
+            hal_flash_unlock();
+        #ifdef EXT_FLASH
+            ext_flash_unlock();
+        #endif
+            wolfBoot_set_partition_state(PART_BOOT, IMG_STATE_SUCCESS);
+        #ifdef EXT_FLASH
+            ext_flash_lock();
+        #endif
+            hal_flash_lock();
+        }
+        return -1;
+    }
+#endif
 
 #else /* DISABLE_BACKUP */
 #ifdef WOLFBOOT_ELF_FLASH_SCATTER
@@ -866,16 +1401,23 @@ static int RAMFUNCTION wolfBoot_update(int fallback_allowed)
         sector++;
     }
     /* erase remainder of partition */
-#ifdef PRINTF_ENABLED
+#if defined(WOLFBOOT_FLASH_MULTI_SECTOR_ERASE) || defined(PRINTF_ENABLED)
     size = WOLFBOOT_PARTITION_SIZE - (sector * sector_size);
     wolfBoot_printf("Erasing remainder of partition (%d sectors)...\n",
         size/sector_size);
 #endif
+#ifdef WOLFBOOT_FLASH_MULTI_SECTOR_ERASE
+    if (size > 0)
+        wb_flash_erase(&boot, sector * sector_size, size);
+#else
     while ((sector * sector_size) < WOLFBOOT_PARTITION_SIZE) {
         wb_flash_erase(&boot, sector * sector_size, sector_size);
         sector++;
     }
+#endif
 
+    /* the trailer of the BOOT partition was erased */
+    wolfBoot_state_cache_invalidate();
 
     wolfBoot_set_partition_state(PART_BOOT, IMG_STATE_SUCCESS);
 
@@ -1021,6 +1563,9 @@ void RAMFUNCTION wolfBoot_start(void)
     wolfBoot_check_self_update();
 #endif
 
+    /* Resume point: decode the partition flags from flash again */
+    wolfBoot_state_cache_invalidate();
+
 #ifdef NVM_FLASH_WRITEONCE
     /* nvm_select_fresh_sector needs unlocked flash in cases where the unused
      * sector needs to be erased */
@@ -1050,24 +1595,27 @@ void RAMFUNCTION wolfBoot_start(void)
          * to trigger fallback.
          */
         if ((bootRet == 0) && (bootState == IMG_STATE_TESTING)) {
-            wolfBoot_update(1);
+            PROFILE_CALL(PROF_UPDATE, wolfBoot_update(1));
         }
 
         /* Check for new updates in the UPDATE partition or if we were
          * interrupted during the flags setting */
         else if ((updateRet == 0) && (updateState == IMG_STATE_UPDATING)) {
             /* Check for new updates in the UPDATE partition */
-            wolfBoot_update(0);
+            PROFILE_CALL(PROF_UPDATE, wolfBoot_update(0));
         }
     }
 
-    bootRet = wolfBoot_open_image(&boot, PART_BOOT);
+    bootRet = PROFILE_CALL(PROF_OPEN_IMAGE,
+        wolfBoot_open_image(&boot, PART_BOOT));
     wolfBoot_printf("Booting version: 0x%x\n",
         wolfBoot_get_blob_version(boot.hdr));
 
     if (bootRet < 0
-            || (wolfBoot_verify_integrity(&boot) < 0)
-            || (wolfBoot_verify_authenticity(&boot) < 0)
+            || (PROFILE_CALL(PROF_VERIFY_INTEGRITY,
+                    wolfBoot_boot_verify_integrity(&boot)) < 0)
+            || (PROFILE_CALL(PROF_VERIFY_AUTHENTICITY,
+                    wolfBoot_verify_authenticity(&boot)) < 0)
     ) {
         wolfBoot_printf("Boot failed: Hdr %d, Hash %d, Sig %d\n",
             boot.hdr_ok, boot.sha_ok, boot.signature_ok);
@@ -1082,7 +1630,7 @@ void RAMFUNCTION wolfBoot_start(void)
         } else {
             /* Emergency update successful, try to re-open boot image */
             if (likely(((wolfBoot_open_image(&boot, PART_BOOT) < 0) ||
-                    (wolfBoot_verify_integrity(&boot) < 0)  ||
+                    (wolfBoot_boot_verify_integrity(&boot) < 0)  ||
                     (wolfBoot_verify_authenticity(&boot) < 0)
                     ))) {
                 wolfBoot_printf("Boot (try 2) failed: Hdr %d, Hash %d, Sig %d\n",
@@ -1135,6 +1683,9 @@ void RAMFUNCTION wolfBoot_start(void)
 #elif defined(WOLFBOOT_ENABLE_WOLFHSM_SERVER)
     (void)hal_hsm_server_cleanup();
 #endif
+    /* The boot never returns: do_boot is a point event */
+    PROFILE_POINT(PROF_DO_BOOT);
+    PROFILE_DUMP();
     hal_prepare_boot();
     do_boot((void *)boot.fw_base);
 }
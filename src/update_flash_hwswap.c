@@ -86,6 +86,7 @@ void RAMFUNCTION wolfBoot_start(void)
          * never returns. A reboot is triggered instead, so the code
          * below is only executed if we are staging the firmware.
          */
+        wolfBoot_state_cache_invalidate();
         active = PART_BOOT;
         if ((wolfBoot_get_partition_state(active, &p_state) == 0) &&
                 (p_state == IMG_STATE_UPDATING))
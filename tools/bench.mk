@@ -0,0 +1,96 @@
+## Host-side benchmark (ARCH=sim only), see docs/Targets.md
+BENCH_DIR=tools/bench
+BENCH=$(BENCH_DIR)/wolfboot-bench
+BENCH_OUT?=$(BENCH_DIR)/bench.csv
+BENCH_IMAGE_KB?=128
+BENCH_ITERATIONS?=10
+BENCH_POWERFAIL?=8
+BENCH_INT_PROFILE?=internal
+BENCH_EXT_PROFILE?=spi-nor
+BENCH_ENC_KEY=$(BENCH_DIR)/enc_key.der
+BENCH_OBJS=$(filter-out ./hal/$(TARGET).o ./src/loader.o,$(OBJS)) \
+	$(BENCH_DIR)/bench.o
+
+ifeq ($(ENCRYPT_WITH_AES128),1)
+  BENCH_ENC_ARGS=--encrypt $(BENCH_ENC_KEY) --aes128
+else ifeq ($(ENCRYPT_WITH_AES256),1)
+  BENCH_ENC_ARGS=--encrypt $(BENCH_ENC_KEY) --aes256
+else
+  BENCH_ENC_ARGS=--encrypt $(BENCH_ENC_KEY)
+endif
+
+ifeq ($(ENCRYPT),1)
+  BENCH_ARGS=-k $(BENCH_ENC_KEY)
+  BENCH_UPDATE_LABEL=encrypted
+  BENCH_UPDATE_IMG=$(BENCH_DIR)/app2_v2_signed_and_encrypted.bin
+  BENCH_DELTA_LABEL=encrypted-delta
+  BENCH_DELTA_IMG=$(BENCH_DIR)/app2_v2_signed_diff_encrypted.bin
+  BENCH_DELTA_ARGS=$(BENCH_ENC_ARGS)
+else
+  BENCH_ARGS=
+  BENCH_UPDATE_LABEL=update
+  BENCH_UPDATE_IMG=$(BENCH_DIR)/app2_v2_signed.bin
+  BENCH_DELTA_LABEL=delta
+  BENCH_DELTA_IMG=$(BENCH_DIR)/app2_v2_signed_diff.bin
+  BENCH_DELTA_ARGS=
+endif
+
+BENCH_ARGS+=-f $(BENCH_INT_PROFILE) -e $(BENCH_EXT_PROFILE)
+
+$(BENCH_DIR)/bench.o: CFLAGS+=-DBENCH_SIGN=\"$(SIGN)\" -DBENCH_HASH=\"$(HASH)\"
+
+$(BENCH): include/target.h $(BENCH_OBJS) FORCE
+	$(Q)(test "$(ARCH)" = "sim") || \
+		(echo "Error: the benchmark requires an ARCH=sim configuration" && false)
+	@echo "\t[LD] $@"
+	$(Q)$(LD) $(LDFLAGS) $(BENCH_OBJS) $(LIBS) -o $@
+
+# Version 2 differs from version 1 in 4KB in the middle of the image
+bench-images: $(PRIVATE_KEY) FORCE
+	$(Q)$(MAKE) keytools_check
+	$(Q)dd if=/dev/urandom of=$(BENCH_DIR)/app1.bin bs=1024 \
+		count=$(BENCH_IMAGE_KB) 2>/dev/null
+	$(Q)cp $(BENCH_DIR)/app1.bin $(BENCH_DIR)/app2.bin
+	$(Q)dd if=/dev/urandom of=$(BENCH_DIR)/app2.bin bs=1024 \
+		seek=$$(($(BENCH_IMAGE_KB) / 2)) count=4 conv=notrunc 2>/dev/null
+	$(Q)$(SIGN_ENV) $(SIGN_TOOL) $(SIGN_OPTIONS) $(BENCH_DIR)/app1.bin \
+		$(PRIVATE_KEY) 1 >/dev/null
+ifeq ($(ENCRYPT),1)
+	@printf "0123456789abcdef0123456789abcdef0123456789abcdef" > $(BENCH_ENC_KEY)
+	$(Q)$(SIGN_ENV) $(SIGN_TOOL) $(SIGN_OPTIONS) $(BENCH_ENC_ARGS) \
+		$(BENCH_DIR)/app2.bin $(PRIVATE_KEY) 2 >/dev/null
+else
+	$(Q)$(SIGN_ENV) $(SIGN_TOOL) $(SIGN_OPTIONS) $(BENCH_DIR)/app2.bin \
+		$(PRIVATE_KEY) 2 >/dev/null
+endif
+ifeq ($(DELTA_UPDATES),1)
+	$(Q)$(SIGN_ENV) $(SIGN_TOOL) $(SIGN_OPTIONS) $(BENCH_DELTA_ARGS) \
+		--delta $(BENCH_DIR)/app1_v1_signed.bin $(BENCH_DIR)/app2.bin \
+		$(PRIVATE_KEY) 2 >/dev/null
+endif
+
+# Appends one CSV row per scenario to $(BENCH_OUT). wolfBoot logs are
+# stored in $(BENCH_DIR)/bench.log
+bench: $(BENCH) bench-images
+	$(Q)test -f $(BENCH_OUT) || $(BENCH) header > $(BENCH_OUT)
+	$(Q)$(BENCH) $(BENCH_ARGS) -n $(BENCH_ITERATIONS) \
+		verify $(BENCH_DIR)/app1_v1_signed.bin \
+		>> $(BENCH_OUT) 2> $(BENCH_DIR)/bench.log
+	$(Q)$(BENCH) $(BENCH_ARGS) -l $(BENCH_UPDATE_LABEL) \
+		update $(BENCH_DIR)/app1_v1_signed.bin $(BENCH_UPDATE_IMG) \
+		>> $(BENCH_OUT) 2>> $(BENCH_DIR)/bench.log
+ifeq ($(DELTA_UPDATES),1)
+	$(Q)$(BENCH) $(BENCH_ARGS) -l $(BENCH_DELTA_LABEL) \
+		update $(BENCH_DIR)/app1_v1_signed.bin $(BENCH_DELTA_IMG) \
+		>> $(BENCH_OUT) 2>> $(BENCH_DIR)/bench.log
+endif
+	$(Q)$(BENCH) $(BENCH_ARGS) -p $(BENCH_POWERFAIL) \
+		resume $(BENCH_DIR)/app1_v1_signed.bin $(BENCH_UPDATE_IMG) \
+		>> $(BENCH_OUT) 2>> $(BENCH_DIR)/bench.log
+	@echo "Results appended to $(BENCH_OUT)"
+
+bench-clean:
+	$(Q)rm -f $(BENCH) $(BENCH_DIR)/*.o $(BENCH_DIR)/*.bin \
+		$(BENCH_DIR)/*.der $(BENCH_DIR)/bench.log
+
+.PHONY: bench bench-images bench-clean
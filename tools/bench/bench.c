@@ -0,0 +1,362 @@
+/* bench.c
+ *
+ * Host-side benchmark for the verification and update paths.
+ *
+ * Links the real image.c, libwolfboot.c, update_flash.c (and delta.c when
+ * DELTA_UPDATES is enabled) against the simulated flash of hal/sim_flash.c,
+ * backed by memory, and prints one CSV row per run with timing, flash
+ * operation counters and the modeled flash time.
+ *
+ * Built from the top-level Makefile with an ARCH=sim configuration:
+ *     make bench
+ * See docs/Targets.md ("Simulated", "Benchmarking").
+ *
+ * Copyright (C) 2025 wolfSSL Inc.
+ *
+ * This file is part of wolfBoot.
+ *
+ * wolfBoot is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfBoot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "wolfboot/wolfboot.h"
+#include "target.h"
+#include "image.h"
+#include "hal.h"
+#include "loader.h"
+#include "printf.h"
+#include "hal/sim_flash.h"
+
+#ifndef ARCH_SIM
+#error "The benchmark requires an ARCH=sim configuration"
+#endif
+#ifdef PART_BOOT_EXT
+#error "The benchmark requires the BOOT partition in internal flash"
+#endif
+
+#ifndef BENCH_SIGN
+#define BENCH_SIGN "unknown"
+#endif
+#ifndef BENCH_HASH
+#define BENCH_HASH "unknown"
+#endif
+
+/* Size of each of the simulated flash devices */
+#ifndef BENCH_FLASH_SIZE
+#define BENCH_FLASH_SIZE (16 * 1024 * 1024)
+#endif
+
+/* Default erase operation at which power fails in the "resume" scenario */
+#define BENCH_POWERFAIL_DEFAULT 8
+
+#define BENCH_CSV_HEADER "label,scenario,sign,hash,fw_size,iterations,usec," \
+    "MB/s,int_write_bytes,int_erase_sectors,ext_read_bytes,ext_write_bytes," \
+    "ext_erase_sectors,flash_us,status"
+
+static int bench_booted;
+
+/* HAL */
+void hal_init(void)
+{
+}
+
+void hal_prepare_boot(void)
+{
+}
+
+void do_boot(const uint32_t *app_offset)
+{
+    (void)app_offset;
+    bench_booted = 1;
+}
+
+/* Setup */
+static uint8_t *bench_map(void)
+{
+    /* Shared mapping: survives the simulated reboot in the "resume"
+     * scenario, which runs the interrupted update in a child process */
+    uint8_t *p = mmap(NULL, BENCH_FLASH_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    memset(p, FLASH_BYTE_ERASED, BENCH_FLASH_SIZE);
+    return p;
+}
+
+static uint8_t *load_file(const char *path, uint32_t *size)
+{
+    FILE *f;
+    long sz;
+    uint8_t *buf = NULL;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if ((sz > 0) && (sz <= WOLFBOOT_PARTITION_SIZE))
+        buf = malloc(sz);
+    if ((buf != NULL) && (fread(buf, 1, sz, f) != (size_t)sz)) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    if (buf == NULL)
+        fprintf(stderr, "failed to load %s\n", path);
+    else
+        *size = (uint32_t)sz;
+    return buf;
+}
+
+static int load_partition(uint8_t part, const char *path)
+{
+    uint8_t *buf, *dst;
+    uint32_t size;
+
+    buf = load_file(path, &size);
+    if (buf == NULL)
+        return -1;
+    if (part == PART_BOOT) {
+        dst = (uint8_t *)WOLFBOOT_PARTITION_BOOT_ADDRESS;
+    } else {
+#ifdef PART_UPDATE_EXT
+        dst = sim_ext_flash_base + WOLFBOOT_PARTITION_UPDATE_ADDRESS;
+#else
+        dst = (uint8_t *)WOLFBOOT_PARTITION_UPDATE_ADDRESS;
+#endif
+    }
+    memcpy(dst, buf, size);
+    free(buf);
+    return 0;
+}
+
+#ifdef EXT_ENCRYPTED
+static int load_encrypt_key(const char *path)
+{
+    uint8_t *buf;
+    uint32_t size;
+    int ret = -1;
+
+    buf = load_file(path, &size);
+    if (buf == NULL)
+        return -1;
+    if (size >= ENCRYPT_KEY_SIZE + ENCRYPT_NONCE_SIZE)
+        ret = wolfBoot_set_encrypt_key(buf, buf + ENCRYPT_KEY_SIZE);
+    free(buf);
+    return ret;
+}
+#endif
+
+static uint32_t boot_fw_size(void)
+{
+    return wolfBoot_image_size((uint8_t *)WOLFBOOT_PARTITION_BOOT_ADDRESS);
+}
+
+static void bench_reset_counters(void)
+{
+    sim_flash_model_reset(&int_flash_model);
+    sim_flash_model_reset(&ext_flash_model);
+}
+
+static void print_row(const char *label, const char *scenario, uint32_t iter,
+    uint64_t usec, int ok)
+{
+    uint64_t fw_size = boot_fw_size();
+    uint64_t rate = 0;
+
+    if (usec == 0)
+        usec = 1;
+    /* bytes per microsecond == MB/s */
+    rate = (fw_size * iter * 100) / usec;
+    printf("%s,%s,%s,%s,%lu,%u,%lu,%lu.%02lu,%lu,%lu,%lu,%lu,%lu,%lu,%s\n",
+        label, scenario, BENCH_SIGN, BENCH_HASH,
+        (unsigned long)fw_size, iter, (unsigned long)usec,
+        (unsigned long)(rate / 100), (unsigned long)(rate % 100),
+        (unsigned long)int_flash_model.bytes_programmed,
+        (unsigned long)int_flash_model.sectors_erased,
+        (unsigned long)ext_flash_model.bytes_read,
+        (unsigned long)ext_flash_model.bytes_programmed,
+        (unsigned long)ext_flash_model.sectors_erased,
+        (unsigned long)(sim_flash_model_us(&int_flash_model) +
+            sim_flash_model_us(&ext_flash_model)),
+        ok ? "ok" : "fail");
+}
+
+/* Scenarios */
+static int bench_verify(const char *label, uint32_t iterations)
+{
+    struct wolfBoot_image img;
+    uint64_t start, elapsed;
+    uint32_t i;
+    int ok = 1;
+
+    bench_reset_counters();
+    start = sim_time_us();
+    for (i = 0; i < iterations; i++) {
+        if ((wolfBoot_open_image(&img, PART_BOOT) < 0) ||
+                (wolfBoot_verify_integrity(&img) < 0) ||
+                (wolfBoot_verify_authenticity(&img) < 0)) {
+            ok = 0;
+            break;
+        }
+    }
+    elapsed = sim_time_us() - start;
+    print_row(label, "verify", iterations, elapsed, ok);
+    return ok ? 0 : -1;
+}
+
+static int bench_update(const char *label, const char *scenario,
+    int powerfail)
+{
+    uint32_t version = wolfBoot_current_firmware_version();
+    uint64_t start, elapsed;
+    pid_t pid;
+    int status;
+
+    wolfBoot_update_trigger();
+
+    if (powerfail >= 0) {
+        /* First boot, interrupted at the given erase operation */
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0)
+            return -1;
+        if (pid == 0) {
+            sim_powerfail_erase_op = powerfail;
+            wolfBoot_start();
+            wolfBoot_printf("Power failure not reached\n");
+            _exit(0);
+        }
+        if ((waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) ||
+                (WEXITSTATUS(status) != 0))
+            return -1;
+    }
+
+    bench_reset_counters();
+    bench_booted = 0;
+    start = sim_time_us();
+    wolfBoot_start();
+    elapsed = sim_time_us() - start;
+    print_row(label, scenario, 1, elapsed,
+        bench_booted && (wolfBoot_current_firmware_version() > version));
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-l label] [-n iterations] [-p erase_op] "
+        "[-k enc_key] [-f int_profile] [-e ext_profile]\n"
+        "          header | verify <boot.bin> | "
+        "update <boot.bin> <update.bin> | resume <boot.bin> <update.bin>\n",
+        name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *label = NULL;
+    const char *scenario;
+    const char *enc_key = NULL;
+    uint32_t iterations = 10;
+    int powerfail = BENCH_POWERFAIL_DEFAULT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:n:p:k:f:e:")) != -1) {
+        switch (opt) {
+            case 'l':
+                label = optarg;
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                powerfail = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'k':
+                enc_key = optarg;
+                break;
+            case 'f':
+                int_flash_model.profile = sim_flash_profile_find(optarg);
+                break;
+            case 'e':
+                ext_flash_model.profile = sim_flash_profile_find(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    scenario = argv[optind++];
+    if (label == NULL)
+        label = scenario;
+
+    if (strcmp(scenario, "header") == 0) {
+        printf("%s\n", BENCH_CSV_HEADER);
+        return 0;
+    }
+
+    sim_ram_base = bench_map();
+    sim_ext_flash_base = bench_map();
+    if ((sim_ram_base == NULL) || (sim_ext_flash_base == NULL)) {
+        fprintf(stderr, "failed to map flash\n");
+        return 1;
+    }
+    sim_flash_model_init(&int_flash_model, BENCH_FLASH_SIZE);
+    sim_flash_model_init(&ext_flash_model, BENCH_FLASH_SIZE);
+
+    if ((optind >= argc) || (load_partition(PART_BOOT, argv[optind]) < 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    hal_init();
+#ifdef EXT_ENCRYPTED
+    if ((enc_key == NULL) || (load_encrypt_key(enc_key) < 0)) {
+        fprintf(stderr, "an encryption key (-k) is required\n");
+        return 1;
+    }
+#else
+    (void)enc_key;
+#endif
+
+    if ((strcmp(scenario, "verify") == 0) && (iterations > 0))
+        return (bench_verify(label, iterations) == 0) ? 0 : 1;
+
+    if ((optind + 1 >= argc) ||
+            (load_partition(PART_UPDATE, argv[optind + 1]) < 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(scenario, "update") == 0)
+        return (bench_update(label, scenario, -1) == 0) ? 0 : 1;
+    if (strcmp(scenario, "resume") == 0)
+        return (bench_update(label, scenario, powerfail) == 0) ? 0 : 1;
+
+    usage(argv[0]);
+    return 1;
+}
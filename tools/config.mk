@@ -25,12 +25,16 @@ ifeq ($(ARCH),)
   NO_ASM?=0
   NO_ARM_ASM?=0
   EXT_FLASH?=0
+  EXT_FLASH_ASYNC?=0
   SPI_FLASH?=0
   QSPI_FLASH?=0
+  SPI_FLASH_BLOCK_ERASE?=0
   NO_XIP?=0
   UART_FLASH?=0
   ALLOW_DOWNGRADE?=0
   NVM_FLASH_WRITEONCE?=0
+  NVM_FLASH_JOURNAL?=0
+  PARTITION_STATE_CACHE?=0
   DISABLE_BACKUP?=0
   WOLFBOOT_VERSION?=0
   V?=0
@@ -73,6 +77,17 @@ ifeq ($(ARCH),)
   WOLFBOOT_SMALL_STACK?=0
   DELTA_UPDATES?=0
   DELTA_BLOCK_SIZE?=256
+  DELTA_COMPRESSION?=0
+  DELTA_INPLACE?=0
+  DELTA_CACHE_STATS?=0
+  COMPRESSED_UPDATES?=0
+  MERKLE?=0
+  PARALLEL_VERIFY?=0
+  ENCRYPT_AEAD?=0
+  VERIFY_CACHE?=0
+  HASH_CONTIGUOUS?=0
+  PROFILE?=0
+  SHA_BLOCK_SIZE?=256
   WOLFBOOT_HUGE_STACK?=0
   ARMORED?=0
   ELF?=0
@@ -82,13 +97,15 @@ ifeq ($(ARCH),)
   FLASH_OTP_KEYSTORE?=0
   BIG_ENDIAN?=0
   FLASH_MULTI_SECTOR_ERASE=0
+  FLASH_SKIP_IDENTICAL?=0
   WOLFHSM_CLIENT=0
   WOLFHSM_CLIENT_LOCAL_KEYS=0
 endif
 
 CONFIG_VARS:= ARCH TARGET SIGN HASH MCUXSDK MCUXPRESSO MCUXPRESSO_CPU MCUXPRESSO_DRIVERS \
 	MCUXPRESSO_CMSIS FREEDOM_E_SDK STM32CUBE CYPRESS_PDL CYPRESS_CORE_LIB CYPRESS_TARGET_LIB DEBUG VTOR \
-	CORTEX_M0 CORTEX_M7 CORTEX_M33 NO_ASM EXT_FLASH SPI_FLASH NO_XIP UART_FLASH ALLOW_DOWNGRADE NVM_FLASH_WRITEONCE \
+	CORTEX_M0 CORTEX_M7 CORTEX_M33 NO_ASM EXT_FLASH EXT_FLASH_ASYNC SPI_FLASH SPI_FLASH_BLOCK_ERASE NO_XIP UART_FLASH ALLOW_DOWNGRADE NVM_FLASH_WRITEONCE \
+	NVM_FLASH_JOURNAL PARTITION_STATE_CACHE \
 	DISABLE_BACKUP WOLFBOOT_VERSION V NO_MPU ENCRYPT FLAGS_HOME FLAGS_INVERT \
 	SPMATH SPMATHALL RAM_CODE DUALBANK_SWAP IMAGE_HEADER_SIZE PKA TZEN PSOC6_CRYPTO \
     WOLFTPM WOLFBOOT_TPM_VERIFY MEASURED_BOOT WOLFBOOT_TPM_SEAL WOLFBOOT_TPM_KEYSTORE \
@@ -97,7 +114,10 @@ CONFIG_VARS:= ARCH TARGET SIGN HASH MCUXSDK MCUXPRESSO MCUXPRESSO_CPU MCUXPRESSO
 	WOLFBOOT_PARTITION_BOOT_ADDRESS WOLFBOOT_PARTITION_UPDATE_ADDRESS \
 	WOLFBOOT_PARTITION_SWAP_ADDRESS WOLFBOOT_LOAD_ADDRESS \
 	WOLFBOOT_LOAD_DTS_ADDRESS WOLFBOOT_DTS_BOOT_ADDRESS WOLFBOOT_DTS_UPDATE_ADDRESS \
-	WOLFBOOT_SMALL_STACK DELTA_UPDATES DELTA_BLOCK_SIZE \
+	WOLFBOOT_SMALL_STACK DELTA_UPDATES DELTA_BLOCK_SIZE DELTA_COMPRESSION \
+	DELTA_INPLACE DELTA_PATCH_CACHE_SIZE DELTA_SRC_CACHE_SIZE DELTA_CACHE_STATS \
+	COMPRESSED_UPDATES MERKLE PARALLEL_VERIFY ENCRYPT_AEAD VERIFY_CACHE \
+	HASH_CONTIGUOUS SHA_BLOCK_SIZE PROFILE FLASH_SKIP_IDENTICAL \
 	WOLFBOOT_HUGE_STACK FORCE_32BIT\
 	ENCRYPT_WITH_CHACHA ENCRYPT_WITH_AES128 ENCRYPT_WITH_AES256 ARMORED \
 	LMS_LEVELS LMS_HEIGHT LMS_WINTERNITZ \
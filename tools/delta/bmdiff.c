@@ -32,11 +32,277 @@
 #include <sys/mman.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include "delta.h"
 
 #define MAX_SRC_SIZE (1 << 24)
+#define MAX_SRC_SIZE_V3 (1 << 30)
 #define PATCH_BLOCK_SIZE WOLFBOOT_SECTOR_SIZE
 
+/* Patch format selected via WOLFBOOT_DELTA_FORMAT, defaults to v1 */
+static uint32_t delta_format(void)
+{
+    const char *env = getenv("WOLFBOOT_DELTA_FORMAT");
+    if (env == NULL)
+        return WB_PATCH_FORMAT_V1;
+    return (uint32_t)strtoul(env, NULL, 10);
+}
+
+/* Patch compression selected via WOLFBOOT_DELTA_CODEC=lz */
+static uint32_t delta_codec(void)
+{
+    const char *env = getenv("WOLFBOOT_DELTA_CODEC");
+    if ((env != NULL) && (strcmp(env, "lz") == 0))
+        return WB_DELTA_CODEC_LZ;
+    return WB_DELTA_CODEC_NONE;
+}
+
+static uint32_t max_src_size(void)
+{
+    if (delta_format() >= WB_PATCH_FORMAT_V3)
+        return MAX_SRC_SIZE_V3;
+    return MAX_SRC_SIZE;
+}
+
+/* Parallel diff: the new image is split in jobs of DIFF_JOB_SECTORS
+ * sectors, picked in order by the worker threads. The patch of each job
+ * does not depend on the others (see wb_diff_sectors()), so the result is
+ * the same with any number of threads. */
+#define DIFF_JOB_SECTORS 16
+
+struct diff_job {
+    const WB_DIFF_CTX *ctx;
+    uint32_t job_size;
+    uint32_t n_jobs;
+    uint32_t next;
+    int error;
+    pthread_mutex_t lock;
+    uint8_t **patch;
+    uint32_t *patch_sz;
+};
+
+static void *diff_worker(void *arg)
+{
+    struct diff_job *job = (struct diff_job *)arg;
+    WB_DIFF_CTX wctx;
+    uint32_t n, start, end;
+    int r;
+
+    if (wb_diff_init_worker(&wctx, job->ctx) < 0) {
+        pthread_mutex_lock(&job->lock);
+        job->error = 1;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        n = job->next++;
+        if (job->error)
+            n = job->n_jobs;
+        pthread_mutex_unlock(&job->lock);
+        if (n >= job->n_jobs)
+            break;
+        start = n * job->job_size;
+        end = start + job->job_size;
+        if (end > job->ctx->size_b)
+            end = job->ctx->size_b;
+        job->patch[n] = malloc(WB_DIFF_BOUND(end - start));
+        r = -1;
+        if (job->patch[n] != NULL)
+            r = wb_diff_sectors(&wctx, start, end, job->patch[n],
+                    WB_DIFF_BOUND(end - start));
+        if (r < 0) {
+            pthread_mutex_lock(&job->lock);
+            job->error = 1;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        job->patch_sz[n] = (uint32_t)r;
+    }
+    wb_diff_free(&wctx);
+    return NULL;
+}
+
+/* Diff 'ctx' with 'threads' workers, and store the patch in 'fname' */
+static int diff_parallel(const WB_DIFF_CTX *ctx, int threads,
+        const char *fname)
+{
+    struct diff_job job;
+    pthread_t *tid;
+    uint8_t *patch = NULL;
+    uint32_t len = 0, n;
+    int i, fd, r, ret = -1;
+
+    memset(&job, 0, sizeof(job));
+    job.ctx = ctx;
+    job.job_size = DIFF_JOB_SECTORS * wb_diff_get_sector_size();
+    job.n_jobs = (ctx->size_b + job.job_size - 1) / job.job_size;
+    job.patch = calloc(job.n_jobs, sizeof(uint8_t *));
+    job.patch_sz = calloc(job.n_jobs, sizeof(uint32_t));
+    tid = calloc(threads, sizeof(pthread_t));
+    if (!job.patch || !job.patch_sz || !tid)
+        goto cleanup;
+    pthread_mutex_init(&job.lock, NULL);
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tid[i], NULL, diff_worker, &job) != 0) {
+            job.error = 1;
+            break;
+        }
+    }
+    threads = i;
+    for (i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    if (job.error)
+        goto cleanup;
+
+    for (n = 0; n < job.n_jobs; n++)
+        len += job.patch_sz[n];
+    patch = malloc(len);
+    if (patch == NULL)
+        goto cleanup;
+    len = 0;
+    for (n = 0; n < job.n_jobs; n++) {
+        memcpy(patch + len, job.patch[n], job.patch_sz[n]);
+        len += job.patch_sz[n];
+    }
+    if ((delta_codec() == WB_DELTA_CODEC_LZ) && (len > 0)) {
+        uint8_t *lz = malloc(WB_LZ_BOUND(len));
+        if (lz == NULL)
+            goto cleanup;
+        r = wb_lz_compress(patch, len, lz, WB_LZ_BOUND(len));
+        free(patch);
+        patch = lz;
+        if (r < 0)
+            goto cleanup;
+        len = r;
+    }
+    fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0660);
+    if (fd < 0) {
+        printf("Cannot open file %s for writing\n", fname);
+        goto cleanup;
+    }
+    if (write(fd, patch, len) == (ssize_t)len)
+        ret = 0;
+    close(fd);
+    printf("%s: %u bytes\n", fname, len);
+
+cleanup:
+    if (job.patch) {
+        for (n = 0; n < job.n_jobs; n++)
+            free(job.patch[n]);
+    }
+    free(job.patch);
+    free(job.patch_sz);
+    free(tid);
+    free(patch);
+    return ret;
+}
+
+static void *map_file(const char *fname, int *len)
+{
+    struct stat st;
+    void *ptr;
+    int fd;
+
+    if (stat(fname, &st) < 0) {
+        printf("Cannot stat %s\n", fname);
+        return NULL;
+    }
+    if ((st.st_size <= 0) || ((uint32_t)st.st_size > max_src_size())) {
+        printf("%s: invalid file size\n", fname);
+        return NULL;
+    }
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        printf("Cannot open file %s\n", fname);
+        return NULL;
+    }
+    *len = (int)st.st_size;
+    ptr = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == (void *)(-1)) {
+        perror("mmap");
+        return NULL;
+    }
+    return ptr;
+}
+
+/* bmdiff [-j threads] file1 file2 patch
+ * bmdiff [-j threads] -t file2 file1 patch1 [file1b patch1b ...]
+ *
+ * Parallel and batch modes. In batch mode, patches from each base image to
+ * the same new image are created in one run, sharing the index of the new
+ * image. */
+static int diff_multi(int argc, char *argv[])
+{
+    WB_DIFF_CTX target_ctx, ctx;
+    const char *target = NULL;
+    void *base, *buffer;
+    int len1, len2;
+    int threads = 1;
+    int i = 1, first;
+
+    while ((i < argc) && (argv[i][0] == '-')) {
+        if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc)) {
+            threads = atoi(argv[++i]);
+            if (threads <= 0)
+                threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (threads <= 0)
+                threads = 1;
+        } else if ((strcmp(argv[i], "-t") == 0) && (i + 1 < argc)) {
+            target = argv[++i];
+        } else {
+            break;
+        }
+        i++;
+    }
+    if (target == NULL) {
+        /* file1 file2 patch: a single base image, file2 is the target */
+        if (argc - i != 3) {
+            printf("Usage: %s [-j threads] file1 file2 patch\n", argv[0]);
+            exit(2);
+        }
+        target = argv[i + 1];
+        argv[i + 1] = argv[i + 2];
+        argc--;
+    }
+    if ((argc - i < 2) || (((argc - i) % 2) != 0)) {
+        printf("Usage: %s [-j threads] -t file2 file1 patch1 "
+                "[file1b patch1b ...]\n", argv[0]);
+        exit(2);
+    }
+    buffer = map_file(target, &len2);
+    if (buffer == NULL)
+        exit(3);
+    for (first = i; i < argc; i += 2) {
+        base = map_file(argv[i], &len1);
+        if (base == NULL)
+            exit(3);
+        if (i == first) {
+            if ((wb_diff_init(&target_ctx, base, len1, buffer, len2) < 0) ||
+                    (wb_diff_index_b(&target_ctx) < 0))
+                exit(6);
+            if (wb_diff_set_format(&target_ctx, delta_format()) < 0) {
+                printf("Unsupported delta format\n");
+                exit(6);
+            }
+            if (diff_parallel(&target_ctx, threads, argv[i + 1]) < 0)
+                exit(4);
+        } else {
+            if (wb_diff_init_base(&ctx, base, len1, &target_ctx) < 0)
+                exit(6);
+            if (diff_parallel(&ctx, threads, argv[i + 1]) < 0)
+                exit(4);
+            wb_diff_free(&ctx);
+        }
+        munmap(base, len1);
+    }
+    wb_diff_free(&target_ctx);
+    munmap(buffer, len2);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int mode;
@@ -54,6 +320,8 @@ int main(int argc, char *argv[])
     } else {
         return 244;
     }
+    if ((mode == MODE_DIFF) && (argc > 1) && (argv[1][0] == '-'))
+        return diff_multi(argc, argv);
     if ((argc != 4) && (mode == MODE_DIFF)) {
             printf("Usage: %s file1 file2 patch\n", argv[0]);
             exit(2);
@@ -71,7 +339,7 @@ int main(int argc, char *argv[])
     }
     len1 = st.st_size;
 
-    if (len1 > MAX_SRC_SIZE) {
+    if ((uint32_t)len1 > max_src_size()) {
         printf("%s: file too large\n", argv[1]);
         exit(3);
     }
@@ -121,6 +389,10 @@ int main(int argc, char *argv[])
         if (wb_diff_init(&dx, base, len1, buffer, len2) < 0) {
             exit(6);
         }
+        if (wb_diff_set_format(&dx, delta_format()) < 0) {
+            printf("Unsupported delta format\n");
+            exit(6);
+        }
         do {
             r = wb_diff(&dx, dest, blksz);
             if (r < 0)
@@ -128,6 +400,24 @@ int main(int argc, char *argv[])
             write(fd3, dest, r);
             len3 += r;
         } while (r > 0);
+        wb_diff_free(&dx);
+        if ((delta_codec() == WB_DELTA_CODEC_LZ) && (len3 > 0)) {
+            uint8_t *patch, *lz;
+            patch = mmap(NULL, len3, PROT_READ, MAP_SHARED, fd3, 0);
+            lz = malloc(WB_LZ_BOUND(len3));
+            if ((patch == (void *)(-1)) || (lz == NULL)) {
+                perror("compress");
+                exit(4);
+            }
+            r = wb_lz_compress(patch, len3, lz, WB_LZ_BOUND(len3));
+            if (r < 0)
+                exit(4);
+            munmap(patch, len3);
+            lseek(fd3, 0, SEEK_SET);
+            write(fd3, lz, r);
+            free(lz);
+            len3 = r;
+        }
         ftruncate(fd3, len3);
     }
     if (mode == MODE_PATCH) {
@@ -140,6 +430,14 @@ int main(int argc, char *argv[])
         if (wb_patch_init(&px, base, len1, buffer, len2) != 0) {
             exit(6);
         }
+        if (wb_patch_set_format(&px, delta_format()) != 0) {
+            printf("Unsupported delta format\n");
+            exit(6);
+        }
+        if (wb_patch_set_codec(&px, delta_codec()) != 0) {
+            printf("Unsupported delta codec\n");
+            exit(6);
+        }
         do {
             r = wb_patch(&px, dest, blksz);
             if (r < 0)
@@ -42,6 +42,7 @@
 #include <fcntl.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <time.h>
 #include <delta.h>
 
 #include "wolfboot/version.h"
@@ -69,10 +70,22 @@ static inline int fp_truncate(FILE *f, size_t len)
 #else
 #define HAVE_MMAP 1
 #include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <signal.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 #endif
 
 #define MAX_SRC_SIZE (1 << 24)
+/* Offsets in delta patches are not limited to 24 bits from format v3 */
+#define MAX_SRC_SIZE_V3 (1 << 30)
 
 #ifndef MAX_CUSTOM_TLVS
 #define MAX_CUSTOM_TLVS (16)
@@ -85,6 +98,9 @@ static inline int fp_truncate(FILE *f, size_t len)
 #ifdef HAVE_CHACHA
 #include <wolfssl/wolfcrypt/chacha.h>
 #endif
+#if defined(HAVE_CHACHA) && defined(HAVE_POLY1305)
+#include <wolfssl/wolfcrypt/chacha20_poly1305.h>
+#endif
 
 
 #ifndef NO_RSA
@@ -174,12 +190,18 @@ static inline int fp_truncate(FILE *f, size_t len)
 #define HDR_IMG_DELTA_BASE_HASH 0x07
 #define HDR_IMG_DELTA_INVERSE 0x15
 #define HDR_IMG_DELTA_INVERSE_SIZE 0x16
+#define HDR_IMG_MERKLE_SECTOR_SIZE 0x17
+#define HDR_IMG_MERKLE_LEAVES 0x18
+#define HDR_IMG_DELTA_FORMAT 0x19
+#define HDR_IMG_DELTA_CODEC 0x1A
+#define HDR_IMG_AEAD_TAGS 0x1B
 
 #define HDR_IMG_TYPE_AUTH_MASK    0xFF00
 #define HDR_IMG_TYPE_AUTH_NONE    0xFF00
 #define HDR_IMG_TYPE_WOLFBOOT     0x0000
 #define HDR_IMG_TYPE_APP          0x0001
 #define HDR_IMG_TYPE_DIFF         0x00D0
+#define HDR_IMG_TYPE_COMPRESSED   0x00C0
 #define HDR_IMG_TYPE_HYBRID       0x0080
 
 #define HASH_SHA256    HDR_SHA256
@@ -209,6 +231,8 @@ static inline int fp_truncate(FILE *f, size_t len)
 #define ENC_BLOCK_SIZE 16
 #define ENC_MAX_KEY_SZ 32
 #define ENC_MAX_IV_SZ  16
+#define ENC_AEAD_TAG_SZ   16
+#define ENC_AEAD_NONCE_SZ 12
 
 static void header_append_u32(uint8_t* header, uint32_t* idx, uint32_t tmp32)
 {
@@ -234,6 +258,7 @@ static void header_append_tag(uint8_t* header, uint32_t* idx, uint16_t tag,
 
 /* Globals */
 static const char wolfboot_delta_file[] = "/tmp/wolfboot-delta.bin";
+static const char wolfboot_compressed_file[] = "/tmp/wolfboot-compressed.bin";
 
 static struct {
     ed25519_key ed;
@@ -268,8 +293,19 @@ struct cmd_options {
     const char *delta_base_file;
     const char *cert_chain_file;
     int no_base_sha;
+    int merkle;
+    int aead;
+    uint32_t delta_format;
+    uint32_t delta_codec;
+    int delta_inplace;
+    int compress;
+    const char *batch_file;
+    int batch_jobs;
+    const char *sign_daemon;
+    const char *sign_socket;
     char output_image_file[PATH_MAX];
     char output_diff_file[PATH_MAX];
+    char output_compressed_file[PATH_MAX];
     char output_encrypted_image_file[PATH_MAX];
     uint32_t pubkey_sz;
     uint32_t header_sz;
@@ -291,6 +327,7 @@ static struct cmd_options CMD = {
     .encrypt  = ENC_OFF,
     .hash_algo = HASH_SHA256,
     .partition_id = HDR_IMG_TYPE_APP,
+    .delta_format = WB_PATCH_FORMAT_V1,
     .hybrid = 0
 };
 
@@ -946,6 +983,357 @@ failure:
     return NULL;
 }
 
+/* Time spent hashing and signing in make_header_ex(), reported in batch
+ * mode */
+static struct {
+    double hash_ms;
+    double sign_ms;
+} sign_time;
+
+static double time_ms(void)
+{
+#ifdef _WIN32
+    return (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
+}
+
+#ifndef _WIN32
+/* Batch mode: the images are signed by child processes. Stateful
+ * signatures (LMS, XMSS) are requested to the parent process through a
+ * pair of pipes, so that the private key state is only updated by one
+ * process, one signature at a time. */
+#define BATCH_MSG_SIGN 1
+#define BATCH_MSG_DONE 2
+
+struct batch_msg {
+    uint32_t type;
+    int32_t ret;
+    /* BATCH_MSG_SIGN */
+    int32_t sign;
+    int32_t hash_algo;
+    int32_t secondary;
+    uint32_t signature_sz;  /* size of the signature buffer */
+    uint32_t digest_sz;
+    uint8_t digest[64];
+    /* BATCH_MSG_DONE */
+    double hash_ms;
+    double sign_ms;
+};
+
+static int batch_fd_req = -1;
+static int batch_fd_rsp = -1;
+
+static int batch_write(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int batch_read(int fd, void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Child side: send the digest to the parent, and wait for the signature */
+static int batch_remote_sign(int sign, int hash_algo, uint8_t *signature,
+        uint32_t *signature_sz, uint8_t *digest, uint32_t digest_sz,
+        int secondary)
+{
+    struct batch_msg msg;
+    int32_t ret;
+    uint32_t sz;
+
+    if (digest_sz > sizeof(msg.digest))
+        return -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = BATCH_MSG_SIGN;
+    msg.sign = sign;
+    msg.hash_algo = hash_algo;
+    msg.secondary = secondary;
+    msg.signature_sz = *signature_sz;
+    msg.digest_sz = digest_sz;
+    memcpy(msg.digest, digest, digest_sz);
+    if ((batch_write(batch_fd_req, &msg, sizeof(msg)) < 0) ||
+            (batch_read(batch_fd_rsp, &ret, sizeof(ret)) < 0) ||
+            (batch_read(batch_fd_rsp, &sz, sizeof(sz)) < 0) ||
+            (sz > *signature_sz) ||
+            (batch_read(batch_fd_rsp, signature, sz) < 0)) {
+        fprintf(stderr, "Lost connection to the signing process\n");
+        return -1;
+    }
+    *signature_sz = sz;
+    return ret;
+}
+
+/* Signing daemon (--sign-daemon): each new state of the stateful key is
+ * appended to a write-ahead log (KEY.wal) and synced before the signature
+ * is released. The key file is only rewritten every SIGND_CHECKPOINT
+ * signatures, and when the daemon stops. A torn record at the end of the
+ * log belongs to a signature that was never released, and is discarded. */
+#define SIGND_WAL_MAGIC   0x4C41574B /* "KWAL" */
+#define SIGND_CHECKPOINT  64
+#define SIGND_MAX_STATE   (1 << 20)
+#define SIGND_MAX_CLIENTS 32
+
+struct signd_wal_rec {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t len;
+    uint8_t digest[SHA256_DIGEST_SIZE]; /* of seq, len and state */
+};
+
+static int signd_wal_fd = -1;
+static uint32_t signd_seq;
+static uint32_t signd_pending; /* log records since the last checkpoint */
+static uint8_t *signd_state;
+static uint32_t signd_state_sz;
+
+static int signd_wal_name(const char *key_file, char *name, size_t sz)
+{
+    if (snprintf(name, sz, "%s.wal", key_file) >= (int)sz)
+        return -1;
+    return 0;
+}
+
+static int signd_wal_digest(const struct signd_wal_rec *rec,
+        const uint8_t *state, uint8_t *out)
+{
+    wc_Sha256 sha;
+    int ret = wc_InitSha256_ex(&sha, NULL, INVALID_DEVID);
+    if (ret == 0)
+        ret = wc_Sha256Update(&sha, (const uint8_t *)rec,
+                offsetof(struct signd_wal_rec, digest));
+    if (ret == 0)
+        ret = wc_Sha256Update(&sha, state, rec->len);
+    if (ret == 0)
+        ret = wc_Sha256Final(&sha, out);
+    wc_Sha256Free(&sha);
+    return ret;
+}
+
+/* Write the last state to the key file, then empty the log */
+static int signd_checkpoint(void)
+{
+    int fd;
+    int ret = -1;
+
+    if (signd_pending == 0)
+        return 0;
+    fd = open(CMD.key_file, O_WRONLY);
+    if (fd >= 0) {
+        if ((pwrite(fd, signd_state, signd_state_sz, 0) ==
+                    (ssize_t)signd_state_sz) && (fsync(fd) == 0))
+            ret = 0;
+        close(fd);
+    }
+    if ((ret == 0) && ((ftruncate(signd_wal_fd, 0) != 0) ||
+                (fsync(signd_wal_fd) != 0)))
+        ret = -1;
+    if (ret == 0)
+        signd_pending = 0;
+    else
+        fprintf(stderr, "sign-daemon: checkpoint of %s failed\n",
+                CMD.key_file);
+    return ret;
+}
+
+static int signd_wal_append(const byte *priv, word32 privSz)
+{
+    struct signd_wal_rec rec;
+
+    if ((privSz == 0) || (privSz > SIGND_MAX_STATE))
+        return -1;
+    if (privSz != signd_state_sz) {
+        free(signd_state);
+        signd_state = malloc(privSz);
+        if (signd_state == NULL) {
+            signd_state_sz = 0;
+            return -1;
+        }
+        signd_state_sz = privSz;
+    }
+    /* Even if the record is not written, the in-memory key has moved
+     * past this state: never checkpoint an older one */
+    memcpy(signd_state, priv, privSz);
+    rec.magic = SIGND_WAL_MAGIC;
+    rec.seq = ++signd_seq;
+    rec.len = privSz;
+    if ((signd_wal_digest(&rec, priv, rec.digest) != 0) ||
+            (batch_write(signd_wal_fd, &rec, sizeof(rec)) < 0) ||
+            (batch_write(signd_wal_fd, priv, privSz) < 0) ||
+            (fsync(signd_wal_fd) != 0)) {
+        fprintf(stderr, "sign-daemon: cannot write the key state log\n");
+        return -1;
+    }
+    signd_pending++;
+    if (signd_pending >= SIGND_CHECKPOINT)
+        (void)signd_checkpoint(); /* the log still holds the state */
+    return 0;
+}
+
+static int signd_lms_write_key(const byte *priv, word32 privSz, void *context)
+{
+    (void)context;
+    if (signd_wal_append(priv, privSz) != 0)
+        return WC_LMS_RC_WRITE_FAIL;
+    return WC_LMS_RC_SAVED_TO_NV_MEMORY;
+}
+
+static enum wc_XmssRc signd_xmss_write_key(const byte *priv, word32 privSz,
+        void *context)
+{
+    (void)context;
+    if (signd_wal_append(priv, privSz) != 0)
+        return WC_XMSS_RC_WRITE_FAIL;
+    return WC_XMSS_RC_SAVED_TO_NV_MEMORY;
+}
+
+/* Replay the log left by a daemon that did not stop cleanly: the last
+ * complete record is the most recent key state */
+static int signd_recover(void)
+{
+    struct signd_wal_rec rec;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t *state;
+    uint32_t n = 0;
+
+    while (batch_read(signd_wal_fd, &rec, sizeof(rec)) == 0) {
+        if ((rec.magic != SIGND_WAL_MAGIC) || (rec.len == 0) ||
+                (rec.len > SIGND_MAX_STATE))
+            break;
+        state = malloc(rec.len);
+        if ((state == NULL) ||
+                (batch_read(signd_wal_fd, state, rec.len) < 0) ||
+                (signd_wal_digest(&rec, state, digest) != 0) ||
+                (memcmp(digest, rec.digest, sizeof(digest)) != 0)) {
+            free(state);
+            break;
+        }
+        free(signd_state);
+        signd_state = state;
+        signd_state_sz = rec.len;
+        signd_seq = rec.seq;
+        n++;
+    }
+    if (n == 0)
+        return ftruncate(signd_wal_fd, 0);
+    printf("sign-daemon: recovered key state from %u log records\n", n);
+    signd_pending = n;
+    return signd_checkpoint();
+}
+
+/* Without the daemon, refuse a key that is served by a daemon, or that has
+ * a state left in the log */
+static int signd_check_idle(const char *key_file)
+{
+    char wal[PATH_MAX];
+    struct stat st;
+    int fd, ret = 0;
+
+    if (signd_wal_name(key_file, wal, sizeof(wal)) != 0)
+        return 0;
+    fd = open(wal, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "%s is in use by a signing daemon\n", key_file);
+        ret = -1;
+    }
+    else if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        fprintf(stderr, "%s has a pending state in %s, start the signing "
+                "daemon to recover it\n", key_file, wal);
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+#endif
+
+/* Stateful keys are loaded once, and kept in memory with the tree cached by
+ * wolfCrypt, so that the next signatures in the same process (batch mode,
+ * signing daemon) don't rebuild it */
+static int stateful_key_loaded;
+
+static int stateful_key_load(int sign, const char *key_file)
+{
+    int ret = 0;
+
+    if (stateful_key_loaded)
+        return 0;
+#ifndef _WIN32
+    if ((signd_wal_fd < 0) && (signd_check_idle(key_file) != 0))
+        return -1;
+#endif
+    if (sign == SIGN_LMS) {
+        /* Set the callbacks, so LMS can update the private key while signing */
+#ifndef _WIN32
+        if (signd_wal_fd >= 0)
+            ret = wc_LmsKey_SetWriteCb(&key.lms, signd_lms_write_key);
+        else
+#endif
+            ret = wc_LmsKey_SetWriteCb(&key.lms, lms_write_key);
+        if (ret == 0) {
+            ret = wc_LmsKey_SetReadCb(&key.lms, lms_read_key);
+        }
+        if (ret == 0) {
+            ret = wc_LmsKey_SetContext(&key.lms, (void*)key_file);
+        }
+        if (ret == 0) {
+            ret = wc_LmsKey_Reload(&key.lms);
+        }
+    }
+    else if (sign == SIGN_XMSS) {
+        ret = wc_XmssKey_Init(&key.xmss, NULL, INVALID_DEVID);
+        /* Set the callbacks, so XMSS can update the private key while signing */
+        if (ret == 0) {
+#ifndef _WIN32
+            if (signd_wal_fd >= 0)
+                ret = wc_XmssKey_SetWriteCb(&key.xmss, signd_xmss_write_key);
+            else
+#endif
+                ret = wc_XmssKey_SetWriteCb(&key.xmss, xmss_write_key);
+        }
+        if (ret == 0) {
+            ret = wc_XmssKey_SetReadCb(&key.xmss, xmss_read_key);
+        }
+        if (ret == 0) {
+            ret = wc_XmssKey_SetContext(&key.xmss, (void*)key_file);
+        }
+        if (ret == 0) {
+            ret = wc_XmssKey_SetParamStr(&key.xmss, WOLFBOOT_XMSS_PARAMS);
+        }
+        if (ret == 0) {
+            ret = wc_XmssKey_Reload(&key.xmss);
+        }
+    }
+    if (ret == 0)
+        stateful_key_loaded = 1;
+    return ret;
+}
+
 /* Sign the digest */
 static int sign_digest(int sign, int hash_algo,
     uint8_t* signature, uint32_t* signature_sz,
@@ -956,6 +1344,14 @@ static int sign_digest(int sign, int hash_algo,
     printf("Sign: %02x\n", sign >> 8);
     (void)secondary;
 
+#ifndef _WIN32
+    /* Batch mode or signing daemon client: stateful keys are only used by
+     * the process that owns them */
+    if ((batch_fd_req >= 0) && ((sign == SIGN_LMS) || (sign == SIGN_XMSS)))
+        return batch_remote_sign(sign, hash_algo, signature, signature_sz,
+                digest, digest_sz, secondary);
+#endif
+
     if ((ret = wc_InitRng(&rng)) != 0) {
         return ret;
     }
@@ -1032,17 +1428,7 @@ static int sign_digest(int sign, int hash_algo,
         if (secondary) {
             key_file = CMD.secondary_key_file;
         }
-        /* Set the callbacks, so LMS can update the private key while signing */
-        ret = wc_LmsKey_SetWriteCb(&key.lms, lms_write_key);
-        if (ret == 0) {
-            ret = wc_LmsKey_SetReadCb(&key.lms, lms_read_key);
-        }
-        if (ret == 0) {
-            ret = wc_LmsKey_SetContext(&key.lms, (void*)key_file);
-        }
-        if (ret == 0) {
-            ret = wc_LmsKey_Reload(&key.lms);
-        }
+        ret = stateful_key_load(sign, key_file);
         if (ret == 0) {
             ret = wc_LmsKey_Sign(&key.lms, signature, signature_sz, digest,
                                  digest_sz);
@@ -1057,23 +1443,7 @@ static int sign_digest(int sign, int hash_algo,
         if (secondary) {
             key_file = CMD.secondary_key_file;
         }
-        ret = wc_XmssKey_Init(&key.xmss, NULL, INVALID_DEVID);
-        /* Set the callbacks, so XMSS can update the private key while signing */
-        if (ret == 0) {
-            ret = wc_XmssKey_SetWriteCb(&key.xmss, xmss_write_key);
-        }
-        if (ret == 0) {
-            ret = wc_XmssKey_SetReadCb(&key.xmss, xmss_read_key);
-        }
-        if (ret == 0) {
-            ret = wc_XmssKey_SetContext(&key.xmss, (void*)key_file);
-        }
-        if (ret == 0) {
-            ret = wc_XmssKey_SetParamStr(&key.xmss, WOLFBOOT_XMSS_PARAMS);
-        }
-        if (ret == 0) {
-            ret = wc_XmssKey_Reload(&key.xmss);
-        }
+        ret = stateful_key_load(sign, key_file);
         if (ret == 0) {
             ret = wc_XmssKey_Sign(&key.xmss, signature, signature_sz, digest,
                                  digest_sz);
@@ -1104,87 +1474,564 @@ static int sign_digest(int sign, int hash_algo,
 #define ALIGN_8(x) while ((x % 8) != 4) { x++; }
 #define ALIGN_4(x) while ((x % 4) != 0) { x++; }
 
-static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
-        const char *image_file, const char *outfile,
-        uint32_t delta_base_version, uint32_t patch_len, uint32_t patch_inv_off,
-        uint32_t patch_inv_len, const uint8_t *secondary_key, uint32_t secondary_key_sz,
-        uint8_t *base_hash, uint32_t base_hash_sz)
+static int merkle_hash(const uint8_t *data, uint32_t len, uint8_t *out)
 {
-    uint32_t header_idx;
-    uint8_t *header;
-    FILE *f, *f2, *fek, *fef;
-    uint32_t fw_version32;
-    struct stat attrib;
-    uint16_t image_type;
-    uint8_t* signature = NULL;
-    uint8_t* secondary_signature = NULL;
-    uint8_t* policy = NULL;
     int ret = -1;
-    uint8_t  buf[4096];
-    uint8_t  second_buf[4096];
-    uint32_t read_sz, pos;
-    uint8_t  digest[48]; /* max digest */
-    uint32_t digest_sz = 0;
-    uint32_t image_sz = 0;
-    int io_sz;
-    uint8_t*    cert_chain    = NULL;
-    uint32_t    cert_chain_sz = 0;
-
-    /* Check certificate chain file size before allocating header, and adjust
-     * header size if needed */
-    if (CMD.cert_chain_file != NULL) {
-        struct stat file_stat;
-
-        /* Get the file size */
-        if (stat(CMD.cert_chain_file, &file_stat) == 0) {
-            /* 2 bytes for tag + 2 bytes for length field */
-            const uint32_t tag_len_size = 4;
-            /* Maximum alignment padding that might be needed */
-            const uint32_t max_alignment = 8;
-            /* Required space = tag(2) + length(2) + data + potential alignment
-             * * padding */
-            const uint32_t required_space =
-                tag_len_size + file_stat.st_size + max_alignment;
-
-            /* If the current header size is too small, increase it */
-            if (CMD.header_sz < required_space) {
-                /* Round up to nearest power of 2 that can hold the chain */
-                const uint32_t min_header_size = 256;
-                uint32_t       new_size        = min_header_size;
-                while (new_size < required_space) {
-                    new_size *= 2;
-                }
-
-                printf("Increasing header size from %u to %u bytes to fit "
-                       "certificate chain\n",
-                       CMD.header_sz, new_size);
-                CMD.header_sz = new_size;
-            }
-        }
-        else {
-            printf("Warning: Could not stat certificate chain file %s: %s\n",
-                   CMD.cert_chain_file, strerror(errno));
-        }
+    if (CMD.hash_algo == HASH_SHA256) {
+    #ifndef NO_SHA256
+        wc_Sha256 sha;
+        ret = wc_InitSha256_ex(&sha, NULL, INVALID_DEVID);
+        if (ret == 0)
+            ret = wc_Sha256Update(&sha, data, len);
+        if (ret == 0)
+            ret = wc_Sha256Final(&sha, out);
+        wc_Sha256Free(&sha);
+    #endif
     }
-
-    header_idx = 0;
-    header = malloc(CMD.header_sz);
-    if (header == NULL) {
-        printf("Header malloc error!\n");
-        goto failure;
+    else if (CMD.hash_algo == HASH_SHA384) {
+    #ifndef NO_SHA384
+        wc_Sha384 sha;
+        ret = wc_InitSha384_ex(&sha, NULL, INVALID_DEVID);
+        if (ret == 0)
+            ret = wc_Sha384Update(&sha, data, len);
+        if (ret == 0)
+            ret = wc_Sha384Final(&sha, out);
+        wc_Sha384Free(&sha);
+    #endif
     }
-    memset(header, 0xFF, CMD.header_sz);
+    else if (CMD.hash_algo == HASH_SHA3) {
+    #ifdef WOLFSSL_SHA3
+        wc_Sha3 sha;
+        ret = wc_InitSha3_384(&sha, NULL, INVALID_DEVID);
+        if (ret == 0)
+            ret = wc_Sha3_384_Update(&sha, data, len);
+        if (ret == 0)
+            ret = wc_Sha3_384_Final(&sha, out);
+        wc_Sha3_384_Free(&sha);
+    #endif
+    }
+    return ret;
+}
 
-    /* Get size of image */
+/* Compute the Merkle manifest: one leaf hash for each partition sector
+ * occupied by the image. Sector 0 only holds the firmware bytes that follow
+ * the manifest header. */
+static int merkle_leaves(const char *image_file, uint32_t image_sz,
+        uint32_t sector_sz, uint8_t *leaves, uint32_t digest_sz)
+{
+    FILE *f;
+    uint8_t *buf;
+    uint32_t pos = 0, len;
+    uint32_t n = 0;
+    int ret = 0;
+
+    buf = malloc(sector_sz);
+    if (buf == NULL) {
+        printf("Merkle buffer malloc error!\n");
+        return -1;
+    }
     f = fopen(image_file, "rb");
     if (f == NULL) {
         printf("Open image file %s failed\n", image_file);
-        goto failure;
+        free(buf);
+        return -1;
+    }
+    do {
+        len = sector_sz;
+        if (n == 0)
+            len -= CMD.header_sz;
+        if (len > image_sz - pos)
+            len = image_sz - pos;
+        if (fread(buf, 1, len, f) != len) {
+            ret = -1;
+            break;
+        }
+        ret = merkle_hash(buf, len, leaves + (n * digest_sz));
+        pos += len;
+        n++;
+    } while ((ret == 0) && (pos < image_sz));
+    fclose(f);
+    free(buf);
+    return ret;
+}
+
+/* The input image is never loaded in memory as a whole: it is mapped when
+ * possible, or read in chunks of IMAGE_IO_CHUNK_SZ bytes. */
+#define IMAGE_IO_CHUNK_SZ (1024 * 1024)
+
+typedef int (*image_update_cb)(void *ctx, const uint8_t *data, uint32_t len);
+
+/* Pass the first 'len' bytes of 'image_file' to 'update' */
+static int image_stream(const char *image_file, uint32_t len,
+        image_update_cb update, void *ctx)
+{
+    FILE *f;
+    uint8_t *buf;
+    uint32_t pos = 0, chunk;
+    int ret = 0;
+#if HAVE_MMAP
+    int fd;
+    uint8_t *img;
+#endif
+
+    if (len == 0)
+        return 0;
+#if HAVE_MMAP
+    fd = open(image_file, O_RDONLY);
+    if (fd < 0) {
+        printf("Open image file %s failed\n", image_file);
+        return -1;
+    }
+    img = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img != MAP_FAILED) {
+        madvise(img, len, MADV_SEQUENTIAL);
+        ret = update(ctx, img, len);
+        munmap(img, len);
+        return ret;
+    }
+    /* Not mappable (e.g. a pipe): read it instead */
+#endif
+    buf = malloc(IMAGE_IO_CHUNK_SZ);
+    if (buf == NULL) {
+        printf("Image buffer malloc error!\n");
+        return -1;
+    }
+    f = fopen(image_file, "rb");
+    if (f == NULL) {
+        printf("Open image file %s failed\n", image_file);
+        free(buf);
+        return -1;
+    }
+    while ((ret == 0) && (pos < len)) {
+        chunk = len - pos;
+        if (chunk > IMAGE_IO_CHUNK_SZ)
+            chunk = IMAGE_IO_CHUNK_SZ;
+        if (fread(buf, 1, chunk, f) != chunk) {
+            printf("Error reading image file %s\n", image_file);
+            ret = -1;
+            break;
+        }
+        ret = update(ctx, buf, chunk);
+        pos += chunk;
+    }
+    fclose(f);
+    free(buf);
+    return ret;
+}
+
+/* Read the key and IV from the encryption key file */
+static void encrypt_key_load(uint8_t *key, int *keySz, uint8_t *iv, int *ivSz)
+{
+    FILE *fek;
+    int ret;
+
+    switch (CMD.encrypt) {
+        case ENC_CHACHA:
+            *ivSz = CHACHA_IV_BYTES;
+            *keySz = CHACHA_MAX_KEY_SZ;
+            break;
+        case ENC_AES128:
+            *ivSz = 16;
+            *keySz = 16;
+            break;
+        case ENC_AES256:
+            *ivSz = 16;
+            *keySz = 32;
+            break;
+        default:
+            printf("No valid encryption mode selected\n");
+            exit(1);
+    }
+    fek = fopen(CMD.encrypt_key_file, "rb");
+    if (fek == NULL) {
+        fprintf(stderr, "Open encryption key file %s: %s\n",
+                CMD.encrypt_key_file, strerror(errno));
+        exit(1);
+    }
+    ret = (int)fread(key, 1, *keySz, fek);
+    if (ret != *keySz) {
+        fprintf(stderr, "Error reading key from %s\n", CMD.encrypt_key_file);
+        exit(1);
+    }
+    ret = (int)fread(iv, 1, *ivSz, fek);
+    if (ret != *ivSz) {
+        fprintf(stderr, "Error reading IV from %s\n", CMD.encrypt_key_file);
+        exit(1);
+    }
+    fclose(fek);
+}
+
+/* Compute the AEAD tag table: one tag for each partition sector occupied by
+ * the image, with the same layout as the Merkle leaves. The firmware is
+ * encrypted as it will be stored in the partition, and the ciphertext of
+ * each sector is authenticated as associated data, using the nonce from the
+ * key file with its last 32 bits XOR-ed with (sector + 1). */
+static int aead_tags(const char *image_file, uint32_t image_sz,
+        uint32_t sector_sz, uint8_t *tags)
+{
+    uint8_t key[ENC_MAX_KEY_SZ], iv[ENC_MAX_IV_SZ];
+    uint8_t nonce[ENC_AEAD_NONCE_SZ];
+    int keySz, ivSz;
+    FILE *f;
+    uint8_t *buf, *enc;
+    uint32_t pos = 0, len, ctr, n = 0;
+    int i, ret = 0;
+    ChaCha cha;
+    Aes aes_e;
+
+    encrypt_key_load(key, &keySz, iv, &ivSz);
+    buf = malloc(sector_sz);
+    enc = malloc(sector_sz);
+    if ((buf == NULL) || (enc == NULL)) {
+        printf("AEAD buffer malloc error!\n");
+        free(buf);
+        free(enc);
+        return -1;
+    }
+    f = fopen(image_file, "rb");
+    if (f == NULL) {
+        printf("Open image file %s failed\n", image_file);
+        free(buf);
+        free(enc);
+        return -1;
+    }
+    /* Position the keystream at the end of the header */
+    if (CMD.encrypt == ENC_CHACHA) {
+        wc_Chacha_SetKey(&cha, key, keySz);
+        wc_Chacha_SetIV(&cha, iv, CMD.header_sz / CHACHA_CHUNK_BYTES);
+    }
+    else {
+        uint8_t ctr_blk[ENC_MAX_IV_SZ];
+        uint32_t carry = CMD.header_sz / ENC_BLOCK_SIZE;
+        memcpy(ctr_blk, iv, sizeof(ctr_blk));
+        for (i = ENC_MAX_IV_SZ - 1; (i >= 0) && (carry != 0); i--) {
+            carry += ctr_blk[i];
+            ctr_blk[i] = (uint8_t)carry;
+            carry >>= 8;
+        }
+        wc_AesInit(&aes_e, NULL, 0);
+        wc_AesSetKeyDirect(&aes_e, key, keySz, ctr_blk, AES_ENCRYPTION);
+    }
+    do {
+        len = sector_sz;
+        if (n == 0)
+            len -= CMD.header_sz;
+        if (len > image_sz - pos)
+            len = image_sz - pos;
+        if (fread(buf, 1, len, f) != len) {
+            ret = -1;
+            break;
+        }
+        if (CMD.encrypt == ENC_CHACHA)
+            ret = wc_Chacha_Process(&cha, enc, buf, len);
+        else
+            ret = wc_AesCtrEncrypt(&aes_e, enc, buf, len);
+        if (ret != 0)
+            break;
+        memcpy(nonce, iv, ENC_AEAD_NONCE_SZ);
+        ctr = n + 1;
+        for (i = 0; i < 4; i++)
+            nonce[ENC_AEAD_NONCE_SZ - 1 - i] ^= (uint8_t)(ctr >> (8 * i));
+        if (CMD.encrypt == ENC_CHACHA) {
+#if defined(HAVE_CHACHA) && defined(HAVE_POLY1305)
+            ChaChaPoly_Aead aead;
+            ret = wc_ChaCha20Poly1305_Init(&aead, key, nonce,
+                    CHACHA20_POLY1305_AEAD_ENCRYPT);
+            if (ret == 0)
+                ret = wc_ChaCha20Poly1305_UpdateAad(&aead, enc, len);
+            if (ret == 0)
+                ret = wc_ChaCha20Poly1305_Final(&aead,
+                        tags + (n * ENC_AEAD_TAG_SZ));
+#else
+            ret = NOT_COMPILED_IN;
+#endif
+        }
+        else {
+#ifdef HAVE_AESGCM
+            Aes gcm;
+            ret = wc_AesInit(&gcm, NULL, INVALID_DEVID);
+            if (ret == 0)
+                ret = wc_AesGcmSetKey(&gcm, key, keySz);
+            if (ret == 0)
+                ret = wc_AesGcmEncrypt(&gcm, NULL, NULL, 0, nonce,
+                        ENC_AEAD_NONCE_SZ, tags + (n * ENC_AEAD_TAG_SZ),
+                        ENC_AEAD_TAG_SZ, enc, len);
+            wc_AesFree(&gcm);
+#else
+            ret = NOT_COMPILED_IN;
+#endif
+        }
+        pos += len;
+        n++;
+    } while ((ret == 0) && (pos < image_sz));
+    if (CMD.encrypt != ENC_CHACHA)
+        wc_AesFree(&aes_e);
+    fclose(f);
+    free(buf);
+    free(enc);
+    return ret;
+}
+
+/* Append the first 'len' bytes of 'image_file' to 'out'. On Linux the data
+ * is copied by the kernel, without going through user space. */
+static int image_copy(FILE *out, const char *image_file, uint32_t len)
+{
+    FILE *f;
+    uint8_t *buf;
+    uint32_t pos = 0, chunk;
+    int ret = 0;
+#ifdef __linux__
+    int fd;
+    ssize_t n;
+
+    if (fflush(out) != 0)
+        return -1;
+    fd = open(image_file, O_RDONLY);
+    if (fd < 0) {
+        printf("Open image file %s failed\n", image_file);
+        return -1;
+    }
+#ifdef SYS_copy_file_range
+    while (pos < len) {
+        n = syscall(SYS_copy_file_range, fd, NULL, fileno(out), NULL,
+                (size_t)(len - pos), 0);
+        if (n <= 0)
+            break;
+        pos += (uint32_t)n;
+    }
+#endif
+    /* copy_file_range() is not available on all kernels and file systems */
+    while (pos < len) {
+        n = sendfile(fileno(out), fd, NULL, (size_t)(len - pos));
+        if (n <= 0)
+            break;
+        pos += (uint32_t)n;
+    }
+    close(fd);
+    /* The stream position is not aware of the copy */
+    if (fseek(out, 0, SEEK_END) != 0)
+        return -1;
+    if (pos == len)
+        return 0;
+#endif
+    buf = malloc(IMAGE_IO_CHUNK_SZ);
+    if (buf == NULL) {
+        printf("Image buffer malloc error!\n");
+        return -1;
+    }
+    f = fopen(image_file, "rb");
+    if ((f == NULL) || (fseek(f, pos, SEEK_SET) != 0)) {
+        printf("Open image file %s failed\n", image_file);
+        if (f != NULL)
+            fclose(f);
+        free(buf);
+        return -1;
+    }
+    while (pos < len) {
+        chunk = len - pos;
+        if (chunk > IMAGE_IO_CHUNK_SZ)
+            chunk = IMAGE_IO_CHUNK_SZ;
+        if ((fread(buf, 1, chunk, f) != chunk) ||
+                (fwrite(buf, 1, chunk, out) != chunk)) {
+            ret = -1;
+            break;
+        }
+        pos += chunk;
+    }
+    fclose(f);
+    free(buf);
+    return ret;
+}
+
+#ifndef NO_SHA256
+static int image_sha256_update(void *ctx, const uint8_t *data, uint32_t len)
+{
+    return wc_Sha256Update((wc_Sha256 *)ctx, data, len);
+}
+#endif
+#ifndef NO_SHA384
+static int image_sha384_update(void *ctx, const uint8_t *data, uint32_t len)
+{
+    return wc_Sha384Update((wc_Sha384 *)ctx, data, len);
+}
+#endif
+#ifdef WOLFSSL_SHA3
+static int image_sha3_384_update(void *ctx, const uint8_t *data, uint32_t len)
+{
+    return wc_Sha3_384_Update((wc_Sha3 *)ctx, data, len);
+}
+#endif
+
+/* Kind of image generated by make_header_ex() */
+#define IMG_KIND_FULL       0
+#define IMG_KIND_DIFF       1
+#define IMG_KIND_COMPRESSED 2
+
+static int make_header_ex(int kind, uint8_t *pubkey, uint32_t pubkey_sz,
+        const char *image_file, const char *outfile,
+        uint32_t delta_base_version, uint32_t patch_len, uint32_t patch_inv_off,
+        uint32_t patch_inv_len, const uint8_t *secondary_key, uint32_t secondary_key_sz,
+        uint8_t *base_hash, uint32_t base_hash_sz)
+{
+    uint32_t header_idx;
+    uint8_t *header;
+    FILE *f, *fef;
+    uint32_t fw_version32;
+    struct stat attrib;
+    uint16_t image_type;
+    uint8_t* signature = NULL;
+    uint8_t* secondary_signature = NULL;
+    uint8_t* policy = NULL;
+    int ret = -1;
+    uint8_t  buf[4096];
+    uint8_t  second_buf[4096];
+    uint32_t read_sz, pos;
+    uint8_t  digest[48]; /* max digest */
+    uint32_t digest_sz = 0;
+    uint32_t image_sz = 0;
+    int io_sz;
+    uint8_t*    cert_chain    = NULL;
+    uint32_t    cert_chain_sz = 0;
+    uint8_t *merkle = NULL;
+    uint32_t merkle_sz = 0;
+    uint32_t merkle_sector_sz = 0;
+    uint8_t *tags = NULL;
+    uint32_t tags_sz = 0;
+    uint32_t fw_hash_sz;
+    double t_start = time_ms(), t_sign;
+
+    /* Check certificate chain file size before allocating header, and adjust
+     * header size if needed */
+    if (CMD.cert_chain_file != NULL) {
+        struct stat file_stat;
+
+        /* Get the file size */
+        if (stat(CMD.cert_chain_file, &file_stat) == 0) {
+            /* 2 bytes for tag + 2 bytes for length field */
+            const uint32_t tag_len_size = 4;
+            /* Maximum alignment padding that might be needed */
+            const uint32_t max_alignment = 8;
+            /* Required space = tag(2) + length(2) + data + potential alignment
+             * * padding */
+            const uint32_t required_space =
+                tag_len_size + file_stat.st_size + max_alignment;
+
+            /* If the current header size is too small, increase it */
+            if (CMD.header_sz < required_space) {
+                /* Round up to nearest power of 2 that can hold the chain */
+                const uint32_t min_header_size = 256;
+                uint32_t       new_size        = min_header_size;
+                while (new_size < required_space) {
+                    new_size *= 2;
+                }
+
+                printf("Increasing header size from %u to %u bytes to fit "
+                       "certificate chain\n",
+                       CMD.header_sz, new_size);
+                CMD.header_sz = new_size;
+            }
+        }
+        else {
+            printf("Warning: Could not stat certificate chain file %s: %s\n",
+                   CMD.cert_chain_file, strerror(errno));
+        }
+    }
+
+    /* Size the header to fit the Merkle manifest: one leaf per sector */
+    if (CMD.merkle && (kind == IMG_KIND_FULL)) {
+        struct stat file_stat;
+        uint32_t leaf_sz = (CMD.hash_algo == HASH_SHA256) ?
+            HDR_SHA256_LEN : HDR_SHA384_LEN;
+        uint32_t n, required_space;
+        uint32_t i;
+
+        if (stat(image_file, &file_stat) != 0) {
+            printf("Could not get image file size: %s\n", strerror(errno));
+            goto failure;
+        }
+        merkle_sector_sz = wb_diff_get_sector_size();
+        for (;;) {
+            n = ((uint32_t)file_stat.st_size + CMD.header_sz +
+                    merkle_sector_sz - 1) / merkle_sector_sz;
+            merkle_sz = n * leaf_sz;
+            if (CMD.aead)
+                tags_sz = n * ENC_AEAD_TAG_SZ;
+            /* Conservative estimate of the remaining fields */
+            required_space = 256 + merkle_sz + tags_sz + CMD.signature_sz +
+                CMD.secondary_signature_sz;
+            if (CMD.policy_sign)
+                required_space += CMD.signature_sz + 16;
+            if (CMD.cert_chain_file != NULL)
+                required_space += CMD.header_sz / 2;
+            for (i = 0; i < CMD.custom_tlvs; i++)
+                required_space += 16 + CMD.custom_tlv[i].len;
+            if ((required_space <= CMD.header_sz) ||
+                    (CMD.header_sz >= merkle_sector_sz))
+                break;
+            printf("Increasing header size from %u to %u bytes to fit "
+                   "Merkle manifest\n", CMD.header_sz, CMD.header_sz * 2);
+            CMD.header_sz *= 2;
+        }
+        if ((CMD.header_sz >= merkle_sector_sz) || (merkle_sz > 0xFFFF) ||
+                (tags_sz > 0xFFFF)) {
+            printf("Error: Merkle manifest for %u sectors (%u bytes) does not "
+                   "fit a header smaller than the sector size %u\n", n,
+                   merkle_sz + tags_sz, merkle_sector_sz);
+            printf("The image must fit in %u sectors, see IMAGE_HEADER_SIZE "
+                   "in docs/Signing.md\n",
+                   (merkle_sector_sz / 2 - 256) / (leaf_sz +
+                    (CMD.aead ? ENC_AEAD_TAG_SZ : 0)));
+            goto failure;
+        }
+        merkle = malloc(merkle_sz);
+        if (merkle == NULL) {
+            printf("Merkle manifest malloc error!\n");
+            goto failure;
+        }
+        if (merkle_leaves(image_file, (uint32_t)file_stat.st_size,
+                    merkle_sector_sz, merkle, leaf_sz) != 0) {
+            printf("Error computing Merkle manifest\n");
+            goto failure;
+        }
+        printf("Merkle manifest: %u sectors of %u bytes\n", n,
+                merkle_sector_sz);
+        if (CMD.aead) {
+            tags = malloc(tags_sz);
+            if (tags == NULL) {
+                printf("AEAD tag table malloc error!\n");
+                goto failure;
+            }
+            if (aead_tags(image_file, (uint32_t)file_stat.st_size,
+                        merkle_sector_sz, tags) != 0) {
+                printf("Error computing AEAD tag table\n");
+                goto failure;
+            }
+            printf("AEAD tag table: %u tags\n", n);
+        }
+    }
+
+    header_idx = 0;
+    header = malloc(CMD.header_sz);
+    if (header == NULL) {
+        printf("Header malloc error!\n");
+        goto failure;
+    }
+    memset(header, 0xFF, CMD.header_sz);
+
+    /* Get size of image */
+    f = fopen(image_file, "rb");
+    if (f == NULL) {
+        printf("Open image file %s failed\n", image_file);
+        goto failure;
     }
     fseek(f, 0, SEEK_END);
     image_sz = ftell(f);
     fseek(f, 0, SEEK_SET);
     fclose(f);
+    /* With a Merkle manifest, the signed digest only covers the header:
+     * the firmware is covered by the leaf hashes */
+    fw_hash_sz = (merkle != NULL) ? 0 : image_sz;
 
     /* Append Magic header (spells 'WOLF') */
     header_append_u32(header, &header_idx, WOLFBOOT_MAGIC);
@@ -1211,12 +2058,24 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
     /* Append Image type field */
     image_type = (uint16_t)CMD.sign & HDR_IMG_TYPE_AUTH_MASK;
     image_type |= CMD.partition_id;
-    if (is_diff)
+    if (kind == IMG_KIND_DIFF)
         image_type |= HDR_IMG_TYPE_DIFF;
+    else if (kind == IMG_KIND_COMPRESSED)
+        image_type |= HDR_IMG_TYPE_COMPRESSED;
     header_append_tag(header, &header_idx, HDR_IMG_TYPE, HDR_IMG_TYPE_LEN,
         &image_type);
 
-    if (is_diff) {
+    if (kind == IMG_KIND_COMPRESSED) {
+        uint32_t codec = WB_DELTA_CODEC_LZ;
+        /* Append pad bytes, so fields are 4-byte aligned */
+        ALIGN_4(header_idx);
+        header_append_tag(header, &header_idx, HDR_IMG_DELTA_SIZE, 4,
+                &patch_len);
+        header_append_tag(header, &header_idx, HDR_IMG_DELTA_CODEC, 4,
+                &codec);
+    }
+
+    if (kind == IMG_KIND_DIFF) {
         /* Append pad bytes, so fields are 4-byte aligned */
         ALIGN_4(header_idx);
         header_append_tag(header, &header_idx, HDR_IMG_DELTA_BASE, 4,
@@ -1231,6 +2090,21 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
         header_append_tag(header, &header_idx, HDR_IMG_DELTA_INVERSE_SIZE, 4,
                 &patch_inv_len);
 
+        /* Patches without format/codec tags are decoded as v1, uncompressed */
+        if ((CMD.delta_format > WB_PATCH_FORMAT_V1) || CMD.delta_inplace) {
+            uint32_t format = CMD.delta_format;
+            if (CMD.delta_inplace)
+                format |= WB_PATCH_INPLACE;
+            ALIGN_4(header_idx);
+            header_append_tag(header, &header_idx, HDR_IMG_DELTA_FORMAT, 4,
+                    &format);
+        }
+        if (CMD.delta_codec != WB_DELTA_CODEC_NONE) {
+            ALIGN_4(header_idx);
+            header_append_tag(header, &header_idx, HDR_IMG_DELTA_CODEC, 4,
+                    &CMD.delta_codec);
+        }
+
         if (!CMD.no_base_sha) {
             /* Append pad bytes, so base hash is 8-byte aligned */
             ALIGN_8(header_idx);
@@ -1283,6 +2157,21 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
         }
     }
 
+    /* Add Merkle manifest */
+    if (merkle != NULL) {
+        ALIGN_4(header_idx);
+        header_append_tag(header, &header_idx, HDR_IMG_MERKLE_SECTOR_SIZE, 4,
+                &merkle_sector_sz);
+        ALIGN_8(header_idx);
+        header_append_tag(header, &header_idx, HDR_IMG_MERKLE_LEAVES,
+                (uint16_t)merkle_sz, merkle);
+        if (tags != NULL) {
+            ALIGN_4(header_idx);
+            header_append_tag(header, &header_idx, HDR_IMG_AEAD_TAGS,
+                    (uint16_t)tags_sz, tags);
+        }
+    }
+
     /* Read certificate chain if provided */
     if (CMD.cert_chain_file != NULL) {
         const size_t cert_chain_tlv_hdr_sz = 4;
@@ -1396,21 +2285,8 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
             ret = wc_Sha256Update(&sha, header, header_idx);
 
             /* Hash image file */
-            f = fopen(image_file, "rb");
-            pos = 0;
-            while (ret == 0 && pos < image_sz) {
-                read_sz = image_sz - pos;
-                if (read_sz > 32)
-                    read_sz = 32;
-                io_sz = (int)fread(buf, 1, read_sz, f);
-                if ((io_sz < 0) && !feof(f)) {
-                    ret = -1;
-                    break;
-                }
-                ret = wc_Sha256Update(&sha, buf, read_sz);
-                pos += read_sz;
-            }
-            fclose(f);
+            if (ret == 0)
+                ret = image_stream(image_file, fw_hash_sz, image_sha256_update, &sha);
             if (ret == 0) {
                 wc_Sha256Final(&sha, digest);
                 digest_sz = HDR_SHA256_LEN;
@@ -1465,21 +2341,8 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
             ret = wc_Sha384Update(&sha, header, header_idx);
 
             /* Hash image file */
-            f = fopen(image_file, "rb");
-            pos = 0;
-            while (ret == 0 && pos < image_sz) {
-                read_sz = image_sz - pos;
-                if (read_sz > 32)
-                    read_sz = 32;
-                io_sz = (int)fread(buf, 1, read_sz, f);
-                if ((io_sz < 0) && !feof(f)) {
-                    ret = -1;
-                    break;
-                }
-                ret = wc_Sha384Update(&sha, buf, read_sz);
-                pos += read_sz;
-            }
-            fclose(f);
+            if (ret == 0)
+                ret = image_stream(image_file, fw_hash_sz, image_sha384_update, &sha);
             if (ret == 0) {
                 wc_Sha384Final(&sha, digest);
                 digest_sz = HDR_SHA384_LEN;
@@ -1532,21 +2395,8 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
             ret = wc_Sha3_384_Update(&sha, header, header_idx);
 
             /* Hash image file */
-            f = fopen(image_file, "rb");
-            pos = 0;
-            while (ret == 0 && pos < image_sz) {
-                read_sz = image_sz - pos;
-                if (read_sz > 128)
-                    read_sz = 128;
-                io_sz = (int)fread(buf, 1, read_sz, f);
-                if ((io_sz < 0) && !feof(f)) {
-                    ret = -1;
-                    break;
-                }
-                ret = wc_Sha3_384_Update(&sha, buf, read_sz);
-                pos += read_sz;
-            }
-            fclose(f);
+            if (ret == 0)
+                ret = image_stream(image_file, fw_hash_sz, image_sha3_384_update, &sha);
             if (ret == 0) {
                 ret = wc_Sha3_384_Final(&sha, digest);
                 digest_sz = HDR_SHA3_384_LEN;
@@ -1562,6 +2412,7 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
     }
     DEBUG_PRINT("Image hash %d\n", digest_sz);
     DEBUG_BUFFER(digest, digest_sz);
+    sign_time.hash_ms += time_ms() - t_start;
 
     /* Add image hash to header */
     header_append_tag(header, &header_idx, CMD.hash_algo, digest_sz, digest);
@@ -1578,6 +2429,7 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
             printf("Digest image %s successfully created.\n", outfile);
             exit(0);
         }
+        t_sign = time_ms();
         /* save max sig size */
         CMD.policy_sz = CMD.signature_sz;
 
@@ -1731,6 +2583,7 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
             header_append_tag(header, &header_idx, HDR_POLICY_SIGNATURE,
                 CMD.policy_sz + (uint16_t)sizeof(uint32_t), policy);
         }
+        sign_time.sign_ms += time_ms() - t_sign;
     } /* end if(sign != NO_SIGN) */
 
     /* Add padded header at end */
@@ -1744,62 +2597,21 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
         printf("Open output image file %s failed\n", outfile);
         goto failure;
     }
-    fwrite(header, 1, header_idx, f);
-    /* Copy image to output */
-    f2 = fopen(image_file, "rb");
-    pos = 0;
-    while (pos < image_sz) {
-        read_sz = image_sz;
-        if (read_sz > sizeof(buf))
-            read_sz = sizeof(buf);
-        read_sz = (uint32_t)fread(buf, 1, read_sz, f2);
-        if ((read_sz == 0) && (feof(f2)))
-            break;
-        fwrite(buf, 1, read_sz, f);
-        pos += read_sz;
+    /* Write the header, then copy the image after it */
+    if ((fwrite(header, 1, header_idx, f) != header_idx) ||
+            (image_copy(f, image_file, image_sz) != 0)) {
+        printf("Error writing output image file %s\n", outfile);
+        fclose(f);
+        goto failure;
     }
 
     if ((CMD.encrypt != ENC_OFF) && CMD.encrypt_key_file) {
         uint8_t key[ENC_MAX_KEY_SZ], iv[ENC_MAX_IV_SZ];
-        uint8_t enc_buf[ENC_BLOCK_SIZE];
+        uint8_t *enc_in, *enc_buf;
         int ivSz, keySz;
         uint32_t fsize = 0;
-        switch (CMD.encrypt) {
-            case ENC_CHACHA:
-                ivSz = CHACHA_IV_BYTES;
-                keySz = CHACHA_MAX_KEY_SZ;
-                break;
-            case ENC_AES128:
-                ivSz = 16;
-                keySz = 16;
-                break;
-            case ENC_AES256:
-                ivSz = 16;
-                keySz = 32;
-                break;
-            default:
-                printf("No valid encryption mode selected\n");
-                goto failure;
-
-        }
-        fek = fopen(CMD.encrypt_key_file, "rb");
-        if (fek == NULL) {
-            fprintf(stderr, "Open encryption key file %s: %s\n",
-                    CMD.encrypt_key_file, strerror(errno));
-            exit(1);
-        }
-        ret = (int)fread(key, 1, keySz, fek);
-        if (ret != keySz) {
-            fprintf(stderr, "Error reading key from %s\n", CMD.encrypt_key_file);
-            exit(1);
-        }
-        ret = (int)fread(iv, 1, ivSz, fek);
-        if (ret != ivSz) {
-            fprintf(stderr, "Error reading IV from %s\n", CMD.encrypt_key_file);
-            exit(1);
-        }
-        fclose(fek);
 
+        encrypt_key_load(key, &keySz, iv, &ivSz);
         fef = fopen(CMD.output_encrypted_image_file, "wb");
         if (!fef) {
             fprintf(stderr, "Open encrypted output file %s: %s\n",
@@ -1808,6 +2620,15 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
         fsize = ftell(f);
         fseek(f, 0, SEEK_SET); /* restart the _signed file from 0 */
 
+        /* Encrypt the signed image in IMAGE_IO_CHUNK_SZ chunks. The chunk
+         * size is a multiple of the cipher block size, so only the last
+         * chunk may need padding. */
+        enc_in = malloc(IMAGE_IO_CHUNK_SZ);
+        enc_buf = malloc(IMAGE_IO_CHUNK_SZ);
+        if ((enc_in == NULL) || (enc_buf == NULL)) {
+            printf("Encryption buffer malloc error!\n");
+            exit(1);
+        }
         if (CMD.encrypt == ENC_CHACHA) {
             ChaCha cha;
 #ifndef HAVE_CHACHA
@@ -1817,42 +2638,45 @@ static int make_header_ex(int is_diff, uint8_t *pubkey, uint32_t pubkey_sz,
 #endif
             wc_Chacha_SetKey(&cha, key, sizeof(key));
             wc_Chacha_SetIV(&cha, iv, 0);
-            for (pos = 0; pos < fsize; pos += ENC_BLOCK_SIZE) {
-                int fread_retval;
-                fread_retval = (int)fread(buf, 1, ENC_BLOCK_SIZE, f);
-                if ((fread_retval == 0) && feof(f)) {
+            for (pos = 0; pos < fsize; pos += read_sz) {
+                read_sz = (uint32_t)fread(enc_in, 1, IMAGE_IO_CHUNK_SZ, f);
+                if (read_sz == 0) {
                     break;
                 }
-                wc_Chacha_Process(&cha, enc_buf, buf, fread_retval);
-                fwrite(enc_buf, 1, fread_retval, fef);
+                wc_Chacha_Process(&cha, enc_buf, enc_in, read_sz);
+                fwrite(enc_buf, 1, read_sz, fef);
             }
         } else if ((CMD.encrypt == ENC_AES128) || (CMD.encrypt == ENC_AES256)) {
             Aes aes_e;
             wc_AesInit(&aes_e, NULL, 0);
             wc_AesSetKeyDirect(&aes_e, key, keySz, iv, AES_ENCRYPTION);
-            for (pos = 0; pos < fsize; pos += ENC_BLOCK_SIZE) {
-                int fread_retval;
-                fread_retval = (int)fread(buf, 1, ENC_BLOCK_SIZE, f);
-                if ((fread_retval == 0) && feof(f)) {
+            for (pos = 0; pos < fsize; pos += read_sz) {
+                read_sz = (uint32_t)fread(enc_in, 1, IMAGE_IO_CHUNK_SZ, f);
+                if (read_sz == 0) {
                     break;
                 }
                 /* Pad with FF if input is too short */
-                while((fread_retval % ENC_BLOCK_SIZE) != 0) {
-                    buf[fread_retval++] = 0xFF;
+                while ((read_sz % ENC_BLOCK_SIZE) != 0) {
+                    enc_in[read_sz++] = 0xFF;
                 }
-                wc_AesCtrEncrypt(&aes_e, enc_buf, buf, fread_retval);
-                fwrite(enc_buf, 1, fread_retval, fef);
+                wc_AesCtrEncrypt(&aes_e, enc_buf, enc_in, read_sz);
+                fwrite(enc_buf, 1, read_sz, fef);
             }
         }
+        free(enc_in);
+        free(enc_buf);
         fclose(fef);
     }
     printf("Output image(s) successfully created.\n");
     ret = 0;
-    fclose(f2);
     fclose(f);
 failure:
     if (cert_chain)
         free(cert_chain);
+    if (merkle)
+        free(merkle);
+    if (tags)
+        free(tags);
     if (policy)
         free(policy);
     if (header)
@@ -1867,8 +2691,8 @@ failure:
 static int make_header(uint8_t *pubkey, uint32_t pubkey_sz,
         const char *image_file, const char *outfile)
 {
-    return make_header_ex(0, pubkey, pubkey_sz, image_file, outfile, 0, 0, 0, 0,
-            NULL, 0, NULL, 0);
+    return make_header_ex(IMG_KIND_FULL, pubkey, pubkey_sz, image_file,
+            outfile, 0, 0, 0, 0, NULL, 0, NULL, 0);
 }
 
 static int make_header_delta(uint8_t *pubkey, uint32_t pubkey_sz,
@@ -1877,18 +2701,159 @@ static int make_header_delta(uint8_t *pubkey, uint32_t pubkey_sz,
         uint32_t patch_inv_off, uint32_t patch_inv_len,
         uint8_t *base_hash, uint32_t base_hash_sz)
 {
-    return make_header_ex(1, pubkey, pubkey_sz, image_file, outfile,
+    return make_header_ex(IMG_KIND_DIFF, pubkey, pubkey_sz, image_file, outfile,
             delta_base_version, patch_len,
             patch_inv_off, patch_inv_len,
             NULL, 0, base_hash, base_hash_sz);
 }
 
-static int make_hybrid_header(uint8_t *pubkey, uint32_t pubkey_sz,
-        const char *image_file, const char *outfile,
-        const uint8_t *secondary_key, uint32_t secondary_key_sz)
-{
-    return make_header_ex(0, pubkey, pubkey_sz, image_file, outfile, 0, 0, 0, 0,
-            secondary_key, secondary_key_sz, NULL, 0);
+static int make_hybrid_header(uint8_t *pubkey, uint32_t pubkey_sz,
+        const char *image_file, const char *outfile,
+        const uint8_t *secondary_key, uint32_t secondary_key_sz)
+{
+    return make_header_ex(IMG_KIND_FULL, pubkey, pubkey_sz, image_file,
+            outfile, 0, 0, 0, 0, secondary_key, secondary_key_sz, NULL, 0);
+}
+
+/* Compress the signed image, and sign the result as a compressed
+ * full-image update */
+static int compress_image(uint8_t *pubkey, uint32_t pubkey_sz)
+{
+    FILE *f = NULL;
+    uint8_t *img = NULL;
+    uint8_t *lz = NULL;
+    long img_sz;
+    int lz_sz;
+    int ret = -1;
+
+    f = fopen(CMD.output_image_file, "rb");
+    if (f == NULL) {
+        printf("Cannot open file %s\n", CMD.output_image_file);
+        goto cleanup;
+    }
+    fseek(f, 0, SEEK_END);
+    img_sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if ((img_sz <= 0) || (img_sz > MAX_SRC_SIZE)) {
+        printf("Invalid file size: %ld\n", img_sz);
+        goto cleanup;
+    }
+    img = malloc(img_sz);
+    lz = malloc(WB_LZ_BOUND(img_sz));
+    if ((img == NULL) || (lz == NULL)) {
+        fprintf(stderr, "Error allocating memory to compress the image\n");
+        goto cleanup;
+    }
+    if (fread(img, 1, img_sz, f) != (size_t)img_sz) {
+        perror("fread of image");
+        goto cleanup;
+    }
+    fclose(f);
+    f = NULL;
+
+    lz_sz = wb_lz_compress(img, (uint32_t)img_sz, lz, WB_LZ_BOUND(img_sz));
+    if (lz_sz < 0) {
+        printf("Image compression failed\n");
+        goto cleanup;
+    }
+    printf("Compressed image: %ld -> %d bytes\n", img_sz, lz_sz);
+
+    f = fopen(wolfboot_compressed_file, "wb");
+    if (f == NULL) {
+        printf("Cannot open file %s for writing\n", wolfboot_compressed_file);
+        goto cleanup;
+    }
+    if (fwrite(lz, 1, lz_sz, f) != (size_t)lz_sz) {
+        printf("Could not write to output file: %s\n", strerror(errno));
+        goto cleanup;
+    }
+    fclose(f);
+    f = NULL;
+
+    ret = make_header_ex(IMG_KIND_COMPRESSED, pubkey, pubkey_sz,
+            wolfboot_compressed_file, CMD.output_compressed_file,
+            0, (uint32_t)lz_sz, 0, 0, NULL, 0, NULL, 0);
+
+cleanup:
+    if (f != NULL)
+        fclose(f);
+    free(img);
+    free(lz);
+    unlink(wolfboot_compressed_file);
+    return ret;
+}
+
+/* Run wb_diff() to completion and return the resulting patch in a newly
+ * allocated buffer, compressed with the selected codec. With
+ * --delta-inplace, the patch is created by wb_diff_inplace(), and the plan
+ * at the beginning of the patch is not compressed. 'blksz' is the sector
+ * size. */
+static int delta_make_patch(WB_DIFF_CTX *diff_ctx, uint8_t *dest,
+        uint32_t blksz, uint8_t **patch, uint32_t *patch_sz)
+{
+    uint8_t *raw = NULL, *tmp;
+    uint32_t raw_sz = 0, raw_max = 0, plan_sz = 0;
+    int r;
+
+    if (CMD.delta_inplace) {
+        uint32_t n_sectors = diff_ctx->size_a;
+        if (diff_ctx->size_b > n_sectors)
+            n_sectors = diff_ctx->size_b;
+        n_sectors = (n_sectors + blksz - 1) / blksz;
+        raw_max = WB_DIFF_INPLACE_BOUND(diff_ctx->size_b, n_sectors);
+        raw = malloc(raw_max);
+        if (raw == NULL)
+            goto error;
+        r = wb_diff_inplace(diff_ctx, raw, raw_max, &plan_sz);
+        if (r < 0) {
+            fprintf(stderr, "Error creating the in-place patch\n");
+            goto error;
+        }
+        raw_sz = (uint32_t)r;
+        printf("In-place patch: %u sectors written\n",
+                ((struct wb_inplace_hdr *)raw)->n_ops);
+    } else {
+        do {
+            r = wb_diff(diff_ctx, dest, blksz);
+            if (r < 0)
+                goto error;
+            if (raw_sz + r > raw_max) {
+                raw_max = 2 * (raw_max + blksz);
+                tmp = realloc(raw, raw_max);
+                if (tmp == NULL)
+                    goto error;
+                raw = tmp;
+            }
+            memcpy(raw + raw_sz, dest, r);
+            raw_sz += r;
+        } while (r > 0);
+    }
+    wb_diff_free(diff_ctx);
+
+    if ((CMD.delta_codec == WB_DELTA_CODEC_LZ) && (raw_sz > plan_sz)) {
+        tmp = malloc(plan_sz + WB_LZ_BOUND(raw_sz - plan_sz));
+        if (tmp == NULL)
+            goto error;
+        memcpy(tmp, raw, plan_sz);
+        r = wb_lz_compress(raw + plan_sz, raw_sz - plan_sz, tmp + plan_sz,
+                WB_LZ_BOUND(raw_sz - plan_sz));
+        if (r < 0) {
+            free(tmp);
+            goto error;
+        }
+        printf("Delta patch compressed: %u -> %d bytes\n", raw_sz - plan_sz,
+                r);
+        free(raw);
+        raw = tmp;
+        raw_sz = plan_sz + (uint32_t)r;
+    }
+    *patch = raw;
+    *patch_sz = raw_sz;
+    return 0;
+
+error:
+    free(raw);
+    return -1;
 }
 
 static int base_diff(const char *f_base, uint8_t *pubkey, uint32_t pubkey_sz, int padding)
@@ -1903,8 +2868,8 @@ static int base_diff(const char *f_base, uint8_t *pubkey, uint32_t pubkey_sz, in
     void *base = NULL;
     void *buffer = NULL;
     uint8_t *dest = NULL;
+    uint8_t *patch = NULL;
     uint8_t ff = 0xff;
-    int r;
     uint32_t patch_sz, patch_inv_sz;
     uint32_t patch_inv_off;
     uint32_t *delta_base_version = NULL;
@@ -1917,6 +2882,7 @@ static int base_diff(const char *f_base, uint8_t *pubkey, uint32_t pubkey_sz, in
     uint32_t wolfboot_sector_size = 0;
     uint32_t blksz;
 
+    memset(&diff_ctx, 0, sizeof(diff_ctx));
     wolfboot_sector_size = wb_diff_get_sector_size();
     printf("delta update: WOLFBOOT_SECTOR_SIZE: %u\n", wolfboot_sector_size);
     blksz = wolfboot_sector_size;
@@ -1933,7 +2899,8 @@ static int base_diff(const char *f_base, uint8_t *pubkey, uint32_t pubkey_sz, in
     }
     len1 = st.st_size;
 
-    if (len1 > MAX_SRC_SIZE) {
+    if ((len1 > MAX_SRC_SIZE) && ((CMD.delta_format < WB_PATCH_FORMAT_V3) ||
+                (len1 > MAX_SRC_SIZE_V3))) {
         printf("%s: file too large\n", f_base);
         goto cleanup;
     }
@@ -2063,21 +3030,24 @@ static int base_diff(const char *f_base, uint8_t *pubkey, uint32_t pubkey_sz, in
     if (wb_diff_init(&diff_ctx, base, len1, buffer, len2) < 0) {
         goto cleanup;
     }
-    do {
-        r = wb_diff(&diff_ctx, dest, blksz);
-        if (r < 0)
-            goto cleanup;
+    if (wb_diff_set_format(&diff_ctx, CMD.delta_format) < 0) {
+        fprintf(stderr, "Delta format %u not supported by the diff engine\n",
+                CMD.delta_format);
+        goto cleanup;
+    }
+    if (delta_make_patch(&diff_ctx, dest, blksz, &patch, &patch_sz) < 0)
+        goto cleanup;
 #if HAVE_MMAP
-        io_sz = write(fd3, dest, r);
+    io_sz = write(fd3, patch, patch_sz);
 #else
-        io_sz = (int)fwrite(dest, r, 1, f3);
+    io_sz = (int)fwrite(patch, 1, patch_sz, f3);
 #endif
-        if (io_sz != r) {
-            goto cleanup;
-        }
-        len3 += r;
-    } while (r > 0);
-    patch_sz = len3;
+    free(patch);
+    patch = NULL;
+    if (io_sz != (int)patch_sz) {
+        goto cleanup;
+    }
+    len3 += patch_sz;
     while ((len3 % padding) != 0) {
         uint8_t zero = 0;
 #if HAVE_MMAP
@@ -2091,27 +3061,29 @@ static int base_diff(const char *f_base, uint8_t *pubkey, uint32_t pubkey_sz, in
         len3++;
     }
     patch_inv_off = (uint32_t)len3 + CMD.header_sz;
-    patch_inv_sz = 0;
 
     /* Inverse second->base patch */
     if (wb_diff_init(&diff_ctx, buffer, len2, base, len1) < 0) {
         goto cleanup;
     }
-    do {
-        r = wb_diff(&diff_ctx, dest, blksz);
-        if (r < 0)
-            goto cleanup;
+    if (wb_diff_set_format(&diff_ctx, CMD.delta_format) < 0) {
+        fprintf(stderr, "Delta format %u not supported by the diff engine\n",
+                CMD.delta_format);
+        goto cleanup;
+    }
+    if (delta_make_patch(&diff_ctx, dest, blksz, &patch, &patch_inv_sz) < 0)
+        goto cleanup;
 #if HAVE_MMAP
-        io_sz = write(fd3, dest, r);
+    io_sz = write(fd3, patch, patch_inv_sz);
 #else
-        io_sz = (int)fwrite(dest, r, 1, f3);
+    io_sz = (int)fwrite(patch, 1, patch_inv_sz, f3);
 #endif
-        if (io_sz != r) {
-            goto cleanup;
-        }
-        patch_inv_sz += r;
-        len3 += r;
-    } while (r > 0);
+    free(patch);
+    patch = NULL;
+    if (io_sz != (int)patch_inv_sz) {
+        goto cleanup;
+    }
+    len3 += patch_inv_sz;
 #if HAVE_MMAP
     if (fd3 >= 0) {
         if (len3 > 0) {
@@ -2141,6 +3113,9 @@ static int base_diff(const char *f_base, uint8_t *pubkey, uint32_t pubkey_sz, in
             *delta_base_version, patch_sz, patch_inv_off, patch_inv_sz, base_hash, base_hash_sz);
 
 cleanup:
+    wb_diff_free(&diff_ctx);
+    if (patch)
+        free(patch);
     if (dest) {
         free(dest);
         dest = NULL;
@@ -2401,11 +3376,713 @@ static void set_signature_sizes(int secondary)
     printf("Manifest header size: %u\n", CMD.header_sz);
 }
 
+/* Default output file names, from the name of the input image and the
+ * version. 'base' receives the name of the input image without extension */
+static void set_output_files(const char *image_file, const char *fw_version,
+        char *base, size_t base_sz)
+{
+    char *tmpstr;
+
+    memset(base, 0, base_sz);
+    strncpy(base, image_file, base_sz - 1);
+    tmpstr = strrchr(base, '.');
+    if (tmpstr) {
+        *tmpstr = '\0'; /* null terminate at last "." */
+    }
+    snprintf(CMD.output_image_file, sizeof(CMD.output_image_file) - 1,
+            "%s_v%s_%s.bin", base, fw_version,
+            CMD.sha_only ? "digest" : "signed");
+
+    snprintf(CMD.output_encrypted_image_file,
+            sizeof(CMD.output_encrypted_image_file),
+            "%s_v%s_signed_and_encrypted.bin", base, fw_version);
+}
+
+/* Batch mode (--batch): one image per line of the manifest:
+ *   image version [output] [id=N] [tlv=tag,len,value]
+ *   [tlv-buffer=tag,hex] [tlv-string=tag,string]
+ * The key is loaded once, and the images are signed by --jobs processes.
+ */
+#define BATCH_MAX_TOKENS (3 + MAX_CUSTOM_TLVS + 1)
+
+struct batch_entry {
+    char *image_file;
+    char *fw_version;
+    char *output_file;  /* NULL: default name */
+    int partition_id;   /* -1: from the command line */
+    uint32_t custom_tlvs;
+    struct cmd_tlv custom_tlv[MAX_CUSTOM_TLVS];
+    int ret;
+    double hash_ms;
+    double sign_ms;
+    double total_ms;
+};
+
+static int batch_parse_tlv(const char *opt, const char *arg,
+        struct cmd_tlv *tlv)
+{
+    const char *val = strchr(arg, ',');
+    uint32_t len, j;
+
+    if (val == NULL)
+        return -1;
+    val++;
+    tlv->tag = (uint16_t)arg2num(arg, 2);
+    if ((tlv->tag < 0x0030) || ((tlv->tag & 0xFF00) == 0xFF00) ||
+            ((tlv->tag & 0xFF) == 0xFF))
+        return -1;
+    tlv->val = 0;
+    tlv->buffer = NULL;
+    if (strcmp(opt, "tlv") == 0) {
+        len = (uint32_t)arg2num(val, 2);
+        val = strchr(val, ',');
+        if ((val == NULL) ||
+                ((len != 1) && (len != 2) && (len != 4) && (len != 8)))
+            return -1;
+        tlv->val = arg2num(val + 1, len);
+    }
+    else if (strcmp(opt, "tlv-buffer") == 0) {
+        len = (uint32_t)strlen(val) / 2;
+        if ((len == 0) || (len > 255))
+            return -1;
+        tlv->buffer = malloc(len);
+        if (tlv->buffer == NULL)
+            return -1;
+        for (j = 0; j < len; j++) {
+            char c[3] = {val[j * 2], val[j * 2 + 1], 0};
+            tlv->buffer[j] = (uint8_t)strtol(c, NULL, 16);
+        }
+    }
+    else if (strcmp(opt, "tlv-string") == 0) {
+        len = (uint32_t)strlen(val);
+        if ((len == 0) || (len > 255))
+            return -1;
+        tlv->buffer = malloc(len);
+        if (tlv->buffer == NULL)
+            return -1;
+        memcpy(tlv->buffer, val, len);
+    }
+    else {
+        return -1;
+    }
+    tlv->len = (uint16_t)len;
+    return 0;
+}
+
+static void batch_free(struct batch_entry *entries, uint32_t n)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < n; i++) {
+        free(entries[i].image_file);
+        free(entries[i].fw_version);
+        free(entries[i].output_file);
+        for (j = 0; j < entries[i].custom_tlvs; j++)
+            free(entries[i].custom_tlv[j].buffer);
+    }
+    free(entries);
+}
+
+static struct batch_entry *batch_load(const char *file, uint32_t *n_entries)
+{
+    FILE *f;
+    char line[4096];
+    char *tok[BATCH_MAX_TOKENS];
+    struct batch_entry *entries = NULL, *e, *tmp;
+    uint32_t n = 0, max = 0, lineno = 0;
+    int ntok, i;
+    char *p;
+
+    f = fopen(file, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Open batch file %s failed\n", file);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        ntok = 0;
+        p = line;
+        while (*p != '\0') {
+            while ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))
+                *(p++) = '\0';
+            if ((*p == '\0') || (*p == '#'))
+                break;
+            if (ntok == BATCH_MAX_TOKENS)
+                goto error;
+            tok[ntok++] = p;
+            while ((*p != '\0') && (*p != ' ') && (*p != '\t') &&
+                    (*p != '\r') && (*p != '\n'))
+                p++;
+        }
+        if (ntok == 0)
+            continue;
+        if (ntok < 2)
+            goto error;
+        if (n == max) {
+            max = 2 * max + 16;
+            tmp = realloc(entries, max * sizeof(*entries));
+            if (tmp == NULL)
+                goto error;
+            entries = tmp;
+        }
+        e = &entries[n++];
+        memset(e, 0, sizeof(*e));
+        e->partition_id = -1;
+        e->image_file = strdup(tok[0]);
+        e->fw_version = strdup(tok[1]);
+        if ((e->image_file == NULL) || (e->fw_version == NULL))
+            goto error;
+        for (i = 2; i < ntok; i++) {
+            char *arg = strchr(tok[i], '=');
+            if (arg == NULL) {
+                if ((i != 2) || ((e->output_file = strdup(tok[i])) == NULL))
+                    goto error;
+                continue;
+            }
+            *(arg++) = '\0';
+            if (strcmp(tok[i], "id") == 0) {
+                long id = strtol(arg, NULL, 10);
+                if ((id < 0 || id > 15) || ((id == 0) && (arg[0] != '0')))
+                    goto error;
+                e->partition_id = (int)id;
+            }
+            else if ((e->custom_tlvs < MAX_CUSTOM_TLVS) &&
+                    (batch_parse_tlv(tok[i], arg,
+                        &e->custom_tlv[e->custom_tlvs]) == 0)) {
+                e->custom_tlvs++;
+            }
+            else {
+                goto error;
+            }
+        }
+    }
+    fclose(f);
+    if (n == 0) {
+        fprintf(stderr, "Batch file %s is empty\n", file);
+        free(entries);
+        return NULL;
+    }
+    *n_entries = n;
+    return entries;
+
+error:
+    fprintf(stderr, "%s:%u: invalid batch entry\n", file, lineno);
+    fclose(f);
+    if (entries != NULL)
+        batch_free(entries, n);
+    return NULL;
+}
+
+/* Sign one image of the batch. Modifies CMD. */
+static int batch_sign_image(struct batch_entry *e, uint8_t *pubkey,
+        uint32_t pubkey_sz, uint8_t *pubkey2, uint32_t pubkey_sz2)
+{
+    char base[PATH_MAX - 32]; /* see main() */
+    double t_start = time_ms();
+    uint32_t i;
+
+    CMD.image_file = e->image_file;
+    CMD.fw_version = e->fw_version;
+    set_output_files(e->image_file, e->fw_version, base, sizeof(base));
+    if (e->output_file != NULL) {
+        snprintf(CMD.output_image_file, sizeof(CMD.output_image_file), "%s",
+                e->output_file);
+    }
+    if (e->partition_id >= 0) {
+        CMD.partition_id = (uint8_t)e->partition_id;
+        CMD.self_update = (e->partition_id == 0);
+    }
+    if (CMD.custom_tlvs + e->custom_tlvs > MAX_CUSTOM_TLVS) {
+        fprintf(stderr, "Too many custom TLVs for %s\n", e->image_file);
+        e->ret = -1;
+        return e->ret;
+    }
+    for (i = 0; i < e->custom_tlvs; i++)
+        CMD.custom_tlv[CMD.custom_tlvs++] = e->custom_tlv[i];
+
+    sign_time.hash_ms = 0;
+    sign_time.sign_ms = 0;
+    if (CMD.hybrid) {
+        e->ret = make_hybrid_header(pubkey, pubkey_sz, CMD.image_file,
+                CMD.output_image_file, pubkey2, pubkey_sz2);
+    } else {
+        e->ret = make_header(pubkey, pubkey_sz, CMD.image_file,
+                CMD.output_image_file);
+    }
+    e->hash_ms = sign_time.hash_ms;
+    e->sign_ms = sign_time.sign_ms;
+    e->total_ms = time_ms() - t_start;
+    return e->ret;
+}
+
+/* Print the result of one image. In parallel mode, 'log' holds the output
+ * of the child process, printed here so that it is not interleaved with the
+ * output of the other images. */
+static void batch_report(struct batch_entry *e, uint32_t done, uint32_t n,
+        FILE *log)
+{
+    char buf[256];
+    size_t len;
+
+    if (log != NULL) {
+        fflush(log);
+        rewind(log);
+        while ((len = fread(buf, 1, sizeof(buf), log)) > 0)
+            fwrite(buf, 1, len, stdout);
+    }
+    printf("[%u/%u] %s v%s: %s, hash %.1f ms, sign %.1f ms, total %.1f ms\n",
+            done, n, e->image_file, e->fw_version,
+            (e->ret == 0) ? "OK" : "FAILED",
+            e->hash_ms, e->sign_ms, e->total_ms);
+    fflush(stdout);
+}
+
+static void batch_run_sequential(struct batch_entry *entries, uint32_t n,
+        uint8_t *pubkey, uint32_t pubkey_sz, uint8_t *pubkey2,
+        uint32_t pubkey_sz2)
+{
+    struct cmd_options cmd = CMD;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        batch_sign_image(&entries[i], pubkey, pubkey_sz, pubkey2, pubkey_sz2);
+        CMD = cmd;
+        batch_report(&entries[i], i + 1, n, NULL);
+    }
+}
+
+#ifndef _WIN32
+struct batch_job {
+    pid_t pid;      /* 0: slot available */
+    int req;        /* requests from the child */
+    int rsp;        /* responses to the child */
+    uint32_t idx;
+    double t_start;
+    FILE *log;      /* output of the child */
+};
+
+/* Sign a digest with the stateful key, for a child process */
+static int batch_serve_sign(int rsp, struct batch_msg *msg)
+{
+    uint8_t *signature = NULL;
+    uint32_t sz = msg->signature_sz;
+    int32_t ret = -1;
+
+    if (((msg->sign == SIGN_LMS) || (msg->sign == SIGN_XMSS)) &&
+            (msg->digest_sz <= sizeof(msg->digest)) && (sz > 0) &&
+            (sz <= (1 << 20))) {
+        signature = malloc(sz);
+    }
+    if (signature != NULL) {
+        ret = sign_digest(msg->sign, msg->hash_algo, signature, &sz,
+                msg->digest, msg->digest_sz, msg->secondary);
+    }
+    if (ret != 0)
+        sz = 0;
+    if ((batch_write(rsp, &ret, sizeof(ret)) < 0) ||
+            (batch_write(rsp, &sz, sizeof(sz)) < 0) ||
+            (batch_write(rsp, signature, sz) < 0))
+        ret = -1;
+    free(signature);
+    return ret;
+}
+
+static int batch_start(struct batch_job *jobs, int n_jobs, int slot,
+        struct batch_entry *entries, uint32_t idx, uint8_t *pubkey,
+        uint32_t pubkey_sz, uint8_t *pubkey2, uint32_t pubkey_sz2)
+{
+    int req[2], rsp[2];
+    struct batch_msg msg;
+    FILE *log;
+    pid_t pid;
+    int i;
+
+    if (pipe(req) < 0)
+        return -1;
+    if (pipe(rsp) < 0) {
+        close(req[0]);
+        close(req[1]);
+        return -1;
+    }
+    log = tmpfile();
+    if (log == NULL) {
+        close(req[0]);
+        close(req[1]);
+        close(rsp[0]);
+        close(rsp[1]);
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        close(req[0]);
+        close(req[1]);
+        close(rsp[0]);
+        close(rsp[1]);
+        fclose(log);
+        return -1;
+    }
+    if (pid == 0) {
+        for (i = 0; i < n_jobs; i++) {
+            if (jobs[i].pid > 0) {
+                close(jobs[i].req);
+                close(jobs[i].rsp);
+                fclose(jobs[i].log);
+            }
+        }
+        close(req[0]);
+        close(rsp[1]);
+        /* The output of make_header() is printed by the parent, in
+         * batch_report() */
+        if (dup2(fileno(log), STDOUT_FILENO) < 0)
+            exit(1);
+        fclose(log);
+        batch_fd_req = req[1];
+        batch_fd_rsp = rsp[0];
+        batch_sign_image(&entries[idx], pubkey, pubkey_sz, pubkey2,
+                pubkey_sz2);
+        memset(&msg, 0, sizeof(msg));
+        msg.type = BATCH_MSG_DONE;
+        msg.ret = entries[idx].ret;
+        msg.hash_ms = entries[idx].hash_ms;
+        msg.sign_ms = entries[idx].sign_ms;
+        fflush(stdout);
+        if (batch_write(batch_fd_req, &msg, sizeof(msg)) < 0)
+            exit(1);
+        exit((msg.ret == 0) ? 0 : 1);
+    }
+    close(req[1]);
+    close(rsp[0]);
+    jobs[slot].pid = pid;
+    jobs[slot].req = req[0];
+    jobs[slot].rsp = rsp[1];
+    jobs[slot].idx = idx;
+    jobs[slot].t_start = time_ms();
+    jobs[slot].log = log;
+    return 0;
+}
+
+static void batch_run_parallel(struct batch_entry *entries, uint32_t n,
+        int n_jobs, uint8_t *pubkey, uint32_t pubkey_sz, uint8_t *pubkey2,
+        uint32_t pubkey_sz2)
+{
+    struct batch_job *jobs;
+    struct batch_msg msg;
+    struct batch_entry *e;
+    uint32_t next = 0, done = 0;
+    fd_set rd;
+    int i, max_fd, status;
+
+    jobs = calloc(n_jobs, sizeof(*jobs));
+    if (jobs == NULL) {
+        batch_run_sequential(entries, n, pubkey, pubkey_sz, pubkey2,
+                pubkey_sz2);
+        return;
+    }
+    while (done < n) {
+        for (i = 0; (i < n_jobs) && (next < n); i++) {
+            if (jobs[i].pid != 0)
+                continue;
+            if (batch_start(jobs, n_jobs, i, entries, next, pubkey,
+                        pubkey_sz, pubkey2, pubkey_sz2) < 0) {
+                fprintf(stderr, "Batch: cannot start a new process: %s\n",
+                        strerror(errno));
+                entries[next].ret = -1;
+                batch_report(&entries[next], ++done, n, NULL);
+            }
+            next++;
+        }
+        FD_ZERO(&rd);
+        max_fd = -1;
+        for (i = 0; i < n_jobs; i++) {
+            if (jobs[i].pid > 0) {
+                FD_SET(jobs[i].req, &rd);
+                if (jobs[i].req > max_fd)
+                    max_fd = jobs[i].req;
+            }
+        }
+        if (max_fd < 0)
+            continue;
+        if (select(max_fd + 1, &rd, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Batch: select failed: %s\n", strerror(errno));
+            break;
+        }
+        for (i = 0; i < n_jobs; i++) {
+            if ((jobs[i].pid <= 0) || !FD_ISSET(jobs[i].req, &rd))
+                continue;
+            if (batch_read(jobs[i].req, &msg, sizeof(msg)) < 0)
+                msg.type = 0; /* The child exited before reporting */
+            if (msg.type == BATCH_MSG_SIGN) {
+                batch_serve_sign(jobs[i].rsp, &msg);
+                continue;
+            }
+            e = &entries[jobs[i].idx];
+            waitpid(jobs[i].pid, &status, 0);
+            if (msg.type == BATCH_MSG_DONE) {
+                e->ret = msg.ret;
+                e->hash_ms = msg.hash_ms;
+                e->sign_ms = msg.sign_ms;
+            }
+            if ((msg.type != BATCH_MSG_DONE) || !WIFEXITED(status) ||
+                    (WEXITSTATUS(status) != 0)) {
+                if (e->ret == 0)
+                    e->ret = -1;
+            }
+            e->total_ms = time_ms() - jobs[i].t_start;
+            close(jobs[i].req);
+            close(jobs[i].rsp);
+            jobs[i].pid = 0;
+            batch_report(e, ++done, n, jobs[i].log);
+            fclose(jobs[i].log);
+        }
+    }
+    /* Only after a select() failure */
+    for (i = 0; i < n_jobs; i++) {
+        if (jobs[i].pid > 0) {
+            close(jobs[i].req);
+            close(jobs[i].rsp);
+            fclose(jobs[i].log);
+            waitpid(jobs[i].pid, &status, 0);
+            entries[jobs[i].idx].ret = -1;
+        }
+    }
+    for (; next < n; next++)
+        entries[next].ret = -1;
+    free(jobs);
+}
+#endif /* !_WIN32 */
+
+static int sign_batch(uint8_t *pubkey, uint32_t pubkey_sz, uint8_t *pubkey2,
+        uint32_t pubkey_sz2)
+{
+    struct batch_entry *entries;
+    uint32_t n = 0, i, failed = 0;
+    double t_start, hash_ms = 0, sign_ms = 0;
+    int n_jobs = CMD.batch_jobs;
+
+    entries = batch_load(CMD.batch_file, &n);
+    if (entries == NULL)
+        return 1;
+#ifndef _WIN32
+    if (n_jobs <= 0)
+        n_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n_jobs < 1)
+        n_jobs = 1;
+    if ((uint32_t)n_jobs > n)
+        n_jobs = (int)n;
+    printf("Batch: %u images, %d jobs\n", n, n_jobs);
+
+    t_start = time_ms();
+#ifndef _WIN32
+    if (n_jobs > 1) {
+        batch_run_parallel(entries, n, n_jobs, pubkey, pubkey_sz, pubkey2,
+                pubkey_sz2);
+    } else
+#endif
+    {
+        batch_run_sequential(entries, n, pubkey, pubkey_sz, pubkey2,
+                pubkey_sz2);
+    }
+    for (i = 0; i < n; i++) {
+        if (entries[i].ret != 0)
+            failed++;
+        hash_ms += entries[i].hash_ms;
+        sign_ms += entries[i].sign_ms;
+    }
+    printf("Batch: %u images signed, %u failed in %.1f ms "
+            "(hash %.1f ms, sign %.1f ms)\n", n - failed, failed,
+            time_ms() - t_start, hash_ms, sign_ms);
+    batch_free(entries, n);
+    return (failed == 0) ? 0 : 1;
+}
+
+#ifndef _WIN32
+static volatile sig_atomic_t signd_stop;
+
+static void signd_signal(int sig)
+{
+    (void)sig;
+    signd_stop = 1;
+}
+
+static int signd_socket_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Client side (--sign-socket): stateful signatures are requested to the
+ * daemon with the same messages used by batch mode */
+static int signd_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (signd_socket_addr(path, &addr) != 0)
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Cannot connect to the signing daemon on %s: %s\n",
+                path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Serve signatures with the stateful key in CMD.key_file, one at a time,
+ * until SIGINT or SIGTERM */
+static int sign_daemon(const char *path)
+{
+    char wal[PATH_MAX];
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct batch_msg msg;
+    int clients[SIGND_MAX_CLIENTS];
+    int n_clients = 0;
+    int srv = -1, fd, max_fd, i;
+    uint32_t n_signed = 0;
+    mode_t mask;
+    double t_start;
+    fd_set rd;
+    int ret = 1;
+
+    if ((CMD.sign != SIGN_LMS) && (CMD.sign != SIGN_XMSS)) {
+        fprintf(stderr, "--sign-daemon requires a stateful key "
+                "(--lms or --xmss)\n");
+        return 1;
+    }
+    if ((signd_socket_addr(path, &addr) != 0) ||
+            (signd_wal_name(CMD.key_file, wal, sizeof(wal)) != 0))
+        return 1;
+
+    /* The log is locked for as long as the daemon owns the key */
+    signd_wal_fd = open(wal, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (signd_wal_fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", wal, strerror(errno));
+        return 1;
+    }
+    if (flock(signd_wal_fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "%s is in use by another signing daemon\n",
+                CMD.key_file);
+        goto out;
+    }
+    if (signd_recover() != 0) {
+        fprintf(stderr, "Cannot recover the key state from %s\n", wal);
+        goto out;
+    }
+    t_start = time_ms();
+    if (stateful_key_load(CMD.sign, CMD.key_file) != 0) {
+        fprintf(stderr, "Cannot load the private key %s\n", CMD.key_file);
+        goto out;
+    }
+    printf("sign-daemon: key loaded in %.1f ms\n", time_ms() - t_start);
+
+    srv = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv < 0)
+        goto out;
+    unlink(path);
+    mask = umask(077); /* owner only */
+    if ((bind(srv, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+            (listen(srv, SIGND_MAX_CLIENTS) != 0)) {
+        umask(mask);
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    umask(mask);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signd_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    printf("sign-daemon: serving %s on %s\n", CMD.key_file, path);
+    fflush(stdout);
+
+    while (!signd_stop) {
+        FD_ZERO(&rd);
+        FD_SET(srv, &rd);
+        max_fd = srv;
+        for (i = 0; i < n_clients; i++) {
+            FD_SET(clients[i], &rd);
+            if (clients[i] > max_fd)
+                max_fd = clients[i];
+        }
+        if (select(max_fd + 1, &rd, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (FD_ISSET(srv, &rd)) {
+            fd = accept(srv, NULL, NULL);
+            if ((fd >= 0) && ((n_clients == SIGND_MAX_CLIENTS) ||
+                        (fd >= FD_SETSIZE))) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd >= 0)
+                clients[n_clients++] = fd;
+        }
+        i = 0;
+        while (i < n_clients) {
+            if (!FD_ISSET(clients[i], &rd)) {
+                i++;
+                continue;
+            }
+            FD_CLR(clients[i], &rd);
+            if ((batch_read(clients[i], &msg, sizeof(msg)) < 0) ||
+                    (msg.type != BATCH_MSG_SIGN) || (msg.sign != CMD.sign)) {
+                /* Disconnected, or not a request for this key */
+                close(clients[i]);
+                clients[i] = clients[--n_clients];
+                continue;
+            }
+            msg.secondary = 0;
+            t_start = time_ms();
+            if (batch_serve_sign(clients[i], &msg) == 0) {
+                n_signed++;
+                printf("sign-daemon: signature %u in %.1f ms\n", n_signed,
+                        time_ms() - t_start);
+            }
+            fflush(stdout);
+            i++;
+        }
+    }
+    printf("sign-daemon: stopped after %u signatures\n", n_signed);
+    ret = 0;
+out:
+    for (i = 0; i < n_clients; i++)
+        close(clients[i]);
+    if (srv >= 0) {
+        close(srv);
+        unlink(path);
+    }
+    if (signd_checkpoint() != 0)
+        ret = 1;
+    close(signd_wal_fd);
+    signd_wal_fd = -1;
+    free(signd_state);
+    signd_state = NULL;
+    return ret;
+}
+#endif
+
 int main(int argc, char** argv)
 {
     int ret = 0;
     int i;
-    char* tmpstr;
     const char* sign_str = "AUTO";
     const char* hash_str = "SHA256";
     const char* secondary_sign_str = "NONE";
@@ -2631,6 +4308,41 @@ int main(int argc, char** argv)
         } else if (strcmp(argv[i], "--no-base-sha") == 0) {
             CMD.no_base_sha = 1;
         }
+        else if (strcmp(argv[i], "--delta-format") == 0) {
+            CMD.delta_format = (uint32_t)arg2num(argv[++i], 4);
+            if ((CMD.delta_format < WB_PATCH_FORMAT_V1) ||
+                    (CMD.delta_format > WB_PATCH_FORMAT_MAX)) {
+                fprintf(stderr, "Invalid delta format: %s\n", argv[i]);
+                exit(16);
+            }
+        }
+        else if (strcmp(argv[i], "--delta-compress") == 0) {
+            CMD.delta_codec = WB_DELTA_CODEC_LZ;
+        }
+        else if (strcmp(argv[i], "--delta-inplace") == 0) {
+            CMD.delta_inplace = 1;
+        }
+        else if (strcmp(argv[i], "--compress") == 0) {
+            CMD.compress = 1;
+        }
+        else if (strcmp(argv[i], "--batch") == 0) {
+            CMD.batch_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jobs") == 0) {
+            CMD.batch_jobs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sign-daemon") == 0) {
+            CMD.sign_daemon = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sign-socket") == 0) {
+            CMD.sign_socket = argv[++i];
+        }
+        else if (strcmp(argv[i], "--merkle") == 0) {
+            CMD.merkle = 1;
+        }
+        else if (strcmp(argv[i], "--aead") == 0) {
+            CMD.aead = 1;
+        }
         else if (strcmp(argv[i], "--no-ts") == 0) {
             CMD.no_ts = 1;
         }
@@ -2771,7 +4483,32 @@ int main(int argc, char** argv)
     }
 
 
-    if (CMD.sign != NO_SIGN) {
+    if (CMD.sign_daemon != NULL) {
+        /* Only the stateful private key */
+        if ((CMD.batch_file != NULL) || (CMD.sign_socket != NULL) ||
+                CMD.hybrid || CMD.delta || CMD.compress || CMD.sha_only ||
+                CMD.manual_sign) {
+            fprintf(stderr, "--sign-daemon cannot be combined with other "
+                    "signing modes\n");
+            exit(1);
+        }
+        CMD.key_file = argv[i+1];
+    } else if (CMD.batch_file != NULL) {
+        /* Images and versions are listed in the batch file */
+        if (CMD.delta || CMD.compress || CMD.sha_only || CMD.manual_sign) {
+            fprintf(stderr, "--batch cannot be combined with --delta, "
+                    "--compress, --sha-only or --manual-sign\n");
+            exit(1);
+        }
+        if (CMD.sign != NO_SIGN) {
+            CMD.key_file = argv[i+1];
+            if (CMD.hybrid) {
+                CMD.secondary_key_file = argv[i+2];
+                printf("Secondary private key: %s\n", CMD.secondary_key_file);
+                printf("Secondary cipher: %s\n", secondary_sign_str);
+            }
+        }
+    } else if (CMD.sign != NO_SIGN) {
         if (CMD.hybrid) {
             printf("Parsing arguments in hybrid mode\n");
             CMD.image_file = argv[i+1];
@@ -2798,20 +4535,10 @@ int main(int argc, char** argv)
         CMD.fw_version = argv[i+2];
     }
 
-    memset(buf, 0, sizeof(buf));
-    strncpy((char*)buf, CMD.image_file, sizeof(buf)-1);
-    tmpstr = strrchr((char*)buf, '.');
-    if (tmpstr) {
-        *tmpstr = '\0'; /* null terminate at last "." */
+    if ((CMD.batch_file == NULL) && (CMD.sign_daemon == NULL)) {
+        set_output_files(CMD.image_file, CMD.fw_version, (char*)buf,
+                sizeof(buf));
     }
-    snprintf(CMD.output_image_file, sizeof(CMD.output_image_file) - 1,
-            "%s_v%s_%s.bin", (char*)buf, CMD.fw_version,
-            CMD.sha_only ? "digest" : "signed");
-
-    snprintf(CMD.output_encrypted_image_file,
-            sizeof(CMD.output_encrypted_image_file),
-            "%s_v%s_signed_and_encrypted.bin",
-            (char*)buf, CMD.fw_version);
 
     printf("Update type:          %s\n",
             CMD.self_update ? "wolfBoot" : "Firmware");
@@ -2828,7 +4555,13 @@ int main(int argc, char** argv)
                 printf("Encryption Algorithm: AES256-CTR\n");
                 break;
     }
-    printf("Input image:          %s\n", CMD.image_file);
+    if (CMD.sign_daemon != NULL) {
+        printf("Signing daemon:       %s\n", CMD.sign_daemon);
+    } else if (CMD.batch_file != NULL) {
+        printf("Batch file:           %s\n", CMD.batch_file);
+    } else {
+        printf("Input image:          %s\n", CMD.image_file);
+    }
     printf("Selected cipher:      %s\n", sign_str);
     printf("Selected hash  :      %s\n", hash_str);
     if (CMD.sign != NO_SIGN) {
@@ -2848,10 +4581,37 @@ int main(int argc, char** argv)
                 "%s_v%s_signed_diff_encrypted.bin",
                 (char*)buf, CMD.fw_version);
     }
-    printf("Output %6s:        %s\n",    CMD.sha_only ? "digest" : "image",
-            CMD.output_image_file);
-    if (CMD.encrypt) {
-        printf("Encrypted output:     %s\n", CMD.output_encrypted_image_file);
+    if (CMD.compress && CMD.delta) {
+        fprintf(stderr, "--compress cannot be combined with --delta\n");
+        exit(1);
+    }
+    if (CMD.aead) {
+        if (CMD.encrypt == ENC_OFF) {
+            printf("Note: --aead has no effect without --encrypt\n");
+            CMD.aead = 0;
+        }
+        else {
+            /* The tag table is part of the Merkle manifest */
+            CMD.merkle = 1;
+        }
+    }
+    if (CMD.compress) {
+        snprintf(CMD.output_compressed_file,
+                sizeof(CMD.output_compressed_file),
+                "%s_v%s_signed_compressed.bin",
+                (char*)buf, CMD.fw_version);
+        snprintf(CMD.output_encrypted_image_file,
+                sizeof(CMD.output_encrypted_image_file),
+                "%s_v%s_signed_compressed_encrypted.bin",
+                (char*)buf, CMD.fw_version);
+    }
+    if ((CMD.batch_file == NULL) && (CMD.sign_daemon == NULL)) {
+        printf("Output %6s:        %s\n",    CMD.sha_only ? "digest" : "image",
+                CMD.output_image_file);
+        if (CMD.encrypt) {
+            printf("Encrypted output:     %s\n",
+                    CMD.output_encrypted_image_file);
+        }
     }
     printf("Target partition id : %hu ", CMD.partition_id);
     if (CMD.partition_id == HDR_IMG_TYPE_WOLFBOOT)
@@ -2903,15 +4663,44 @@ int main(int argc, char** argv)
         }
     } /* CMD.sign != NO_SIGN */
 
-    if (CMD.hybrid) {
+    if (CMD.sign_socket != NULL) {
+#ifndef _WIN32
+        if ((CMD.sign != SIGN_LMS) && (CMD.sign != SIGN_XMSS) &&
+                (!CMD.hybrid || ((CMD.secondary_sign != SIGN_LMS) &&
+                                 (CMD.secondary_sign != SIGN_XMSS)))) {
+            fprintf(stderr, "--sign-socket requires a stateful key "
+                    "(--lms or --xmss)\n");
+            exit(1);
+        }
+        batch_fd_req = batch_fd_rsp = signd_connect(CMD.sign_socket);
+        if (batch_fd_req < 0)
+            exit(1);
+#else
+        fprintf(stderr, "--sign-socket is not supported on Windows\n");
+        exit(1);
+#endif
+    }
+
+    if (CMD.sign_daemon != NULL) {
+#ifndef _WIN32
+        ret = sign_daemon(CMD.sign_daemon);
+#else
+        fprintf(stderr, "--sign-daemon is not supported on Windows\n");
+        ret = 1;
+#endif
+    } else if (CMD.hybrid) {
         uint8_t *kbuf2 = NULL;
         uint8_t *pubkey2 = NULL;
         uint32_t pubkey_sz2;
         DEBUG_PRINT("Loading secondary key\n");
         kbuf2 = load_key(&key_buffer2, &key_buffer_sz2, &pubkey2, &pubkey_sz2, 1);
         printf("Creating hybrid signature\n");
-        make_hybrid_header(pubkey, pubkey_sz, CMD.image_file, CMD.output_image_file,
-                pubkey2, pubkey_sz2);
+        if (CMD.batch_file != NULL) {
+            ret = sign_batch(pubkey, pubkey_sz, pubkey2, pubkey_sz2);
+        } else {
+            make_hybrid_header(pubkey, pubkey_sz, CMD.image_file,
+                    CMD.output_image_file, pubkey2, pubkey_sz2);
+        }
         DEBUG_PRINT("Signature size: %u\n", CMD.signature_sz);
         DEBUG_PRINT("Secondary signature size: %u\n", CMD.secondary_signature_sz);
         DEBUG_PRINT("Header size: %u\n", CMD.header_sz);
@@ -2919,6 +4708,8 @@ int main(int argc, char** argv)
             free(kbuf2);
         if (pubkey2)
             free(pubkey2);
+    } else if (CMD.batch_file != NULL) {
+        ret = sign_batch(pubkey, pubkey_sz, NULL, 0);
     } else {
         make_header(pubkey, pubkey_sz, CMD.image_file, CMD.output_image_file);
     }
@@ -2930,6 +4721,9 @@ int main(int argc, char** argv)
         else
             ret = base_diff(CMD.delta_base_file, pubkey, pubkey_sz, 16);
     }
+    else if (CMD.compress) {
+        ret = compress_image(pubkey, pubkey_sz);
+    }
 
     /* Add pubkey cleanup */
     if (pubkey)
@@ -127,10 +127,12 @@
 
 /* Chacha stream cipher */
 #define HAVE_CHACHA
+#define HAVE_POLY1305
 
 /* AES */
 #define WOLFSSL_AES_COUNTER
 #define WOLFSSL_AES_DIRECT
+#define HAVE_AESGCM
 
 /* Disables */
 #define NO_CMAC
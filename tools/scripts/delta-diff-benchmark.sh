@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Compares the delta diff engines (WOLFBOOT_DIFF_ENGINE=scan|hash) on pairs
+# of images: patch size and run time of bmdiff.
+# Run from the wolfBoot root directory:
+#
+#   tools/scripts/delta-diff-benchmark.sh base1.bin new1.bin [base2.bin new2.bin ...]
+#
+# The sector size is taken from WOLFBOOT_SECTOR_SIZE (default: 0x1000).
+# Each pair is made of the plain firmware files, as passed to the sign tool
+# with --delta.
+#
+DELTA_DIR=tools/delta
+export WOLFBOOT_SECTOR_SIZE=${WOLFBOOT_SECTOR_SIZE:-0x1000}
+
+if [ $# -lt 2 ] || [ $(($# % 2)) -ne 0 ]; then
+    echo "Usage: $0 base1 new1 [base2 new2 ...]"
+    exit 1
+fi
+
+make -C $DELTA_DIR clean >/dev/null
+rm -f $DELTA_DIR/bmdiff.o
+if ! make -C $DELTA_DIR \
+    CFLAGS="-DDELTA_UPDATES -DWOLFBOOT_SECTOR_SIZE=$((WOLFBOOT_SECTOR_SIZE))" \
+    bmdiff >/dev/null 2>&1; then
+    echo "Build of bmdiff failed"
+    exit 1
+fi
+
+PATCH=$(mktemp)
+echo "base,new,sector_size,base_size,new_size,engine,patch_size,seconds"
+while [ $# -gt 0 ]; do
+    BASE=$1
+    NEW=$2
+    shift 2
+    for ENGINE in scan hash; do
+        START=$(date +%s.%N)
+        if ! WOLFBOOT_DIFF_ENGINE=$ENGINE $DELTA_DIR/bmdiff $BASE $NEW $PATCH \
+            >/dev/null; then
+            echo "bmdiff failed on $BASE $NEW"
+            exit 1
+        fi
+        END=$(date +%s.%N)
+        echo "$BASE,$NEW,$WOLFBOOT_SECTOR_SIZE,$(stat -c %s $BASE),$(stat -c %s $NEW),$ENGINE,$(stat -c %s $PATCH),$(awk "BEGIN { print $END - $START }")"
+    done
+done
+rm -f $PATCH
+exit 0
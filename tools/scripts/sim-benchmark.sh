@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Host-side benchmark of the verify/update paths (see tools/bench.mk).
+# Runs every signature algorithm on the plain simulator configuration, then
+# the delta and encrypted update configurations. Results are collected in a
+# single CSV file, printed at the end.
+# Run from the wolfBoot root directory. Extra arguments are passed to make,
+# e.g. "BENCH_IMAGE_KB=200" or "HASH=SHA384".
+#
+SIGNS=${SIGNS:-"ED25519 ED448 ECC256 ECC384 ECC521 RSA2048 RSA3072 RSA4096"}
+OUT=${BENCH_OUT:-$(pwd)/tools/bench/bench.csv}
+
+rm -f $OUT
+
+run_bench() {
+    CONFIG=$1
+    SIGN=$2
+    shift 2
+    cp config/examples/$CONFIG .config
+    make keysclean >/dev/null 2>&1
+    if ! make bench SIGN=$SIGN BENCH_OUT=$OUT "$@" >/dev/null 2>&1; then
+        echo "Benchmark failed for $CONFIG, SIGN=$SIGN"
+        exit 1
+    fi
+}
+
+for SIGN in $SIGNS; do
+    run_bench sim.config $SIGN "$@"
+done
+run_bench sim-delta-update.config ECC256 "$@"
+run_bench sim-encrypt-update.config ECC256 "$@"
+run_bench sim-encrypt-delta-update.config ECC256 "$@"
+
+cat $OUT
+exit 0
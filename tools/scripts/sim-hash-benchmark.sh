@@ -0,0 +1,26 @@
+#!/bin/bash
+#
+# Hashing throughput on the simulator, for each hash algorithm and chunk size.
+# The simulator is rebuilt for each combination, and the image in the BOOT
+# partition is hashed through wolfBoot_verify_integrity(). Chunk size 0 is
+# HASH_CONTIGUOUS=1 (single call over the whole image).
+# Run from the wolfBoot root directory. Extra arguments are passed to make.
+#
+echo "hash,chunk,MB/s"
+for HASH in SHA256 SHA384 SHA3; do
+    for CHUNK in 64 256 1024 4096 16384 0; do
+        if [ $CHUNK -eq 0 ]; then
+            OPT="HASH_CONTIGUOUS=1"
+        else
+            OPT="SHA_BLOCK_SIZE=$CHUNK"
+        fi
+        cp config/examples/sim.config .config
+        make clean >/dev/null 2>&1
+        if ! make HASH=$HASH $OPT "$@" >/dev/null 2>&1; then
+            echo "Build failed for HASH=$HASH $OPT"
+            exit 1
+        fi
+        ./wolfboot.elf hashbench 2>/dev/null | tail -n +2
+    done
+done
+exit 0
@@ -24,9 +24,23 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "delta.h"
 #define WC_RSA_BLINDING
+
+#ifdef EXT_FLASH
+/* Mock external flash: patch and base image are read from their address */
+static uint32_t ext_flash_reads;
+int ext_flash_read(uintptr_t address, uint8_t *data, int len)
+{
+    memcpy(data, (void *)address, len);
+    ext_flash_reads++;
+    return len;
+}
+#define ext_flash_check_read ext_flash_read
+#endif
+
 #include "delta.c"
 
 #define SRC_SIZE 4096
@@ -98,23 +112,59 @@ static void initialize_buffers(uint8_t *src_a, uint8_t *src_b)
 
 }
 
-START_TEST(test_wb_patch_and_diff)
+static void check_patch(uint8_t *src_a, uint8_t *src_b, uint8_t *patch,
+        uint32_t p_written, uint32_t format, uint32_t codec)
 {
-    WB_DIFF_CTX diff_ctx;
     WB_PATCH_CTX patch_ctx;
-    uint8_t src_a[SRC_SIZE];
-    uint8_t src_b[SRC_SIZE];
-    uint8_t patch[PATCH_SIZE];
     uint8_t patched_dst[DST_SIZE];
+    uint8_t base[SRC_SIZE];
     int ret;
     int i;
-    uint32_t p_written = 0;
 
+    /* The patch is applied in place, like in the BOOT partition: sectors
+     * that have been patched replace the original content in the base */
+    memcpy(base, src_a, SRC_SIZE);
+    ret = wb_patch_init(&patch_ctx, base, SRC_SIZE, patch, p_written);
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(wb_patch_set_format(&patch_ctx, format), 0);
+    ck_assert_int_eq(wb_patch_set_codec(&patch_ctx, codec), 0);
 
-    initialize_buffers(src_a, src_b);
+    /* Apply the patch */
+    for (i = 0; i < SRC_SIZE;)
+    {
+        ret = wb_patch(&patch_ctx, patched_dst + i, DELTA_BLOCK_SIZE);
+        ck_assert_int_ge(ret, 0); /* Should not be 0 until patch is over*/
+        if (ret == 0)
+            break;
+        i += ret;
+        if ((i % wolfboot_sector_size) == 0) {
+            memcpy(base + i - wolfboot_sector_size,
+                   patched_dst + i - wolfboot_sector_size,
+                   wolfboot_sector_size);
+            wb_patch_src_written(&patch_ctx);
+        }
+    }
+    ck_assert_int_gt(i, 0); /* Should not be 0 */
+    ck_assert_int_eq(i, SRC_SIZE); // The patched length should match the buffer size
+
+    /* Verify that the patched destination matches src_b */
+    for (int i = 0; i < SRC_SIZE; ++i) {
+        ck_assert_uint_eq(patched_dst[i], src_b[i]);
+    }
+}
+
+static void patch_and_diff(uint8_t *src_a, uint8_t *src_b, uint32_t format,
+        uint32_t codec)
+{
+    WB_DIFF_CTX diff_ctx;
+    uint8_t patch[PATCH_SIZE];
+    int ret;
+    int i;
+    uint32_t p_written = 0;
 
     ret = wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_b, SRC_SIZE);
     ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(wb_diff_set_format(&diff_ctx, format), 0);
 
     /* Create the patch */
     for (i = 0; i < SRC_SIZE; i += DELTA_BLOCK_SIZE) {
@@ -127,28 +177,571 @@ START_TEST(test_wb_patch_and_diff)
     ck_assert_int_gt(p_written, 0); /* Should not be 0 */
 
     printf("patch size: %u\n", p_written);
-    ret = wb_patch_init(&patch_ctx, src_a, SRC_SIZE, patch, p_written);
-    ck_assert_int_eq(ret, 0);
+    wb_diff_free(&diff_ctx);
+
+    if (codec == WB_DELTA_CODEC_LZ) {
+        uint8_t lz[WB_LZ_BOUND(PATCH_SIZE)];
+        ret = wb_lz_compress(patch, p_written, lz, sizeof(lz));
+        ck_assert_int_gt(ret, 0);
+        printf("compressed patch size: %d\n", ret);
+        memcpy(patch, lz, ret);
+        p_written = ret;
+    }
 
-    /* Apply the patch */
-    for (i = 0; i < SRC_SIZE;)
-    {
-        ret = wb_patch(&patch_ctx, patched_dst + i, DELTA_BLOCK_SIZE);
-        ck_assert_int_ge(ret, 0); /* Should not be 0 until patch is over*/
-        if (ret == 0)
-            break;
-        i += ret;
+    check_patch(src_a, src_b, patch, p_written, format, codec);
+}
+
+START_TEST(test_wb_patch_and_diff)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+
+    initialize_buffers(src_a, src_b);
+    patch_and_diff(src_a, src_b, WB_PATCH_FORMAT_V1, WB_DELTA_CODEC_NONE);
+}
+END_TEST
+
+START_TEST(test_wb_patch_and_diff_literal_runs)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+    WB_DIFF_CTX diff_ctx;
+    WB_PATCH_CTX patch_ctx;
+    uint32_t pseudo_rand = 0x5a5a5a5a;
+    int i;
+
+    initialize_buffers(src_a, src_b);
+
+    /* New content with no match in either image, across a sector
+     * boundary, including escape bytes */
+    for (i = 2000; i < 3300; i++) {
+        pseudo_rand *= 1664525;
+        pseudo_rand += 1013904223;
+        src_b[i] = (uint8_t)(pseudo_rand >> 24);
+        if ((i % 257) == 0)
+            src_b[i] = ESC;
     }
-    ck_assert_int_gt(i, 0); /* Should not be 0 */
-    ck_assert_int_eq(i, SRC_SIZE); // The patched length should match the buffer size
+    patch_and_diff(src_a, src_b, WB_PATCH_FORMAT_V2, WB_DELTA_CODEC_NONE);
+
+    ck_assert_int_eq(wb_patch_init(&patch_ctx, src_a, SRC_SIZE, src_b,
+                SRC_SIZE), 0);
+    ck_assert_int_eq(wb_patch_set_format(&patch_ctx, 0), -1);
+    ck_assert_int_eq(wb_patch_set_format(&patch_ctx,
+                WB_PATCH_FORMAT_MAX + 1), -1);
+
+    /* Literal runs are only produced by the hash engine */
+    setenv("WOLFBOOT_DIFF_ENGINE", "scan", 1);
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_b,
+                SRC_SIZE), 0);
+    ck_assert_int_eq(wb_diff_set_format(&diff_ctx, WB_PATCH_FORMAT_V2), -1);
+    wb_diff_free(&diff_ctx);
+    unsetenv("WOLFBOOT_DIFF_ENGINE");
+}
+END_TEST
 
-    /* Verify that the patched destination matches src_b */
-    for (int i = 0; i < SRC_SIZE; ++i) {
-        ck_assert_uint_eq(patched_dst[i], src_b[i]);
+
+START_TEST(test_wb_patch_and_diff_compressed)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+    uint8_t lz[WB_LZ_BOUND(SRC_SIZE)];
+    uint8_t dst[DELTA_BLOCK_SIZE];
+    WB_PATCH_CTX patch_ctx;
+    int lz_sz;
+    int ret;
+
+    initialize_buffers(src_a, src_b);
+    patch_and_diff(src_a, src_b, WB_PATCH_FORMAT_V1, WB_DELTA_CODEC_LZ);
+    patch_and_diff(src_a, src_b, WB_PATCH_FORMAT_V2, WB_DELTA_CODEC_LZ);
+
+    /* Truncated stream: the patch fails instead of returning stale data */
+    lz_sz = wb_lz_compress(src_b, SRC_SIZE, lz, sizeof(lz));
+    ck_assert_int_gt(lz_sz, 0);
+    ck_assert_int_eq(wb_patch_init(&patch_ctx, src_a, SRC_SIZE, lz,
+                lz_sz / 2), 0);
+    ck_assert_int_eq(wb_patch_set_codec(&patch_ctx, WB_DELTA_CODEC_LZ), 0);
+    do {
+        ret = wb_patch(&patch_ctx, dst, DELTA_BLOCK_SIZE);
+    } while (ret > 0);
+    ck_assert_int_eq(ret, -1);
+
+    ck_assert_int_eq(wb_patch_init(&patch_ctx, src_a, SRC_SIZE, lz, lz_sz), 0);
+    ck_assert_int_eq(wb_patch_set_codec(&patch_ctx, WB_DELTA_CODEC_LZ + 1), -1);
+}
+END_TEST
+
+START_TEST(test_wb_patch_compressed_image)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+    uint8_t lz[WB_LZ_BOUND(SRC_SIZE)];
+    uint8_t dst[DST_SIZE];
+    WB_PATCH_CTX patch_ctx;
+    uint32_t len = 0;
+    int lz_sz;
+    int ret;
+
+    initialize_buffers(src_a, src_b);
+
+    /* Full image: the decompressed stream is copied verbatim, including
+     * escape bytes */
+    lz_sz = wb_lz_compress(src_b, SRC_SIZE, lz, sizeof(lz));
+    ck_assert_int_gt(lz_sz, 0);
+    ck_assert_int_eq(wb_patch_init(&patch_ctx, src_a, SRC_SIZE, lz, lz_sz), 0);
+    ck_assert_int_eq(wb_patch_set_format(&patch_ctx, WB_PATCH_FORMAT_RAW), 0);
+    ck_assert_int_eq(wb_patch_set_codec(&patch_ctx, WB_DELTA_CODEC_LZ), 0);
+    do {
+        ret = wb_patch(&patch_ctx, dst + len, DELTA_BLOCK_SIZE);
+        ck_assert_int_ge(ret, 0);
+        len += ret;
+    } while ((ret > 0) && (len < DST_SIZE));
+    ck_assert_uint_eq(len, SRC_SIZE);
+    ck_assert_int_eq(memcmp(dst, src_b, SRC_SIZE), 0);
+    ck_assert_int_eq(wb_patch(&patch_ctx, dst, DELTA_BLOCK_SIZE), 0);
+}
+END_TEST
+
+#define WIDE_SRC_SIZE (0x1000000 + 0x20000)
+#define WIDE_COPY_OFF 0x1008000
+#define WIDE_COPY_SIZE 0x18000
+
+START_TEST(test_wb_patch_wide_hdr)
+{
+    uint8_t *src = malloc(WIDE_SRC_SIZE);
+    uint8_t *dst = malloc(WIDE_COPY_SIZE + DELTA_BLOCK_SIZE);
+    /* Literal, copy block beyond 16MB larger than 64KB, literal run,
+     * escaped literal */
+    uint8_t patch[] = { 'A', ESC, WIDE_COPY, 0x80, 0x80, 0x82, 0x08,
+        0x80, 0x80, 0x06, ESC, LIT_RUN, 3, 'x', ESC, 'y', ESC, ESC };
+    uint8_t truncated[] = { 'A', ESC, WIDE_COPY, 0x80, 0x80 };
+    WB_PATCH_CTX patch_ctx;
+    uint32_t i, len = 0;
+    int ret;
+
+    ck_assert_ptr_nonnull(src);
+    ck_assert_ptr_nonnull(dst);
+    for (i = 0; i < WIDE_SRC_SIZE; i++)
+        src[i] = (uint8_t)((i * 7) ^ (i >> 8));
+
+    ck_assert_int_eq(wb_patch_init(&patch_ctx, src, WIDE_SRC_SIZE, patch,
+                sizeof(patch)), 0);
+    ck_assert_int_eq(wb_patch_set_format(&patch_ctx, WB_PATCH_FORMAT_V3), 0);
+    do {
+        ret = wb_patch(&patch_ctx, dst + len, DELTA_BLOCK_SIZE);
+        ck_assert_int_ge(ret, 0);
+        len += ret;
+    } while (ret > 0);
+    ck_assert_uint_eq(len, WIDE_COPY_SIZE + 5);
+    ck_assert_uint_eq(dst[0], 'A');
+    ck_assert_int_eq(memcmp(dst + 1, src + WIDE_COPY_OFF, WIDE_COPY_SIZE), 0);
+    ck_assert_int_eq(memcmp(dst + 1 + WIDE_COPY_SIZE, "x\x7fy\x7f", 4), 0);
+
+    /* A truncated header is an error */
+    ck_assert_int_eq(wb_patch_init(&patch_ctx, src, WIDE_SRC_SIZE, truncated,
+                sizeof(truncated)), 0);
+    ck_assert_int_eq(wb_patch_set_format(&patch_ctx, WB_PATCH_FORMAT_V3), 0);
+    ck_assert_int_eq(wb_patch(&patch_ctx, dst, DELTA_BLOCK_SIZE), -1);
+    free(src);
+    free(dst);
+}
+END_TEST
+
+START_TEST(test_wb_patch_and_diff_wide)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+    WB_DIFF_CTX diff_ctx;
+    uint8_t patch[PATCH_SIZE];
+    uint32_t p_written = 0;
+    int ret;
+
+    initialize_buffers(src_a, src_b);
+    patch_and_diff(src_a, src_b, WB_PATCH_FORMAT_V3, WB_DELTA_CODEC_NONE);
+    patch_and_diff(src_a, src_b, WB_PATCH_FORMAT_V3, WB_DELTA_CODEC_LZ);
+
+    /* Identical images: one block per sector, with short headers */
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_a,
+                SRC_SIZE), 0);
+    ck_assert_int_eq(wb_diff_set_format(&diff_ctx, WB_PATCH_FORMAT_V3), 0);
+    do {
+        ret = wb_diff(&diff_ctx, patch + p_written, DELTA_BLOCK_SIZE);
+        ck_assert_int_ge(ret, 0);
+        p_written += ret;
+    } while (ret > 0);
+    wb_diff_free(&diff_ctx);
+    ck_assert_uint_le(p_written, (SRC_SIZE / wolfboot_sector_size) *
+            BLOCK_HDR_SIZE);
+}
+END_TEST
+
+#define LARGE_SECTOR_SIZE 0x20000
+
+START_TEST(test_wb_diff_wide_blocks)
+{
+    uint8_t *src_a = malloc(LARGE_SECTOR_SIZE);
+    uint8_t *src_b = malloc(LARGE_SECTOR_SIZE);
+    uint8_t *dst = malloc(LARGE_SECTOR_SIZE);
+    uint8_t patch[DELTA_BLOCK_SIZE];
+    WB_DIFF_CTX diff_ctx;
+    WB_PATCH_CTX patch_ctx;
+    uint32_t pseudo_rand = 0;
+    uint32_t p_written = 0, len = 0;
+    char *sector_size = strdup(getenv("WOLFBOOT_SECTOR_SIZE"));
+    int i, ret;
+
+    ck_assert_ptr_nonnull(sector_size);
+    ck_assert_ptr_nonnull(src_a);
+    ck_assert_ptr_nonnull(src_b);
+    ck_assert_ptr_nonnull(dst);
+    for (i = 0; i < LARGE_SECTOR_SIZE; i++) {
+        pseudo_rand *= 1664525;
+        pseudo_rand += 1013904223;
+        src_a[i] = (uint8_t)(pseudo_rand >> 24);
+    }
+    memcpy(src_b, src_a, LARGE_SECTOR_SIZE);
+    src_b[100000] ^= 0x55;
+
+    /* Blocks larger than 64KB, within a single sector */
+    setenv("WOLFBOOT_SECTOR_SIZE", "131072", 1);
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, LARGE_SECTOR_SIZE, src_b,
+                LARGE_SECTOR_SIZE), 0);
+    ck_assert_int_eq(wb_diff_set_format(&diff_ctx, WB_PATCH_FORMAT_V3), 0);
+    ret = wb_diff(&diff_ctx, patch, DELTA_BLOCK_SIZE);
+    ck_assert_int_gt(ret, 0);
+    p_written = ret;
+    ck_assert_int_eq(wb_diff(&diff_ctx, patch + p_written,
+                DELTA_BLOCK_SIZE - p_written), 0);
+    wb_diff_free(&diff_ctx);
+    ck_assert_uint_le(p_written, 16);
+
+    ck_assert_int_eq(wb_patch_init(&patch_ctx, src_a, LARGE_SECTOR_SIZE, patch,
+                p_written), 0);
+    ck_assert_int_eq(wb_patch_set_format(&patch_ctx, WB_PATCH_FORMAT_V3), 0);
+    do {
+        ret = wb_patch(&patch_ctx, dst + len, DELTA_BLOCK_SIZE);
+        ck_assert_int_ge(ret, 0);
+        len += ret;
+    } while ((ret > 0) && (len < LARGE_SECTOR_SIZE));
+    ck_assert_uint_eq(len, LARGE_SECTOR_SIZE);
+    ck_assert_int_eq(memcmp(dst, src_b, LARGE_SECTOR_SIZE), 0);
+    setenv("WOLFBOOT_SECTOR_SIZE", sector_size, 1);
+    free(sector_size);
+    free(src_a);
+    free(src_b);
+    free(dst);
+}
+END_TEST
+
+START_TEST(test_wb_diff_sectors)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+    uint8_t src_c[SRC_SIZE];
+    uint8_t patch[WB_DIFF_BOUND(SRC_SIZE)];
+    uint8_t patch_w[WB_DIFF_BOUND(SRC_SIZE)];
+    WB_DIFF_CTX diff_ctx, base_ctx, worker[2];
+    uint32_t ss, sec, p_written, w_written = 0;
+    int ret;
+
+    initialize_buffers(src_a, src_b);
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_b,
+                SRC_SIZE), 0);
+    ck_assert_int_eq(wb_diff_set_format(&diff_ctx, WB_PATCH_FORMAT_V2), 0);
+    ss = wolfboot_sector_size;
+    ck_assert_int_eq(wb_diff_init_worker(&worker[0], &diff_ctx), -1);
+    ck_assert_int_eq(wb_diff_index_b(&diff_ctx), 0);
+    ck_assert_int_eq(wb_diff_sectors(&diff_ctx, 1, SRC_SIZE, patch,
+                sizeof(patch)), -1);
+    ck_assert_int_eq(wb_diff_sectors(&diff_ctx, 0, SRC_SIZE, patch,
+                WB_DIFF_BOUND(SRC_SIZE) - 1), -1);
+
+    /* Whole image in one range */
+    ck_assert_int_eq(wb_diff_init_worker(&worker[0], &diff_ctx), 0);
+    ret = wb_diff_sectors(&worker[0], 0, SRC_SIZE, patch, sizeof(patch));
+    ck_assert_int_gt(ret, 0);
+    p_written = ret;
+    wb_diff_free(&worker[0]);
+    check_patch(src_a, src_b, patch, p_written, WB_PATCH_FORMAT_V2,
+            WB_DELTA_CODEC_NONE);
+
+    /* One sector at a time, alternating between two workers */
+    ck_assert_int_eq(wb_diff_init_worker(&worker[0], &diff_ctx), 0);
+    ck_assert_int_eq(wb_diff_init_worker(&worker[1], &diff_ctx), 0);
+    for (sec = 0; sec < SRC_SIZE / ss; sec++) {
+        ret = wb_diff_sectors(&worker[sec % 2], sec * ss, (sec + 1) * ss,
+                patch_w + w_written, sizeof(patch_w) - w_written);
+        ck_assert_int_gt(ret, 0);
+        w_written += ret;
     }
+    wb_diff_free(&worker[0]);
+    wb_diff_free(&worker[1]);
+    ck_assert_uint_eq(w_written, p_written);
+    ck_assert_int_eq(memcmp(patch, patch_w, p_written), 0);
+
+    /* Another base image, sharing the index of the new image, gives the
+     * same patch as a context of its own */
+    memcpy(src_c, src_a, SRC_SIZE);
+    memset(src_c + 1500, 0x55, 700);
+    ck_assert_int_eq(wb_diff_init_base(&base_ctx, src_c, SRC_SIZE,
+                &diff_ctx), 0);
+    ret = wb_diff_sectors(&base_ctx, 0, SRC_SIZE, patch_w, sizeof(patch_w));
+    ck_assert_int_gt(ret, 0);
+    w_written = ret;
+    wb_diff_free(&base_ctx);
+    wb_diff_free(&diff_ctx);
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_c, SRC_SIZE, src_b,
+                SRC_SIZE), 0);
+    ck_assert_int_eq(wb_diff_set_format(&diff_ctx, WB_PATCH_FORMAT_V2), 0);
+    ret = wb_diff_sectors(&diff_ctx, 0, SRC_SIZE, patch, sizeof(patch));
+    ck_assert_int_gt(ret, 0);
+    wb_diff_free(&diff_ctx);
+    ck_assert_uint_eq(w_written, (uint32_t)ret);
+    ck_assert_int_eq(memcmp(patch, patch_w, w_written), 0);
+    check_patch(src_c, src_b, patch_w, w_written, WB_PATCH_FORMAT_V2,
+            WB_DELTA_CODEC_NONE);
 }
 END_TEST
 
+static uint32_t diff_patch_size(uint8_t *src_a, uint8_t *src_b)
+{
+    WB_DIFF_CTX diff_ctx;
+    uint8_t patch[PATCH_SIZE];
+    uint32_t p_written = 0;
+    int ret;
+
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_b, SRC_SIZE), 0);
+    do {
+        ret = wb_diff(&diff_ctx, patch + p_written, DELTA_BLOCK_SIZE);
+        ck_assert_int_ge(ret, 0);
+        p_written += ret;
+    } while (ret > 0);
+    wb_diff_free(&diff_ctx);
+    return p_written;
+}
+
+START_TEST(test_wb_diff_engines)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+    WB_DIFF_CTX diff_ctx;
+    uint32_t sz_scan, sz_hash;
+
+    initialize_buffers(src_a, src_b);
+
+    setenv("WOLFBOOT_DIFF_ENGINE", "scan", 1);
+    sz_scan = diff_patch_size(src_a, src_b);
+    setenv("WOLFBOOT_DIFF_ENGINE", "hash", 1);
+    sz_hash = diff_patch_size(src_a, src_b);
+    printf("patch size: scan %u, hash %u\n", sz_scan, sz_hash);
+    ck_assert_uint_gt(sz_hash, 0);
+    ck_assert_uint_le(sz_hash, sz_scan);
+
+    setenv("WOLFBOOT_DIFF_ENGINE", "invalid", 1);
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_b, SRC_SIZE), -1);
+    unsetenv("WOLFBOOT_DIFF_ENGINE");
+}
+END_TEST
+
+#ifdef DELTA_CACHE_STATS
+START_TEST(test_wb_patch_cache_stats)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+    uint8_t patch[PATCH_SIZE];
+    uint8_t dst[DST_SIZE];
+    uint8_t base[SRC_SIZE];
+    WB_DIFF_CTX diff_ctx;
+    WB_PATCH_CTX patch_ctx;
+    uint32_t p_written = 0, len = 0;
+    int ret;
+
+    initialize_buffers(src_a, src_b);
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_b,
+                SRC_SIZE), 0);
+    do {
+        ret = wb_diff(&diff_ctx, patch + p_written, DELTA_BLOCK_SIZE);
+        ck_assert_int_ge(ret, 0);
+        p_written += ret;
+    } while (ret > 0);
+    wb_diff_free(&diff_ctx);
+
+    /* Patched in place, see check_patch() */
+    memcpy(base, src_a, SRC_SIZE);
+    ck_assert_int_eq(wb_patch_init(&patch_ctx, base, SRC_SIZE, patch,
+                p_written), 0);
+    do {
+        ret = wb_patch(&patch_ctx, dst + len, DELTA_BLOCK_SIZE);
+        ck_assert_int_ge(ret, 0);
+        len += ret;
+        if ((len % wolfboot_sector_size) == 0) {
+            memcpy(base + len - wolfboot_sector_size,
+                    dst + len - wolfboot_sector_size, wolfboot_sector_size);
+            wb_patch_src_written(&patch_ctx);
+        }
+    } while ((ret > 0) && (len < DST_SIZE));
+    ck_assert_uint_eq(len, DST_SIZE);
+    ck_assert_int_eq(memcmp(dst, src_b, DST_SIZE), 0);
+
+    printf("patch cache: %u hits, %u misses, %u bytes read\n",
+            patch_ctx.stats.patch_hits, patch_ctx.stats.patch_misses,
+            patch_ctx.stats.patch_read);
+    printf("source cache: %u hits, %u misses, %u bytes read\n",
+            patch_ctx.stats.src_hits, patch_ctx.stats.src_misses,
+            patch_ctx.stats.src_read);
+#ifdef EXT_FLASH
+    /* Sequential read: each byte of the patch is read once */
+    ck_assert_uint_eq(patch_ctx.stats.patch_read, p_written);
+    ck_assert_uint_gt(patch_ctx.stats.patch_hits,
+            patch_ctx.stats.patch_misses);
+#endif
+#if defined(EXT_FLASH) && defined(PART_BOOT_EXT)
+    ck_assert_uint_gt(patch_ctx.stats.src_misses, 0);
+    ck_assert_uint_le(patch_ctx.stats.src_read, 2 * SRC_SIZE);
+#endif
+}
+END_TEST
+#endif
+
+#ifdef DELTA_INPLACE
+/* Applies an in-place patch to 'part' the way wolfBoot_delta_inplace() does,
+ * keeping the per-step flags in 'flags'. Returns 1 when interrupted by a
+ * simulated power failure at step 'stop'.
+ */
+static int apply_inplace(uint8_t *part, uint8_t *swap, uint8_t *patch,
+        uint32_t len, int stop, uint8_t *flags)
+{
+    const uint32_t ss = wolfboot_sector_size;
+    struct wb_inplace_hdr hdr;
+    struct wb_inplace_op op;
+    WB_PATCH_CTX patch_ctx;
+    uint8_t blk[DELTA_BLOCK_SIZE];
+    uint32_t step, plan_sz, off, sz, done;
+    int ret;
+
+    memcpy(&hdr, patch, sizeof(hdr));
+    plan_sz = WB_INPLACE_PLAN_SIZE(hdr.n_ops);
+    ck_assert_uint_ge(len, plan_sz);
+    memset(&patch_ctx, 0, sizeof(patch_ctx));
+    if (len > plan_sz) {
+        ck_assert_int_eq(wb_patch_init(&patch_ctx, part, SRC_SIZE,
+                    patch + plan_sz, len - plan_sz), 0);
+        ck_assert_int_eq(wb_patch_set_format(&patch_ctx, WB_PATCH_FORMAT_V2), 0);
+    }
+    for (step = 0; step < hdr.n_ops; step++) {
+        memcpy(&op, patch + WB_INPLACE_PLAN_SIZE(step), sizeof(op));
+        off = op.sector * ss;
+        if (op.flags & WB_INPLACE_ERASE) {
+            if ((int)step == stop)
+                return 1;
+            memset(part + off, 0xFF, ss);
+            flags[step] = 2;
+            continue;
+        }
+        if ((op.flags & WB_INPLACE_SAVE) && (flags[step] == 0)) {
+            if ((int)step == stop) {
+                memset(swap, 0x5A, ss);
+                return 1;
+            }
+            memcpy(swap, part + off, ss);
+            flags[step] = 1;
+        }
+        if (op.flags & WB_INPLACE_SAVE)
+            ck_assert_int_eq(wb_patch_set_saved(&patch_ctx, off, swap, ss), 0);
+        if (flags[step] == 0)
+            flags[step] = 1;
+        if (flags[step] == 1) {
+            memset(part + off, 0xFF, ss);
+            if ((int)step == stop) {
+                memset(part + off, 0xA5, ss / 2);
+                return 1;
+            }
+        }
+        sz = hdr.img_size - off;
+        if (sz > ss)
+            sz = ss;
+        for (done = 0; done < sz; done += ret) {
+            ret = wb_patch(&patch_ctx, blk, (sz - done) < DELTA_BLOCK_SIZE ?
+                    (sz - done) : DELTA_BLOCK_SIZE);
+            ck_assert_int_gt(ret, 0);
+            if (flags[step] == 1)
+                memcpy(part + off + done, blk, ret);
+        }
+        flags[step] = 2;
+    }
+    return 0;
+}
+
+START_TEST(test_wb_diff_inplace)
+{
+    uint8_t src_a[SRC_SIZE];
+    uint8_t src_b[SRC_SIZE];
+    uint8_t part[SRC_SIZE];
+    uint8_t swap[SRC_SIZE];
+    uint8_t flags[16];
+    uint8_t *patch;
+    struct wb_inplace_hdr hdr;
+    struct wb_inplace_op op;
+    WB_DIFF_CTX diff_ctx;
+    uint32_t ss, b_size, plan_sz, i, saves = 0;
+    int len, stop;
+
+    initialize_buffers(src_a, src_b);
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_b,
+                SRC_SIZE), 0);
+    ss = wolfboot_sector_size;
+    wb_diff_free(&diff_ctx);
+    ck_assert_uint_ge(SRC_SIZE / ss, 4);
+
+    /* New image: first two sectors swapped, a modified copy of the last
+     * sector and one sector shorter than the base image
+     */
+    b_size = SRC_SIZE - ss;
+    memcpy(src_b, src_a + ss, ss);
+    memcpy(src_b + ss, src_a, ss);
+    memcpy(src_b + b_size - ss, src_a + SRC_SIZE - ss, ss);
+    src_b[b_size - 10] ^= 0x55;
+
+    patch = malloc(WB_DIFF_INPLACE_BOUND(SRC_SIZE, SRC_SIZE / ss));
+    ck_assert_ptr_nonnull(patch);
+    ck_assert_int_eq(wb_diff_init(&diff_ctx, src_a, SRC_SIZE, src_b,
+                b_size), 0);
+    ck_assert_int_eq(wb_diff_set_format(&diff_ctx, WB_PATCH_FORMAT_V2), 0);
+    len = wb_diff_inplace(&diff_ctx, patch,
+            WB_DIFF_INPLACE_BOUND(SRC_SIZE, SRC_SIZE / ss), &plan_sz);
+    wb_diff_free(&diff_ctx);
+    ck_assert_int_gt(len, 0);
+
+    memcpy(&hdr, patch, sizeof(hdr));
+    ck_assert_uint_eq(hdr.img_size, b_size);
+    ck_assert_uint_eq(plan_sz, WB_INPLACE_PLAN_SIZE(hdr.n_ops));
+    ck_assert_uint_lt(hdr.n_ops, sizeof(flags));
+    for (i = 0; i < hdr.n_ops; i++) {
+        memcpy(&op, patch + WB_INPLACE_PLAN_SIZE(i), sizeof(op));
+        if (op.flags & WB_INPLACE_SAVE)
+            saves++;
+    }
+    /* The swapped sectors need one of them saved */
+    ck_assert_uint_eq(saves, 1);
+    memcpy(&op, patch + WB_INPLACE_PLAN_SIZE(hdr.n_ops - 1), sizeof(op));
+    ck_assert_uint_eq(op.flags, WB_INPLACE_ERASE);
+    ck_assert_uint_eq(op.sector, SRC_SIZE / ss - 1);
+
+    /* Uninterrupted, then resumed after a power failure at each step */
+    for (stop = -1; stop < (int)hdr.n_ops; stop++) {
+        memcpy(part, src_a, SRC_SIZE);
+        memset(flags, 0, sizeof(flags));
+        if (stop >= 0)
+            ck_assert_int_eq(apply_inplace(part, swap, patch, len, stop,
+                        flags), 1);
+        ck_assert_int_eq(apply_inplace(part, swap, patch, len, -1, flags), 0);
+        ck_assert_int_eq(memcmp(part, src_b, b_size), 0);
+        for (i = b_size; i < SRC_SIZE; i++)
+            ck_assert_uint_eq(part[i], 0xFF);
+    }
+    free(patch);
+}
+END_TEST
+#endif
 
 Suite *patch_diff_suite(void)
 {
@@ -163,6 +756,20 @@ Suite *patch_diff_suite(void)
     tcase_add_test(tc_wolfboot_delta, test_wb_patch_init_invalid);
     tcase_add_test(tc_wolfboot_delta, test_wb_diff_init_invalid);
     tcase_add_test(tc_wolfboot_delta, test_wb_patch_and_diff);
+    tcase_add_test(tc_wolfboot_delta, test_wb_patch_and_diff_literal_runs);
+    tcase_add_test(tc_wolfboot_delta, test_wb_patch_and_diff_compressed);
+    tcase_add_test(tc_wolfboot_delta, test_wb_patch_compressed_image);
+    tcase_add_test(tc_wolfboot_delta, test_wb_patch_wide_hdr);
+    tcase_add_test(tc_wolfboot_delta, test_wb_patch_and_diff_wide);
+    tcase_add_test(tc_wolfboot_delta, test_wb_diff_wide_blocks);
+    tcase_add_test(tc_wolfboot_delta, test_wb_diff_sectors);
+    tcase_add_test(tc_wolfboot_delta, test_wb_diff_engines);
+#ifdef DELTA_CACHE_STATS
+    tcase_add_test(tc_wolfboot_delta, test_wb_patch_cache_stats);
+#endif
+#ifdef DELTA_INPLACE
+    tcase_add_test(tc_wolfboot_delta, test_wb_diff_inplace);
+#endif
     suite_add_tcase(s, tc_wolfboot_delta);
 
     return s;
@@ -39,6 +39,13 @@
 #if defined(ENCRYPT_WITH_CHACHA)
     #define HAVE_CHACHA
 #endif
+#if defined(ENCRYPT_AEAD) && defined(ENCRYPT_WITH_CHACHA)
+    #define HAVE_POLY1305
+#elif defined(ENCRYPT_AEAD)
+    #define HAVE_AESGCM
+    #define WOLFSSL_AESGCM_STREAM
+    #define GCM_SMALL
+#endif
 
 #define ENCRYPT_KEY "123456789abcdef0123456789abcdef0123456789abcdef"
 #include <stdio.h>
@@ -58,6 +65,10 @@
 #if defined(ENCRYPT_WITH_CHACHA)
     #include "wolfcrypt/src/chacha.c"
 #endif
+#if defined(ENCRYPT_AEAD) && defined(ENCRYPT_WITH_CHACHA)
+    #include "wolfcrypt/src/poly1305.c"
+    #include "wolfcrypt/src/chacha20_poly1305.c"
+#endif
 
 /* Mocks */
 
@@ -118,6 +129,37 @@ int ext_flash_write(uintptr_t address, const uint8_t *data, int len) {
     return 0;
 }
 
+#ifdef EXT_FLASH_ASYNC
+/* The transfer is only copied in the destination buffer on completion */
+static struct {
+    uintptr_t address;
+    uint8_t *data;
+    int len;
+    int busy;
+} ext_async;
+
+int ext_flash_read_start(uintptr_t address, uint8_t *data, int len) {
+    ck_assert_msg(!ext_async.busy, "Transfer already in flight\n");
+    ck_assert_int_le(address + len, FLASH_SIZE);
+    ext_async.address = address;
+    ext_async.data = data;
+    ext_async.len = len;
+    ext_async.busy = 1;
+    return 0;
+}
+
+int ext_flash_read_poll(void) {
+    return ext_async.busy;
+}
+
+int ext_flash_read_complete(void) {
+    ck_assert_msg(ext_async.busy, "No transfer in flight\n");
+    memcpy(ext_async.data, &flash[ext_async.address], ext_async.len);
+    ext_async.busy = 0;
+    return ext_async.len;
+}
+#endif
+
 int ext_flash_erase(uintptr_t address, int len) {
     /* Check that the erase address and size are within the bounds of the flash memory */
     ck_assert_int_le(address + len, FLASH_SIZE);
@@ -260,6 +302,130 @@ START_TEST(test_ext_enc_flash_operations) {
 }
 END_TEST
 
+#ifdef EXT_ENCRYPTED
+START_TEST(test_ext_enc_flash_bulk) {
+    uint32_t address = 0x2000;
+    uint32_t size = 2 * NVM_CACHE_SIZE + 3 * ENCRYPT_BLOCK_SIZE;
+    static uint8_t plain[4 * WOLFBOOT_SECTOR_SIZE];
+    static uint8_t cipher[4 * WOLFBOOT_SECTOR_SIZE];
+    static uint8_t data[4 * WOLFBOOT_SECTOR_SIZE];
+    uint32_t i;
+    int rres, wres;
+
+    for (i = 0; i < size; i++)
+        plain[i] = (uint8_t)(i * 7 + (i >> 8));
+
+    /* Runs longer than the cache are written in one call */
+    wres = ext_flash_check_write(address, plain, size);
+    ck_assert_int_eq(wres, 0);
+    memcpy(cipher, &flash[address], size);
+    ck_assert_msg(memcmp(cipher, plain, size) != 0, "Data not encrypted\n");
+
+    /* Same ciphertext as writing one block at a time */
+    memset(&flash[address], 0xFF, size);
+    for (i = 0; i < size; i += ENCRYPT_BLOCK_SIZE) {
+        wres = ext_flash_check_write(address + i, plain + i,
+                ENCRYPT_BLOCK_SIZE);
+        ck_assert_int_eq(wres, 0);
+    }
+    ck_assert_mem_eq(&flash[address], cipher, size);
+
+    /* Aligned and unaligned reads of the whole run */
+    rres = ext_flash_check_read(address, data, size);
+    ck_assert_int_eq(rres, size);
+    ck_assert_mem_eq(data, plain, size);
+    rres = ext_flash_check_read(address + 5, data, size - 13);
+    ck_assert_int_eq(rres, size - 13);
+    ck_assert_mem_eq(data, plain + 5, size - 13);
+#ifdef EXT_FLASH_ASYNC
+    ck_assert_msg(!ext_async.busy, "Transfer left in flight\n");
+#endif
+}
+END_TEST
+#endif
+
+#ifdef ENCRYPT_AEAD
+/* Reference tag, computed in one pass over the ciphertext in flash */
+static void aead_ref_tag(const uint8_t *key, const uint8_t *nonce,
+    uint32_t sector, uintptr_t address, uint32_t len, uint8_t *tag)
+{
+    uint8_t iv[ENCRYPT_AEAD_NONCE_SIZE];
+    int ret;
+#ifndef ENCRYPT_WITH_CHACHA
+    Aes gcm;
+#endif
+
+    memcpy(iv, nonce, ENCRYPT_AEAD_NONCE_SIZE);
+    iv[11] ^= (uint8_t)(sector + 1);
+#ifdef ENCRYPT_WITH_CHACHA
+    ret = wc_ChaCha20Poly1305_Encrypt(key, iv, &flash[address], len,
+            NULL, 0, NULL, tag);
+#else
+    wc_AesInit(&gcm, NULL, INVALID_DEVID);
+    ret = wc_AesGcmSetKey(&gcm, key, ENCRYPT_KEY_SIZE);
+    if (ret == 0)
+        ret = wc_AesGcmEncrypt(&gcm, NULL, NULL, 0, iv,
+                ENCRYPT_AEAD_NONCE_SIZE, tag, ENCRYPT_AEAD_TAG_SIZE,
+                &flash[address], len);
+    wc_AesFree(&gcm);
+#endif
+    ck_assert_int_eq(ret, 0);
+}
+
+START_TEST(test_ext_enc_flash_aead) {
+    uint32_t address = 0x2000;
+    uint32_t start = address + 5;
+    uint32_t len = 2 * NVM_CACHE_SIZE + 3 * ENCRYPT_BLOCK_SIZE - 13;
+    static uint8_t plain[4 * WOLFBOOT_SECTOR_SIZE];
+    static uint8_t data[4 * WOLFBOOT_SECTOR_SIZE];
+    const uint8_t *key = (const uint8_t *)ENCRYPT_KEY;
+    const uint8_t *nonce = key + ENCRYPT_KEY_SIZE;
+    uint8_t tag[ENCRYPT_AEAD_TAG_SIZE];
+    uint32_t i, size = 2 * NVM_CACHE_SIZE + 4 * ENCRYPT_BLOCK_SIZE;
+    int ret;
+
+    for (i = 0; i < size; i++)
+        plain[i] = (uint8_t)(i * 13 + (i >> 8));
+    ck_assert_int_eq(ext_flash_check_write(address, plain, size), 0);
+    aead_ref_tag(key, nonce, 3, start, len, tag);
+
+    /* The tag is computed while the sector is decrypted, in several reads
+     * that go past both ends of the authenticated range */
+    ck_assert_int_eq(aead_sector_init(key, nonce, 3, start, len), 0);
+    ck_assert_int_eq(ext_flash_check_read(address, data, 100), 100);
+    ck_assert_int_eq(ext_flash_check_read(address + 100, data + 100,
+            size - 100), size - 100);
+    ck_assert_mem_eq(data, plain, size);
+    ck_assert_int_eq(aead_sector_final(tag), 0);
+
+    /* Wrong sector index */
+    ck_assert_int_eq(aead_sector_init(key, nonce, 4, start, len), 0);
+    ext_flash_check_read(address, data, size);
+    ck_assert_int_eq(aead_sector_final(tag), -1);
+
+    /* Tampered ciphertext */
+    flash[start + 200] ^= 0x01;
+    ck_assert_int_eq(aead_sector_init(key, nonce, 3, start, len), 0);
+    ext_flash_check_read(address, data, size);
+    ck_assert_int_eq(aead_sector_final(tag), -1);
+    flash[start + 200] ^= 0x01;
+
+    /* Part of the range was not read */
+    ck_assert_int_eq(aead_sector_init(key, nonce, 3, start, len), 0);
+    ext_flash_check_read(address, data, 100);
+    ext_flash_check_read(address + 200, data, size - 200);
+    ck_assert_int_eq(aead_sector_final(tag), -1);
+    ck_assert_int_eq(aead_sector_init(key, nonce, 3, start, len), 0);
+    ext_flash_check_read(address, data, 100);
+    ck_assert_int_eq(aead_sector_final(tag), -1);
+
+    /* Reads are not authenticated once the tag is checked */
+    ext_flash_check_read(address, data, size);
+    ck_assert_int_eq(aead_win.state, 0);
+}
+END_TEST
+#endif
+
 
 
 Suite *wolfboot_suite(void)
@@ -271,15 +437,35 @@ Suite *wolfboot_suite(void)
     /* Test cases */
     TCase *ext_flash_operations  = tcase_create("External flash operations: API");
     TCase *ext_enc_flash_operations  = tcase_create("External encrypted flash operations");
+#ifdef EXT_ENCRYPTED
+    TCase *ext_enc_flash_bulk  = tcase_create("External encrypted flash: bulk runs");
+#endif
+#ifdef ENCRYPT_AEAD
+    TCase *ext_enc_flash_aead  = tcase_create("External encrypted flash: sector tags");
+#endif
 
     /* Set parameters + add to suite */
     tcase_add_test(ext_flash_operations, test_ext_flash_operations);
     tcase_add_test(ext_enc_flash_operations, test_ext_enc_flash_operations);
+#ifdef EXT_ENCRYPTED
+    tcase_add_test(ext_enc_flash_bulk, test_ext_enc_flash_bulk);
+#endif
+#ifdef ENCRYPT_AEAD
+    tcase_add_test(ext_enc_flash_aead, test_ext_enc_flash_aead);
+#endif
 
     tcase_set_timeout(ext_flash_operations, 20);
     tcase_set_timeout(ext_enc_flash_operations, 20);
     suite_add_tcase(s, ext_flash_operations);
     suite_add_tcase(s, ext_enc_flash_operations);
+#ifdef EXT_ENCRYPTED
+    tcase_set_timeout(ext_enc_flash_bulk, 20);
+    suite_add_tcase(s, ext_enc_flash_bulk);
+#endif
+#ifdef ENCRYPT_AEAD
+    tcase_set_timeout(ext_enc_flash_aead, 20);
+    suite_add_tcase(s, ext_enc_flash_aead);
+#endif
 
     return s;
 }
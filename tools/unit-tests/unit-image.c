@@ -50,6 +50,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+#include <pthread.h>
+#endif
 #include "user_settings.h"
 #include "wolfssl/wolfcrypt/sha.h"
 #include "wolfboot/wolfboot.h"
@@ -69,6 +72,14 @@ static int find_header_fail = 0;
 static int find_header_called = 0;
 static int find_header_mocked = 1;
 
+#ifdef WOLFBOOT_VERIFY_CACHE
+static struct wolfBoot_verify_cache verify_cache_mock;
+static int verify_cache_stored = 0;
+static uint32_t erase_count_mock = 0;
+static uint8_t verify_cache_key_mock = 0xA5;
+static int verify_cache_key_fail = 0;
+#endif
+
 static const unsigned char pubkey_digest[SHA256_DIGEST_SIZE] = {
   0x17, 0x20, 0xa5, 0x9b, 0xe0, 0x9b, 0x80, 0x0c, 0xaa, 0xc4, 0xf5, 0x3f,
   0xae, 0xe5, 0x72, 0x4f, 0xf2, 0x1f, 0x33, 0x53, 0xd1, 0xd4, 0xcd, 0x8b,
@@ -251,6 +262,75 @@ uint16_t wolfBoot_find_header(uint8_t *haystack, uint16_t type, uint8_t **ptr)
     }
 }
 
+#ifdef WOLFBOOT_VERIFY_CACHE
+int wolfBoot_get_verify_cache(struct wolfBoot_verify_cache *rec)
+{
+    memcpy(rec, &verify_cache_mock, sizeof(*rec));
+    return 0;
+}
+
+int wolfBoot_set_verify_cache(const struct wolfBoot_verify_cache *rec)
+{
+    uint8_t *p = (uint8_t *)&verify_cache_mock;
+    uint32_t i;
+    for (i = 0; i < sizeof(verify_cache_mock); i++) {
+        if (p[i] != FLASH_BYTE_ERASED)
+            return -1;
+    }
+    memcpy(&verify_cache_mock, rec, sizeof(*rec));
+    verify_cache_stored++;
+    return 0;
+}
+
+uint32_t wolfBoot_get_erase_count(uint8_t part)
+{
+    (void)part;
+    return erase_count_mock;
+}
+
+int wolfBoot_get_verify_cache_key(uint8_t *key, uint32_t len)
+{
+    if (verify_cache_key_fail)
+        return -1;
+    memset(key, verify_cache_key_mock, len);
+    return 0;
+}
+#endif /* WOLFBOOT_VERIFY_CACHE */
+
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+/* Secondary core worker, backed by a thread */
+static pthread_t worker_thread;
+static void (*worker_job)(void *arg);
+static void *worker_arg;
+static int worker_busy = 0;
+static int worker_started = 0;
+
+static void *worker_main(void *unused)
+{
+    (void)unused;
+    worker_job(worker_arg);
+    return NULL;
+}
+
+int hal_worker_start(void (*job)(void *arg), void *arg)
+{
+    ck_assert_msg(!worker_busy, "Worker already busy\n");
+    worker_job = job;
+    worker_arg = arg;
+    if (pthread_create(&worker_thread, NULL, worker_main, NULL) != 0)
+        return -1;
+    worker_busy = 1;
+    worker_started++;
+    return 0;
+}
+
+void hal_worker_wait(void)
+{
+    ck_assert_msg(worker_busy, "Wait without a job\n");
+    pthread_join(worker_thread, NULL);
+    worker_busy = 0;
+}
+#endif /* WOLFBOOT_PARALLEL_VERIFY */
 
 int wc_ecc_init(ecc_key* key) {
     if (ecc_init_fail)
@@ -554,6 +634,291 @@ START_TEST(test_open_image)
 }
 END_TEST
 
+#if defined(WOLFBOOT_MERKLE) || defined(WOLFBOOT_HASH_CONTIGUOUS) || \
+    defined(WOLFBOOT_VERIFY_CACHE)
+/* Build the manifest header of a test image, with the firmware stored right
+ * after it: magic, size, version 1, then the Merkle sector size and leaf
+ * table if 'n_leaves' is not zero, then the digest TLV. With a leaf table the
+ * digest covers the header only (the Merkle root), otherwise it covers the
+ * header and the firmware. Returns the offset of the digest in the header. */
+static uint32_t build_test_header(uint8_t *hdr, uint32_t fw_size,
+    const uint8_t *leaves, uint32_t n_leaves)
+{
+    uint32_t off = 16, word;
+    wc_Sha256 sha;
+
+    memset(hdr, 0xFF, 256);
+    memcpy(hdr, "WOLF", 4);
+    memcpy(hdr + 4, &fw_size, 4);
+    hdr[8] = HDR_VERSION; hdr[9] = 0; hdr[10] = 4; hdr[11] = 0;
+    word = 1;
+    memcpy(hdr + 12, &word, 4);
+    if (n_leaves > 0) {
+        hdr[16] = HDR_IMG_MERKLE_SECTOR_SIZE; hdr[17] = 0;
+        hdr[18] = 4; hdr[19] = 0;
+        word = WOLFBOOT_SECTOR_SIZE;
+        memcpy(hdr + 20, &word, 4);
+        hdr[28] = HDR_IMG_MERKLE_LEAVES; hdr[29] = 0;
+        hdr[30] = (uint8_t)(n_leaves * SHA256_DIGEST_SIZE);
+        hdr[31] = (uint8_t)((n_leaves * SHA256_DIGEST_SIZE) >> 8);
+        memcpy(hdr + 32, leaves, n_leaves * SHA256_DIGEST_SIZE);
+        off = 32 + (n_leaves * SHA256_DIGEST_SIZE);
+    }
+    hdr[off] = HDR_SHA256; hdr[off + 1] = 0;
+    hdr[off + 2] = SHA256_DIGEST_SIZE; hdr[off + 3] = 0;
+    wc_InitSha256(&sha);
+    wc_Sha256Update(&sha, hdr, off);
+    if (n_leaves == 0)
+        wc_Sha256Update(&sha, hdr + 256, fw_size);
+    wc_Sha256Final(&sha, hdr + off + 4);
+    return off + 4;
+}
+#endif
+
+#ifdef WOLFBOOT_MERKLE
+/* Leaf hashes of a test image with a 256 bytes header, one per sector */
+static uint32_t build_test_leaves(const uint8_t *fw, uint32_t fw_size,
+    uint8_t *leaves)
+{
+    uint32_t i, start, end;
+    uint32_t n = (fw_size + 256 + WOLFBOOT_SECTOR_SIZE - 1) /
+        WOLFBOOT_SECTOR_SIZE;
+
+    for (i = 0; i < n; i++) {
+        start = (i == 0) ? 0 : (i * WOLFBOOT_SECTOR_SIZE) - 256;
+        end = ((i + 1) * WOLFBOOT_SECTOR_SIZE) - 256;
+        if (end > fw_size)
+            end = fw_size;
+        wc_Sha256Hash(fw + start, end - start,
+                leaves + (i * SHA256_DIGEST_SIZE));
+    }
+    return n;
+}
+
+START_TEST(test_merkle)
+{
+    static uint8_t merkle_img[256 + 1500];
+    uint8_t *hdr = merkle_img;
+    uint8_t *fw = merkle_img + 256;
+    uint8_t leaves[2 * SHA256_DIGEST_SIZE];
+    uint32_t i;
+    uint8_t corrupt = 0x00;
+    struct wolfBoot_image img;
+    int ret;
+
+    /* Manifest: version, sector size, 2 leaves, digest of the header */
+    for (i = 0; i < 1500; i++)
+        fw[i] = (uint8_t)i;
+    ck_assert_uint_eq(build_test_leaves(fw, 1500, leaves), 2);
+    build_test_header(hdr, 1500, leaves, 2);
+
+    find_header_mocked = 0;
+    find_header_fail = 0;
+    hdr_cpy_done = 0;
+    ext_flash_erase(WOLFBOOT_PARTITION_UPDATE_ADDRESS,
+            2 * WOLFBOOT_SECTOR_SIZE);
+    ext_flash_write(WOLFBOOT_PARTITION_UPDATE_ADDRESS, merkle_img,
+            sizeof(merkle_img));
+    ret = wolfBoot_open_image(&img, PART_UPDATE);
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(wolfBoot_merkle_sectors(&img), 2);
+
+    /* Sectors are not trusted until the root is verified */
+    ck_assert_int_eq(wolfBoot_merkle_verify_sector(&img, 0), -1);
+    ck_assert_int_eq(wolfBoot_merkle_verify_root(&img), 0);
+    ck_assert_int_eq(wolfBoot_merkle_verify_sector(&img, 0), 0);
+    ck_assert_int_eq(wolfBoot_merkle_verify_sector(&img, 1), 0);
+    ck_assert_int_eq(wolfBoot_merkle_verify_sector(&img, 2), -1);
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), 0);
+
+    /* Corrupt the second sector */
+    ext_flash_write(WOLFBOOT_PARTITION_UPDATE_ADDRESS +
+            WOLFBOOT_SECTOR_SIZE + 10, &corrupt, 1);
+    ck_assert_int_eq(wolfBoot_merkle_verify_sector(&img, 0), 0);
+    ck_assert_int_eq(wolfBoot_merkle_verify_sector(&img, 1), -1);
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    ck_assert_uint_eq(img.sha_ok, 0);
+}
+END_TEST
+
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+START_TEST(test_merkle_parallel)
+{
+    static uint8_t merkle_img[256 + 2500];
+    uint8_t *hdr = merkle_img;
+    uint8_t *fw = merkle_img + 256;
+    uint8_t leaves[3 * SHA256_DIGEST_SIZE];
+    uint32_t i;
+    struct wolfBoot_image img;
+
+    /* Manifest: version, sector size, 3 leaves, digest of the header */
+    for (i = 0; i < 2500; i++)
+        fw[i] = (uint8_t)(i * 3);
+    ck_assert_uint_eq(build_test_leaves(fw, 2500, leaves), 3);
+    build_test_header(hdr, 2500, leaves, 3);
+
+    /* Image loaded in RAM: the last 2 sectors go to the worker */
+    find_header_mocked = 0;
+    find_header_fail = 0;
+    memset(&img, 0, sizeof(img));
+    img.part = PART_UPDATE;
+    img.not_ext = 1;
+    ck_assert_int_eq(wolfBoot_open_image_address(&img, merkle_img), 0);
+    ck_assert_int_eq(wolfBoot_merkle_sectors(&img), 3);
+    worker_started = 0;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), 0);
+    ck_assert_int_eq(worker_started, 1);
+    ck_assert_uint_eq(img.sha_ok, 1);
+
+    /* A corrupted sector is detected on either core */
+    fw[2000] ^= 0x01;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    ck_assert_uint_eq(img.sha_ok, 0);
+    fw[2000] ^= 0x01;
+    fw[10] ^= 0x01;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    ck_assert_uint_eq(img.sha_ok, 0);
+    ck_assert_int_eq(worker_started, 3);
+    ck_assert_int_eq(worker_busy, 0);
+}
+END_TEST
+#endif /* WOLFBOOT_PARALLEL_VERIFY */
+
+#endif /* WOLFBOOT_MERKLE */
+
+#ifdef WOLFBOOT_HASH_CONTIGUOUS
+START_TEST(test_hash_contiguous)
+{
+    static uint8_t contig_img[256 + 1000];
+    uint8_t *hdr = contig_img;
+    uint8_t *fw = contig_img + 256;
+    struct wolfBoot_image img;
+    uint32_t i;
+
+    for (i = 0; i < 1000; i++)
+        fw[i] = (uint8_t)(i * 3);
+    build_test_header(hdr, 1000, NULL, 0);
+
+    find_header_mocked = 0;
+    find_header_fail = 0;
+    memset(&img, 0, sizeof(img));
+    img.part = PART_UPDATE;
+    img.not_ext = 1;
+    ck_assert_int_eq(wolfBoot_open_image_address(&img, contig_img), 0);
+
+    /* Memory-mapped image: the remaining firmware is hashed in one call,
+     * both in an internal partition and in a copy of an external one */
+    img.part = PART_BOOT;
+    ck_assert_uint_eq(get_sha_block_size(&img, 0), 1000);
+    img.not_ext = 0;
+    ck_assert_uint_eq(get_sha_block_size(&img, 100), 900);
+    img.part = PART_UPDATE;
+    img.not_ext = 1;
+    ck_assert_uint_eq(get_sha_block_size(&img, 0), 1000);
+    ck_assert_uint_eq(get_sha_block_size(&img, 100), 900);
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), 0);
+    fw[999] ^= 0x01;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    fw[999] ^= 0x01;
+
+    /* Image on external flash: read in WOLFBOOT_SHA_BLOCK_SIZE blocks */
+    img.not_ext = 0;
+    ck_assert_uint_eq(get_sha_block_size(&img, 0), WOLFBOOT_SHA_BLOCK_SIZE);
+    ck_assert_uint_eq(get_sha_block_size(&img, 900), 100);
+}
+END_TEST
+#endif
+
+#ifdef WOLFBOOT_VERIFY_CACHE
+START_TEST(test_verify_cache)
+{
+    static uint8_t cache_img[256 + 1000];
+    uint8_t *hdr = cache_img;
+    uint8_t *fw = cache_img + 256;
+    uint8_t key[SHA256_DIGEST_SIZE], mac[SHA256_DIGEST_SIZE];
+    Hmac hmac;
+    struct wolfBoot_image img;
+    uint32_t i, digest_off;
+
+    /* Manifest: version, digest of the header and firmware */
+    for (i = 0; i < 1000; i++)
+        fw[i] = (uint8_t)(i * 7);
+    digest_off = build_test_header(hdr, 1000, NULL, 0);
+
+    find_header_mocked = 0;
+    find_header_fail = 0;
+    memset(&verify_cache_mock, FLASH_BYTE_ERASED, sizeof(verify_cache_mock));
+    verify_cache_stored = 0;
+    erase_count_mock = 0;
+    memset(&img, 0, sizeof(img));
+    img.part = PART_BOOT;
+    img.not_ext = 1;
+    ck_assert_int_eq(wolfBoot_open_image_address(&img, cache_img), 0);
+
+    /* First boot: full verification, record is stored */
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), 0);
+    ck_assert_int_eq(verify_cache_stored, 1);
+    ck_assert_uint_eq(verify_cache_mock.magic, WOLFBOOT_VERIFY_CACHE_MAGIC);
+
+    /* The record is authenticated with HMAC-SHA256 */
+    memset(key, verify_cache_key_mock, sizeof(key));
+    ck_assert_int_eq(wc_HmacInit(&hmac, NULL, INVALID_DEVID), 0);
+    ck_assert_int_eq(wc_HmacSetKey(&hmac, WC_SHA256, key, sizeof(key)), 0);
+    wc_HmacUpdate(&hmac, (const uint8_t *)&verify_cache_mock.erase_count,
+            sizeof(verify_cache_mock.erase_count));
+    wc_HmacUpdate(&hmac, verify_cache_mock.hdr_digest,
+            sizeof(verify_cache_mock.hdr_digest));
+    ck_assert_int_eq(wc_HmacFinal(&hmac, mac), 0);
+    wc_HmacFree(&hmac);
+    ck_assert_mem_eq(verify_cache_mock.mac, mac, sizeof(mac));
+
+    /* Warm boot: the bulk hash is skipped, a firmware change goes unnoticed */
+    fw[10] ^= 0xFF;
+    img.sha_ok = 0;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), 0);
+    ck_assert_uint_eq(img.sha_ok, 1);
+    ck_assert_ptr_eq(img.sha_hash, hdr + digest_off);
+    ck_assert_int_eq(verify_cache_stored, 1);
+
+    /* Erase counter mismatch: full verification */
+    erase_count_mock++;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    erase_count_mock--;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), 0);
+
+    /* Forged record: full verification */
+    verify_cache_mock.mac[0] ^= 0x01;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    verify_cache_mock.mac[0] ^= 0x01;
+
+    /* Record written with a different device key: full verification */
+    verify_cache_key_mock ^= 0xFF;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    verify_cache_key_mock ^= 0xFF;
+
+    /* Device key not available: full verification, no record is stored */
+    verify_cache_key_fail = 1;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    fw[10] ^= 0xFF;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), 0);
+    fw[10] ^= 0xFF;
+    verify_cache_key_fail = 0;
+    ck_assert_int_eq(verify_cache_stored, 1);
+
+    /* Header change: full verification */
+    hdr[12] = 2;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    hdr[12] = 1;
+
+    /* Only the BOOT partition uses the record */
+    img.part = PART_UPDATE;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), -1);
+    fw[10] ^= 0xFF;
+    ck_assert_int_eq(wolfBoot_verify_integrity(&img), 0);
+    ck_assert_int_eq(verify_cache_stored, 1);
+}
+END_TEST
+#endif /* WOLFBOOT_VERIFY_CACHE */
 
 Suite *wolfboot_suite(void)
 {
@@ -589,6 +954,34 @@ Suite *wolfboot_suite(void)
     tcase_set_timeout(tcase_open_image, 20);
     tcase_add_test(tcase_open_image, test_open_image);
     suite_add_tcase(s, tcase_open_image);
+
+#ifdef WOLFBOOT_MERKLE
+    TCase* tcase_merkle = tcase_create("merkle");
+    tcase_set_timeout(tcase_merkle, 20);
+    tcase_add_test(tcase_merkle, test_merkle);
+    suite_add_tcase(s, tcase_merkle);
+
+#ifdef WOLFBOOT_PARALLEL_VERIFY
+    TCase* tcase_merkle_parallel = tcase_create("merkle_parallel");
+    tcase_set_timeout(tcase_merkle_parallel, 20);
+    tcase_add_test(tcase_merkle_parallel, test_merkle_parallel);
+    suite_add_tcase(s, tcase_merkle_parallel);
+#endif
+#endif
+
+#ifdef WOLFBOOT_HASH_CONTIGUOUS
+    TCase* tcase_hash_contiguous = tcase_create("hash_contiguous");
+    tcase_set_timeout(tcase_hash_contiguous, 20);
+    tcase_add_test(tcase_hash_contiguous, test_hash_contiguous);
+    suite_add_tcase(s, tcase_hash_contiguous);
+#endif
+
+#ifdef WOLFBOOT_VERIFY_CACHE
+    TCase* tcase_verify_cache = tcase_create("verify_cache");
+    tcase_set_timeout(tcase_verify_cache, 20);
+    tcase_add_test(tcase_verify_cache, test_verify_cache);
+    suite_add_tcase(s, tcase_verify_cache);
+#endif
     return s;
 }
 
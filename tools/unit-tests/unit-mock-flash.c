@@ -31,6 +31,7 @@ static int erased_swap = 0;
 static int erased_nvm_bank0 = 0;
 static int erased_nvm_bank1 = 0;
 static int erased_vault = 0;
+static int ext_flash_read_count = 0;
 const char *argv0;
 
 #include <sys/stat.h>
@@ -173,6 +174,7 @@ int ext_flash_read(uintptr_t address, uint8_t *data, int len)
 {
     int i;
     uint8_t *a = (uint8_t *)address;
+    ext_flash_read_count++;
     for (i = 0; i < len; i++) {
          data[i] = a[i];
     }
@@ -0,0 +1,207 @@
+/* unit-nvm-journal.c
+ *
+ * unit tests for the trailer journal (NVM_FLASH_JOURNAL) on write-once flash.
+ *
+ * Copyright (C) 2024 wolfSSL Inc.
+ *
+ * This file is part of wolfBoot.
+ *
+ * wolfBoot is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfBoot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+#define WOLFBOOT_HASH_SHA256
+#define IMAGE_HEADER_SIZE 256
+#define MOCK_ADDRESS 0xCC000000
+#define MOCK_ADDRESS_BOOT 0xCD000000
+#define MOCK_ADDRESS_SWAP 0xCE000000
+#define WC_RSA_BLINDING
+#define ECC_TIMING_RESISTANT
+#include <stdio.h>
+#include "libwolfboot.c"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <check.h>
+
+#include "unit-mock-flash.c"
+
+
+Suite *wolfboot_suite(void);
+
+static uint8_t *journal_sector(uintptr_t base_addr, int sel)
+{
+    return (uint8_t *)(base_addr + WOLFBOOT_PARTITION_SIZE -
+            WOLFBOOT_SECTOR_SIZE * (1 + sel));
+}
+
+static uint8_t raw_sector_flags(int sel, uint32_t pos)
+{
+    return *(uint8_t *)(PART_UPDATE_ENDFLAGS -
+            (WOLFBOOT_SECTOR_SIZE * sel + sizeof(uint32_t) + 2 + pos));
+}
+
+static void check_sector_flags(uint16_t first, uint16_t last, uint8_t flag)
+{
+    uint16_t i;
+    uint8_t st;
+    for (i = first; i < last; i++) {
+        ck_assert_msg(wolfBoot_get_update_sector_flag(i, &st) == 0,
+                "Failed to read sector flag state\n");
+        ck_assert_msg(st == flag, "Wrong flag for sector %u: %02x\n", i, st);
+    }
+}
+
+START_TEST (test_nvm_journal)
+{
+    int ret, i, sel;
+    uint8_t st;
+    uint8_t *sector;
+    uintptr_t base_addr = WOLFBOOT_PARTITION_UPDATE_ADDRESS;
+    uint8_t part = PART_UPDATE;
+
+    ret = mmap_file("/tmp/wolfboot-unit-file.bin", (void *)MOCK_ADDRESS,
+            WOLFBOOT_PARTITION_SIZE, NULL);
+    ck_assert(ret >= 0);
+#ifdef FLAGS_HOME
+    ret = mmap_file("/tmp/wolfboot-unit-int-file.bin", (void *)MOCK_ADDRESS_BOOT,
+            WOLFBOOT_PARTITION_SIZE, NULL);
+    ck_assert(ret >= 0);
+    part = PART_BOOT;
+    base_addr = WOLFBOOT_PARTITION_BOOT_ADDRESS;
+#endif
+    ret = mmap_file("/tmp/wolfboot-unit-swap.bin", (void *)MOCK_ADDRESS_SWAP,
+            WOLFBOOT_SECTOR_SIZE, NULL);
+    ck_assert(ret >= 0);
+
+    /* Sanity: the test below needs more updates than journal slots */
+    ck_assert(NVM_JOURNAL_SLOTS == 32);
+
+    hal_flash_unlock();
+    wolfBoot_erase_partition(part);
+
+    /* Writing the magic compacts into sector 1, the state goes in the
+     * journal */
+    wolfBoot_set_partition_state(PART_UPDATE, IMG_STATE_UPDATING);
+    sel = nvm_select_fresh_sector(PART_UPDATE);
+    ck_assert_msg(sel == 1, "Failed to select sector 1 after the magic\n");
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == 0, "Failed to read back state\n");
+    ck_assert_msg(st == IMG_STATE_UPDATING, "Bootloader in the wrong state\n");
+
+    /* 20 more updates fit in the journal: no erase, no sector change */
+    erased_nvm_bank0 = 0;
+    erased_nvm_bank1 = 0;
+    for (i = 0; i < 10; i++)
+        wolfBoot_set_update_sector_flag(i, SECT_FLAG_SWAPPING);
+    check_sector_flags(0, 10, SECT_FLAG_SWAPPING);
+    for (i = 0; i < 10; i++)
+        wolfBoot_set_update_sector_flag(i, SECT_FLAG_UPDATED);
+    ck_assert_msg(erased_nvm_bank0 == 0 && erased_nvm_bank1 == 0,
+            "Journal append erased a sector\n");
+    ck_assert_msg(nvm_select_fresh_sector(PART_UPDATE) == 1,
+            "Journal append changed the selected sector\n");
+    check_sector_flags(0, 10, SECT_FLAG_UPDATED);
+    check_sector_flags(10, 16, SECT_FLAG_NEW);
+
+    /* Flags in the sector are untouched, the records are in the journal */
+    ck_assert(raw_sector_flags(1, 0) == FLASH_BYTE_ERASED);
+    sector = journal_sector(base_addr, 1);
+    ck_assert(sector[20 * NVM_JOURNAL_LINE_SIZE] != FLASH_BYTE_ERASED);
+    ck_assert(sector[21 * NVM_JOURNAL_LINE_SIZE] == FLASH_BYTE_ERASED);
+
+    /* Replaying the journal from flash gives the same state */
+    nvm_journal_invalidate();
+    check_sector_flags(0, 10, SECT_FLAG_UPDATED);
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == 0 && st == IMG_STATE_UPDATING,
+            "Wrong state after replaying the journal\n");
+
+    /* Fill up the journal: the 33rd update compacts into sector 0 */
+    for (i = 10; i < 16; i++)
+        wolfBoot_set_update_sector_flag(i, SECT_FLAG_SWAPPING);
+    for (i = 10; i < 16; i++)
+        wolfBoot_set_update_sector_flag(i, SECT_FLAG_UPDATED);
+    ck_assert_msg(nvm_select_fresh_sector(PART_UPDATE) == 0,
+            "Full journal was not compacted\n");
+    ck_assert_msg(erased_nvm_bank1 > 0, "Did not erase the compacted bank");
+    check_sector_flags(0, 16, SECT_FLAG_UPDATED);
+    sector = journal_sector(base_addr, 0);
+    for (i = 0; i < NVM_JOURNAL_SIZE; i++)
+        ck_assert_msg(sector[i] == FLASH_BYTE_ERASED,
+                "Journal not empty after compaction\n");
+    ck_assert(raw_sector_flags(0, 0) == (uint8_t)((SECT_FLAG_UPDATED << 4) |
+            SECT_FLAG_UPDATED));
+
+    /* A torn record is skipped, the next record goes after it */
+    sector[0] = 0x05;
+    sector[1] = 0x00;
+    sector[2] = 0x42;
+    sector[3] = 0x00;
+    nvm_journal_invalidate();
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == 0 && st == IMG_STATE_UPDATING,
+            "Torn record was applied\n");
+    wolfBoot_set_update_sector_flag(16, SECT_FLAG_SWAPPING);
+    ck_assert(sector[NVM_JOURNAL_LINE_SIZE] != FLASH_BYTE_ERASED);
+    check_sector_flags(16, 17, SECT_FLAG_SWAPPING);
+
+    /* An erase behind the back of the journal is detected */
+    hal_flash_erase((uintptr_t)sector, WOLFBOOT_SECTOR_SIZE);
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == -1, "Stale trailer state after erase\n");
+
+    /* update_trigger folds the journal before writing the state */
+    wolfBoot_set_update_sector_flag(0, SECT_FLAG_SWAPPING);
+    hal_flash_lock();
+    wolfBoot_update_trigger();
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == 0 && st == IMG_STATE_UPDATING,
+            "Wrong state after update trigger\n");
+    check_sector_flags(0, 1, SECT_FLAG_SWAPPING);
+    sel = nvm_select_fresh_sector(PART_UPDATE);
+    sector = journal_sector(base_addr, sel);
+    for (i = 0; i < NVM_JOURNAL_SIZE; i++)
+        ck_assert(sector[i] == FLASH_BYTE_ERASED);
+
+    /* Sanity check at the end of the operations. */
+    ck_assert_msg(locked, "The FLASH was left unlocked.\n");
+}
+END_TEST
+
+
+Suite *wolfboot_suite(void)
+{
+    /* Suite initialization */
+    Suite *s = suite_create("wolfboot");
+
+    /* Test cases */
+    TCase *nvm_journal = tcase_create("NVM trailer journal");
+    tcase_add_test(nvm_journal, test_nvm_journal);
+    suite_add_tcase(s, nvm_journal);
+
+    return s;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int fails;
+    argv0 = strdup(argv[0]);
+    Suite *s = wolfboot_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,150 @@
+/* unit-state-cache.c
+ *
+ * unit tests for the RAM partition state cache (PARTITION_STATE_CACHE).
+ *
+ * Copyright (C) 2024 wolfSSL Inc.
+ *
+ * This file is part of wolfBoot.
+ *
+ * wolfBoot is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfBoot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+#define WOLFBOOT_HASH_SHA256
+#define IMAGE_HEADER_SIZE 256
+#define MOCK_ADDRESS 0xCC000000
+#define MOCK_ADDRESS_BOOT 0xCD000000
+#define MOCK_ADDRESS_SWAP 0xCE000000
+#define WC_RSA_BLINDING
+#define ECC_TIMING_RESISTANT
+#include <stdio.h>
+#include "libwolfboot.c"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <check.h>
+
+#include "unit-mock-flash.c"
+
+#define N_SECTORS (WOLFBOOT_PARTITION_SIZE / WOLFBOOT_SECTOR_SIZE)
+
+Suite *wolfboot_suite(void);
+
+
+START_TEST (test_state_cache)
+{
+    int ret, i;
+    uint8_t st;
+    uint8_t *update_flags = (uint8_t *)(PART_UPDATE_ENDFLAGS);
+    uint8_t *boot_flags = (uint8_t *)(PART_BOOT_ENDFLAGS);
+
+    ret = mmap_file("/tmp/wolfboot-unit-ext-file.bin", (void *)MOCK_ADDRESS,
+            WOLFBOOT_PARTITION_SIZE, NULL);
+    ck_assert(ret >= 0);
+    ret = mmap_file("/tmp/wolfboot-unit-int-file.bin", (void *)MOCK_ADDRESS_BOOT,
+            WOLFBOOT_PARTITION_SIZE, NULL);
+    ck_assert(ret >= 0);
+    ret = mmap_file("/tmp/wolfboot-unit-swap.bin", (void *)MOCK_ADDRESS_SWAP,
+            WOLFBOOT_SECTOR_SIZE, NULL);
+    ck_assert(ret >= 0);
+
+    hal_flash_unlock();
+    wolfBoot_erase_partition(PART_BOOT);
+    wolfBoot_erase_partition(PART_UPDATE);
+    ext_flash_unlock();
+
+    /* The flags of the external partition are read once */
+    ext_flash_read_count = 0;
+    wolfBoot_set_partition_state(PART_UPDATE, IMG_STATE_UPDATING);
+    for (i = 0; i < N_SECTORS; i++)
+        wolfBoot_set_update_sector_flag(i, SECT_FLAG_SWAPPING);
+    for (i = 0; i < N_SECTORS; i++) {
+        ret = wolfBoot_get_update_sector_flag(i, &st);
+        ck_assert_msg(ret == 0, "Failed to read sector flag state\n");
+        ck_assert_msg(st == SECT_FLAG_SWAPPING, "Wrong sector flag state\n");
+    }
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == 0 && st == IMG_STATE_UPDATING,
+            "Failed to read back state\n");
+    ck_assert_msg(ext_flash_read_count == 1,
+            "Flags read %d times from external flash\n", ext_flash_read_count);
+
+    /* Writes go through to flash, the neighbouring flags are preserved */
+    ck_assert(*(uint32_t *)(update_flags - 4) == WOLFBOOT_MAGIC_TRAIL);
+    ck_assert(update_flags[-5] == IMG_STATE_UPDATING);
+    for (i = 0; i < N_SECTORS / 2; i++)
+        ck_assert(update_flags[-(6 + i)] ==
+                ((SECT_FLAG_SWAPPING << 4) | SECT_FLAG_SWAPPING));
+
+    /* Internal partition */
+    wolfBoot_set_partition_state(PART_BOOT, IMG_STATE_TESTING);
+    ret = wolfBoot_get_partition_state(PART_BOOT, &st);
+    ck_assert_msg(ret == 0 && st == IMG_STATE_TESTING,
+            "Failed to read back boot state\n");
+    ck_assert(boot_flags[-5] == IMG_STATE_TESTING);
+
+    /* Changes behind the cache are only seen after an invalidation */
+    ext_flash_erase(WOLFBOOT_PARTITION_UPDATE_ADDRESS + WOLFBOOT_PARTITION_SIZE -
+            WOLFBOOT_SECTOR_SIZE, WOLFBOOT_SECTOR_SIZE);
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == 0 && st == IMG_STATE_UPDATING,
+            "State read from flash\n");
+    wolfBoot_state_cache_invalidate();
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == -1, "Stale state after invalidation\n");
+    ck_assert(ext_flash_read_count == 2);
+
+    /* update_trigger erases the trailer and drops the cache */
+    ext_flash_lock();
+    hal_flash_lock();
+    wolfBoot_update_trigger();
+    ret = wolfBoot_get_partition_state(PART_UPDATE, &st);
+    ck_assert_msg(ret == 0 && st == IMG_STATE_UPDATING,
+            "Wrong state after update trigger\n");
+    ck_assert(update_flags[-5] == IMG_STATE_UPDATING);
+    for (i = 0; i < N_SECTORS; i++)
+        ck_assert(wolfBoot_get_update_sector_flag(i, &st) == 0 &&
+                st == SECT_FLAG_NEW);
+
+    /* Sanity check at the end of the operations. */
+    ck_assert_msg(locked, "The FLASH was left unlocked.\n");
+    ck_assert_msg(ext_locked, "The external FLASH was left unlocked.\n");
+}
+END_TEST
+
+
+Suite *wolfboot_suite(void)
+{
+    /* Suite initialization */
+    Suite *s = suite_create("wolfboot");
+
+    /* Test cases */
+    TCase *state_cache = tcase_create("Partition state cache");
+    tcase_add_test(state_cache, test_state_cache);
+    suite_add_tcase(s, state_cache);
+
+    return s;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int fails;
+    argv0 = strdup(argv[0]);
+    Suite *s = wolfboot_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
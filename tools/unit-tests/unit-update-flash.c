@@ -32,12 +32,29 @@
 
 #define NO_FORK 0 /* Set to 1 to disable fork mode (e.g. for gdb debugging) */
 
+#if defined(ENCRYPT_WITH_CHACHA)
+    #define HAVE_CHACHA
+#endif
+#if defined(ENCRYPT_AEAD) && defined(ENCRYPT_WITH_CHACHA)
+    #define HAVE_POLY1305
+#endif
+#ifdef EXT_ENCRYPTED
+#define ENCRYPT_KEY "123456789abcdef0123456789abcdef0123456789abcdef"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include "user_settings.h"
 #include "wolfboot/wolfboot.h"
 #include "libwolfboot.c"
 #include "update_flash.c"
+#if defined(ENCRYPT_WITH_CHACHA)
+    #include "wolfcrypt/src/chacha.c"
+#endif
+#if defined(ENCRYPT_AEAD) && defined(ENCRYPT_WITH_CHACHA)
+    #include "wolfcrypt/src/poly1305.c"
+    #include "wolfcrypt/src/chacha20_poly1305.c"
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -63,6 +80,15 @@ void do_boot(const uint32_t *address)
     printf("Called do_boot with address %p\n", address);
 }
 
+#ifdef EXT_ENCRYPTED
+int wolfBoot_get_encrypt_key(uint8_t *k, uint8_t *nonce)
+{
+    memcpy(k, ENCRYPT_KEY, ENCRYPT_KEY_SIZE);
+    memcpy(nonce, ENCRYPT_KEY + ENCRYPT_KEY_SIZE, ENCRYPT_NONCE_SIZE);
+    return 0;
+}
+#endif
+
 static void reset_mock_stats(void)
 {
     wolfBoot_staged_ok = 0;
@@ -175,6 +201,75 @@ static int add_payload(uint8_t part, uint32_t version, uint32_t size)
 
 }
 
+#ifdef WOLFBOOT_MERKLE
+#define MERKLE_TEST_SIZE 3800
+#define MERKLE_TEST_SECTORS \
+    ((MERKLE_TEST_SIZE + IMAGE_HEADER_SIZE + WOLFBOOT_SECTOR_SIZE - 1) / \
+     WOLFBOOT_SECTOR_SIZE)
+#define MERKLE_LEAVES_OFF_IN_HDR 32
+#define MERKLE_DIGEST_TLV_OFF_IN_HDR \
+    (MERKLE_LEAVES_OFF_IN_HDR + 4 + MERKLE_TEST_SECTORS * SHA256_DIGEST_SIZE)
+
+/* Same as add_payload(), with a per-sector Merkle manifest in the header */
+static int add_payload_merkle(uint8_t part, uint32_t version)
+{
+    uint32_t word, start, end;
+    uint32_t size = MERKLE_TEST_SIZE;
+    uint16_t word16;
+    int i;
+    uint8_t *base = (uint8_t *)(uintptr_t)WOLFBOOT_PARTITION_BOOT_ADDRESS;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    if (part == PART_UPDATE)
+        base = (uint8_t *)(uintptr_t)WOLFBOOT_PARTITION_UPDATE_ADDRESS;
+    srandom(part);
+
+    hal_flash_unlock();
+    hal_flash_write((uintptr_t)base, "WOLF", 4);
+    hal_flash_write((uintptr_t)base + 4, (void *)&size, 4);
+    word = 4 << 16 | HDR_VERSION;
+    hal_flash_write((uintptr_t)base + 8, (void *)&word, 4);
+    hal_flash_write((uintptr_t)base + 12, (void *)&version, 4);
+    word = 2 << 16 | HDR_IMG_TYPE;
+    hal_flash_write((uintptr_t)base + 16, (void *)&word, 4);
+    word16 = HDR_IMG_TYPE_AUTH_NONE | HDR_IMG_TYPE_APP;
+    hal_flash_write((uintptr_t)base + 20, (void *)&word16, 2);
+    word = 4 << 16 | HDR_IMG_MERKLE_SECTOR_SIZE;
+    hal_flash_write((uintptr_t)base + 24, (void *)&word, 4);
+    word = WOLFBOOT_SECTOR_SIZE;
+    hal_flash_write((uintptr_t)base + 28, (void *)&word, 4);
+
+    /* Payload */
+    for (i = IMAGE_HEADER_SIZE; i < size + IMAGE_HEADER_SIZE; i += 4) {
+        word = (random() << 16) | random();
+        hal_flash_write((uintptr_t)base + i, (void *)&word, 4);
+    }
+
+    /* One leaf per partition sector, then the digest of the header */
+    word = (MERKLE_TEST_SECTORS * SHA256_DIGEST_SIZE) << 16 |
+        HDR_IMG_MERKLE_LEAVES;
+    hal_flash_write((uintptr_t)base + MERKLE_LEAVES_OFF_IN_HDR, (void *)&word,
+            4);
+    for (i = 0; i < MERKLE_TEST_SECTORS; i++) {
+        start = (i == 0) ? 0 : (i * WOLFBOOT_SECTOR_SIZE) - IMAGE_HEADER_SIZE;
+        end = ((i + 1) * WOLFBOOT_SECTOR_SIZE) - IMAGE_HEADER_SIZE;
+        if (end > size)
+            end = size;
+        wc_Sha256Hash(base + IMAGE_HEADER_SIZE + start, end - start, digest);
+        hal_flash_write((uintptr_t)base + MERKLE_LEAVES_OFF_IN_HDR + 4 +
+                (i * SHA256_DIGEST_SIZE), digest, SHA256_DIGEST_SIZE);
+    }
+    word = SHA256_DIGEST_SIZE << 16 | HDR_SHA256;
+    hal_flash_write((uintptr_t)base + MERKLE_DIGEST_TLV_OFF_IN_HDR,
+            (void *)&word, 4);
+    wc_Sha256Hash(base, MERKLE_DIGEST_TLV_OFF_IN_HDR, digest);
+    hal_flash_write((uintptr_t)base + MERKLE_DIGEST_TLV_OFF_IN_HDR + 4, digest,
+            SHA256_DIGEST_SIZE);
+    hal_flash_lock();
+    return 0;
+}
+#endif
+
 START_TEST (test_empty_panic)
 {
     reset_mock_stats();
@@ -413,11 +508,172 @@ START_TEST (test_empty_boot_but_update_sha_corrupted_denied) {
 }
 
 
+#ifdef WOLFBOOT_MERKLE
+START_TEST (test_merkle_update) {
+    reset_mock_stats();
+    prepare_flash();
+    add_payload(PART_BOOT, 1, TEST_SIZE_SMALL);
+    add_payload_merkle(PART_UPDATE, 2);
+    wolfBoot_update_trigger();
+    wolfBoot_start();
+    ck_assert(!wolfBoot_panicked);
+    ck_assert(wolfBoot_staged_ok);
+    ck_assert(wolfBoot_current_firmware_version() == 2);
+    /* Every sector was verified during the swap */
+    ck_assert(!merkle_swap.failed);
+    ck_assert(merkle_swap.first == 0);
+    ck_assert(merkle_swap.last == MERKLE_TEST_SECTORS);
+    cleanup_flash();
+}
+END_TEST
+
+START_TEST (test_merkle_update_bad_sector) {
+    uint8_t byte, st;
+    uintptr_t bad = WOLFBOOT_PARTITION_UPDATE_ADDRESS +
+        (2 * WOLFBOOT_SECTOR_SIZE) + 10;
+    reset_mock_stats();
+    prepare_flash();
+    add_payload(PART_BOOT, 1, TEST_SIZE_SMALL);
+    add_payload_merkle(PART_UPDATE, 2);
+    wolfBoot_success();
+
+    /* Corrupt sector 2: the root and the signature are still valid */
+    byte = *(uint8_t *)bad ^ 0x01;
+    ext_flash_unlock();
+    ext_flash_write(bad, &byte, 1);
+    ext_flash_lock();
+    wolfBoot_update_trigger();
+
+    /* The update is rejected, the previous image is swapped back before
+     * wolfBoot_update() returns */
+    ck_assert(wolfBoot_update(0) < 0);
+    ck_assert(wolfBoot_current_firmware_version() == 1);
+    ck_assert(wolfBoot_update_firmware_version() == 2);
+    ck_assert(wolfBoot_get_partition_state(PART_BOOT, &st) == 0);
+    ck_assert(st == IMG_STATE_SUCCESS);
+    wolfBoot_start();
+    ck_assert(!wolfBoot_panicked);
+    ck_assert(wolfBoot_staged_ok);
+    ck_assert(wolfBoot_current_firmware_version() == 1);
+    cleanup_flash();
+}
+END_TEST
+#endif
+
+#if defined(WOLFBOOT_MERKLE) && defined(ENCRYPT_AEAD)
+/* Encrypt a sector of the image in BOOT (or of another image, when plain is
+ * not NULL) into UPDATE, then move it to BOOT through the swap partition, as
+ * wolfBoot_update() does. The expected tag is computed over the ciphertext
+ * before it is tampered with. */
+static void aead_swap_sector(struct wolfBoot_image *merkle, uint32_t sector,
+    const uint8_t *plain, int bad_data, int bad_tag)
+{
+    struct wolfBoot_image update, swap, boot;
+    uint32_t off = sector * WOLFBOOT_SECTOR_SIZE;
+    uint32_t end = MERKLE_TEST_SIZE + IMAGE_HEADER_SIZE - off;
+    uintptr_t addr = WOLFBOOT_PARTITION_UPDATE_ADDRESS + off;
+    const uint8_t *key = (const uint8_t *)ENCRYPT_KEY;
+    uint8_t iv[ENCRYPT_AEAD_NONCE_SIZE];
+    uint8_t byte;
+
+    if (end > WOLFBOOT_SECTOR_SIZE)
+        end = WOLFBOOT_SECTOR_SIZE;
+    if (plain == NULL)
+        plain = (const uint8_t *)WOLFBOOT_PARTITION_BOOT_ADDRESS + off;
+    ext_flash_unlock();
+    ck_assert_int_eq(ext_flash_encrypt_write(addr, plain,
+            WOLFBOOT_SECTOR_SIZE), 0);
+    memcpy(iv, key + ENCRYPT_KEY_SIZE, ENCRYPT_AEAD_NONCE_SIZE);
+    iv[11] ^= (uint8_t)(sector + 1);
+    ck_assert_int_eq(wc_ChaCha20Poly1305_Encrypt(key, iv, (uint8_t *)addr,
+            end, NULL, 0, NULL, aead_check.tag), 0);
+    aead_check.sector = sector;
+    aead_check.start = 0;
+    aead_check.end = end;
+    aead_check.state = 1;
+    if (bad_data) {
+        byte = *(uint8_t *)(addr + 100) ^ 0x01;
+        ext_flash_write(addr + 100, &byte, 1);
+    }
+    if (bad_tag)
+        aead_check.tag[0] ^= 0x01;
+
+    memset(&update, 0, sizeof(update));
+    update.part = PART_UPDATE;
+    update.hdr = (void *)WOLFBOOT_PARTITION_UPDATE_ADDRESS;
+    update.fw_size = MERKLE_TEST_SIZE;
+    wolfBoot_open_image(&swap, PART_SWAP);
+    wolfBoot_open_image(&boot, PART_BOOT);
+    hal_flash_unlock();
+    wolfBoot_copy_sector(&update, &swap, sector);
+    wolfBoot_copy_sector(&swap, &boot, sector);
+    wolfBoot_merkle_check_sector(merkle, sector);
+    hal_flash_lock();
+    ext_flash_lock();
+}
+
+START_TEST (test_merkle_aead_tampered_sector) {
+    struct wolfBoot_image merkle;
+    uint8_t other[WOLFBOOT_SECTOR_SIZE];
+    reset_mock_stats();
+    prepare_flash();
+    add_payload_merkle(PART_BOOT, 2);
+    merkle.hdr_ok = 0;
+    merkle_swap.first = 0;
+    merkle_swap.last = 0;
+    merkle_swap.failed = 0;
+
+    /* Authenticated while it is decrypted */
+    aead_swap_sector(&merkle, 1, NULL, 0, 0);
+    ck_assert(aead_check.state == 2);
+    ck_assert(!merkle_swap.failed);
+    ck_assert(merkle_swap.first == 1);
+    ck_assert(merkle_swap.last == 2);
+
+    /* Tampered ciphertext */
+    aead_swap_sector(&merkle, 2, NULL, 1, 0);
+    ck_assert(aead_check.state == 3);
+    ck_assert(merkle_swap.failed);
+
+    /* The tag is enforced on its own: the decrypted sector still matches its
+     * leaf hash */
+    merkle_swap.failed = 0;
+    aead_swap_sector(&merkle, 3, NULL, 0, 1);
+    ck_assert(wolfBoot_merkle_verify_sector(&merkle, 3) == 0);
+    ck_assert(aead_check.state == 3);
+    ck_assert(merkle_swap.failed);
+    ck_assert(merkle_swap.last == 2);
+
+    /* A sector of a different image, carrying a valid tag for the same key
+     * and nonce: the tag matches, but not the signed leaf */
+    merkle_swap.failed = 0;
+    memcpy(other, (uint8_t *)WOLFBOOT_PARTITION_BOOT_ADDRESS +
+            (3 * WOLFBOOT_SECTOR_SIZE), WOLFBOOT_SECTOR_SIZE);
+    other[100] ^= 0x01;
+    aead_swap_sector(&merkle, 3, other, 0, 0);
+    ck_assert(aead_check.state == 2);
+    ck_assert(merkle_swap.failed);
+    ck_assert(merkle_swap.last == 2);
+    cleanup_flash();
+}
+END_TEST
+#endif
+
 Suite *wolfboot_suite(void)
 {
     /* Suite initialization */
     Suite *s = suite_create("wolfboot");
 
+#if defined(WOLFBOOT_MERKLE) && defined(ENCRYPT_AEAD)
+    /* The payloads of the other tests are not encrypted */
+    TCase *merkle_aead_tampered_sector =
+        tcase_create("Merkle update with a tampered encrypted sector");
+    tcase_add_test(merkle_aead_tampered_sector,
+            test_merkle_aead_tampered_sector);
+    suite_add_tcase(s, merkle_aead_tampered_sector);
+    return s;
+#endif
+
     /* Test cases */
     TCase *empty_panic = tcase_create("Empty partition panic test");
     TCase *sunnyday_noupdate =
@@ -439,6 +695,11 @@ Suite *wolfboot_suite(void)
     TCase *emergency_rollback_failure_due_to_bad_update = tcase_create("Emergency rollback failure due to bad update");
     TCase *empty_boot_partition_update = tcase_create("Empty boot partition update");
     TCase *empty_boot_but_update_sha_corrupted_denied = tcase_create("Empty boot partition but update SHA corrupted");
+#ifdef WOLFBOOT_MERKLE
+    TCase *merkle_update = tcase_create("Merkle update");
+    TCase *merkle_update_bad_sector =
+        tcase_create("Merkle update with a corrupted sector");
+#endif
 
 
 
@@ -456,6 +717,10 @@ Suite *wolfboot_suite(void)
     tcase_add_test(emergency_rollback_failure_due_to_bad_update, test_emergency_rollback_failure_due_to_bad_update);
     tcase_add_test(empty_boot_partition_update, test_empty_boot_partition_update);
     tcase_add_test(empty_boot_but_update_sha_corrupted_denied, test_empty_boot_but_update_sha_corrupted_denied);
+#ifdef WOLFBOOT_MERKLE
+    tcase_add_test(merkle_update, test_merkle_update);
+    tcase_add_test(merkle_update_bad_sector, test_merkle_update_bad_sector);
+#endif
 
 
 
@@ -473,6 +738,10 @@ Suite *wolfboot_suite(void)
     suite_add_tcase(s, emergency_rollback_failure_due_to_bad_update);
     suite_add_tcase(s, empty_boot_partition_update);
     suite_add_tcase(s, empty_boot_but_update_sha_corrupted_denied);
+#ifdef WOLFBOOT_MERKLE
+    suite_add_tcase(s, merkle_update);
+    suite_add_tcase(s, merkle_update_bad_sector);
+#endif
 
 
 